@@ -0,0 +1,341 @@
+#include "Ambisonics.h"
+
+
+/*
+ *  Real spherical harmonics up to order, without the Condon-Shortley phase
+ *  The associated Legendre functions are found with the usual recurrences over the degree for each order m
+ */
+void Ambisonics::evaluate(int order, float theta, float phi, float *dest)
+{
+    auto azimuth = juce::degreesToRadians((double)theta);
+    auto x = std::sin(juce::degreesToRadians((double)phi));
+    auto cosElevation = std::sqrt(juce::jmax(0.0, 1.0 - (x * x)));
+
+    //  P[l] holds the associated Legendre function of degree l for the current m
+    double legendre[MAX_ORDER + 1];
+    double sectoral = 1.0;
+
+    for (auto m = 0; m <= order; ++m)
+    {
+        //  P(m, m) = (2m - 1)!! (1 - x^2)^(m / 2)
+        if (m > 0)
+            sectoral *= (2 * m - 1) * cosElevation;
+
+        legendre[m] = sectoral;
+        if (m < order)
+            legendre[m + 1] = x * (2 * m + 1) * sectoral;
+
+        for (auto l = m + 2; l <= order; ++l)
+            legendre[l] = (((2 * l - 1) * x * legendre[l - 1]) - ((l + m - 1) * legendre[l - 2])) / (l - m);
+
+        for (auto l = m; l <= order; ++l)
+        {
+            //  SN3D: sqrt((2 - delta(m)) (l - m)! / (l + m)!)
+            double factorialRatio = 1.0;
+            for (auto k = l - m + 1; k <= l + m; ++k)
+                factorialRatio /= k;
+
+            auto normalisation = std::sqrt(((m == 0) ? 1.0 : 2.0) * factorialRatio);
+            auto value = normalisation * legendre[l];
+
+            dest[(l * l) + l + m] = (float)(value * std::cos(m * azimuth));
+            if (m > 0)
+                dest[(l * l) + l - m] = (float)(value * std::sin(m * azimuth));
+        }
+    }
+}
+
+
+/*
+ *  Least-squares fit of the spherical-harmonic HRTFs to the measured ones
+ *  With Y the spherical harmonics of the directions, one row per direction, the weights are (Y'Y + lambda I)^-1 Y'.
+ *  Y'Y is only channels by channels so it is solved with a Cholesky decomposition
+ */
+bool Ambisonics::findDecoderWeights(int order, const std::vector<SphericalIndex::Position> &directions, std::vector<float> &weights)
+{
+    if (order < 1 || order > MAX_ORDER)
+        return false;
+
+    auto numChannels = getNumChannels(order);
+    auto numDirections = directions.size();
+
+    if (numDirections < numChannels)
+        return false;
+
+    std::vector<float> harmonics(numDirections * numChannels);
+    for (auto d = 0; d < numDirections; ++d)
+        evaluate(order, directions[d].theta, directions[d].phi, harmonics.data() + (d * numChannels));
+
+    std::vector<double> gram(numChannels * numChannels, 0.0);
+    for (auto d = 0; d < numDirections; ++d)
+    {
+        auto *y = harmonics.data() + (d * numChannels);
+
+        for (auto i = 0; i < numChannels; ++i)
+        {
+            for (auto j = 0; j <= i; ++j)
+                gram[(i * numChannels) + j] += (double)y[i] * y[j];
+        }
+    }
+
+    double trace = 0;
+    for (auto i = 0; i < numChannels; ++i)
+        trace += gram[(i * numChannels) + i];
+
+    auto lambda = DECODER_REGULARISATION * trace / numChannels;
+
+    //  Lower triangle of the Cholesky factor, written over the lower triangle of the Gram matrix
+    auto &factor = gram;
+    for (auto i = 0; i < numChannels; ++i)
+    {
+        factor[(i * numChannels) + i] += lambda;
+
+        for (auto j = 0; j <= i; ++j)
+        {
+            auto sum = factor[(i * numChannels) + j];
+            for (auto k = 0; k < j; ++k)
+                sum -= factor[(i * numChannels) + k] * factor[(j * numChannels) + k];
+
+            if (i == j)
+            {
+                if (sum <= 0)
+                    return false;
+
+                factor[(i * numChannels) + i] = std::sqrt(sum);
+            }
+            else
+            {
+                factor[(i * numChannels) + j] = sum / factor[(j * numChannels) + j];
+            }
+        }
+    }
+
+    weights = std::vector<float>(numChannels * numDirections);
+    std::vector<double> solution(numChannels);
+
+    for (auto d = 0; d < numDirections; ++d)
+    {
+        auto *y = harmonics.data() + (d * numChannels);
+
+        //  Forward substitution with the factor, then back substitution with its transpose
+        for (auto i = 0; i < numChannels; ++i)
+        {
+            double sum = y[i];
+            for (auto k = 0; k < i; ++k)
+                sum -= factor[(i * numChannels) + k] * solution[k];
+
+            solution[i] = sum / factor[(i * numChannels) + i];
+        }
+
+        for (auto i = (int)numChannels - 1; i >= 0; --i)
+        {
+            auto sum = solution[i];
+            for (auto k = i + 1; k < numChannels; ++k)
+                sum -= factor[(k * numChannels) + i] * solution[k];
+
+            solution[i] = sum / factor[(i * numChannels) + i];
+        }
+
+        for (auto channel = 0; channel < numChannels; ++channel)
+            weights[(channel * numDirections) + d] = (float)solution[channel];
+    }
+
+    return true;
+}
+
+
+//  Every source starts out straight ahead
+Ambisonics::Encoder::Encoder(int encoderOrder, size_t numSources)
+{
+    order = juce::jlimit(1, MAX_ORDER, encoderOrder);
+    numChannels = Ambisonics::getNumChannels(order);
+
+    std::vector<float> front(numChannels);
+    evaluate(order, 0, 0, front.data());
+
+    gains = std::vector<std::vector<float>>(numSources, front);
+    incomingGains = std::vector<TripleBuffer<std::vector<float>>>(numSources);
+    for (auto &incoming : incomingGains)
+        incoming.setup(front);
+}
+
+
+bool Ambisonics::Encoder::setDirection(size_t source, float theta, float phi)
+{
+    if (source >= gains.size())
+        return false;
+
+    evaluate(order, theta, phi, incomingGains[source].getWriteBuffer().data());
+    incomingGains[source].publish();
+
+    return true;
+}
+
+
+/*
+ *  DO NOT CALL THIS FUNCTION ON MULTIPLE THREADS
+ *  Sources that moved since the last block are ramped to their new gains over this block so the move does not click
+ */
+void Ambisonics::Encoder::encode(const float *const *sources, size_t numSamples, float *const *bus)
+{
+    for (auto channel = 0; channel < numChannels; ++channel)
+        juce::FloatVectorOperations::clear(bus[channel], (int)numSamples);
+
+    if (numSamples == 0)
+        return;
+
+    for (auto source = 0; source < gains.size(); ++source)
+    {
+        auto &current = gains[source];
+
+        if (incomingGains[source].acquire())
+        {
+            auto &target = incomingGains[source].getReadBuffer();
+
+            for (auto channel = 0; channel < numChannels; ++channel)
+            {
+                auto step = (target[channel] - current[channel]) / (float)numSamples;
+
+                for (auto i = 0; i < numSamples; ++i)
+                    bus[channel][i] += sources[source][i] * (current[channel] + (step * (i + 1)));
+
+                current[channel] = target[channel];
+            }
+        }
+        else
+        {
+            for (auto channel = 0; channel < numChannels; ++channel)
+                juce::FloatVectorOperations::addWithMultiply(bus[channel], sources[source], current[channel], (int)numSamples);
+        }
+    }
+}
+
+
+
+#ifdef JUCE_UNIT_TESTS
+void AmbisonicsTest::runTest()
+{
+    beginTest("Spherical Harmonics");
+
+    float harmonics[Ambisonics::MAX_CHANNELS];
+
+    //  First order is W, Y, Z, X in ACN order
+    Ambisonics::evaluate(2, 30, 20, harmonics);
+
+    auto azimuth = juce::degreesToRadians(30.0f);
+    auto elevation = juce::degreesToRadians(20.0f);
+
+    expectWithinAbsoluteError<float>(harmonics[0], 1.0f, 1e-6f);
+    expectWithinAbsoluteError<float>(harmonics[1], std::sin(azimuth) * std::cos(elevation), 1e-6f);
+    expectWithinAbsoluteError<float>(harmonics[2], std::sin(elevation), 1e-6f);
+    expectWithinAbsoluteError<float>(harmonics[3], std::cos(azimuth) * std::cos(elevation), 1e-6f);
+
+    //  Two of the second order harmonics
+    expectWithinAbsoluteError<float>(harmonics[6], 0.5f * ((3 * std::sin(elevation) * std::sin(elevation)) - 1), 1e-6f);
+    expectWithinAbsoluteError<float>(harmonics[8], 0.5f * std::sqrt(3.0f) * std::cos(elevation) * std::cos(elevation) * std::cos(2 * azimuth), 1e-6f);
+
+    //  A lower order gives the same first channels
+    float firstOrder[4];
+    Ambisonics::evaluate(1, 30, 20, firstOrder);
+    for (auto channel = 0; channel < 4; ++channel)
+        expectEquals(firstOrder[channel], harmonics[channel]);
+
+    //===================================================================================================//
+
+
+    beginTest("Decoder Weights");
+
+    std::vector<SphericalIndex::Position> directions;
+    for (auto phi = -80; phi <= 80; phi += 10)
+    {
+        for (auto theta = 0; theta < 360; theta += 10)
+            directions.push_back({ (float)theta, (float)phi, 1.0f });
+    }
+
+    directions.push_back({ 0, 90, 1 });
+    directions.push_back({ 0, -90, 1 });
+
+    //  A function on the sphere that is made of spherical harmonics is fitted back to its coefficients
+    int order = 3;
+    auto numChannels = Ambisonics::getNumChannels(order);
+    std::vector<float> coefficients(numChannels);
+    for (auto channel = 0; channel < numChannels; ++channel)
+        coefficients[channel] = std::cos(0.7f * channel);
+
+    std::vector<float> measured(directions.size());
+    for (auto d = 0; d < directions.size(); ++d)
+    {
+        Ambisonics::evaluate(order, directions[d].theta, directions[d].phi, harmonics);
+
+        measured[d] = 0;
+        for (auto channel = 0; channel < numChannels; ++channel)
+            measured[d] += coefficients[channel] * harmonics[channel];
+    }
+
+    std::vector<float> weights;
+    expect(Ambisonics::findDecoderWeights(order, directions, weights));
+    expectEquals<size_t>(weights.size(), numChannels * directions.size());
+
+    //  The regularisation pulls the fit in a little, the directions cover the whole sphere so not by much
+    for (auto channel = 0; channel < numChannels; ++channel)
+    {
+        float fitted = 0;
+        for (auto d = 0; d < directions.size(); ++d)
+            fitted += weights[(channel * directions.size()) + d] * measured[d];
+
+        expectWithinAbsoluteError<float>(fitted, coefficients[channel], 0.05f);
+    }
+
+    std::vector<SphericalIndex::Position> tooFew(directions.begin(), directions.begin() + numChannels - 1);
+    expect(!Ambisonics::findDecoderWeights(order, tooFew, weights));
+    expect(!Ambisonics::findDecoderWeights(Ambisonics::MAX_ORDER + 1, directions, weights));
+
+    //===================================================================================================//
+
+
+    beginTest("Encoder");
+
+    Ambisonics::Encoder encoder(2, 2);
+    expectEquals<size_t>(encoder.getNumChannels(), 9);
+    expect(!encoder.setDirection(2, 0, 0));
+
+    std::vector<float> first(64, 1.0f);
+    std::vector<float> second(64);
+    for (auto i = 0; i < second.size(); ++i)
+        second[i] = std::sin(0.1f * i);
+
+    std::vector<std::vector<float>> bus(9, std::vector<float>(64));
+    float *busPointers[9];
+    for (auto channel = 0; channel < 9; ++channel)
+        busPointers[channel] = bus[channel].data();
+
+    const float *sources[] = { first.data(), second.data() };
+
+    float front[9], left[9], up[9];
+    Ambisonics::evaluate(2, 0, 0, front);
+    Ambisonics::evaluate(2, 90, 0, left);
+    Ambisonics::evaluate(2, 0, 90, up);
+
+    //  Sources start straight ahead
+    encoder.encode(sources, 64, busPointers);
+    for (auto channel = 0; channel < 9; ++channel)
+        expectWithinAbsoluteError<float>(bus[channel][10], (first[10] + second[10]) * front[channel], 1e-5f);
+
+    //  A move is ramped over the next block and reached at its end
+    expect(encoder.setDirection(0, 90, 0));
+    expect(encoder.setDirection(1, 0, 90));
+    encoder.encode(sources, 64, busPointers);
+
+    for (auto channel = 0; channel < 9; ++channel)
+    {
+        auto halfway = (0.5f * (front[channel] + left[channel]) * first[31]) + (0.5f * (front[channel] + up[channel]) * second[31]);
+        expectWithinAbsoluteError<float>(bus[channel][31], halfway, 1e-5f);
+        expectWithinAbsoluteError<float>(bus[channel][63], (left[channel] * first[63]) + (up[channel] * second[63]), 1e-5f);
+    }
+
+    encoder.encode(sources, 64, busPointers);
+    for (auto channel = 0; channel < 9; ++channel)
+        expectWithinAbsoluteError<float>(bus[channel][5], (left[channel] * first[5]) + (up[channel] * second[5]), 1e-5f);
+}
+
+#endif
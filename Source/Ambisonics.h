@@ -0,0 +1,90 @@
+#pragma once
+#include <JuceHeader.h>
+#include <vector>
+#include "SphericalIndex.h"
+#include "TripleBuffer.h"
+
+
+/*
+ *  Higher-order Ambisonics for rendering many sources at a fixed cost
+ *
+ *  Sources are encoded into (order + 1)^2 channels of spherical harmonics, which only takes a gain per channel and source,
+ *  so moving a source is a change of gains.  The channels are decoded to binaural with one HRTF per channel and ear: the spherical-harmonic
+ *  HRTFs.  These are fitted to the measurements of a file by least squares, and since every HRTF is linear in the HRIR they are a weighted
+ *  sum of the prepared HRTFs of the measurements.  findDecoderWeights() returns those weights, so the decoder can be built with
+ *  HRTFProcessor::swapHRTF() from the cache or the compiled file like any blend.  Rendering the channels as the sources of one
+ *  HRTFProcessor costs a forward FFT per channel and two inverse FFTs, no matter how many sources are encoded.
+ *
+ *  Channels are in ACN order with SN3D normalisation (AmbiX).  Directions use the SOFA coordinates of SphericalIndex:
+ *  theta is the azimuth and phi the elevation, both in degrees.
+ */
+class Ambisonics
+{
+#ifdef JUCE_UNIT_TESTS
+    friend class AmbisonicsTest;
+#endif
+
+public:
+
+    static constexpr int        MAX_ORDER = 5;
+    static constexpr size_t     MAX_CHANNELS = (MAX_ORDER + 1) * (MAX_ORDER + 1);
+
+    static size_t   getNumChannels(int order) { return (size_t)((order + 1) * (order + 1)); }
+
+    //  Writes the getNumChannels(order) spherical harmonics of a direction into dest
+    static void     evaluate(int order, float theta, float phi, float *dest);
+
+    //  Writes the weight of every direction for every channel into weights, indexed by channel * directions.size() + direction
+    //  Returns false if the order is out of range or there are fewer directions than channels
+    static bool     findDecoderWeights(int order, const std::vector<SphericalIndex::Position> &directions, std::vector<float> &weights);
+
+    //  Tikhonov regularisation of the fit relative to the mean energy of a channel, keeps files that only cover part of the sphere from blowing up
+    static constexpr double     DECODER_REGULARISATION = 1e-2;
+
+
+    /*
+     *  Encodes mono sources into the Ambisonics channels
+     *  setDirection() can be called from one thread while encode() runs on the audio thread, the gains are ramped over the next encoded block.
+     *  encode() does not allocate
+     */
+    class Encoder
+    {
+    public:
+
+        Encoder(int order, size_t numSources);
+
+        size_t  getNumChannels() const { return numChannels; }
+        size_t  getNumSources() const { return gains.size(); }
+
+        //  Only call from one thread at a time
+        bool    setDirection(size_t source, float theta, float phi);
+
+        //  Overwrites the getNumChannels() channels of bus with the sum of the numSamples long sources
+        void    encode(const float *const *sources, size_t numSamples, float *const *bus);
+
+    private:
+
+        int                                         order;
+        size_t                                      numChannels;
+
+        //  The gains of each source the last block ended on, and the ones to ramp to
+        std::vector<std::vector<float>>             gains;
+        std::vector<TripleBuffer<std::vector<float>>>  incomingGains;
+
+        JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(Encoder)
+    };
+};
+
+
+#ifdef JUCE_UNIT_TESTS
+class AmbisonicsTest : public juce::UnitTest
+{
+public:
+    AmbisonicsTest() : UnitTest("AmbisonicsUnitTest", "HRTFProcessor") {};
+
+    void runTest() override;
+};
+
+static AmbisonicsTest ambisonicsUnitTest;
+
+#endif
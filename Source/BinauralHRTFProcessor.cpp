@@ -0,0 +1,471 @@
+#include "BinauralHRTFProcessor.h"
+
+
+bool BinauralHRTFProcessor::init(const double *hrirLeft, const double *hrirRight, size_t hrirSize, float samplingFreq, size_t audioBufferSize, size_t numDelaySamples, PartitionScheme scheme, bool useBackgroundThread)
+{
+    return initEngine({ hrirLeft, hrirRight }, hrirSize, samplingFreq, audioBufferSize, numDelaySamples, scheme, useBackgroundThread);
+}
+
+
+//  Both HRIRs are swapped together so the ears always crossfade in the same block
+bool BinauralHRTFProcessor::swapHRIR(const double *hrirLeft, const double *hrirRight, size_t hrirSize, size_t numDelaySamples)
+{
+    if (!hrirLoaded || hrirSize <= 0)
+        return false;
+
+    if (hrirLeft == nullptr || hrirRight == nullptr)
+        return false;
+
+    return setupHRTF({ hrirLeft, hrirRight }, hrirSize, numDelaySamples);
+}
+
+
+/*
+ *  Write numSamples of processed output for each ear into left and right
+ *  Returns false and leaves left and right untouched if there are not enough output samples available
+ */
+bool BinauralHRTFProcessor::getOutput(float *left, float *right, size_t numSamples)
+{
+    if (numSamples > numOutputSamplesAvailable)
+        return false;
+
+    for (auto i = 0; i < numSamples; ++i)
+    {
+        left[i] = outputBuffer[0][outputSampleStart];
+        right[i] = outputBuffer[1][outputSampleStart];
+
+        outputSampleStart = (outputSampleStart + 1) % outputBuffer[0].size();
+    }
+
+    numOutputSamplesAvailable -= numSamples;
+
+    return true;
+}
+
+
+/*
+ *  DO NOT CALL THIS FUNCTION ON MULTIPLE THREADS
+ *  Process buffer in place, the first getNumSources() channels are used as the inputs and the left and right outputs are written to channels 0 and 1
+ *  If the input was added but there is not enough output yet, both channels are cleared so the dry input does not leak through
+ */
+bool BinauralHRTFProcessor::process(juce::AudioBuffer<float> &buffer)
+{
+    if (buffer.getNumChannels() < juce::jmax(2, (int)getNumSources()))
+        return false;
+
+    auto numSamples = buffer.getNumSamples();
+
+    if (!addSamples(buffer.getArrayOfReadPointers(), (size_t)numSamples))
+        return false;
+
+    //  The input has been consumed so the output can be written straight over it
+    if (!getOutput(buffer.getWritePointer(0), buffer.getWritePointer(1), (size_t)numSamples))
+    {
+        buffer.clear(0, 0, numSamples);
+        buffer.clear(1, 0, numSamples);
+        return false;
+    }
+
+    return true;
+}
+
+
+
+#ifdef JUCE_UNIT_TESTS
+void BinauralHRTFProcessorTest::runTest()
+{
+    float samplingFreq = 44100.0;
+
+    std::vector<double> hrirLeft(3000);
+    std::vector<double> hrirRight(3000);
+    for (auto i = 0; i < hrirLeft.size(); ++i)
+    {
+        hrirLeft[i] = sin(0.03 * i) * exp(-0.002 * i);
+        hrirRight[i] = cos(0.07 * i) * exp(-0.003 * i);
+    }
+
+    std::vector<float> signal(8192);
+    for (auto i = 0; i < signal.size(); ++i)
+        signal[i] = sin((i * 2 * juce::MathConstants<float>::pi * 800) / samplingFreq);
+
+
+    beginTest("Binaural Initialization");
+
+    BinauralHRTFProcessor processor;
+    expect(processor.init(hrirLeft.data(), hrirRight.data(), hrirLeft.size(), samplingFreq, 256, 0, HRTFProcessor::PartitionScheme::nonUniform, true));
+    expect(processor.isHRIRLoaded());
+
+    //  The input side is shared, only the HRTFs and outputs are kept per ear
+    expectEquals<size_t>(processor.outputBuffer.size(), 2);
+    expectEquals<size_t>(processor.headTaps.size(), 2);
+    for (auto &segment : processor.segments)
+    {
+        expectEquals<size_t>(segment->frequencyDelayLines.size(), 1);
+        expectEquals<size_t>(segment->frequencyDelayLines[0].size(), segment->numPartitions * 2 * segment->binStride);
+        expectEquals<size_t>(segment->activeHRTF.size(), 2);
+        expectEquals<size_t>(segment->outputBlocks.size(), 2);
+    }
+
+    expect(!processor.init(hrirLeft.data(), hrirRight.data(), hrirLeft.size(), samplingFreq, 256, 0));
+
+    //===================================================================================================//
+
+
+    beginTest("Binaural Convolution");
+
+    //  Each ear should match a direct convolution with its own HRIR
+    auto referenceLeft = convolve(signal, hrirLeft);
+    auto referenceRight = convolve(signal, hrirRight);
+
+    std::vector<float> outLeft(signal.size());
+    std::vector<float> outRight(signal.size());
+
+    for (auto position = 0; position < signal.size(); position += 128)
+    {
+        expect(processor.addSamples(signal.data() + position, 128));
+
+        for (auto i = 0; i < 128; ++i)
+        {
+            outLeft[position + i] = processor.outputBuffer[0][processor.outputSampleStart];
+            outRight[position + i] = processor.outputBuffer[1][processor.outputSampleStart];
+            processor.outputSampleStart = (processor.outputSampleStart + 1) % processor.outputBuffer[0].size();
+        }
+
+        processor.numOutputSamplesAvailable -= 128;
+    }
+
+    float maxErrorLeft = 0;
+    float maxErrorRight = 0;
+    for (auto i = 0; i < signal.size(); ++i)
+    {
+        maxErrorLeft = juce::jmax(maxErrorLeft, std::abs(outLeft[i] - referenceLeft[i]));
+        maxErrorRight = juce::jmax(maxErrorRight, std::abs(outRight[i] - referenceRight[i]));
+    }
+
+    expectWithinAbsoluteError<float>(maxErrorLeft, 0.0, 0.001);
+    expectWithinAbsoluteError<float>(maxErrorRight, 0.0, 0.001);
+
+    //===================================================================================================//
+
+
+    beginTest("Binaural Output");
+
+    processor.flushBuffers();
+
+    expect(!processor.getOutput(outLeft.data(), outRight.data(), 128));
+
+    expect(processor.addSamples(signal.data(), 256));
+    expect(processor.getOutput(outLeft.data(), outRight.data(), 256));
+    expectEquals<size_t>(processor.numOutputSamplesAvailable, 0);
+
+    //  A block processed in place leaves no output behind
+    juce::AudioBuffer<float> buffer(2, 256);
+    buffer.copyFrom(0, 0, signal.data() + 256, 256);
+    expect(processor.process(buffer));
+    expectEquals<size_t>(processor.numOutputSamplesAvailable, 0);
+
+    juce::AudioBuffer<float> monoBuffer(1, 256);
+    expect(!processor.process(monoBuffer));
+
+    //  Both ears swap together
+    expect(processor.swapHRIR(hrirRight.data(), hrirLeft.data(), hrirLeft.size(), 0));
+    expect(!processor.swapHRIR(hrirRight.data(), nullptr, hrirLeft.size(), 0));
+
+    //===================================================================================================//
+
+
+    beginTest("Minimum Phase");
+
+    //  The same minimum-phase resonance reaches the ears 10 and 25 samples late, 5 of which are the common onset delay
+    std::vector<double> resonance(256, 0.0);
+    for (auto i = 0; i < 128; ++i)
+        resonance[i] = pow(0.9, i) * cos(0.3 * i);
+
+    auto delayResonance = [&](size_t delay)
+    {
+        std::vector<double> hrir(256, 0.0);
+        std::copy(resonance.begin(), resonance.end() - delay, hrir.begin() + delay);
+        return hrir;
+    };
+
+    auto delayedLeft = delayResonance(10);
+    auto delayedRight = delayResonance(25);
+
+    BinauralHRTFProcessor minimumPhaseProcessor;
+    expect(minimumPhaseProcessor.setMinimumPhase(128));
+    expect(minimumPhaseProcessor.init(delayedLeft.data(), delayedRight.data(), 256, samplingFreq, 256, 5, HRTFProcessor::PartitionScheme::nonUniform));
+    expect(minimumPhaseProcessor.isMinimumPhase());
+    expect(!minimumPhaseProcessor.setMinimumPhase(0));
+
+    //  The segments only cover the truncated filter
+    expectEquals<size_t>(minimumPhaseProcessor.hrirPartitionedSize, 128);
+    expectWithinAbsoluteError<float>(minimumPhaseProcessor.earDelays[0], 5.0f, 0.05f);
+    expectWithinAbsoluteError<float>(minimumPhaseProcessor.earDelays[1], 20.0f, 0.05f);
+
+    std::vector<double> shiftedLeft(delayedLeft.begin() + 5, delayedLeft.end());
+    std::vector<double> shiftedRight(delayedRight.begin() + 5, delayedRight.end());
+    referenceLeft = convolve(signal, shiftedLeft);
+    referenceRight = convolve(signal, shiftedRight);
+
+    for (auto position = 0; position < signal.size(); position += 128)
+    {
+        expect(minimumPhaseProcessor.addSamples(signal.data() + position, 128));
+
+        for (auto i = 0; i < 128; ++i)
+        {
+            outLeft[position + i] = minimumPhaseProcessor.outputBuffer[0][minimumPhaseProcessor.outputSampleStart];
+            outRight[position + i] = minimumPhaseProcessor.outputBuffer[1][minimumPhaseProcessor.outputSampleStart];
+            minimumPhaseProcessor.outputSampleStart = (minimumPhaseProcessor.outputSampleStart + 1) % minimumPhaseProcessor.outputBuffer[0].size();
+        }
+
+        minimumPhaseProcessor.numOutputSamplesAvailable -= 128;
+    }
+
+    maxErrorLeft = 0;
+    maxErrorRight = 0;
+    for (auto i = 0; i < signal.size(); ++i)
+    {
+        maxErrorLeft = juce::jmax(maxErrorLeft, std::abs(outLeft[i] - referenceLeft[i]));
+        maxErrorRight = juce::jmax(maxErrorRight, std::abs(outRight[i] - referenceRight[i]));
+    }
+
+    expectWithinAbsoluteError<float>(maxErrorLeft, 0.0, 0.01);
+    expectWithinAbsoluteError<float>(maxErrorRight, 0.0, 0.01);
+
+    //  Blending two measurements blends their delays, the new delay is reached one hop after the swap is picked up
+    HRTFProcessor::PreparedHRTF toLeft, toRight;
+    auto delayedFar = delayResonance(30);
+    expect(minimumPhaseProcessor.prepareHRTF({ delayedLeft.data(), delayedFar.data() }, 256, 5, toLeft));
+    expect(minimumPhaseProcessor.prepareHRTF({ delayedFar.data(), delayedLeft.data() }, 256, 5, toRight));
+
+    const HRTFProcessor::PreparedHRTF *blend[] = { &toLeft, &toRight };
+    float weights[] = { 0.5, 0.5 };
+    expect(minimumPhaseProcessor.swapHRTF(blend, weights, 2));
+
+    std::vector<float> block(2 * minimumPhaseProcessor.hopSize);
+    minimumPhaseProcessor.flushBuffers();
+    expect(minimumPhaseProcessor.addSamples(block.data(), block.size()));
+    expectWithinAbsoluteError<float>(minimumPhaseProcessor.earDelays[0], 15.0f, 0.05f);
+    expectWithinAbsoluteError<float>(minimumPhaseProcessor.earDelays[1], 15.0f, 0.05f);
+
+    //===================================================================================================//
+
+
+    beginTest("Multiple Sources");
+
+    //  Three sources, each with its own HRIRs, should sum to the three convolutions
+    BinauralHRTFProcessor multiSourceProcessor;
+    expect(multiSourceProcessor.setNumSources(3));
+    expect(!multiSourceProcessor.setMinimumPhase(128));
+    expect(multiSourceProcessor.init(hrirLeft.data(), hrirRight.data(), hrirLeft.size(), samplingFreq, 256, 0, HRTFProcessor::PartitionScheme::nonUniform));
+    expect(!multiSourceProcessor.setNumSources(1));
+    expect(!multiSourceProcessor.addSamples(signal.data(), 128));
+
+    //  The input side is kept per source, the outputs and inverse transforms per ear
+    expectEquals<size_t>(multiSourceProcessor.headTaps.size(), 6);
+    for (auto &segment : multiSourceProcessor.segments)
+    {
+        expectEquals<size_t>(segment->frequencyDelayLines.size(), 3);
+        expectEquals<size_t>(segment->activeHRTF.size(), 6);
+        expectEquals<size_t>(segment->xBuffer.size(), 2);
+    }
+
+    std::vector<std::vector<double>> sourceLeft(3, std::vector<double>(hrirLeft.size(), 0.0));
+    std::vector<std::vector<double>> sourceRight(3, std::vector<double>(hrirLeft.size(), 0.0));
+    std::vector<std::vector<float>> sourceSignals(3, std::vector<float>(signal.size()));
+
+    for (auto source = 0; source < 3; ++source)
+    {
+        for (auto i = 0; i < hrirLeft.size(); ++i)
+        {
+            sourceLeft[source][i] = sin((0.02 + 0.03 * source) * i) * exp(-0.002 * i);
+            sourceRight[source][i] = cos((0.05 + 0.02 * source) * i) * exp(-0.004 * i);
+        }
+
+        for (auto i = 0; i < signal.size(); ++i)
+            sourceSignals[source][i] = sin((i * 2 * juce::MathConstants<float>::pi * (300 + 250 * source)) / samplingFreq);
+
+        HRTFProcessor::PreparedHRTF prepared;
+        expect(multiSourceProcessor.prepareHRTF({ sourceLeft[source].data(), sourceRight[source].data() }, hrirLeft.size(), 0, prepared));
+        expect(multiSourceProcessor.swapHRTF(prepared, source));
+    }
+
+    HRTFProcessor::PreparedHRTF unusedSource;
+    expect(multiSourceProcessor.prepareHRTF({ hrirLeft.data(), hrirRight.data() }, hrirLeft.size(), 0, unusedSource));
+    expect(!multiSourceProcessor.swapHRTF(unusedSource, 3));
+
+    //  Let every segment pick up the new HRTFs on silence so the output only has the new HRTFs in it
+    std::vector<float> silence(128, 0.0);
+    const float *silentSources[] = { silence.data(), silence.data(), silence.data() };
+    for (auto position = 0; position < signal.size(); position += 128)
+    {
+        expect(multiSourceProcessor.addSamples(silentSources, 128));
+        multiSourceProcessor.outputSampleStart = (multiSourceProcessor.outputSampleStart + 128) % multiSourceProcessor.outputBuffer[0].size();
+        multiSourceProcessor.numOutputSamplesAvailable -= 128;
+    }
+
+    multiSourceProcessor.flushBuffers();
+
+    referenceLeft = std::vector<float>(signal.size(), 0.0);
+    referenceRight = std::vector<float>(signal.size(), 0.0);
+    for (auto source = 0; source < 3; ++source)
+    {
+        auto left = convolve(sourceSignals[source], sourceLeft[source]);
+        auto right = convolve(sourceSignals[source], sourceRight[source]);
+
+        for (auto i = 0; i < signal.size(); ++i)
+        {
+            referenceLeft[i] += left[i];
+            referenceRight[i] += right[i];
+        }
+    }
+
+    for (auto position = 0; position < signal.size(); position += 128)
+    {
+        const float *inputs[] = { sourceSignals[0].data() + position, sourceSignals[1].data() + position, sourceSignals[2].data() + position };
+        expect(multiSourceProcessor.addSamples(inputs, 128));
+
+        for (auto i = 0; i < 128; ++i)
+        {
+            outLeft[position + i] = multiSourceProcessor.outputBuffer[0][multiSourceProcessor.outputSampleStart];
+            outRight[position + i] = multiSourceProcessor.outputBuffer[1][multiSourceProcessor.outputSampleStart];
+            multiSourceProcessor.outputSampleStart = (multiSourceProcessor.outputSampleStart + 1) % multiSourceProcessor.outputBuffer[0].size();
+        }
+
+        multiSourceProcessor.numOutputSamplesAvailable -= 128;
+    }
+
+    maxErrorLeft = 0;
+    maxErrorRight = 0;
+    for (auto i = 0; i < signal.size(); ++i)
+    {
+        maxErrorLeft = juce::jmax(maxErrorLeft, std::abs(outLeft[i] - referenceLeft[i]));
+        maxErrorRight = juce::jmax(maxErrorRight, std::abs(outRight[i] - referenceRight[i]));
+    }
+
+    expectWithinAbsoluteError<float>(maxErrorLeft, 0.0, 0.05);
+    expectWithinAbsoluteError<float>(maxErrorRight, 0.0, 0.05);
+
+    //===================================================================================================//
+
+
+    beginTest("Render Pool");
+
+    //  Sharing the segments with a render pool should not change a single bit of the output, even while HRTFs are being interpolated
+    RenderPool pool(3);
+    BinauralHRTFProcessor serialProcessor;
+    BinauralHRTFProcessor pooledProcessor;
+    pooledProcessor.setRenderPool(&pool);
+
+    for (auto *engine : { &serialProcessor, &pooledProcessor })
+    {
+        expect(engine->setNumSources(3));
+        expect(engine->init(hrirLeft.data(), hrirRight.data(), hrirLeft.size(), samplingFreq, 256, 0, HRTFProcessor::PartitionScheme::nonUniform));
+    }
+
+    //  Three sources of a long HRIR are worth sharing, a single source of a short one is not
+    expect(pooledProcessor.needsRenderPool());
+
+    BinauralHRTFProcessor smallProcessor;
+    expect(smallProcessor.init(hrirLeft.data(), hrirRight.data(), 64, samplingFreq, 256, 0, HRTFProcessor::PartitionScheme::nonUniform));
+    expect(!smallProcessor.needsRenderPool());
+
+    int numMismatches = 0;
+    for (auto position = 0; position < signal.size(); position += 256)
+    {
+        //  Move one source to another HRTF every few blocks
+        if (position % 1024 == 0)
+        {
+            auto source = (size_t)(position / 1024) % 3;
+            auto &left = ((position / 1024) % 2 == 0) ? sourceLeft[source] : hrirLeft;
+            auto &right = ((position / 1024) % 2 == 0) ? sourceRight[source] : hrirRight;
+
+            HRTFProcessor::PreparedHRTF prepared;
+            expect(serialProcessor.prepareHRTF({ left.data(), right.data() }, hrirLeft.size(), 0, prepared));
+            expect(serialProcessor.swapHRTF(prepared, source));
+            expect(pooledProcessor.swapHRTF(prepared, source));
+        }
+
+        const float *inputs[] = { sourceSignals[0].data() + position, sourceSignals[1].data() + position, sourceSignals[2].data() + position };
+        std::vector<float> serialLeft(256), serialRight(256), pooledLeft(256), pooledRight(256);
+
+        expect(serialProcessor.addSamples(inputs, 256));
+        expect(pooledProcessor.addSamples(inputs, 256));
+        expect(serialProcessor.getOutput(serialLeft.data(), serialRight.data(), 256));
+        expect(pooledProcessor.getOutput(pooledLeft.data(), pooledRight.data(), 256));
+
+        for (auto i = 0; i < 256; ++i)
+            numMismatches += (serialLeft[i] != pooledLeft[i] || serialRight[i] != pooledRight[i]) ? 1 : 0;
+    }
+
+    expectEquals(numMismatches, 0);
+
+    //===================================================================================================//
+
+
+    beginTest("Long Room Response");
+
+    //  A two second room response at 48 kHz, sparse so the reference is cheap to calculate
+    float roomSamplingFreq = 48000.0;
+    std::vector<double> roomLeft(96000, 0.0);
+    std::vector<double> roomRight(96000, 0.0);
+    roomLeft[0] = 0.5;
+    roomLeft[20000] = 0.25;
+    roomLeft[95999] = 0.125;
+    roomRight[5] = 0.5;
+    roomRight[60000] = -0.3;
+
+    BinauralHRTFProcessor roomProcessor;
+    expect(roomProcessor.init(roomLeft.data(), roomRight.data(), roomLeft.size(), roomSamplingFreq, 256, 0, HRTFProcessor::PartitionScheme::nonUniform, true));
+
+    //  The long segments that make up most of the response are calculated on the background thread
+    for (auto &segment : roomProcessor.segments)
+    {
+        if (segment->blockSize == HRTFProcessor::MAX_PARTITION_SIZE)
+            expect(segment->processInBackground);
+    }
+
+    std::vector<float> roomInput(100096);
+    for (auto i = 0; i < roomInput.size(); ++i)
+        roomInput[i] = 0.5f * sin(0.013f * i) + 0.3f * sin(0.31f * i + 1.0f);
+
+    std::vector<float> roomOutLeft(roomInput.size()), roomOutRight(roomInput.size());
+    for (auto position = 0; position < roomInput.size(); position += 256)
+    {
+        expect(roomProcessor.addSamples(roomInput.data() + position, 256));
+        expect(roomProcessor.getOutput(roomOutLeft.data() + position, roomOutRight.data() + position, 256));
+    }
+
+    maxErrorLeft = 0;
+    maxErrorRight = 0;
+    for (auto n = 0; n < roomInput.size(); ++n)
+    {
+        auto input = [&roomInput](int i) { return (i >= 0) ? roomInput[i] : 0.0f; };
+        auto expectedLeft = 0.5f * input(n) + 0.25f * input(n - 20000) + 0.125f * input(n - 95999);
+        auto expectedRight = 0.5f * input(n - 5) - 0.3f * input(n - 60000);
+
+        maxErrorLeft = juce::jmax(maxErrorLeft, std::abs(roomOutLeft[n] - expectedLeft));
+        maxErrorRight = juce::jmax(maxErrorRight, std::abs(roomOutRight[n] - expectedRight));
+    }
+
+    expectWithinAbsoluteError<float>(maxErrorLeft, 0.0, 0.001);
+    expectWithinAbsoluteError<float>(maxErrorRight, 0.0, 0.001);
+}
+
+
+//  Direct form convolution used as a reference for the partitioned convolution
+std::vector<float> BinauralHRTFProcessorTest::convolve(const std::vector<float> &x, const std::vector<double> &h)
+{
+    std::vector<float> y(x.size());
+    std::fill(y.begin(), y.end(), 0.0);
+
+    for (auto n = 0; n < x.size(); ++n)
+    {
+        for (auto k = 0; k < h.size() && k <= n; ++k)
+            y[n] += h[k] * x[n - k];
+    }
+
+    return y;
+}
+
+#endif
@@ -0,0 +1,47 @@
+#pragma once
+#include "HRTFProcessor.h"
+
+
+/*
+ *  Applies a left and a right HRIR to the same mono signal
+ *
+ *  Both ears share one set of input frames, forward FFTs and frequency-domain delay lines so every block of input is
+ *  buffered and transformed once.  The input spectrum is multiplied with both ear HRTFs and only the two inverse FFTs are done per ear.
+ *  The reverb only depends on the input so it is not part of the engine, the plugin runs one stereo reverb on the dry mix.
+ *
+ *  With several sources (see HRTFProcessor::setNumSources()) process() reads one source from each of the first getNumSources() channels.
+ *
+ *  Like HRTFProcessor, addSamples(), getOutput() and process() only use storage allocated in init() and are safe to call on the audio thread.
+ */
+class BinauralHRTFProcessor : public HRTFProcessor
+{
+#ifdef JUCE_UNIT_TESTS
+    friend class BinauralHRTFProcessorTest;
+#endif
+
+public:
+
+    BinauralHRTFProcessor() {}
+
+    bool    init(const double *hrirLeft, const double *hrirRight, size_t hrirSize, float samplingFreq, size_t audioBufferSize, size_t numDelaySamples, PartitionScheme scheme = PartitionScheme::uniform, bool useBackgroundThread = false);
+    bool    swapHRIR(const double *hrirLeft, const double *hrirRight, size_t hrirSize, size_t numDelaySamples);
+    bool    getOutput(float *left, float *right, size_t numSamples);
+    bool    process(juce::AudioBuffer<float> &buffer);
+};
+
+
+#ifdef JUCE_UNIT_TESTS
+class BinauralHRTFProcessorTest : public juce::UnitTest
+{
+public:
+    BinauralHRTFProcessorTest() : UnitTest("BinauralHRTFProcessorUnitTest", "HRTFProcessor") {};
+
+    void runTest() override;
+
+private:
+    std::vector<float> convolve(const std::vector<float> &x, const std::vector<double> &h);
+};
+
+static BinauralHRTFProcessorTest binauralHRTFProcessorUnitTest;
+
+#endif
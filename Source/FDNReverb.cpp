@@ -0,0 +1,362 @@
+#include "FDNReverb.h"
+
+
+//  Spread over a bit more than an octave and far from sharing factors, so the echoes of the lines rarely line up
+const float FDNReverb::DELAY_LENGTHS[NUM_LINES] = { 887, 1009, 1117, 1213, 1327, 1433, 1553, 1667,
+                                                    1783, 1901, 2011, 2129, 2243, 2357, 2473, 2591 };
+
+
+FDNReverb::FDNReverb()
+{
+    fs = 0.0;
+    ringSize = 0;
+    writeIndex = 0;
+    damping = 0.0f;
+
+    std::fill(delays, delays + NUM_LINES, 0.0f);
+
+    std::vector<float> lanes(NUM_LINES);
+    auto toVectors = [&lanes](std::vector<Vector> &dest)
+    {
+        dest.resize(NUM_VECTORS);
+        for (auto v = 0; v < NUM_VECTORS; ++v)
+        {
+            for (auto lane = 0; lane < LANES; ++lane)
+                dest[v].set(lane, lanes[(v * LANES) + lane]);
+        }
+    };
+
+    //  Rows of a Hadamard matrix, they are orthogonal to each other and to the all-ones direction the Householder matrix reflects
+    //  so the input is spread evenly and the two outputs are decorrelated
+    auto norm = 1.0f / std::sqrt((float)NUM_LINES);
+
+    for (auto line = 0; line < NUM_LINES; ++line)
+        lanes[line] = INPUT_GAIN * (((line & 1) != 0) ? -1.0f : 1.0f);
+    toVectors(inputSigns);
+
+    for (auto line = 0; line < NUM_LINES; ++line)
+        lanes[line] = norm * (((line & 2) != 0) ? -1.0f : 1.0f);
+    toVectors(leftSigns);
+
+    for (auto line = 0; line < NUM_LINES; ++line)
+        lanes[line] = norm * (((line & 4) != 0) ? -1.0f : 1.0f);
+    toVectors(rightSigns);
+
+    std::fill(lanes.begin(), lanes.end(), 0.0f);
+    toVectors(decayGains);
+    toVectors(modulationCos);
+    toVectors(modulationSin);
+    toVectors(lowpassState);
+    toVectors(taps);
+    toVectors(offsets);
+
+    oscillatorCos = 1.0f;
+    oscillatorSin = 0.0f;
+    rotationCos = 1.0f;
+    rotationSin = 0.0f;
+
+    setParameters(params);
+}
+
+
+void FDNReverb::setSampleRate(double sampleRate)
+{
+    if (sampleRate <= 0.0)
+        return;
+
+    fs = sampleRate;
+
+    auto scale = (float)(fs / 48000.0);
+    auto depth = MODULATION_DEPTH * scale;
+
+    float longestDelay = 0.0f;
+    for (auto line = 0; line < NUM_LINES; ++line)
+    {
+        delays[line] = DELAY_LENGTHS[line] * scale;
+        longestDelay = juce::jmax(longestDelay, delays[line]);
+    }
+
+    //  Room for the longest modulated delay and the sample after it that the interpolation reads
+    ringSize = 1;
+    while (ringSize < (size_t)(longestDelay + depth) + 4)
+        ringSize *= 2;
+
+    ring = std::vector<Vector>(ringSize * NUM_VECTORS, Vector::expand(0.0f));
+
+    //  Every line is moved by the same oscillator at a phase of its own
+    for (auto line = 0; line < NUM_LINES; ++line)
+    {
+        auto phase = (2.0f * juce::MathConstants<float>::pi * line) / (float)NUM_LINES;
+        modulationCos[line / LANES].set(line % LANES, depth * std::cos(phase));
+        modulationSin[line / LANES].set(line % LANES, -depth * std::sin(phase));
+    }
+
+    auto rotation = (2.0 * juce::MathConstants<double>::pi * MODULATION_RATE) / fs;
+    rotationCos = (float)std::cos(rotation);
+    rotationSin = (float)std::sin(rotation);
+
+    dryGain.reset(fs, 0.01);
+    wetGain1.reset(fs, 0.01);
+    wetGain2.reset(fs, 0.01);
+
+    updateDecay();
+    reset();
+}
+
+
+void FDNReverb::setParameters(const juce::Reverb::Parameters &newParams)
+{
+    params = newParams;
+
+    dryGain.setTargetValue(params.dryLevel * DRY_SCALE);
+    wetGain1.setTargetValue(params.wetLevel * WET_SCALE * (0.5f + (0.5f * params.width)));
+    wetGain2.setTargetValue(params.wetLevel * WET_SCALE * (0.5f - (0.5f * params.width)));
+
+    damping = params.damping * MAX_DAMPING;
+
+    updateDecay();
+}
+
+
+void FDNReverb::reset()
+{
+    for (auto &frame : ring)
+        frame = Vector::expand(0.0f);
+
+    for (auto &state : lowpassState)
+        state = Vector::expand(0.0f);
+
+    writeIndex = 0;
+    oscillatorCos = 1.0f;
+    oscillatorSin = 0.0f;
+
+    dryGain.setCurrentAndTargetValue(dryGain.getTargetValue());
+    wetGain1.setCurrentAndTargetValue(wetGain1.getTargetValue());
+    wetGain2.setCurrentAndTargetValue(wetGain2.getTargetValue());
+}
+
+
+//  Cubic so that most of the range is spent on the shorter, more common decay times
+float FDNReverb::getDecayTime(float roomSize)
+{
+    roomSize = juce::jlimit(0.0f, 1.0f, roomSize);
+
+    return MIN_DECAY_TIME + ((MAX_DECAY_TIME - MIN_DECAY_TIME) * roomSize * roomSize * roomSize);
+}
+
+
+//  Every line loses 60 dB over the decay time, longer lines lose more per pass so they all decay at the same rate
+void FDNReverb::updateDecay()
+{
+    if (fs <= 0.0)
+        return;
+
+    auto decayTime = getDecayTime(params.roomSize);
+
+    for (auto line = 0; line < NUM_LINES; ++line)
+        decayGains[line / LANES].set(line % LANES, std::pow(10.0f, (-3.0f * delays[line]) / (decayTime * (float)fs)));
+}
+
+
+/*
+ *  Per sample: read every line at its modulated delay, lowpass and attenuate the taps, reflect them through the Householder matrix
+ *  I - (2 / NUM_LINES) * ones, add the input and write the result as the newest frame
+ */
+void FDNReverb::processStereo(float *left, float *right, int numSamples)
+{
+    if (ring.empty())
+        return;
+
+    auto *ringSamples = reinterpret_cast<const float*>(ring.data());
+    auto *tapSamples = reinterpret_cast<float*>(taps.data());
+    auto *offsetSamples = reinterpret_cast<float*>(offsets.data());
+    auto mask = ringSize - 1;
+    auto reflection = 2.0f / (float)NUM_LINES;
+
+    for (auto i = 0; i < numSamples; ++i)
+    {
+        auto nextCos = (oscillatorCos * rotationCos) - (oscillatorSin * rotationSin);
+        oscillatorSin = (oscillatorSin * rotationCos) + (oscillatorCos * rotationSin);
+        oscillatorCos = nextCos;
+
+        for (auto v = 0; v < NUM_VECTORS; ++v)
+            offsets[v] = (modulationCos[v] * oscillatorCos) + (modulationSin[v] * oscillatorSin);
+
+        //  The delays are at least a few hundred samples so the read position never passes the frame being written
+        for (auto line = 0; line < NUM_LINES; ++line)
+        {
+            auto position = (float)(writeIndex + ringSize) - delays[line] - offsetSamples[line];
+            auto index = (size_t)position;
+            auto fraction = position - (float)index;
+
+            auto a = ringSamples[((index & mask) * NUM_LINES) + line];
+            auto b = ringSamples[(((index + 1) & mask) * NUM_LINES) + line];
+            tapSamples[line] = a + (fraction * (b - a));
+        }
+
+        auto input = Vector::expand((left[i] + right[i]) * 0.5f);
+        auto sum = Vector::expand(0.0f);
+        auto wetLeft = Vector::expand(0.0f);
+        auto wetRight = Vector::expand(0.0f);
+        Vector decayed[NUM_VECTORS];
+
+        for (auto v = 0; v < NUM_VECTORS; ++v)
+        {
+            //  One-pole lowpass, y = x + damping * (y - x)
+            lowpassState[v] = taps[v] + ((lowpassState[v] - taps[v]) * damping);
+            decayed[v] = lowpassState[v] * decayGains[v];
+            sum += decayed[v];
+
+            wetLeft += taps[v] * leftSigns[v];
+            wetRight += taps[v] * rightSigns[v];
+        }
+
+        auto feedback = Vector::expand(sum.sum() * reflection);
+        auto *frame = ring.data() + (writeIndex * NUM_VECTORS);
+
+        for (auto v = 0; v < NUM_VECTORS; ++v)
+            frame[v] = decayed[v] - feedback + (inputSigns[v] * input);
+
+        writeIndex = (writeIndex + 1) & mask;
+
+        auto outLeft = wetLeft.sum();
+        auto outRight = wetRight.sum();
+        auto wet1 = wetGain1.getNextValue();
+        auto wet2 = wetGain2.getNextValue();
+        auto dry = dryGain.getNextValue();
+
+        left[i] = (outLeft * wet1) + (outRight * wet2) + (left[i] * dry);
+        right[i] = (outRight * wet1) + (outLeft * wet2) + (right[i] * dry);
+    }
+
+    //  Keep rounding errors from changing the amplitude of the oscillator
+    auto magnitude = std::sqrt((oscillatorCos * oscillatorCos) + (oscillatorSin * oscillatorSin));
+    oscillatorCos /= magnitude;
+    oscillatorSin /= magnitude;
+}
+
+
+
+#ifdef JUCE_UNIT_TESTS
+void FDNReverbTest::runTest()
+{
+    double samplingFreq = 48000.0;
+
+    auto energy = [](const std::vector<float> &x, size_t start, size_t length)
+    {
+        double sum = 0.0;
+        for (auto i = start; i < start + length; ++i)
+            sum += (double)x[i] * x[i];
+
+        return sum;
+    };
+
+
+    beginTest("Dry Signal");
+
+    //  Without any wet level the input passes through at twice the dry level, like juce::Reverb
+    FDNReverb dryReverb;
+    juce::Reverb::Parameters dryParams;
+    dryParams.wetLevel = 0.0f;
+    dryParams.dryLevel = 0.5f;
+
+    dryReverb.setSampleRate(samplingFreq);
+    dryReverb.setParameters(dryParams);
+    dryReverb.reset();
+
+    std::vector<float> left(512), right(512);
+    for (auto i = 0; i < left.size(); ++i)
+    {
+        left[i] = std::sin(0.05f * i);
+        right[i] = std::cos(0.03f * i);
+    }
+
+    auto dryLeft = left;
+    auto dryRight = right;
+    dryReverb.processStereo(dryLeft.data(), dryRight.data(), (int)left.size());
+
+    float maxError = 0.0f;
+    for (auto i = 0; i < left.size(); ++i)
+        maxError = juce::jmax(maxError, std::abs(dryLeft[i] - left[i]), std::abs(dryRight[i] - right[i]));
+
+    expectWithinAbsoluteError<float>(maxError, 0.0f, 1e-6f);
+
+    //===================================================================================================//
+
+
+    beginTest("Decay");
+
+    //  The impulse response should lose 60 dB over the decay time that roomSize maps to
+    FDNReverb reverb;
+    juce::Reverb::Parameters params;
+    params.roomSize = 0.5f;
+    params.damping = 0.0f;
+    params.wetLevel = 1.0f;
+    params.dryLevel = 0.0f;
+    params.width = 1.0f;
+
+    reverb.setSampleRate(samplingFreq);
+    reverb.setParameters(params);
+    reverb.reset();
+
+    auto decayTime = FDNReverb::MIN_DECAY_TIME + ((FDNReverb::MAX_DECAY_TIME - FDNReverb::MIN_DECAY_TIME) * 0.125f);
+
+    std::vector<float> responseLeft((size_t)(3.0 * samplingFreq), 0.0f);
+    std::vector<float> responseRight(responseLeft.size(), 0.0f);
+    responseLeft[0] = 1.0f;
+    responseRight[0] = 1.0f;
+
+    for (size_t position = 0; position < responseLeft.size(); position += 512)
+    {
+        auto numSamples = (int)juce::jmin((size_t)512, responseLeft.size() - position);
+        reverb.processStereo(responseLeft.data() + position, responseRight.data() + position, numSamples);
+    }
+
+    bool finite = true;
+    for (auto i = 0; i < responseLeft.size(); ++i)
+        finite &= std::isfinite(responseLeft[i]) && std::isfinite(responseRight[i]);
+
+    expect(finite);
+
+    auto window = (size_t)(0.1 * samplingFreq);
+    auto early = (size_t)(0.3 * samplingFreq);
+    auto late = early + (size_t)(0.5 * decayTime * samplingFreq);
+
+    auto decayDb = 10.0 * std::log10(energy(responseLeft, late, window) / energy(responseLeft, early, window));
+    expectWithinAbsoluteError<double>(decayDb, -30.0, 5.0);
+
+    //===================================================================================================//
+
+
+    beginTest("Stereo Decorrelation");
+
+    //  At full width the two outputs tap the lines with orthogonal sign patterns
+    auto start = (size_t)(0.05 * samplingFreq);
+    auto length = (size_t)(0.5 * samplingFreq);
+
+    double cross = 0.0;
+    for (auto i = start; i < start + length; ++i)
+        cross += (double)responseLeft[i] * responseRight[i];
+
+    auto correlation = cross / std::sqrt(energy(responseLeft, start, length) * energy(responseRight, start, length));
+    expectLessThan<double>(std::abs(correlation), 0.2);
+
+    //  At zero width both outputs get the same mix of the two taps
+    params.width = 0.0f;
+    reverb.setParameters(params);
+    reverb.reset();
+
+    std::fill(responseLeft.begin(), responseLeft.end(), 0.0f);
+    std::fill(responseRight.begin(), responseRight.end(), 0.0f);
+    responseLeft[0] = 1.0f;
+    responseRight[0] = 1.0f;
+    reverb.processStereo(responseLeft.data(), responseRight.data(), 4096);
+
+    maxError = 0.0f;
+    for (auto i = 0; i < 4096; ++i)
+        maxError = juce::jmax(maxError, std::abs(responseLeft[i] - responseRight[i]));
+
+    expectWithinAbsoluteError<float>(maxError, 0.0f, 1e-6f);
+}
+
+#endif
@@ -0,0 +1,120 @@
+#pragma once
+#include <JuceHeader.h>
+#include <vector>
+
+
+/*
+ *  A feedback delay network reverb, cheaper and denser than juce::Reverb
+ *
+ *  NUM_LINES delay lines of different lengths feed back into each other through a Householder matrix, which mixes every line
+ *  into every other with a single sum.  The lines are kept in the lanes of SIMD registers: a frame of the ring buffer holds the newest
+ *  sample of every line, so the damping, decay, feedback and output taps of all lines are a few vector operations per sample.
+ *  Only reading the lines at their own delays is done lane by lane.  The delays are slowly modulated by one shared oscillator
+ *  to break up the metallic ringing of fixed delays.  The left and right outputs tap the lines with two orthogonal sign patterns,
+ *  so they are decorrelated and width blends them like juce::Reverb does.
+ *
+ *  Takes the same juce::Reverb::Parameters as juce::Reverb: roomSize sets the decay time and damping the loss of high frequencies
+ *  in the loop.  freezeMode is not supported.  Only setSampleRate() allocates.
+ */
+class FDNReverb
+{
+#ifdef JUCE_UNIT_TESTS
+    friend class FDNReverbTest;
+#endif
+
+public:
+
+    FDNReverb();
+
+    //  Allocates the delay lines so it should not be called on the audio thread
+    void    setSampleRate(double sampleRate);
+
+    void    setParameters(const juce::Reverb::Parameters &newParams);
+    const juce::Reverb::Parameters &getParameters() const { return params; }
+
+    void    reset();
+
+    //  Time in seconds for the network to decay by 60 dB at roomSize
+    static float    getDecayTime(float roomSize);
+
+    //  The two channels are mixed into the network like in juce::Reverb, processing happens in place
+    void    processStereo(float *left, float *right, int numSamples);
+
+    static constexpr size_t     NUM_LINES = 16;
+
+    //  Decay times in seconds that roomSize 0 and 1 map to
+    static constexpr float      MIN_DECAY_TIME = 0.3f;
+    static constexpr float      MAX_DECAY_TIME = 10.0f;
+
+
+private:
+
+    typedef juce::dsp::SIMDRegister<float>   Vector;
+
+    static constexpr size_t     LANES = Vector::SIMDNumElements;
+    static constexpr size_t     NUM_VECTORS = NUM_LINES / LANES;
+
+    //  Delay lengths at 48 kHz, in samples, and how far the modulation moves them
+    static const float          DELAY_LENGTHS[NUM_LINES];
+    static constexpr float      MODULATION_DEPTH = 6.0f;
+    static constexpr float      MODULATION_RATE = 0.35f;
+
+    //  The lowpass coefficient of every line at damping 1
+    static constexpr float      MAX_DAMPING = 0.7f;
+
+    //  The dry level is scaled like in juce::Reverb, the input is spread over the lines with a total gain of one
+    static constexpr float      INPUT_GAIN = 0.25f;
+    static constexpr float      WET_SCALE = 1.0f;
+    static constexpr float      DRY_SCALE = 2.0f;
+
+    void    updateDecay();
+
+    juce::Reverb::Parameters    params;
+    double                      fs;
+
+    //  Frames of NUM_LINES samples, ringSize frames long
+    std::vector<Vector>         ring;
+    size_t                      ringSize;
+    size_t                      writeIndex;
+    float                       delays[NUM_LINES];
+
+    //  Per-line constants, in the lanes of their vectors
+    std::vector<Vector>         decayGains;
+    std::vector<Vector>         inputSigns;
+    std::vector<Vector>         leftSigns;
+    std::vector<Vector>         rightSigns;
+    std::vector<Vector>         modulationCos;
+    std::vector<Vector>         modulationSin;
+
+    //  State of the one-pole lowpass of every line, and room for the taps read from the lines
+    std::vector<Vector>         lowpassState;
+    std::vector<Vector>         taps;
+    std::vector<Vector>         offsets;
+
+    //  The modulation oscillator turns its phasor by a fixed angle each sample
+    float                       oscillatorCos;
+    float                       oscillatorSin;
+    float                       rotationCos;
+    float                       rotationSin;
+
+    float                       damping;
+    juce::SmoothedValue<float>  dryGain;
+    juce::SmoothedValue<float>  wetGain1;
+    juce::SmoothedValue<float>  wetGain2;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(FDNReverb)
+};
+
+
+#ifdef JUCE_UNIT_TESTS
+class FDNReverbTest : public juce::UnitTest
+{
+public:
+    FDNReverbTest() : UnitTest("FDNReverbUnitTest", "HRTFProcessor") {};
+
+    void runTest() override;
+};
+
+static FDNReverbTest fdnReverbUnitTest;
+
+#endif
@@ -0,0 +1,411 @@
+#include "HRTFCache.h"
+#include "BinauralHRTFProcessor.h"
+
+
+HRTFCache::HRTFCache(const HRTFProcessor &p, size_t numMeasurements, HRIRProvider hrirProvider, size_t hrirSize, size_t numDelaySamples, size_t memoryLimit) :
+    processor(p),
+    hrirProvider(hrirProvider),
+    numMeasurements(numMeasurements),
+    hrirSize(hrirSize),
+    numDelaySamples(numDelaySamples),
+    memoryUsage(0),
+    memoryLimit(memoryLimit)
+{
+    entries = std::vector<std::shared_ptr<const HRTFProcessor::PreparedHRTF>>(numMeasurements);
+    recentlyUsedPositions = std::vector<std::list<size_t>::iterator>(numMeasurements, recentlyUsed.end());
+
+    nextMeasurementToPrecompute.store(0);
+    numPrecomputeJobs.store(0);
+    precomputeCancelled.store(false);
+}
+
+HRTFCache::~HRTFCache()
+{
+    cancelPrecompute();
+}
+
+
+/*
+ *  Start preparing every measurement that is not cached yet on numThreads threads and return straight away
+ *  The threads share one measurement counter so they finish at about the same time no matter how long each measurement takes
+ */
+void HRTFCache::precomputeAll(int numThreads)
+{
+    cancelPrecompute();
+
+    numThreads = juce::jmax(1, numThreads);
+
+    precomputeCancelled.store(false);
+    nextMeasurementToPrecompute.store(0);
+    numPrecomputeJobs.store(numThreads);
+
+    threadPool.reset(new juce::ThreadPool(numThreads));
+
+    for (auto i = 0; i < numThreads; ++i)
+        threadPool->addJob([this] { runPrecomputeJob(); });
+}
+
+
+//  Blocks until the precompute threads have stopped, the entries that are already cached are kept
+void HRTFCache::cancelPrecompute()
+{
+    precomputeCancelled.store(true);
+
+    if (threadPool.get() != nullptr)
+    {
+        threadPool->removeAllJobs(true, 5000);
+        threadPool.reset();
+    }
+
+    numPrecomputeJobs.store(0);
+}
+
+
+//  Share of the measurements the precompute threads have started on, 1 once they are done or have stopped
+float HRTFCache::getPrecomputeProgress() const
+{
+    if (!isPrecomputing() || numMeasurements == 0)
+        return 1.0f;
+
+    return juce::jmin(1.0f, (float)nextMeasurementToPrecompute.load() / numMeasurements);
+}
+
+
+void HRTFCache::runPrecomputeJob()
+{
+    while (!precomputeCancelled.load())
+    {
+        auto measurement = nextMeasurementToPrecompute.fetch_add(1);
+        if (measurement >= numMeasurements)
+            break;
+
+        if (isCached(measurement))
+            continue;
+
+        auto entry = prepare(measurement);
+        if (entry == nullptr)
+            continue;
+
+        //  Once the cache is full the remaining measurements are prepared on demand
+        if (!insert(measurement, entry, false))
+        {
+            precomputeCancelled.store(true);
+            break;
+        }
+    }
+
+    numPrecomputeJobs.fetch_sub(1);
+}
+
+
+std::shared_ptr<const HRTFProcessor::PreparedHRTF> HRTFCache::get(size_t measurement)
+{
+    if (measurement >= numMeasurements)
+        return nullptr;
+
+    {
+        const juce::ScopedLock scopedLock(lock);
+
+        if (entries[measurement] != nullptr)
+        {
+            recentlyUsed.splice(recentlyUsed.begin(), recentlyUsed, recentlyUsedPositions[measurement]);
+            return entries[measurement];
+        }
+    }
+
+    auto entry = prepare(measurement);
+    if (entry == nullptr)
+        return nullptr;
+
+    //  An entry that is larger than the whole cache is still returned, it just is not kept
+    insert(measurement, entry, true);
+
+    return entry;
+}
+
+
+bool HRTFCache::isCached(size_t measurement)
+{
+    if (measurement >= numMeasurements)
+        return false;
+
+    const juce::ScopedLock scopedLock(lock);
+    return entries[measurement] != nullptr;
+}
+
+
+void HRTFCache::setMemoryLimit(size_t newMemoryLimit)
+{
+    const juce::ScopedLock scopedLock(lock);
+
+    memoryLimit = newMemoryLimit;
+
+    while (memoryUsage > memoryLimit && !recentlyUsed.empty())
+        evictLeastRecentlyUsed();
+}
+
+
+size_t HRTFCache::getMemoryUsage()
+{
+    const juce::ScopedLock scopedLock(lock);
+    return memoryUsage;
+}
+
+
+size_t HRTFCache::getNumCached()
+{
+    const juce::ScopedLock scopedLock(lock);
+    return recentlyUsed.size();
+}
+
+
+//  Thread safe, the processor only reads its segment layout while preparing
+std::shared_ptr<const HRTFProcessor::PreparedHRTF> HRTFCache::prepare(size_t measurement) const
+{
+    auto hrirs = hrirProvider(measurement);
+    if (hrirs.empty())
+        return nullptr;
+
+    std::shared_ptr<HRTFProcessor::PreparedHRTF> entry(new HRTFProcessor::PreparedHRTF());
+    if (!processor.prepareHRTF(hrirs, hrirSize, numDelaySamples, *entry))
+        return nullptr;
+
+    return entry;
+}
+
+
+/*
+ *  Add an entry unless the measurement is already cached
+ *  Returns false if the entry does not fit, either because it is larger than the limit or because the cache is full and evictIfFull is false
+ */
+bool HRTFCache::insert(size_t measurement, const std::shared_ptr<const HRTFProcessor::PreparedHRTF> &entry, bool evictIfFull)
+{
+    auto entrySize = entry->getSizeInBytes();
+
+    const juce::ScopedLock scopedLock(lock);
+
+    if (entries[measurement] != nullptr)
+        return true;
+
+    if (entrySize > memoryLimit)
+        return false;
+
+    if (memoryUsage + entrySize > memoryLimit)
+    {
+        if (!evictIfFull)
+            return false;
+
+        while (memoryUsage + entrySize > memoryLimit && !recentlyUsed.empty())
+            evictLeastRecentlyUsed();
+    }
+
+    entries[measurement] = entry;
+    recentlyUsed.push_front(measurement);
+    recentlyUsedPositions[measurement] = recentlyUsed.begin();
+    memoryUsage += entrySize;
+
+    return true;
+}
+
+
+//  Call with the lock held.  Anyone still holding the evicted entry keeps it alive until they let go of it
+void HRTFCache::evictLeastRecentlyUsed()
+{
+    auto measurement = recentlyUsed.back();
+
+    memoryUsage -= entries[measurement]->getSizeInBytes();
+    entries[measurement].reset();
+
+    recentlyUsed.pop_back();
+    recentlyUsedPositions[measurement] = recentlyUsed.end();
+}
+
+
+
+#ifdef JUCE_UNIT_TESTS
+void HRTFCacheTest::runTest()
+{
+    float samplingFreq = 44100.0;
+    size_t hrirSize = 1024;
+    size_t numMeasurements = 24;
+
+    //  Every measurement gets its own decaying HRIR per ear
+    std::vector<std::vector<double>> hrirs(2 * numMeasurements, std::vector<double>(hrirSize));
+    for (auto m = 0; m < hrirs.size(); ++m)
+    {
+        for (auto i = 0; i < hrirSize; ++i)
+            hrirs[m][i] = sin((0.01 + 0.005 * m) * i) * exp(-0.004 * i);
+    }
+
+    HRTFCache::HRIRProvider provider = [&hrirs, numMeasurements](size_t measurement)
+    {
+        if (measurement >= numMeasurements)
+            return std::vector<const double*>();
+
+        return std::vector<const double*>({ hrirs[2 * measurement].data(), hrirs[2 * measurement + 1].data() });
+    };
+
+    BinauralHRTFProcessor processor;
+    processor.init(hrirs[0].data(), hrirs[1].data(), hrirSize, samplingFreq, 256, 0, HRTFProcessor::PartitionScheme::nonUniform, false);
+
+    HRTFProcessor::PreparedHRTF reference;
+    expect(processor.prepareHRTF(provider(0), hrirSize, 0, reference));
+    auto entrySize = reference.getSizeInBytes();
+
+
+    beginTest("Precompute");
+
+    HRTFCache cache(processor, numMeasurements, provider, hrirSize, 0, numMeasurements * entrySize);
+    cache.precomputeAll(4);
+
+    while (cache.isPrecomputing())
+        juce::Thread::sleep(1);
+
+    expectEquals<size_t>(cache.getNumCached(), numMeasurements);
+    expectEquals<size_t>(cache.getMemoryUsage(), numMeasurements * entrySize);
+    expectEquals(cache.getPrecomputeProgress(), 1.0f);
+
+    //  The precomputed entries match preparing the measurement directly
+    auto cached = cache.get(5);
+    expect(cached != nullptr);
+
+    HRTFProcessor::PreparedHRTF direct;
+    expect(processor.prepareHRTF(provider(5), hrirSize, 0, direct));
+    expect(cached->headTaps == direct.headTaps);
+    expect(cached->segmentSpectra == direct.segmentSpectra);
+
+    expect(cache.get(numMeasurements) == nullptr);
+
+    //===================================================================================================//
+
+
+    beginTest("Memory Limit");
+
+    HRTFCache smallCache(processor, numMeasurements, provider, hrirSize, 0, 4 * entrySize);
+    smallCache.precomputeAll(2);
+
+    while (smallCache.isPrecomputing())
+        juce::Thread::sleep(1);
+
+    expectEquals<size_t>(smallCache.getNumCached(), 4);
+    expect(smallCache.getMemoryUsage() <= 4 * entrySize);
+
+    //  An entry that does not fit at all is still handed out
+    HRTFCache tinyCache(processor, numMeasurements, provider, hrirSize, 0, entrySize / 2);
+    expect(tinyCache.get(3) != nullptr);
+    expectEquals<size_t>(tinyCache.getNumCached(), 0);
+
+    //===================================================================================================//
+
+
+    beginTest("LRU Eviction");
+
+    HRTFCache lruCache(processor, numMeasurements, provider, hrirSize, 0, 3 * entrySize);
+    expect(lruCache.get(0) != nullptr);
+    expect(lruCache.get(1) != nullptr);
+    expect(lruCache.get(2) != nullptr);
+
+    //  Using 0 again makes 1 the least recently used
+    expect(lruCache.get(0) != nullptr);
+    expect(lruCache.get(3) != nullptr);
+
+    expect(lruCache.isCached(0));
+    expect(!lruCache.isCached(1));
+    expect(lruCache.isCached(2));
+    expect(lruCache.isCached(3));
+    expectEquals<size_t>(lruCache.getNumCached(), 3);
+
+    //  An evicted entry stays valid for whoever still holds it
+    auto held = lruCache.get(2);
+    expect(lruCache.get(0) != nullptr);
+    lruCache.setMemoryLimit(entrySize);
+    expectEquals<size_t>(lruCache.getNumCached(), 1);
+    expect(!lruCache.isCached(2));
+    expect(held->headTaps.size() == 2);
+
+    //===================================================================================================//
+
+
+    beginTest("Swap Prepared HRTF");
+
+    //  Swapping a cached entry sounds the same as swapping the HRIR itself
+    //  Both processors run in the foreground so the swaps are picked up in the same blocks
+    BinauralHRTFProcessor swapProcessor;
+    swapProcessor.init(hrirs[0].data(), hrirs[1].data(), hrirSize, samplingFreq, 256, 0, HRTFProcessor::PartitionScheme::nonUniform, false);
+
+    std::vector<float> signal(8192);
+    for (auto i = 0; i < signal.size(); ++i)
+        signal[i] = sin((i * 2 * juce::MathConstants<float>::pi * 500) / samplingFreq);
+
+    std::vector<float> leftA(256), rightA(256), leftB(256), rightB(256);
+    float maxError = 0;
+
+    for (auto position = 0; position < signal.size(); position += 256)
+    {
+        if (position == 2048)
+        {
+            expect(processor.swapHRIR(hrirs[10].data(), hrirs[11].data(), hrirSize, 0));
+            expect(swapProcessor.swapHRTF(*cache.get(5)));
+        }
+
+        expect(processor.addSamples(signal.data() + position, 256));
+        expect(swapProcessor.addSamples(signal.data() + position, 256));
+        expect(processor.getOutput(leftA.data(), rightA.data(), 256));
+        expect(swapProcessor.getOutput(leftB.data(), rightB.data(), 256));
+
+        for (auto i = 0; i < 256; ++i)
+            maxError = juce::jmax(maxError, std::abs(leftA[i] - leftB[i]), std::abs(rightA[i] - rightB[i]));
+    }
+
+    expectWithinAbsoluteError<float>(maxError, 0.0, 1e-5);
+
+    //  Entries prepared for a different layout are rejected
+    HRTFProcessor monoProcessor;
+    monoProcessor.init(hrirs[0].data(), hrirSize, samplingFreq, 256, 0);
+    expect(!monoProcessor.swapHRTF(*cache.get(5)));
+
+    //===================================================================================================//
+
+
+    beginTest("Blend Prepared HRTFs");
+
+    //  Blending the prepared spectra of two measurements sounds the same as swapping the blend of their HRIRs
+    std::vector<double> blendLeft(hrirSize), blendRight(hrirSize);
+    for (auto i = 0; i < hrirSize; ++i)
+    {
+        blendLeft[i] = (0.3 * hrirs[14][i]) + (0.7 * hrirs[16][i]);
+        blendRight[i] = (0.3 * hrirs[15][i]) + (0.7 * hrirs[17][i]);
+    }
+
+    auto entryA = cache.get(7);
+    auto entryB = cache.get(8);
+    const HRTFProcessor::PreparedHRTF *blend[] = { entryA.get(), entryB.get() };
+    float weights[] = { 0.3f, 0.7f };
+
+    maxError = 0;
+
+    for (auto position = 0; position < signal.size(); position += 256)
+    {
+        if (position == 2048)
+        {
+            expect(processor.swapHRIR(blendLeft.data(), blendRight.data(), hrirSize, 0));
+            expect(swapProcessor.swapHRTF(blend, weights, 2));
+        }
+
+        expect(processor.addSamples(signal.data() + position, 256));
+        expect(swapProcessor.addSamples(signal.data() + position, 256));
+        expect(processor.getOutput(leftA.data(), rightA.data(), 256));
+        expect(swapProcessor.getOutput(leftB.data(), rightB.data(), 256));
+
+        for (auto i = 0; i < 256; ++i)
+            maxError = juce::jmax(maxError, std::abs(leftA[i] - leftB[i]), std::abs(rightA[i] - rightB[i]));
+    }
+
+    expectWithinAbsoluteError<float>(maxError, 0.0, 1e-5);
+
+    const HRTFProcessor::PreparedHRTF *missing[] = { entryA.get(), nullptr };
+    expect(!swapProcessor.swapHRTF(missing, weights, 2));
+    expect(!swapProcessor.swapHRTF(blend, weights, 0));
+}
+
+#endif
@@ -0,0 +1,90 @@
+#pragma once
+#include <JuceHeader.h>
+#include <list>
+#include <functional>
+#include "HRTFProcessor.h"
+
+
+/*
+ *  Keeps the prepared HRTFs of every measurement of a SOFA file for one HRTFProcessor
+ *
+ *  When a file is loaded, precomputeAll() prepares the HRTFs of all measurements on a pool of threads so that moving the source
+ *  only needs a swapHRTF() of an entry that is already in the processor's layout.  The entries are only valid for the processor
+ *  they were prepared with, so the cache must be thrown away (before the processor) whenever the processor is initialized again.
+ *
+ *  The cache holds at most memoryLimit bytes.  Precomputing stops once the cache is full, after that a measurement that is asked for
+ *  but not cached is prepared on the calling thread and replaces the least recently used entries.
+ *
+ *  None of the functions are real-time safe, use them from the thread that swaps the HRTFs.
+ */
+class HRTFCache
+{
+#ifdef JUCE_UNIT_TESTS
+    friend class HRTFCacheTest;
+#endif
+
+public:
+
+    //  Returns the HRIR of every ear of a measurement, or an empty vector if there is none
+    //  Called from several threads at once while precomputing
+    typedef std::function<std::vector<const double*>(size_t measurement)>  HRIRProvider;
+
+    HRTFCache(const HRTFProcessor &processor, size_t numMeasurements, HRIRProvider hrirProvider, size_t hrirSize, size_t numDelaySamples, size_t memoryLimit);
+    ~HRTFCache();
+
+    void        precomputeAll(int numThreads);
+    void        cancelPrecompute();
+    bool        isPrecomputing() const { return numPrecomputeJobs.load() > 0; }
+    float       getPrecomputeProgress() const;
+
+    //  Returns nullptr if the measurement does not exist or could not be prepared
+    std::shared_ptr<const HRTFProcessor::PreparedHRTF>  get(size_t measurement);
+
+    bool        isCached(size_t measurement);
+    void        setMemoryLimit(size_t newMemoryLimit);
+    size_t      getMemoryUsage();
+    size_t      getNumCached();
+    size_t      getNumMeasurements() const { return numMeasurements; }
+
+
+private:
+
+    std::shared_ptr<const HRTFProcessor::PreparedHRTF>  prepare(size_t measurement) const;
+    bool        insert(size_t measurement, const std::shared_ptr<const HRTFProcessor::PreparedHRTF> &entry, bool evictIfFull);
+    void        evictLeastRecentlyUsed();
+    void        runPrecomputeJob();
+
+
+    const HRTFProcessor                                 &processor;
+    HRIRProvider                                        hrirProvider;
+    size_t                                              numMeasurements;
+    size_t                                              hrirSize;
+    size_t                                              numDelaySamples;
+
+    //  Entries are indexed by measurement, the most recently used measurement is at the front of recentlyUsed
+    std::vector<std::shared_ptr<const HRTFProcessor::PreparedHRTF>>     entries;
+    std::list<size_t>                                   recentlyUsed;
+    std::vector<std::list<size_t>::iterator>            recentlyUsedPositions;
+    size_t                                              memoryUsage;
+    size_t                                              memoryLimit;
+    juce::CriticalSection                               lock;
+
+    std::unique_ptr<juce::ThreadPool>                   threadPool;
+    std::atomic<size_t>                                 nextMeasurementToPrecompute;
+    std::atomic<int>                                    numPrecomputeJobs;
+    std::atomic<bool>                                   precomputeCancelled;
+};
+
+
+#ifdef JUCE_UNIT_TESTS
+class HRTFCacheTest : public juce::UnitTest
+{
+public:
+    HRTFCacheTest() : UnitTest("HRTFCacheUnitTest", "HRTFProcessor") {};
+
+    void runTest() override;
+};
+
+static HRTFCacheTest hrtfCacheUnitTest;
+
+#endif
@@ -0,0 +1,357 @@
+#include "HRTFDatabase.h"
+#include "BinauralHRTFProcessor.h"
+
+
+static const char   HRTF_DATABASE_MAGIC[8] = { 'O', 'R', 'B', 'H', 'R', 'T', 'F', '\0' };
+
+
+HRTFDatabase::HRTFDatabase()
+{
+    header = nullptr;
+    positions = nullptr;
+    index = nullptr;
+}
+
+
+/*
+ *  The index is written last, once the offset of every entry is known
+ *  Returns false if the file could not be written or an entry does not match header.entrySize
+ */
+bool HRTFDatabase::write(const juce::File &file, const Header &header, const std::vector<SphericalIndex::Position> &positions,
+                         PreparedHRTFProvider getPreparedHRTF, ProgressCallback progressCallback)
+{
+    static_assert(std::is_trivially_copyable<Header>::value, "The header is written and mapped as raw bytes");
+    static_assert(std::is_trivially_copyable<SphericalIndex::Position>::value, "The positions are written and mapped as raw bytes");
+
+    if (header.numMeasurements != positions.size() || header.entrySize == 0)
+        return false;
+
+    Header fileHeader = header;
+    std::copy(HRTF_DATABASE_MAGIC, HRTF_DATABASE_MAGIC + sizeof(HRTF_DATABASE_MAGIC), fileHeader.magic);
+    fileHeader.version = VERSION;
+
+    juce::TemporaryFile tempFile(file);
+
+    {
+        std::unique_ptr<juce::FileOutputStream> stream(new juce::FileOutputStream(tempFile.getFile()));
+        if (!stream->openedOk())
+            return false;
+
+        std::vector<uint64_t> offsets(header.numMeasurements, 0);
+        std::vector<float> entry(header.entrySize);
+        std::vector<char> padding(ENTRY_ALIGNMENT, 0);
+
+        auto positionsSize = positions.size() * sizeof(SphericalIndex::Position);
+
+        if (!stream->write(&fileHeader, sizeof(Header)) || !stream->write(positions.data(), positionsSize)
+            || !stream->write(padding.data(), getPositionsEnd(header.numMeasurements) - sizeof(Header) - positionsSize)
+            || !stream->write(offsets.data(), offsets.size() * sizeof(uint64_t)))
+            return false;
+
+        auto position = getIndexEnd(header.numMeasurements);
+
+        for (auto measurement = 0; measurement < header.numMeasurements; ++measurement)
+        {
+            if (progressCallback != nullptr && !progressCallback((float)measurement / header.numMeasurements))
+                return false;
+
+            auto prepared = getPreparedHRTF(measurement);
+            if (prepared == nullptr)
+                continue;
+
+            if (prepared->getSizeInBytes() != header.entrySize * sizeof(float))
+                return false;
+
+            auto alignedPosition = ((position + ENTRY_ALIGNMENT - 1) / ENTRY_ALIGNMENT) * ENTRY_ALIGNMENT;
+            if (!stream->write(padding.data(), alignedPosition - position))
+                return false;
+
+            prepared->copyTo(entry.data());
+            if (!stream->write(entry.data(), entry.size() * sizeof(float)))
+                return false;
+
+            offsets[measurement] = alignedPosition;
+            position = alignedPosition + (entry.size() * sizeof(float));
+        }
+
+        if (!stream->setPosition(getPositionsEnd(header.numMeasurements)) || !stream->write(offsets.data(), offsets.size() * sizeof(uint64_t)))
+            return false;
+
+        stream->flush();
+    }
+
+    return tempFile.overwriteTargetFileWithTemporary();
+}
+
+
+/*
+ *  Map a compiled file into memory and check that it is complete
+ *  Only the header, positions and index are read, the entries are paged in when they are first used
+ */
+bool HRTFDatabase::open(const juce::File &file)
+{
+    close();
+
+    std::unique_ptr<juce::MemoryMappedFile> newMappedFile(new juce::MemoryMappedFile(file, juce::MemoryMappedFile::readOnly));
+
+    auto *data = static_cast<const char*>(newMappedFile->getData());
+    auto size = newMappedFile->getSize();
+
+    if (data == nullptr || size < sizeof(Header))
+        return false;
+
+    auto *newHeader = reinterpret_cast<const Header*>(data);
+
+    if (!std::equal(HRTF_DATABASE_MAGIC, HRTF_DATABASE_MAGIC + sizeof(HRTF_DATABASE_MAGIC), newHeader->magic) || newHeader->version != VERSION)
+        return false;
+
+    if (newHeader->numMeasurements == 0 || newHeader->entrySize == 0)
+        return false;
+
+    if (getIndexEnd(newHeader->numMeasurements) > size)
+        return false;
+
+    auto *newPositions = reinterpret_cast<const SphericalIndex::Position*>(data + sizeof(Header));
+    auto *newIndex = reinterpret_cast<const uint64_t*>(data + getPositionsEnd(newHeader->numMeasurements));
+    auto entrySizeInBytes = newHeader->entrySize * sizeof(float);
+
+    for (auto measurement = 0; measurement < newHeader->numMeasurements; ++measurement)
+    {
+        auto offset = newIndex[measurement];
+        if (offset == 0)
+            continue;
+
+        if (offset % ENTRY_ALIGNMENT != 0 || offset < getIndexEnd(newHeader->numMeasurements) || offset + entrySizeInBytes > size)
+            return false;
+    }
+
+    mappedFile = std::move(newMappedFile);
+    header = newHeader;
+    positions = newPositions;
+    index = newIndex;
+
+    return true;
+}
+
+
+void HRTFDatabase::close()
+{
+    header = nullptr;
+    positions = nullptr;
+    index = nullptr;
+    mappedFile.reset();
+}
+
+
+const float *HRTFDatabase::getHRTF(size_t measurement) const
+{
+    if (header == nullptr || measurement >= header->numMeasurements || index[measurement] == 0)
+        return nullptr;
+
+    return reinterpret_cast<const float*>(static_cast<const char*>(mappedFile->getData()) + index[measurement]);
+}
+
+
+size_t HRTFDatabase::getPositionsEnd(size_t numMeasurements)
+{
+    auto positionsSize = numMeasurements * sizeof(SphericalIndex::Position);
+    return sizeof(Header) + (((positionsSize + sizeof(uint64_t) - 1) / sizeof(uint64_t)) * sizeof(uint64_t));
+}
+
+
+size_t HRTFDatabase::getIndexEnd(size_t numMeasurements)
+{
+    return getPositionsEnd(numMeasurements) + (numMeasurements * sizeof(uint64_t));
+}
+
+
+
+#ifdef JUCE_UNIT_TESTS
+void HRTFDatabaseTest::runTest()
+{
+    float samplingFreq = 44100.0;
+    size_t hrirSize = 1024;
+
+    //  An irregular set of 11 positions (an odd number so the index needs padding), the last measurement has no HRIR
+    std::vector<SphericalIndex::Position> positions;
+    for (auto m = 0; m < 11; ++m)
+        positions.push_back({ 33.0f * m, (float)((m * 37) % 180) - 90.0f, 1.2f });
+
+    size_t numMeasurements = positions.size();
+
+    std::vector<std::vector<double>> hrirs(2 * numMeasurements, std::vector<double>(hrirSize));
+    for (auto m = 0; m < hrirs.size(); ++m)
+    {
+        for (auto i = 0; i < hrirSize; ++i)
+            hrirs[m][i] = sin((0.01 + 0.005 * m) * i) * exp(-0.004 * i);
+    }
+
+    BinauralHRTFProcessor processor;
+    processor.init(hrirs[0].data(), hrirs[1].data(), hrirSize, samplingFreq, 256, 0, HRTFProcessor::PartitionScheme::nonUniform, false);
+
+    auto prepare = [&](size_t measurement)
+    {
+        std::shared_ptr<HRTFProcessor::PreparedHRTF> prepared;
+        if (measurement + 1 == numMeasurements)
+            return prepared;
+
+        prepared.reset(new HRTFProcessor::PreparedHRTF());
+        processor.prepareHRTF({ hrirs[2 * measurement].data(), hrirs[2 * measurement + 1].data() }, hrirSize, 0, *prepared);
+        return prepared;
+    };
+
+    HRTFDatabase::Header header;
+    header.numEars = 2;
+    header.hrirSize = (uint32_t)hrirSize;
+    header.audioBufferSize = 256;
+    header.partitionScheme = (uint32_t)HRTFProcessor::PartitionScheme::nonUniform;
+    header.numDelaySamples = 0;
+    header.minimumPhaseLength = 0;
+    header.measuredHRIRSize = (uint32_t)hrirSize;
+    header.truncationThresholdDb = 60;
+    header.controlRate = (uint32_t)processor.getControlRate();
+    header.samplingFreq = samplingFreq;
+    header.numMeasurements = numMeasurements;
+    header.entrySize = processor.getPreparedHRTFSize();
+    header.sourceModificationTime = 1234;
+    header.sourceSize = 5678;
+
+    auto file = juce::File::getSpecialLocation(juce::File::tempDirectory).getChildFile("HRTFDatabaseUnitTest.orbhrtf");
+
+
+    beginTest("Write and Open");
+
+    expect(HRTFDatabase::write(file, header, positions, prepare));
+
+    HRTFDatabase database;
+    expect(database.open(file));
+    expect(database.isOpen());
+    expectEquals<uint32_t>(database.getHeader().version, HRTFDatabase::VERSION);
+    expectEquals<uint64_t>(database.getHeader().numMeasurements, numMeasurements);
+    expectEquals<uint32_t>(database.getHeader().minimumPhaseLength, 0);
+    expectEquals<float>(database.getHeader().truncationThresholdDb, 60);
+    expectEquals<int64_t>(database.getHeader().sourceModificationTime, 1234);
+
+    for (auto measurement = 0; measurement < numMeasurements; ++measurement)
+    {
+        expectEquals<float>(database.getPositions()[measurement].theta, positions[measurement].theta);
+        expectEquals<float>(database.getPositions()[measurement].phi, positions[measurement].phi);
+        expectEquals<float>(database.getPositions()[measurement].radius, positions[measurement].radius);
+    }
+
+    //  Entries are stored exactly as prepared and aligned for vector loads
+    std::vector<float> flat(header.entrySize);
+    for (auto measurement = 0; measurement + 1 < numMeasurements; ++measurement)
+    {
+        auto *entry = database.getHRTF(measurement);
+        expect(entry != nullptr);
+        expect(reinterpret_cast<uintptr_t>(entry) % HRTFDatabase::ENTRY_ALIGNMENT == 0);
+
+        prepare(measurement)->copyTo(flat.data());
+        expect(std::equal(flat.begin(), flat.end(), entry));
+    }
+
+    expect(database.getHRTF(numMeasurements - 1) == nullptr);
+    expect(database.getHRTF(numMeasurements) == nullptr);
+
+    //  A second process opening the same file works on its own mapping of the same pages
+    HRTFDatabase otherDatabase;
+    expect(otherDatabase.open(file));
+    expect(otherDatabase.getHRTF(3) != database.getHRTF(3));
+    expect(std::equal(database.getHRTF(3), database.getHRTF(3) + header.entrySize, otherDatabase.getHRTF(3)));
+
+    //===================================================================================================//
+
+
+    beginTest("Swap From Database");
+
+    //  Swapping straight from the mapping sounds the same as swapping the prepared HRTF
+    BinauralHRTFProcessor referenceProcessor;
+    referenceProcessor.init(hrirs[0].data(), hrirs[1].data(), hrirSize, samplingFreq, 256, 0, HRTFProcessor::PartitionScheme::nonUniform, false);
+
+    std::vector<float> signal(4096);
+    for (auto i = 0; i < signal.size(); ++i)
+        signal[i] = sin((i * 2 * juce::MathConstants<float>::pi * 500) / samplingFreq);
+
+    std::vector<float> leftA(256), rightA(256), leftB(256), rightB(256);
+    float maxError = 0;
+
+    for (auto position = 0; position < signal.size(); position += 256)
+    {
+        if (position == 1024)
+        {
+            expect(processor.swapHRTF(database.getHRTF(7), header.entrySize));
+            expect(referenceProcessor.swapHRTF(*prepare(7)));
+        }
+
+        //  Blends as well
+        if (position == 2560)
+        {
+            const float *compiled[] = { database.getHRTF(2), database.getHRTF(5), database.getHRTF(9) };
+            auto prepared2 = prepare(2), prepared5 = prepare(5), prepared9 = prepare(9);
+            const HRTFProcessor::PreparedHRTF *prepared[] = { prepared2.get(), prepared5.get(), prepared9.get() };
+            float weights[] = { 0.2f, 0.5f, 0.3f };
+
+            expect(processor.swapHRTF(compiled, weights, 3, header.entrySize));
+            expect(referenceProcessor.swapHRTF(prepared, weights, 3));
+        }
+
+        processor.addSamples(signal.data() + position, 256);
+        referenceProcessor.addSamples(signal.data() + position, 256);
+        processor.getOutput(leftA.data(), rightA.data(), 256);
+        referenceProcessor.getOutput(leftB.data(), rightB.data(), 256);
+
+        for (auto i = 0; i < 256; ++i)
+            maxError = juce::jmax(maxError, std::abs(leftA[i] - leftB[i]), std::abs(rightA[i] - rightB[i]));
+    }
+
+    expectWithinAbsoluteError<float>(maxError, 0.0, 1e-6);
+    expect(!processor.swapHRTF(database.getHRTF(7), header.entrySize - 1));
+
+    //===================================================================================================//
+
+
+    beginTest("Invalid Files");
+
+    database.close();
+    otherDatabase.close();
+    expect(!database.isOpen());
+
+    //  An entry that does not fit the header is not written
+    auto badHeader = header;
+    badHeader.entrySize += 1;
+    expect(!HRTFDatabase::write(file, badHeader, positions, prepare));
+
+    //  Nor are positions that do not match the header
+    expect(!HRTFDatabase::write(file, header, std::vector<SphericalIndex::Position>(positions.begin(), positions.end() - 1), prepare));
+
+    //  Neither does a cancelled one
+    int numProgressCalls = 0;
+    expect(!HRTFDatabase::write(file, header, positions, prepare, [&numProgressCalls](float progress) { return ++numProgressCalls < 4; }));
+    expectEquals(numProgressCalls, 4);
+
+    //  The failed writes leave the previous file in place
+    expect(database.open(file));
+    database.close();
+
+    //  A truncated file is rejected
+    {
+        juce::MemoryMappedFile mapped(file, juce::MemoryMappedFile::readOnly);
+        auto truncatedFile = juce::File::getSpecialLocation(juce::File::tempDirectory).getChildFile("HRTFDatabaseUnitTestTruncated.orbhrtf");
+        truncatedFile.deleteFile();
+
+        {
+            juce::FileOutputStream stream(truncatedFile);
+            stream.write(mapped.getData(), mapped.getSize() - 4);
+        }
+
+        expect(!database.open(truncatedFile));
+        truncatedFile.deleteFile();
+    }
+
+    expect(!database.open(juce::File::getSpecialLocation(juce::File::tempDirectory).getChildFile("HRTFDatabaseUnitTestMissing.orbhrtf")));
+
+    file.deleteFile();
+}
+
+#endif
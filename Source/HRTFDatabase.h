@@ -0,0 +1,106 @@
+#pragma once
+#include <JuceHeader.h>
+#include <functional>
+#include "HRTFProcessor.h"
+#include "SphericalIndex.h"
+
+
+/*
+ *  A compiled store of the prepared HRTFs of every measurement of a SOFA file
+ *
+ *  Parsing a SOFA file and transforming every HRIR takes a while, so the prepared HRTFs are written once into a compiled file
+ *  which later sessions map straight into memory.  Opening a compiled file does not parse or copy anything, getHRTF() points into
+ *  the mapping and HRTFProcessor::swapHRTF() copies from there.  The mapping is read only so every process that opens the same file
+ *  shares its pages.
+ *
+ *  The file is laid out as
+ *
+ *  Header
+ *  Positions:  The SphericalIndex::Position of every measurement, padded to a multiple of 8 bytes
+ *  Index:      One uint64 byte offset per measurement, 0 if the measurement has no entry
+ *  Entries:    header.entrySize floats per measurement in the flat layout of HRTFProcessor::swapHRTF(), aligned to ENTRY_ALIGNMENT bytes
+ *
+ *  Everything is stored in the byte order of the machine, compiled files are a local cache and are not meant to be moved around.
+ *  The entries are only valid for an engine set up with the hrirSize, audioBufferSize, partitionScheme and minimumPhaseLength in the header.
+ */
+class HRTFDatabase
+{
+#ifdef JUCE_UNIT_TESTS
+    friend class HRTFDatabaseTest;
+#endif
+
+public:
+
+    struct Header
+    {
+        char            magic[8];
+        uint32_t        version;
+        uint32_t        numEars;
+        uint32_t        hrirSize;
+        uint32_t        audioBufferSize;
+        uint32_t        partitionScheme;
+        uint32_t        numDelaySamples;
+        uint32_t        minimumPhaseLength;     //  0 if the HRIRs were applied as measured, see HRTFProcessor::setMinimumPhase()
+        uint32_t        measuredHRIRSize;       //  Length of the HRIRs in the SOFA file before they were truncated to hrirSize
+        float           truncationThresholdDb;
+        uint32_t        controlRate;            //  See HRTFProcessor::setControlRate(), it sets the segment layout of the nonUniform scheme
+        double          samplingFreq;
+        uint64_t        numMeasurements;
+        uint64_t        entrySize;
+
+        //  Used to tell if the SOFA file changed since it was compiled
+        int64_t         sourceModificationTime;
+        int64_t         sourceSize;
+    };
+
+    typedef std::function<std::shared_ptr<const HRTFProcessor::PreparedHRTF>(size_t measurement)>   PreparedHRTFProvider;
+
+    //  Called after every measurement with the share of measurements written so far, return false to stop writing
+    typedef std::function<bool(float progress)>     ProgressCallback;
+
+    HRTFDatabase();
+
+    //  Write the position and entry of every measurement.  The file is written next to file and then moved over it,
+    //  so processes that still have the old file mapped keep their pages and a cancelled write leaves the old file in place
+    static bool         write(const juce::File &file, const Header &header, const std::vector<SphericalIndex::Position> &positions,
+                              PreparedHRTFProvider getPreparedHRTF, ProgressCallback progressCallback = nullptr);
+
+    bool                open(const juce::File &file);
+    void                close();
+    bool                isOpen() const { return header != nullptr; }
+
+    //  Only valid while the database is open
+    const Header        &getHeader() const { return *header; }
+    const SphericalIndex::Position  *getPositions() const { return positions; }
+
+    //  Returns nullptr if the measurement does not exist
+    const float         *getHRTF(size_t measurement) const;
+
+    static constexpr uint32_t   VERSION = 5;
+    static constexpr size_t     ENTRY_ALIGNMENT = 64;
+
+
+private:
+
+    static size_t       getPositionsEnd(size_t numMeasurements);
+    static size_t       getIndexEnd(size_t numMeasurements);
+
+    std::unique_ptr<juce::MemoryMappedFile>     mappedFile;
+    const Header                                *header;
+    const SphericalIndex::Position              *positions;
+    const uint64_t                              *index;
+};
+
+
+#ifdef JUCE_UNIT_TESTS
+class HRTFDatabaseTest : public juce::UnitTest
+{
+public:
+    HRTFDatabaseTest() : UnitTest("HRTFDatabaseUnitTest", "HRTFProcessor") {};
+
+    void runTest() override;
+};
+
+static HRTFDatabaseTest hrtfDatabaseUnitTest;
+
+#endif
@@ -1,34 +1,103 @@
 #include "HRTFProcessor.h"
+#include <thread>
 
 HRTFProcessor::HRTFProcessor()
 {
-    olaWriteIndex = 0;
-    hrirChanged = false;
+    crossfadeMode.store(CrossfadeMode::timeDomain);
+    visualizationTapEnabled.store(false);
+    numEars = 0;
+    numSources = 1;
+    minimumPhaseLength = 0;
+    controlRate = DEFAULT_CONTROL_RATE;
+    hrtfRampLength.store(0);
+    renderPool = nullptr;
     hrirLoaded = false;
 }
 
-HRTFProcessor::HRTFProcessor(const double *hrir, size_t hrirSize, float samplingFreq, size_t audioBufferSize, size_t numDelaySamples)
+HRTFProcessor::HRTFProcessor(const double *hrir, size_t hrirSize, float samplingFreq, size_t audioBufferSize, size_t numDelaySamples, PartitionScheme scheme, bool useBackgroundThread)
 {
-    olaWriteIndex = 0;
-    hrirChanged = false;
+    crossfadeMode.store(CrossfadeMode::timeDomain);
+    visualizationTapEnabled.store(false);
+    numEars = 0;
+    numSources = 1;
+    minimumPhaseLength = 0;
+    controlRate = DEFAULT_CONTROL_RATE;
+    hrtfRampLength.store(0);
+    renderPool = nullptr;
     hrirLoaded = false;
-    
-    if (!init(hrir, hrirSize, fs, audioBufferSize, numDelaySamples))
+
+    if (!init(hrir, hrirSize, samplingFreq, audioBufferSize, numDelaySamples, scheme, useBackgroundThread))
         hrirLoaded = false;
 }
 
+HRTFProcessor::~HRTFProcessor()
+{
+    if (segmentWorker.get() != nullptr)
+    {
+        segmentWorker->signalThreadShouldExit();
+        segmentWorker->wake();
+        segmentWorker->stopThread(1000);
+    }
+}
+
+
+bool HRTFProcessor::init(const double *hrir, size_t hrirSize, float samplingFreq, size_t audioBufferSize, size_t numDelaySamples, PartitionScheme scheme, bool useBackgroundThread)
+{
+    return initEngine({ hrir }, hrirSize, samplingFreq, audioBufferSize, numDelaySamples, scheme, useBackgroundThread);
+}
+
+
+bool HRTFProcessor::setMinimumPhase(size_t filterLength)
+{
+    if (hrirLoaded || (filterLength > 0 && numSources > 1))
+        return false;
+
+    minimumPhaseLength = filterLength;
+
+    return true;
+}
+
+
+bool HRTFProcessor::setControlRate(size_t numSamples)
+{
+    if (hrirLoaded || numSamples < MIN_CONTROL_RATE || numSamples > MAX_CONTROL_RATE || !juce::isPowerOfTwo(numSamples))
+        return false;
+
+    controlRate = numSamples;
+
+    return true;
+}
+
+
+bool HRTFProcessor::setNumSources(size_t newNumSources)
+{
+    if (hrirLoaded || newNumSources == 0 || (newNumSources > 1 && minimumPhaseLength > 0))
+        return false;
+
+    numSources = newNumSources;
+
+    return true;
+}
+
 
-bool HRTFProcessor::init(const double *hrir, size_t hrirSize, float samplingFreq, size_t audioBufferSize, size_t numDelaySamples)
+//  Set up the engine to apply one HRIR per ear to the same input
+bool HRTFProcessor::initEngine(const std::vector<const double*> &hrirs, size_t hrirSize, float samplingFreq, size_t audioBufferSize, size_t numDelaySamples, PartitionScheme scheme, bool useBackgroundThread)
 {
     if (hrirLoaded)
         return false;
-    
-    if (hrir == nullptr)
+
+    if (hrirs.empty())
         return false;
-    
+
+    for (auto *hrir : hrirs)
+    {
+        if (hrir == nullptr)
+            return false;
+    }
+
     if (hrirSize <= 0 || samplingFreq <= 0.0 || audioBufferSize <= 1)
         return false;
-    
+
     //  audioBufferSize must be a power of 2
     //  Check this constraint here
     auto audioBufferSizeCopy = audioBufferSize;
@@ -38,378 +107,1386 @@ bool HRTFProcessor::init(const double *hrir, size_t hrirSize, float samplingFreq
         bitSum += audioBufferSizeCopy & 0x01;
         audioBufferSizeCopy = audioBufferSizeCopy >> 1;
     }
-    
+
     if (bitSum > 1)
         return false;
-    
-    
-    //  When performing overlap and add with windowing, we need to have 2x audioBufferSize in order to get audioBufferSize outputs
+
+
     fs = samplingFreq;
-    audioBlockSize = (audioBufferSize * 2) + 1;
-    hopSize = audioBufferSize;
-    
-    //  Calculate buffer sizes and initialize them
-    auto bufferPower = calculateNextPowerOfTwo(hrirSize + audioBlockSize);
-    zeroPaddedBufferSize = pow(2, bufferPower);
-    
-    fftEngine.reset(new juce::dsp::FFT(bufferPower));
-    if (fftEngine.get() == nullptr)
+    partitionScheme = scheme;
+    numEars = hrirs.size();
+
+    //  Minimum-phase filters are truncated so the segments only need to cover the truncated length
+    auto filterLength = (minimumPhaseLength > 0) ? juce::jmin(minimumPhaseLength, hrirSize) : hrirSize;
+
+    if (!createSegments(filterLength, audioBufferSize, scheme, useBackgroundThread))
         return false;
-    
-    inputBuffer = std::vector<float>(3 * audioBufferSize+ 1);
-    std::fill(inputBuffer.begin(), inputBuffer.end(), 0.0);
-    
-    outputBuffer = std::vector<float>(zeroPaddedBufferSize);
-    std::fill(outputBuffer.begin(), outputBuffer.end(), 0.0);
-    
-    xBuffer = std::vector<std::complex<float>>(zeroPaddedBufferSize);
-    std::fill(xBuffer.begin(), xBuffer.end(), std::complex<float>(0.0, 0.0));
-    
-    auxBuffer = std::vector<std::complex<float>>(zeroPaddedBufferSize);
-    
-    olaBuffer = std::vector<float>(zeroPaddedBufferSize);
-    std::fill(olaBuffer.begin(), olaBuffer.end(), 0.0);
-    
-    shadowOLABuffer = std::vector<float>(zeroPaddedBufferSize);
-    std::fill(shadowOLABuffer.begin(), shadowOLABuffer.end(), 0.0);
-    
-    activeHRTF = std::vector<std::complex<float>>(zeroPaddedBufferSize);
-    std::fill(xBuffer.begin(), xBuffer.end(), std::complex<float>(0.0, 0.0));
-    
-    auxHRTFBuffer = std::vector<std::complex<float>>(zeroPaddedBufferSize);
-    std::fill(xBuffer.begin(), xBuffer.end(), std::complex<float>(0.0, 0.0));
-    
-    reverbBuffer = std::vector<float>(zeroPaddedBufferSize);
-    std::fill(reverbBuffer.begin(), reverbBuffer.end(), 0.0);
-    
+
+    //  Leave room for a few blocks of output in case the caller adds more samples than it reads out
+    outputBuffer = std::vector<std::vector<float>>(numEars, std::vector<float>(4 * audioBufferSize, 0.0));
+
+    visualizationTapFifo.reset(new juce::AbstractFifo((int)VISUALIZATION_TAP_SIZE));
+    visualizationTapBuffer = std::vector<float>(VISUALIZATION_TAP_SIZE);
+
+    earDelays = std::vector<float>(numEars, 0.0);
+    earDelayIncrements = std::vector<float>(numEars, 0.0);
+    earDelayRampRemaining = std::vector<size_t>(numEars, 0);
+    incomingEarDelays.setup(earDelays);
+    earDelayLines = std::vector<std::vector<float>>(numEars, std::vector<float>(EAR_DELAY_LINE_SIZE, 0.0));
+    earDelayLineIndex = 0;
+
     outputSampleStart = 0;
     outputSampleEnd = 0;
-    numSamplesAdded = 0;
-    inputBlockStart = 0;
-    inputSampleAddIndex = 0;
     numOutputSamplesAvailable = 0;
-    
-    reverbBufferStartIndex = 0;
-    reverbBufferAddIndex = 0;
-    
-    reverb.setSampleRate(samplingFreq);
-    juce::Reverb::Parameters reverbParam;
-    
-    reverbParam.roomSize = 0.5f;
-    reverbParam.damping = 0.5f;
-    reverbParam.dryLevel = 0.5f;
-    reverbParam.wetLevel = 0.5f;
-    reverbParam.width = 0.5f;
-    
-    reverb.setParameters(reverbParam);
-    
-    //  Create input window
-    //  To satisfy the COLA constraint for a Hamming window, the last value should be 0
-    window = std::vector<float>(audioBlockSize);
-    juce::dsp::WindowingFunction<float>::fillWindowingTables(window.data(), audioBlockSize, juce::dsp::WindowingFunction<float>::WindowingMethod::triangular);
-    
-    
+    inputPosition = 0;
+
     //  Transform HRIR into HRTF
-    if (!setupHRTF(hrir, hrirSize, numDelaySamples))
+    if (!setupHRTF(hrirs, hrirSize, numDelaySamples))
         return false;
-    
-    for (auto i = 0; i < audioBlockSize; ++i)
+
+    bool needsWorker = false;
+    for (auto &segment : segments)
+        needsWorker |= segment->processInBackground;
+
+    //  The background segments have to be ready within one of their blocks so run the worker at a high priority
+    if (needsWorker)
     {
-        fadeOutEnvelope.push_back(pow(juce::dsp::FastMathApproximations::cos((i * juce::MathConstants<float>::pi) / (2 * audioBlockSize)), 2));
-        fadeInEnvelope.push_back(pow(juce::dsp::FastMathApproximations::sin((i * juce::MathConstants<float>::pi) / (2 * audioBlockSize)), 2));
+        segmentWorker.reset(new SegmentWorker(*this));
+        segmentWorker->startThread(9);
     }
-    
+
     hrirLoaded = true;
-    
+
+    return true;
+}
+
+
+/*
+ *  Split the HRIR into segments of partitions
+ *
+ *  uniform:    One segment of audioBufferSize partitions, processed as soon as its input block is complete
+ *
+ *  nonUniform: A direct form head of hopSize taps, hopSize being the control rate, followed by
+ *              3 partitions of hopSize, 2 partitions of 2 * hopSize, 2 partitions of 4 * hopSize...
+ *              up to MAX_PARTITION_SIZE, which then covers the rest of the HRIR.
+ *              Every segment starts at least one of its own blocks into the HRIR so its output can be calculated
+ *              as soon as its input block is complete.  From the second segment on, segments start two blocks in
+ *              which gives them a whole block to be calculated on the background thread.
+ */
+bool HRTFProcessor::createSegments(size_t hrirSize, size_t audioBufferSize, PartitionScheme scheme, bool useBackgroundThread)
+{
+    segments.clear();
+
+    std::vector<SegmentPlan> plan;
+    planSegments(hrirSize, audioBufferSize, scheme, controlRate, hopSize, headLength, plan);
+
+    for (auto &segment : plan)
+        addSegment(segment.blockSize, segment.firstTap, segment.numPartitions, useBackgroundThread && segment.canProcessInBackground);
+
+    if (segments.empty())
+        hrirPartitionedSize = headLength;
+    else
+        hrirPartitionedSize = segments.back()->firstTap + (segments.back()->numPartitions * segments.back()->blockSize);
+
+    headFrames = std::vector<std::vector<float>>(numSources, std::vector<float>(2 * hopSize, 0.0));
+
+    headTaps = std::vector<std::vector<float>>(numSources * numEars, std::vector<float>(headLength, 0.0));
+    incomingHeadTaps = std::vector<TripleBuffer<std::vector<std::vector<float>>>>(numSources);
+    for (auto &incoming : incomingHeadTaps)
+        incoming.setup(std::vector<std::vector<float>>(numEars, std::vector<float>(headLength, 0.0)));
+
+    //  Room for the output of an ear, and the old and new output of a source that is crossfading
+    headScratch = std::vector<float>(3 * hopSize);
+
+    headFadeInEnvelope.clear();
+    headFadeOutEnvelope.clear();
+    for (auto i = 0; i < hopSize; ++i)
+    {
+        headFadeOutEnvelope.push_back(pow(juce::dsp::FastMathApproximations::cos((i * juce::MathConstants<float>::pi) / (2 * hopSize)), 2));
+        headFadeInEnvelope.push_back(pow(juce::dsp::FastMathApproximations::sin((i * juce::MathConstants<float>::pi) / (2 * hopSize)), 2));
+    }
+
+    headCrossfading = std::vector<bool>(numSources, false);
+    headRampStartTaps = headTaps;
+    headNextTaps = headTaps;
+    headRampStep = std::vector<size_t>(numSources, 0);
+    headRampSteps = std::vector<size_t>(numSources, 0);
+
+    //  Every foreground segment can be due at the same block boundary
+    dueSegments = std::vector<ConvolutionSegment*>(segments.size(), nullptr);
+
     return true;
 }
 
 
+//  The segment layout createSegments() sets up, without allocating anything for it
+void HRTFProcessor::planSegments(size_t hrirSize, size_t audioBufferSize, PartitionScheme scheme, size_t controlRate, size_t &hopSize, size_t &headLength, std::vector<SegmentPlan> &plan)
+{
+    plan.clear();
+
+    if (scheme == PartitionScheme::uniform)
+    {
+        hopSize = audioBufferSize;
+        headLength = 0;
+
+        plan.push_back({ hopSize, 0, (hrirSize + hopSize - 1) / hopSize, false });
+    }
+    else
+    {
+        hopSize = juce::jmin(audioBufferSize, controlRate);
+        headLength = hopSize;
+
+        size_t firstTap = headLength;
+        size_t blockSize = hopSize;
+        size_t numPartitions = 3;
+
+        while (firstTap < hrirSize)
+        {
+            auto numPartitionsNeeded = (hrirSize - firstTap + blockSize - 1) / blockSize;
+
+            if (blockSize >= MAX_PARTITION_SIZE)
+                numPartitions = numPartitionsNeeded;
+            else
+                numPartitions = juce::jmin(numPartitions, numPartitionsNeeded);
+
+            plan.push_back({ blockSize, firstTap, numPartitions, firstTap >= 2 * blockSize });
+
+            firstTap += numPartitions * blockSize;
+            blockSize *= 2;
+            numPartitions = 2;
+        }
+    }
+}
+
+
+/*
+ *  Estimate the work an engine set up for filterLength taps does, without setting one up
+ *  A real-only FFT of size N is counted as 2.5 * N * log2(N) operations and a complex multiply-add as 8,
+ *  which is close enough to compare two layouts with each other
+ */
+HRTFProcessor::EngineCost HRTFProcessor::estimateCost(size_t filterLength, size_t audioBufferSize, PartitionScheme scheme, size_t numEars, size_t controlRate)
+{
+    size_t hopSize, headLength;
+    std::vector<SegmentPlan> plan;
+    planSegments(filterLength, audioBufferSize, scheme, controlRate, hopSize, headLength, plan);
+
+    EngineCost cost;
+    cost.numSegments = plan.size();
+    cost.largestFFTSize = 0;
+    cost.operationsPerSample = 2.0 * headLength * numEars;
+
+    for (auto &segment : plan)
+    {
+        auto fftSize = 2 * segment.blockSize;
+        auto fftOperations = 2.5 * fftSize * std::log2((double)fftSize);
+        auto multiplyOperations = 8.0 * (segment.blockSize + 1) * segment.numPartitions;
+
+        cost.largestFFTSize = juce::jmax(cost.largestFFTSize, fftSize);
+        cost.operationsPerSample += (fftOperations + (numEars * (fftOperations + multiplyOperations))) / segment.blockSize;
+    }
+
+    return cost;
+}
+
+
+void HRTFProcessor::addSegment(size_t blockSize, size_t firstTap, size_t numPartitions, bool processInBackground)
+{
+    std::unique_ptr<ConvolutionSegment> segment(new ConvolutionSegment());
+
+    segment->blockSize = blockSize;
+    segment->fftSize = 2 * blockSize;
+    segment->numBins = blockSize + 1;
+    segment->binStride = SpectralKernels::getPaddedNumBins(segment->numBins);
+    segment->firstTap = firstTap;
+    segment->numPartitions = numPartitions;
+    segment->latencyBlocks = firstTap / blockSize;
+    segment->processInBackground = processInBackground;
+
+    //  Since blockSize is a power of 2, this gives the order of an FFT of size 2 * blockSize
+    segment->fftEngine.reset(new juce::dsp::FFT(calculateNextPowerOfTwo(blockSize)));
+
+    segment->inputFrames = std::vector<std::vector<float>>(numSources, std::vector<float>(segment->fftSize, 0.0));
+    segment->processingFrames = std::vector<std::vector<float>>(numSources, std::vector<float>(segment->fftSize, 0.0));
+    segment->frequencyDelayLines = std::vector<std::vector<float>>(numSources, std::vector<float>(numPartitions * 2 * segment->binStride, 0.0));
+    segment->fdlIndex = 0;
+
+    std::vector<float> emptyHRTF(numPartitions * 2 * segment->binStride, 0.0);
+    segment->activeHRTF = std::vector<std::vector<float>>(numSources * numEars, emptyHRTF);
+    segment->incomingHRTF = std::vector<TripleBuffer<std::vector<std::vector<float>>>>(numSources);
+    for (auto &incoming : segment->incomingHRTF)
+        incoming.setup(std::vector<std::vector<float>>(numEars, emptyHRTF));
+
+    segment->spectrumAccumulators = std::vector<std::vector<float>>(numEars, std::vector<float>(2 * segment->binStride, 0.0));
+    segment->interpolationStep = std::vector<size_t>(numSources, 0);
+    segment->interpolationSteps = std::vector<size_t>(numSources, SPECTRAL_INTERPOLATION_STEPS);
+    segment->timeDomainSwap = false;
+
+    segment->fftBuffers = std::vector<std::vector<float>>(numSources, std::vector<float>(2 * segment->fftSize));
+    segment->xBuffer = std::vector<std::vector<float>>(numEars, std::vector<float>(2 * segment->fftSize));
+    segment->auxBuffer = std::vector<std::vector<float>>(numEars, std::vector<float>(2 * segment->fftSize));
+
+    //  HRTF changes are crossfaded over one output block of the segment
+    for (auto i = 0; i < blockSize; ++i)
+    {
+        segment->fadeOutEnvelope.push_back(pow(juce::dsp::FastMathApproximations::cos((i * juce::MathConstants<float>::pi) / (2 * blockSize)), 2));
+        segment->fadeInEnvelope.push_back(pow(juce::dsp::FastMathApproximations::sin((i * juce::MathConstants<float>::pi) / (2 * blockSize)), 2));
+    }
+
+    segment->outputBlocks = std::vector<std::vector<float>>(numEars, std::vector<float>(2 * blockSize, 0.0));
+    segment->nextOutputBlock = segment->latencyBlocks;
+
+    segment->crossFaded = false;
+    segment->jobRequested.store(false);
+    segment->jobPending = false;
+    segment->jobFinished.store(false);
+
+    segments.push_back(std::move(segment));
+}
+
+
 bool HRTFProcessor::swapHRIR(const double *hrir, size_t hrirSize, size_t numDelaySamples)
 {
-    if (!hrirLoaded || hrirSize <= 0)
-        return false;
-    
-    bool success = setupHRTF(hrir, hrirSize, numDelaySamples);
-    if (!success)
+    if (!hrirLoaded || hrirSize <= 0 || numEars != 1)
         return false;
-    
-    hrirChanged = true;
-    
-    return true;
+
+    return setupHRTF({ hrir }, hrirSize, numDelaySamples);
 }
 
 
 /*
  *  DO NOT CALL THIS FUNCTION ON MULTIPLE THREADS
  *  Add input samples into the input buffer
- *  If enough samples have been collected then process those samples
+ *  Input is processed in chunks that never cross a hopSize boundary.  Every time a boundary is reached,
+ *  the segments whose input blocks are complete are processed
  *  To get the processed output, call getOutput()
  */
-bool HRTFProcessor::addSamples(float *samples, size_t numSamples)
+bool HRTFProcessor::addSamples(const float *samples, size_t numSamples)
 {
-    if (numSamples > inputBuffer.size() - numSamplesAdded)
+    if (numSources != 1)
         return false;
-    
-    for (auto i = 0; i < numSamples; ++i)
+
+    return addSamples(&samples, numSamples);
+}
+
+
+//  Same as addSamples() above with one input per source, all of them numSamples long
+bool HRTFProcessor::addSamples(const float *const *sources, size_t numSamples)
+{
+    if (numSamples + (inputPosition % hopSize) + numOutputSamplesAvailable > outputBuffer[0].size())
+        return false;
+
+    size_t samplesDone = 0;
+
+    while (samplesDone < numSamples)
     {
-        //  Add samples into the input buffer and reverb buffer
-        inputBuffer[inputSampleAddIndex] = samples[i];
-        reverbBuffer[reverbBufferAddIndex] = samples[i];
-        
-        inputSampleAddIndex = (inputSampleAddIndex + 1) % inputBuffer.size();
-        reverbBufferAddIndex = (reverbBufferAddIndex + 1) % reverbBuffer.size();
-        
-        numSamplesAdded++;
-    }
-    
-    
-    //  Execute when we have added enough samples for processing
-    if (numSamplesAdded >= audioBlockSize)
-    {
-        numSamplesAdded -= hopSize;
-        std::vector<float> x(audioBlockSize);
-        auto blockStart = inputBlockStart;
-        
-        for (auto i = 0; i < audioBlockSize; ++i)
+        auto blockOffset = inputPosition % hopSize;
+        auto numToProcess = juce::jmin(numSamples - samplesDone, hopSize - blockOffset);
+
+        for (auto source = 0; source < numSources; ++source)
         {
-            x[i] = inputBuffer[blockStart] * window[i];
-            blockStart = (blockStart + 1) % inputBuffer.size();
+            auto *samples = sources[source] + samplesDone;
+
+            //  New samples are collected in the second half of each overlap-save frame
+            for (auto &segment : segments)
+            {
+                auto frameOffset = segment->blockSize + (inputPosition % segment->blockSize);
+                std::copy(samples, samples + numToProcess, segment->inputFrames[source].begin() + frameOffset);
+            }
+
+            if (headLength > 0)
+                std::copy(samples, samples + numToProcess, headFrames[source].begin() + hopSize + blockOffset);
         }
-        
-        inputBlockStart = (inputBlockStart + hopSize) % inputBuffer.size();
-        calculateOutput(x);
+
+        if (headLength > 0)
+            processHead(numToProcess);
+
+        inputPosition += numToProcess;
+        samplesDone += numToProcess;
+
+        if (inputPosition % hopSize == 0)
+            processBlockBoundary();
     }
-    
+
     return true;
 }
 
 
-std::vector<float> HRTFProcessor::getOutput(size_t numSamples)
+/*
+ *  Write numSamples of processed output into dest
+ *  Returns false and leaves dest untouched if there are not enough output samples available
+ */
+bool HRTFProcessor::getOutput(float *dest, size_t numSamples)
 {
-    std::vector<float> out(numSamples);
-    if (numSamples > numOutputSamplesAvailable)
-        return std::vector<float>(0);
-    
-    //  Get reverberated input signal
-    reverb.processMono(reverbBuffer.data() + reverbBufferStartIndex, (int)numSamples);
-    
+    if (numSamples > numOutputSamplesAvailable || numEars != 1)
+        return false;
+
     for (auto i = 0; i < numSamples; ++i)
     {
-        out[i] = outputBuffer[outputSampleStart] + (0.5f * reverbBuffer[reverbBufferStartIndex]);
-        outputSampleStart = (outputSampleStart + 1) % outputBuffer.size();
-        reverbBufferStartIndex = (reverbBufferStartIndex + 1) % reverbBuffer.size();
+        dest[i] = outputBuffer[0][outputSampleStart];
+        outputSampleStart = (outputSampleStart + 1) % outputBuffer[0].size();
     }
-    
+
     numOutputSamplesAvailable -= numSamples;
-    
+
+    return true;
+}
+
+
+std::vector<float> HRTFProcessor::getOutput(size_t numSamples)
+{
+    std::vector<float> out(numSamples);
+    if (!getOutput(out.data(), numSamples))
+        return std::vector<float>(0);
+
     return out;
 }
 
 
-/*
- *  Clear everything in the input, output and OLA buffers
- *  Any indices related to these buffers are also reset
- */
-void HRTFProcessor::flushBuffers()
+/*
+ *  DO NOT CALL THIS FUNCTION ON MULTIPLE THREADS
+ *  Process one channel of buffer in place
+ *  If the input could not be added the channel is left untouched.  If the input was added but there is not
+ *  enough output yet, the channel is cleared so the dry input does not leak through
+ */
+bool HRTFProcessor::process(juce::AudioBuffer<float> &buffer, int channel)
+{
+    if (channel < 0 || channel >= buffer.getNumChannels())
+        return false;
+
+    auto numSamples = buffer.getNumSamples();
+
+    if (!addSamples(buffer.getReadPointer(channel), (size_t)numSamples))
+        return false;
+
+    if (!getOutput(buffer.getWritePointer(channel), (size_t)numSamples))
+    {
+        buffer.clear(channel, 0, numSamples);
+        return false;
+    }
+
+    return true;
+}
+
+
+/*
+ *  Clear everything in the input, output and frequency-domain delay line buffers
+ *  Any indices related to these buffers are also reset
+ */
+void HRTFProcessor::flushBuffers()
+{
+    waitForBackgroundJobs();
+
+    for (auto &segment : segments)
+    {
+        for (auto &frame : segment->inputFrames)
+            std::fill(frame.begin(), frame.end(), 0.0);
+
+        for (auto &fdl : segment->frequencyDelayLines)
+            std::fill(fdl.begin(), fdl.end(), 0.0);
+
+        for (auto &block : segment->outputBlocks)
+            std::fill(block.begin(), block.end(), 0.0);
+
+        segment->fdlIndex = 0;
+        segment->nextOutputBlock = segment->latencyBlocks;
+
+        for (auto source = 0; source < numSources; ++source)
+        {
+            if (segment->interpolationStep[source] > 0)
+            {
+                auto &incoming = segment->incomingHRTF[source].getReadBuffer();
+                for (auto ear = 0; ear < numEars; ++ear)
+                    segment->activeHRTF[(source * numEars) + ear] = incoming[ear];
+
+                segment->interpolationStep[source] = 0;
+            }
+        }
+    }
+
+    for (auto source = 0; source < numSources; ++source)
+    {
+        if (headCrossfading[source])
+        {
+            auto &incoming = incomingHeadTaps[source].getReadBuffer();
+            for (auto ear = 0; ear < numEars; ++ear)
+                headTaps[(source * numEars) + ear] = incoming[ear];
+
+            headCrossfading[source] = false;
+        }
+
+        std::fill(headFrames[source].begin(), headFrames[source].end(), 0.0);
+    }
+
+    for (auto ear = 0; ear < numEars; ++ear)
+    {
+        if (earDelayRampRemaining[ear] > 0)
+        {
+            earDelays[ear] = incomingEarDelays.getReadBuffer()[ear];
+            earDelayRampRemaining[ear] = 0;
+        }
+
+        std::fill(earDelayLines[ear].begin(), earDelayLines[ear].end(), 0.0);
+    }
+
+    earDelayLineIndex = 0;
+
+    for (auto &buffer : outputBuffer)
+        std::fill(buffer.begin(), buffer.end(), 0.0);
+
+    inputPosition = 0;
+    outputSampleStart = 0;
+    outputSampleEnd = 0;
+    numOutputSamplesAvailable = 0;
+}
+
+
+/*
+ *  DO NOT CALL THIS FUNCTION ON MULTIPLE THREADS
+ *  Apply the direct form head to the newest numSamples input samples and add the output of every segment
+ *  The result is output straight away
+ */
+void HRTFProcessor::processHead(size_t numSamples)
+{
+    auto blockOffset = inputPosition % hopSize;
+    auto *out = headScratch.data();
+    auto *sourceOut = out + hopSize;
+    auto *newSourceOut = sourceOut + hopSize;
+
+    for (auto ear = 0; ear < numEars; ++ear)
+    {
+        juce::FloatVectorOperations::clear(out, (int)numSamples);
+
+        for (auto source = 0; source < numSources; ++source)
+        {
+            auto *x = headFrames[source].data() + hopSize + blockOffset;
+            auto &taps = headTaps[(source * numEars) + ear];
+
+            if (!headCrossfading[source])
+            {
+                for (auto tap = 0; tap < headLength; ++tap)
+                    juce::FloatVectorOperations::addWithMultiply(out, x - tap, taps[tap], (int)numSamples);
+
+                continue;
+            }
+
+            auto &newTaps = headNextTaps[(source * numEars) + ear];
+
+            juce::FloatVectorOperations::clear(sourceOut, (int)numSamples);
+            juce::FloatVectorOperations::clear(newSourceOut, (int)numSamples);
+            for (auto tap = 0; tap < headLength; ++tap)
+            {
+                juce::FloatVectorOperations::addWithMultiply(sourceOut, x - tap, taps[tap], (int)numSamples);
+                juce::FloatVectorOperations::addWithMultiply(newSourceOut, x - tap, newTaps[tap], (int)numSamples);
+            }
+
+            SpectralKernels::crossfade(sourceOut, sourceOut, headFadeOutEnvelope.data() + blockOffset, newSourceOut, headFadeInEnvelope.data() + blockOffset, numSamples);
+            juce::FloatVectorOperations::add(out, sourceOut, (int)numSamples);
+        }
+
+        for (auto &segment : segments)
+            juce::FloatVectorOperations::add(out, segment->outputBlocks[ear].data() + (inputPosition % (2 * segment->blockSize)), (int)numSamples);
+
+        writeOutput(ear, out, numSamples);
+    }
+
+    outputSampleEnd = (outputSampleEnd + numSamples) % outputBuffer[0].size();
+    earDelayLineIndex = (earDelayLineIndex + numSamples) & (EAR_DELAY_LINE_SIZE - 1);
+    numOutputSamplesAvailable += numSamples;
+}
+
+
+//  Set the next head taps of a source to the step of its ramp that the next hop crossfades to
+void HRTFProcessor::blendHeadTaps(size_t source)
+{
+    auto &incoming = incomingHeadTaps[source].getReadBuffer();
+    auto weight = (float)headRampStep[source] / (float)headRampSteps[source];
+
+    for (auto ear = 0; ear < numEars; ++ear)
+    {
+        auto &nextTaps = headNextTaps[(source * numEars) + ear];
+
+        if (headRampStep[source] == headRampSteps[source])
+        {
+            std::copy(incoming[ear].begin(), incoming[ear].end(), nextTaps.begin());
+            continue;
+        }
+
+        juce::FloatVectorOperations::copyWithMultiply(nextTaps.data(), headRampStartTaps[(source * numEars) + ear].data(), 1.0f - weight, (int)headLength);
+        juce::FloatVectorOperations::addWithMultiply(nextTaps.data(), incoming[ear].data(), weight, (int)headLength);
+    }
+}
+
+
+/*
+ *  DO NOT CALL THIS FUNCTION ON MULTIPLE THREADS
+ *  Called every hopSize samples
+ *  Every segment whose input block is now complete is calculated, either here or on the background thread
+ */
+void HRTFProcessor::processBlockBoundary()
+{
+    auto rampLength = hrtfRampLength.load(std::memory_order_relaxed);
+
+    for (auto source = 0; source < numSources && headLength > 0; ++source)
+    {
+        //  The hop that just ended crossfaded to the next taps, move the ramp on by another hop or end it
+        if (headCrossfading[source])
+        {
+            for (auto ear = 0; ear < numEars; ++ear)
+            {
+                auto &nextTaps = headNextTaps[(source * numEars) + ear];
+                std::copy(nextTaps.begin(), nextTaps.end(), headTaps[(source * numEars) + ear].begin());
+            }
+
+            if (headRampStep[source] < headRampSteps[source])
+            {
+                headRampStep[source]++;
+                blendHeadTaps(source);
+            }
+            else
+            {
+                headCrossfading[source] = false;
+            }
+        }
+
+        std::copy(headFrames[source].begin() + hopSize, headFrames[source].end(), headFrames[source].begin());
+
+        //  Pick up the newest HRTF for the head once the last one is blended in, it is crossfaded to over the next rampLength samples
+        if (!headCrossfading[source] && incomingHeadTaps[source].acquire())
+        {
+            for (auto ear = 0; ear < numEars; ++ear)
+                headRampStartTaps[(source * numEars) + ear] = headTaps[(source * numEars) + ear];
+
+            headRampSteps[source] = juce::jmax((size_t)1, rampLength / hopSize);
+            headRampStep[source] = 1;
+            blendHeadTaps(source);
+            headCrossfading[source] = true;
+        }
+    }
+
+    //  New ear delays are ramped to over the next hopSize samples, or the ramp length if that is longer
+    if (minimumPhaseLength > 0 && incomingEarDelays.acquire())
+    {
+        auto rampSamples = juce::jmax(hopSize, rampLength);
+        auto &incoming = incomingEarDelays.getReadBuffer();
+        for (auto ear = 0; ear < numEars; ++ear)
+        {
+            earDelayIncrements[ear] = (incoming[ear] - earDelays[ear]) / (float)rampSamples;
+            earDelayRampRemaining[ear] = rampSamples;
+        }
+    }
+
+    crossFaded = false;
+    size_t numDueSegments = 0;
+
+    for (auto &segment : segments)
+    {
+        if (inputPosition % segment->blockSize != 0)
+            continue;
+
+        //  The previous job of this segment has to be finished before its frame can be reused
+        if (segment->jobPending)
+        {
+            joinBackgroundJob(*segment);
+            crossFaded |= segment->crossFaded;
+        }
+
+        //  Hand the complete frames over for processing and start the next frames with the newest block
+        for (auto source = 0; source < numSources; ++source)
+        {
+            auto &inputFrame = segment->inputFrames[source];
+            auto &processingFrame = segment->processingFrames[source];
+
+            std::swap(inputFrame, processingFrame);
+            std::copy(processingFrame.begin() + segment->blockSize, processingFrame.end(), inputFrame.begin());
+        }
+
+        if (segment->processInBackground)
+        {
+            segment->jobPending = true;
+            segment->jobRequested.store(true);
+            segmentWorker->wake();
+        }
+        else
+        {
+            dueSegments[numDueSegments++] = segment.get();
+        }
+    }
+
+    calculateSegmentOutputs(numDueSegments);
+
+    //  The uniform scheme has no head so the block that was just calculated is output as a whole
+    if (partitionScheme == PartitionScheme::uniform)
+    {
+        auto &segment = *segments.front();
+        auto blockStart = ((segment.nextOutputBlock - 1) % 2) * segment.blockSize;
+
+        for (auto ear = 0; ear < numEars; ++ear)
+            writeOutput(ear, segment.outputBlocks[ear].data() + blockStart, hopSize);
+
+        outputSampleEnd = (outputSampleEnd + hopSize) % outputBuffer[0].size();
+        earDelayLineIndex = (earDelayLineIndex + hopSize) & (EAR_DELAY_LINE_SIZE - 1);
+        numOutputSamplesAvailable += hopSize;
+    }
+
+    if (visualizationTapEnabled.load(std::memory_order_relaxed))
+        writeVisualizationTap();
+}
+
+
+//  FFT points and complex multiplies of one block of segment
+size_t HRTFProcessor::getSegmentWork(const ConvolutionSegment &segment) const
+{
+    return segment.fftSize * (numSources + numEars + (numSources * numEars * segment.numPartitions));
+}
+
+
+//  The most work a block can have is every segment on the audio thread falling due at once
+bool HRTFProcessor::needsRenderPool() const
+{
+    size_t work = 0;
+    size_t numParallelSegments = 0;
+
+    for (auto &segment : segments)
+    {
+        if (segment->processInBackground)
+            continue;
+
+        work += getSegmentWork(*segment);
+        ++numParallelSegments;
+    }
+
+    return (numParallelSegments * numEars >= 2) && (work >= MIN_PARALLEL_WORK);
+}
+
+
+/*
+ *  Calculate the output of the first numSegments dueSegments
+ *  With a render pool and enough work, the forward transforms of every source and segment are shared between the threads of the pool,
+ *  then the accumulation and inverse transform of every ear and segment.  Each task only writes buffers of its own source or ear
+ *  and sums the sources in the same order as calculateSegmentOutput(), so the output is the same whichever thread calculated it
+ */
+void HRTFProcessor::calculateSegmentOutputs(size_t numSegments)
+{
+    size_t work = 0;
+    for (auto i = 0; i < numSegments; ++i)
+        work += getSegmentWork(*dueSegments[i]);
+
+    if (renderPool == nullptr || numSegments * numEars < 2 || work < MIN_PARALLEL_WORK)
+    {
+        for (auto i = 0; i < numSegments; ++i)
+        {
+            calculateSegmentOutput(*dueSegments[i]);
+            crossFaded |= dueSegments[i]->crossFaded;
+        }
+
+        return;
+    }
+
+    auto transformTask = [this](size_t index) { transformSegmentInput(*dueSegments[index / numSources], index % numSources); };
+    renderPool->run(numSegments * numSources, transformTask);
+
+    for (auto i = 0; i < numSegments; ++i)
+        beginSegmentOutput(*dueSegments[i]);
+
+    auto earTask = [this](size_t index) { calculateSegmentEar(*dueSegments[index / numEars], index % numEars); };
+    renderPool->run(numSegments * numEars, earTask);
+
+    for (auto i = 0; i < numSegments; ++i)
+    {
+        finishSegmentOutput(*dueSegments[i]);
+        crossFaded |= dueSegments[i]->crossFaded;
+    }
+}
+
+
+/*
+ *  Apply the HRTF partitions of a segment to its processing frames
+ *  If the HRTF is changed, the output will be a crossfaded mix of audio data with both HRTFs applied
+ *  The output block is written to the segment's output blocks, ready to be played back latencyBlocks later
+ */
+void HRTFProcessor::calculateSegmentOutput(ConvolutionSegment &segment)
+{
+    for (auto source = 0; source < numSources; ++source)
+        transformSegmentInput(segment, source);
+
+    beginSegmentOutput(segment);
+
+    for (auto ear = 0; ear < numEars; ++ear)
+        calculateSegmentEar(segment, ear);
+
+    finishSegmentOutput(segment);
+}
+
+
+//  Transform the newest input frame of a source into the front of its frequency-domain delay line
+//  The input is real so only the non-negative frequency bins are calculated and kept
+void HRTFProcessor::transformSegmentInput(ConvolutionSegment &segment, size_t source)
+{
+    auto &fftBuffer = segment.fftBuffers[source];
+
+    std::copy(segment.processingFrames[source].begin(), segment.processingFrames[source].end(), fftBuffer.begin());
+    segment.fftEngine->performRealOnlyForwardTransform(fftBuffer.data(), true);
+
+    auto *fdlSlot = segment.frequencyDelayLines[source].data() + (segment.fdlIndex * 2 * segment.binStride);
+    SpectralKernels::deinterleave(fftBuffer.data(), fdlSlot, fdlSlot + segment.binStride, segment.numBins);
+}
+
+
+/*
+ *  Pick up the newest HRTF of every source.  A spectral interpolation that is already running is finished first
+ *  The interpolation takes at least SPECTRAL_INTERPOLATION_STEPS blocks, or as many blocks as fit in the ramp length
+ */
+void HRTFProcessor::beginSegmentOutput(ConvolutionSegment &segment)
+{
+    auto mode = (numSources > 1) ? CrossfadeMode::spectralInterpolation : crossfadeMode.load();
+    auto rampLength = hrtfRampLength.load(std::memory_order_relaxed);
+    segment.crossFaded = false;
+    segment.timeDomainSwap = false;
+
+    for (auto source = 0; source < numSources; ++source)
+    {
+        if (segment.interpolationStep[source] == 0 && segment.incomingHRTF[source].acquire())
+        {
+            if (mode == CrossfadeMode::spectralInterpolation)
+            {
+                segment.interpolationStep[source] = 1;
+                segment.interpolationSteps[source] = juce::jmax(SPECTRAL_INTERPOLATION_STEPS, rampLength / segment.blockSize);
+            }
+            else
+                segment.timeDomainSwap = true;
+        }
+    }
+}
+
+
+//  The spectra of every source are summed per ear, so only the inverse transform of the sum is needed
+void HRTFProcessor::calculateSegmentEar(ConvolutionSegment &segment, size_t ear)
+{
+    auto &accumulator = segment.spectrumAccumulators[ear];
+    std::fill(accumulator.begin(), accumulator.end(), 0.0);
+
+    for (auto source = 0; source < numSources; ++source)
+    {
+        auto &activeHRTF = segment.activeHRTF[(source * numEars) + ear];
+
+        if (segment.interpolationStep[source] > 0)
+        {
+            auto weight = (float)segment.interpolationStep[source] / (float)(segment.interpolationSteps[source] + 1);
+            accumulateInterpolatedHRTFPartitions(segment, source, ear, activeHRTF, segment.incomingHRTF[source].getReadBuffer()[ear], weight);
+        }
+        else
+        {
+            accumulateHRTFPartitions(segment, source, ear, activeHRTF);
+        }
+    }
+
+    SpectralKernels::interleave(accumulator.data(), accumulator.data() + segment.binStride, segment.xBuffer[ear].data(), segment.numBins);
+    segment.fftEngine->performRealOnlyInverseTransform(segment.xBuffer[ear].data());
+
+    //  Only engines with a single source crossfade in the time domain
+    if (segment.timeDomainSwap)
+    {
+        auto &incomingHRTF = segment.incomingHRTF[0].getReadBuffer()[ear];
+
+        crossfadeWithNewHRTF(segment, ear);
+        std::copy(incomingHRTF.begin(), incomingHRTF.end(), segment.activeHRTF[ear].begin());
+    }
+}
+
+
+//  Move the spectral interpolations on and write the output blocks of every ear
+void HRTFProcessor::finishSegmentOutput(ConvolutionSegment &segment)
+{
+    for (auto source = 0; source < numSources; ++source)
+    {
+        if (segment.interpolationStep[source] == 0)
+            continue;
+
+        segment.crossFaded = true;
+
+        if (++segment.interpolationStep[source] > segment.interpolationSteps[source])
+        {
+            auto &incomingHRTF = segment.incomingHRTF[source].getReadBuffer();
+            for (auto ear = 0; ear < numEars; ++ear)
+                std::copy(incomingHRTF[ear].begin(), incomingHRTF[ear].end(), segment.activeHRTF[(source * numEars) + ear].begin());
+
+            segment.interpolationStep[source] = 0;
+        }
+    }
+
+    if (segment.timeDomainSwap)
+        segment.crossFaded = true;
+
+    //  Only the second half of the frame is free of aliasing so that is what gets output
+    for (auto ear = 0; ear < numEars; ++ear)
+    {
+        auto *outputBlock = segment.outputBlocks[ear].data() + ((segment.nextOutputBlock % 2) * segment.blockSize);
+        std::copy(segment.xBuffer[ear].begin() + segment.blockSize, segment.xBuffer[ear].begin() + segment.fftSize, outputBlock);
+    }
+
+    segment.nextOutputBlock++;
+    segment.fdlIndex = (segment.fdlIndex + 1) % segment.numPartitions;
+}
+
+
+/*
+ *  Multiply every spectrum in the frequency-domain delay line of a source with its matching HRTF partition
+ *  and write the sum into dest, interleaved and ready for the inverse transform
+ */
+void HRTFProcessor::applyHRTFPartitions(ConvolutionSegment &segment, size_t source, size_t ear, const std::vector<float> &hrtf, std::vector<float> &dest)
+{
+    auto &accumulator = segment.spectrumAccumulators[ear];
+
+    std::fill(accumulator.begin(), accumulator.end(), 0.0);
+    accumulateHRTFPartitions(segment, source, ear, hrtf);
+
+    SpectralKernels::interleave(accumulator.data(), accumulator.data() + segment.binStride, dest.data(), segment.numBins);
+}
+
+
+/*
+ *  Multiply every spectrum in the frequency-domain delay line of a source with its matching HRTF partition
+ *  and add the results to the segment's spectrum accumulator of an ear
+ *  The newest input spectrum is paired with the first partition, the one before it with the second partition and so on
+ */
+void HRTFProcessor::accumulateHRTFPartitions(ConvolutionSegment &segment, size_t source, size_t ear, const std::vector<float> &hrtf)
+{
+    auto stride = segment.binStride;
+    auto *yRe = segment.spectrumAccumulators[ear].data();
+    auto *yIm = yRe + stride;
+
+    //  The padding bins are zero so the whole stride can be processed in full vectors
+    for (auto partition = 0; partition < segment.numPartitions; ++partition)
+    {
+        auto fdlSlot = (segment.fdlIndex + segment.numPartitions - partition) % segment.numPartitions;
+        auto *x = segment.frequencyDelayLines[source].data() + (fdlSlot * 2 * stride);
+        auto *h = hrtf.data() + (partition * 2 * stride);
+
+        SpectralKernels::multiplyAccumulate(yRe, yIm, x, x + stride, h, h + stride, stride);
+    }
+}
+
+
+/*
+ *  Same as accumulateHRTFPartitions() but every partition is a blend of two HRTFs
+ *  A weight of 0 applies only from and a weight of 1 applies only to
+ */
+void HRTFProcessor::accumulateInterpolatedHRTFPartitions(ConvolutionSegment &segment, size_t source, size_t ear, const std::vector<float> &from, const std::vector<float> &to, float weight)
+{
+    auto stride = segment.binStride;
+    auto *yRe = segment.spectrumAccumulators[ear].data();
+    auto *yIm = yRe + stride;
+
+    for (auto partition = 0; partition < segment.numPartitions; ++partition)
+    {
+        auto fdlSlot = (segment.fdlIndex + segment.numPartitions - partition) % segment.numPartitions;
+        auto *x = segment.frequencyDelayLines[source].data() + (fdlSlot * 2 * stride);
+        auto *h0 = from.data() + (partition * 2 * stride);
+        auto *h1 = to.data() + (partition * 2 * stride);
+
+        SpectralKernels::multiplyAccumulateInterpolated(yRe, yIm, x, x + stride, h0, h0 + stride, h1, h1 + stride, weight, stride);
+    }
+}
+
+
+//  Copy samples into an ear's output buffer at outputSampleEnd without moving outputSampleEnd
+void HRTFProcessor::writeOutput(size_t ear, const float *samples, size_t numSamples)
+{
+    if (minimumPhaseLength > 0)
+    {
+        writeDelayedOutput(ear, samples, numSamples);
+        return;
+    }
+
+    auto &buffer = outputBuffer[ear];
+    auto numSamplesToEnd = juce::jmin(numSamples, buffer.size() - outputSampleEnd);
+
+    std::copy(samples, samples + numSamplesToEnd, buffer.begin() + outputSampleEnd);
+    std::copy(samples + numSamplesToEnd, samples + numSamples, buffer.begin());
+}
+
+
+/*
+ *  Same as writeOutput() but the samples first go through the ear's delay line
+ *  The fractional delay is read with third-order Lagrange interpolation from the samples around it
+ */
+void HRTFProcessor::writeDelayedOutput(size_t ear, const float *samples, size_t numSamples)
+{
+    auto &buffer = outputBuffer[ear];
+    auto &line = earDelayLines[ear];
+    auto mask = EAR_DELAY_LINE_SIZE - 1;
+    auto lineIndex = earDelayLineIndex;
+    auto outputIndex = outputSampleEnd;
+
+    for (auto i = 0; i < numSamples; ++i)
+    {
+        line[lineIndex] = samples[i];
+
+        if (earDelayRampRemaining[ear] > 0)
+        {
+            if (--earDelayRampRemaining[ear] == 0)
+                earDelays[ear] = incomingEarDelays.getReadBuffer()[ear];
+            else
+                earDelays[ear] += earDelayIncrements[ear];
+        }
+
+        auto delay = earDelays[ear];
+        auto whole = (size_t)delay;
+        auto f = delay - whole;
+
+        auto newest = (lineIndex - whole + 1) & mask;
+        auto x0 = line[newest];
+        auto x1 = line[(newest - 1) & mask];
+        auto x2 = line[(newest - 2) & mask];
+        auto x3 = line[(newest - 3) & mask];
+
+        buffer[outputIndex] = (-f * (f - 1) * (f - 2) / 6) * x0
+                            + ((f + 1) * (f - 1) * (f - 2) / 2) * x1
+                            - ((f + 1) * f * (f - 2) / 2) * x2
+                            + ((f + 1) * f * (f - 1) / 6) * x3;
+
+        lineIndex = (lineIndex + 1) & mask;
+        outputIndex = (outputIndex + 1) % buffer.size();
+    }
+}
+
+
+void HRTFProcessor::waitForBackgroundJobs()
+{
+    for (auto &segment : segments)
+    {
+        if (segment->jobPending)
+            joinBackgroundJob(*segment);
+    }
+}
+
+
+//  Background segments start at least two of their blocks into the HRIR, so a job has a whole block of the segment to finish
+//  before the audio thread needs its frame again and this rarely has to spin
+void HRTFProcessor::joinBackgroundJob(ConvolutionSegment &segment)
+{
+    while (!segment.jobFinished.load(std::memory_order_acquire))
+        juce::Thread::yield();
+
+    segment.jobFinished.store(false, std::memory_order_relaxed);
+    segment.jobPending = false;
+}
+
+
+void HRTFProcessor::SegmentWorker::run()
+{
+    while (!threadShouldExit())
+    {
+        wakeSignal.wait();
+
+        for (auto &segment : processor.segments)
+        {
+            if (segment->jobRequested.exchange(false))
+            {
+                processor.calculateSegmentOutput(*segment);
+                segment->jobFinished.store(true, std::memory_order_release);
+            }
+        }
+    }
+}
+
+
+
+/*
+ *  DO NOT CALL THIS FUNCTION ON MULTIPLE THREADS
+ *  Convert one HRIR per ear into the head taps and partitioned HRTFs
+ *  During init() they are written straight into the active HRTFs.  After that they are written into the write slots
+ *  of the triple buffers and published, all ears are swapped together
+ */
+bool HRTFProcessor::setupHRTF(const std::vector<const double*> &hrirs, size_t hrirSize, size_t numDelaySamples)
+{
+    PreparedHRTF prepared;
+    if (!prepareHRTF(hrirs, hrirSize, numDelaySamples, prepared))
+        return false;
+
+    if (hrirLoaded)
+        return swapHRTF(prepared);
+
+    //  Every source starts out with the same HRTF
+    for (auto source = 0; source < numSources; ++source)
+    {
+        for (auto ear = 0; ear < numEars; ++ear)
+        {
+            headTaps[(source * numEars) + ear] = prepared.headTaps[ear];
+
+            for (auto s = 0; s < segments.size(); ++s)
+                segments[s]->activeHRTF[(source * numEars) + ear] = prepared.segmentSpectra[s][ear];
+        }
+    }
+
+    earDelays = prepared.earDelays;
+
+    return true;
+}
+
+
+/*
+ *  Convert one HRIR per ear into the head taps and segment spectra used by this engine
+ *  This only reads the segment layout set up in init() and uses its own FFT engines and buffers,
+ *  so it can be called on any number of threads at once, including while audio is being processed
+ */
+bool HRTFProcessor::prepareHRTF(const std::vector<const double*> &hrirs, size_t hrirSize, size_t numDelaySamples, PreparedHRTF &dest) const
+{
+    if (hrirSize == 0 || hrirs.size() != numEars || numEars == 0)
+        return false;
+
+    //  Minimum-phase filters are truncated to fit the engine so only measured HRIRs need to fit as they are
+    if (minimumPhaseLength == 0 && hrirSize > hrirPartitionedSize)
+        return false;
+
+    for (auto *hrir : hrirs)
+    {
+        if (hrir == nullptr)
+            return false;
+    }
+
+    //  Sharing the segment FFT engines would make the audio thread contend with this thread
+    std::vector<std::unique_ptr<juce::dsp::FFT>> fftEngines;
+    for (auto &segment : segments)
+        fftEngines.emplace_back(new juce::dsp::FFT(calculateNextPowerOfTwo(segment->blockSize)));
+
+    dest.headTaps = std::vector<std::vector<float>>(numEars, std::vector<float>(headLength, 0.0));
+    dest.segmentSpectra.clear();
+    for (auto &segment : segments)
+        dest.segmentSpectra.push_back(std::vector<std::vector<float>>(numEars, std::vector<float>(segment->numPartitions * 2 * segment->binStride, 0.0)));
+
+    dest.earDelays = std::vector<float>(numEars, 0.0);
+
+    std::vector<float> hrirVec(hrirPartitionedSize);
+
+    std::unique_ptr<MinimumPhase> minimumPhase;
+    std::vector<float> filter;
+    if (minimumPhaseLength > 0)
+        minimumPhase.reset(new MinimumPhase(hrirSize));
+
+    for (auto ear = 0; ear < numEars; ++ear)
+    {
+        std::fill(hrirVec.begin(), hrirVec.end(), 0.0);
+
+        if (minimumPhase.get() != nullptr)
+        {
+            //  The common onset delay is taken off the ear delays instead of the filters.  A silent HRIR gives a silent filter
+            float delay;
+            if (minimumPhase->split(hrirs[ear], hrirSize, filter, delay))
+            {
+                MinimumPhase::truncate(filter, juce::jmin(minimumPhaseLength, hrirPartitionedSize));
+                std::copy(filter.begin(), filter.end(), hrirVec.begin());
+            }
+            else
+            {
+                delay = 0;
+            }
+
+            dest.earDelays[ear] = juce::jlimit(1.0f, MAX_EAR_DELAY, delay - (float)numDelaySamples);
+        }
+        else
+        {
+            for (auto i = 0; i < hrirSize; ++i)
+                hrirVec[i] = hrirs[ear][i];
+
+            if (numDelaySamples != 0)
+            {
+                if (!removeImpulseDelay(hrirVec, numDelaySamples))
+                    return false;
+            }
+        }
+
+        std::copy(hrirVec.begin(), hrirVec.begin() + headLength, dest.headTaps[ear].begin());
+
+        for (auto s = 0; s < segments.size(); ++s)
+        {
+            auto &segment = *segments[s];
+            auto &hrtf = dest.segmentSpectra[s][ear];
+            std::vector<float> hrtfBuffer(2 * segment.fftSize);
+
+            for (auto partition = 0; partition < segment.numPartitions; ++partition)
+            {
+                auto *hrirPartition = hrirVec.data() + segment.firstTap + (partition * segment.blockSize);
+
+                std::fill(hrtfBuffer.begin(), hrtfBuffer.end(), 0.0);
+                std::copy(hrirPartition, hrirPartition + segment.blockSize, hrtfBuffer.begin());
+
+                fftEngines[s]->performRealOnlyForwardTransform(hrtfBuffer.data(), true);
+                auto *hrtfPartition = hrtf.data() + (partition * 2 * segment.binStride);
+                SpectralKernels::deinterleave(hrtfBuffer.data(), hrtfPartition, hrtfPartition + segment.binStride, segment.numBins);
+            }
+        }
+    }
+
+    return true;
+}
+
+
+//  dest = sum of sources[i] * weights[i]
+static void blendInto(float *dest, const float *const *sources, const float *weights, size_t numSources, size_t numFloats)
+{
+    juce::FloatVectorOperations::copyWithMultiply(dest, sources[0], weights[0], (int)numFloats);
+
+    for (auto i = 1; i < numSources; ++i)
+        juce::FloatVectorOperations::addWithMultiply(dest, sources[i], weights[i], (int)numFloats);
+}
+
+
+/*
+ *  Hand HRTFs that were prepared for this engine over to the audio thread
+ *  Only copies into the triple buffers, no transforms are done.  Only call from one thread at a time
+ */
+bool HRTFProcessor::swapHRTF(const PreparedHRTF &prepared, size_t source)
+{
+    const PreparedHRTF *preparedPtr = &prepared;
+    float weight = 1.0;
+
+    return swapHRTF(&preparedPtr, &weight, 1, source);
+}
+
+
+//  Same as swapHRTF() above, with the HRTFs read from the flat layout
+bool HRTFProcessor::swapHRTF(const float *prepared, size_t numFloats, size_t source)
+{
+    float weight = 1.0;
+
+    return swapHRTF(&prepared, &weight, 1, numFloats, source);
+}
+
+
+/*
+ *  Hand the weighted sum of prepared HRTFs over to the audio thread for one source
+ *  The sum is written straight into the write slots of the triple buffers.  Only call from one thread at a time
+ *  The ear delays are only used by engines with a single source so they are only handed over for the first one
+ */
+bool HRTFProcessor::swapHRTF(const PreparedHRTF *const *prepared, const float *weights, size_t numHRTFs, size_t source)
+{
+    if (!hrirLoaded || numHRTFs == 0 || source >= numSources)
+        return false;
+
+    for (auto h = 0; h < numHRTFs; ++h)
+    {
+        if (prepared[h] == nullptr || prepared[h]->headTaps.size() != numEars || prepared[h]->segmentSpectra.size() != segments.size() || prepared[h]->earDelays.size() != numEars)
+            return false;
+
+        for (auto ear = 0; ear < numEars; ++ear)
+        {
+            if (prepared[h]->headTaps[ear].size() != headLength)
+                return false;
+        }
+
+        for (auto s = 0; s < segments.size(); ++s)
+        {
+            if (prepared[h]->segmentSpectra[s].size() != numEars)
+                return false;
+
+            for (auto ear = 0; ear < numEars; ++ear)
+            {
+                if (prepared[h]->segmentSpectra[s][ear].size() != segments[s]->activeHRTF[(source * numEars) + ear].size())
+                    return false;
+            }
+        }
+    }
+
+    std::vector<const float*> sources(numHRTFs);
+
+    auto &newHeadTaps = incomingHeadTaps[source].getWriteBuffer();
+    for (auto ear = 0; ear < numEars; ++ear)
+    {
+        for (auto h = 0; h < numHRTFs; ++h)
+            sources[h] = prepared[h]->headTaps[ear].data();
+
+        blendInto(newHeadTaps[ear].data(), sources.data(), weights, numHRTFs, headLength);
+    }
+
+    for (auto s = 0; s < segments.size(); ++s)
+    {
+        auto &newHRTF = segments[s]->incomingHRTF[source].getWriteBuffer();
+        for (auto ear = 0; ear < numEars; ++ear)
+        {
+            for (auto h = 0; h < numHRTFs; ++h)
+                sources[h] = prepared[h]->segmentSpectra[s][ear].data();
+
+            blendInto(newHRTF[ear].data(), sources.data(), weights, numHRTFs, newHRTF[ear].size());
+        }
+    }
+
+    if (source == 0)
+    {
+        for (auto h = 0; h < numHRTFs; ++h)
+            sources[h] = prepared[h]->earDelays.data();
+
+        blendInto(incomingEarDelays.getWriteBuffer().data(), sources.data(), weights, numHRTFs, numEars);
+        incomingEarDelays.publish();
+    }
+
+    incomingHeadTaps[source].publish();
+
+    for (auto &segment : segments)
+        segment->incomingHRTF[source].publish();
+
+    return true;
+}
+
+
+//  Same as swapHRTF() above, with the HRTFs read from the flat layout
+bool HRTFProcessor::swapHRTF(const float *const *prepared, const float *weights, size_t numHRTFs, size_t numFloats, size_t source)
+{
+    if (!hrirLoaded || numHRTFs == 0 || source >= numSources || numFloats != getPreparedHRTFSize())
+        return false;
+
+    for (auto h = 0; h < numHRTFs; ++h)
+    {
+        if (prepared[h] == nullptr)
+            return false;
+    }
+
+    std::vector<const float*> sources(prepared, prepared + numHRTFs);
+
+    auto blendNext = [&](float *dest, size_t size)
+    {
+        blendInto(dest, sources.data(), weights, numHRTFs, size);
+
+        for (auto &source : sources)
+            source += size;
+    };
+
+    auto &newHeadTaps = incomingHeadTaps[source].getWriteBuffer();
+    for (auto ear = 0; ear < numEars; ++ear)
+        blendNext(newHeadTaps[ear].data(), headLength);
+
+    for (auto &segment : segments)
+    {
+        auto &newHRTF = segment->incomingHRTF[source].getWriteBuffer();
+        for (auto ear = 0; ear < numEars; ++ear)
+            blendNext(newHRTF[ear].data(), newHRTF[ear].size());
+    }
+
+    if (source == 0)
+    {
+        blendNext(incomingEarDelays.getWriteBuffer().data(), numEars);
+        incomingEarDelays.publish();
+    }
+
+    incomingHeadTaps[source].publish();
+
+    for (auto &segment : segments)
+        segment->incomingHRTF[source].publish();
+
+    return true;
+}
+
+
+size_t HRTFProcessor::getPreparedHRTFSize() const
+{
+    auto numFloats = numEars * headLength;
+
+    for (auto &segment : segments)
+        numFloats += numEars * segment->numPartitions * 2 * segment->binStride;
+
+    return numFloats + numEars;
+}
+
+
+void HRTFProcessor::PreparedHRTF::copyTo(float *dest) const
+{
+    for (auto &taps : headTaps)
+        dest = std::copy(taps.begin(), taps.end(), dest);
+
+    for (auto &segment : segmentSpectra)
+    {
+        for (auto &hrtf : segment)
+            dest = std::copy(hrtf.begin(), hrtf.end(), dest);
+    }
+
+    std::copy(earDelays.begin(), earDelays.end(), dest);
+}
+
+
+size_t HRTFProcessor::PreparedHRTF::getSizeInBytes() const
 {
-    std::fill(inputBuffer.begin(), inputBuffer.end(), 0.0);
-    std::fill(outputBuffer.begin(), outputBuffer.end(), 0.0);
-    std::fill(olaBuffer.begin(), olaBuffer.end(), 0.0);
-    
-    inputBlockStart = 0;
-    inputSampleAddIndex = 0;
-    numSamplesAdded = 0;
-    outputSamplesStart = 0;
-    outputSamplesEnd = 0;
-    numOutputSamplesAvailable = 0;
+    size_t numFloats = 0;
+
+    for (auto &taps : headTaps)
+        numFloats += taps.size();
+
+    for (auto &segment : segmentSpectra)
+    {
+        for (auto &hrtf : segment)
+            numFloats += hrtf.size();
+    }
+
+    numFloats += earDelays.size();
+
+    return numFloats * sizeof(float);
 }
 
 
 /*
  *  DO NOT CALL THIS FUNCTION ON MULTIPLE THREADS
- *  Apply the HRTF to an input sample of audio data
- *  If the HRTF is changed, the output will be a crossfaded mix of audio data
- *  with both HRTFs applied
+ *  Push the hop of output samples that was just completed for the first ear into the visualization tap
+ *  If the reader has fallen behind, the samples that do not fit are dropped
  */
-const float* HRTFProcessor::calculateOutput(const std::vector<float> &x)
-{
-    if (!hrirLoaded || x.size() == 0)
-        return nullptr;
-    
-    if (x.size() != audioBlockSize)
-        return nullptr;
-    
-    std::fill(olaBuffer.begin() + olaWriteIndex, olaBuffer.begin() + olaWriteIndex + hopSize, 0.0);
-    
-    olaWriteIndex = (olaWriteIndex + hopSize) % olaBuffer.size();
-    
-    std::fill(xBuffer.begin(), xBuffer.end(), std::complex<float>(0.0, 0.0));
-    for (auto i = 0; i < x.size(); ++i)
-        xBuffer.at(i) = std::complex<float>(x.at(i), 0.0);
-    
-    fftEngine->perform(xBuffer.data(), xBuffer.data(), false);
-    
-    
-    for (auto i = 0; i < zeroPaddedBufferSize; ++i)
-        xBuffer.at(i) = xBuffer.at(i) * activeHRTF.at(i);
-    
-    fftEngine->perform(xBuffer.data(), xBuffer.data(), true);
-    
-    if (hrirChanged)
-    {
-        juce::SpinLock::ScopedTryLockType hrirChangingScopedLock(hrirChangingLock);
-        if (hrirChangingScopedLock.isLocked())
-        {
-            hrirChanged = false;
-            crossfadeWithNewHRTF(x);
-            
-            std::copy(auxHRTFBuffer.begin(), auxHRTFBuffer.end(), activeHRTF.begin());
-            
-            crossFaded = true;
-        }
-    }else
-        crossFaded = false;
-    
-    if(!overlapAndAdd())
-        return nullptr;
-    
-    
-    //  Copy outputtable audio data to the output buffer
-    std::copy(olaBuffer.begin() + olaWriteIndex, olaBuffer.begin() + olaWriteIndex + hopSize, outputBuffer.begin() + outputSampleEnd);
-    outputSampleEnd = (outputSampleEnd + hopSize) % outputBuffer.size();
-    
-    numOutputSamplesAvailable += hopSize;
-    
-    
-    return olaBuffer.data() + olaWriteIndex;
-}
+void HRTFProcessor::writeVisualizationTap()
+{
+    auto &buffer = outputBuffer[0];
+    auto hopStart = (outputSampleEnd + buffer.size() - hopSize) % buffer.size();
 
+    int start1, size1, start2, size2;
+    visualizationTapFifo->prepareToWrite((int)hopSize, start1, size1, start2, size2);
 
+    for (auto i = 0; i < size1; ++i)
+        visualizationTapBuffer[start1 + i] = buffer[(hopStart + i) % buffer.size()];
 
-//  Convert an HRIR into an HRTF and queue the new HRTF for swapping which is done in calculateOutput()
-bool HRTFProcessor::setupHRTF(const double *hrir, size_t hrirSize, size_t numDelaySamples)
-{
-    if (hrirSize == 0 || hrirSize > zeroPaddedBufferSize)
-        return false;
-    
-    if (fftEngine.get() == nullptr)
-        return false;
-    
-    
-    juce::SpinLock::ScopedLockType scopedLock(hrirChangingLock);
-    
-    std::fill(auxHRTFBuffer.begin(), auxHRTFBuffer.end(), std::complex<float>(0.0, 0.0));
-    
-    std::vector<float> hrirVec(hrirSize);
-    for (auto i = 0; i < hrirSize; ++i)
-        hrirVec[i] = hrir[i];
-    
-    if (numDelaySamples != 0)
-    {
-        if (!removeImpulseDelay(hrirVec, numDelaySamples))
-            return false;
-    }
-    
-    for (auto i = 0; i < hrirSize; ++i)
-    {
-        if (!hrirLoaded)
-            activeHRTF.at(i) = std::complex<float>((float)hrirVec[i], 0.0);
-        else
-            auxHRTFBuffer.at(i) = std::complex<float>((float)hrirVec[i], 0.0);
-    }
-    
-    if (!hrirLoaded)
-        fftEngine->perform(activeHRTF.data(), activeHRTF.data(), false);
-    
-    else
-    {
-        fftEngine->perform(auxHRTFBuffer.data(), auxHRTFBuffer.data(), false);
-        hrirChanged = true;
-    }
-    
-    return true;
+    for (auto i = 0; i < size2; ++i)
+        visualizationTapBuffer[start2 + i] = buffer[(hopStart + size1 + i) % buffer.size()];
+
+    visualizationTapFifo->finishedWrite(size1 + size2);
 }
 
 
-//  Peel off a copy of the OLA buffer
-bool HRTFProcessor::copyOLABuffer(std::vector<float> &dest, size_t numSamplesToCopy)
+/*
+ *  Read up to maxNumSamples of the newest output of the first ear from the visualization tap
+ *  Returns the number of samples written to dest.  Only one thread should read the tap
+ */
+size_t HRTFProcessor::readVisualizationTap(float *dest, size_t maxNumSamples)
 {
     if (!hrirLoaded)
-        return false;
-    
-    if (numSamplesToCopy > zeroPaddedBufferSize)
-        return false;
-    
-    juce::SpinLock::ScopedLockType olaScopeLock(shadowOLACopyingLock);
-    
-    std::copy(shadowOLABuffer.begin(), shadowOLABuffer.begin() + numSamplesToCopy, dest.begin());
-    
-    return true;
-}
+        return 0;
 
+    int start1, size1, start2, size2;
+    visualizationTapFifo->prepareToRead((int)maxNumSamples, start1, size1, start2, size2);
 
-void HRTFProcessor::setReverbParameters(juce::Reverb::Parameters params)
-{
-    reverb.setParameters(params);
-}
+    std::copy(visualizationTapBuffer.begin() + start1, visualizationTapBuffer.begin() + start1 + size1, dest);
+    std::copy(visualizationTapBuffer.begin() + start2, visualizationTapBuffer.begin() + start2 + size2, dest + size1);
 
+    visualizationTapFifo->finishedRead(size1 + size2);
 
-bool HRTFProcessor::crossfadeWithNewHRTF(const std::vector<float> &x)
-{
-    if (!hrirLoaded)
-        return false;
-    
-    //  Calculate the output with the new HRTF applied before we crossfade the old and new outputs together
-    std::fill(auxBuffer.begin(), auxBuffer.end(), std::complex<float>(0.0, 0.0));
-    for (auto i = 0; i < audioBlockSize; ++i)
-        auxBuffer.at(i) = std::complex<float>(x.at(i), 0.0);
-    
-    fftEngine->perform(auxBuffer.data(), auxBuffer.data(), false);
-    
-    for (auto i = 0; i < zeroPaddedBufferSize; ++i)
-        auxBuffer.at(i) = auxBuffer.at(i) * auxHRTFBuffer.at(i);
-    
-    fftEngine->perform(auxBuffer.data(), auxBuffer.data(), true);
-    
-    
-    for (auto i = 0; i < zeroPaddedBufferSize; ++i)
-    {
-        if (i < audioBlockSize)
-        {
-            auto fadedSignal = (xBuffer.at(i).real() * fadeOutEnvelope.at(i)) + (auxBuffer.at(i).real() * fadeInEnvelope.at(i));
-            xBuffer.at(i) = std::complex<float>(fadedSignal, 0.0);
-        }
-        else
-            xBuffer.at(i) = auxBuffer.at(i);
-    }
-    
-    return true;
+    return (size_t)(size1 + size2);
 }
 
 
-bool HRTFProcessor::overlapAndAdd()
+/*
+ *  Used by the timeDomain crossfade mode
+ *  Calculate the output with the new HRTF applied and crossfade it with the output of the old HRTF
+ *  Both outputs are filtered from the same frequency-domain delay line so no extra forward FFT is needed
+ */
+bool HRTFProcessor::crossfadeWithNewHRTF(ConvolutionSegment &segment, size_t ear)
 {
-    if (!hrirLoaded)
-        return false;
-    
-    auto offset = olaWriteIndex;
-    
-    for (auto i = 0; i < zeroPaddedBufferSize; ++i)
-    {
-        olaBuffer.at(offset) += xBuffer.at(i).real();
-        offset = (offset + 1) % zeroPaddedBufferSize;
-    }
-    
-    juce::SpinLock::ScopedTryLockType olaScopeLock(shadowOLACopyingLock);
-    if (olaScopeLock.isLocked())
-        std::copy(olaBuffer.begin(), olaBuffer.end(), shadowOLABuffer.begin());
-    
+    auto &x = segment.xBuffer[ear];
+    auto &aux = segment.auxBuffer[ear];
+
+    applyHRTFPartitions(segment, 0, ear, segment.incomingHRTF[0].getReadBuffer()[ear], aux);
+    segment.fftEngine->performRealOnlyInverseTransform(aux.data());
+
+    SpectralKernels::crossfade(x.data() + segment.blockSize, x.data() + segment.blockSize, segment.fadeOutEnvelope.data(),
+                               aux.data() + segment.blockSize, segment.fadeInEnvelope.data(), segment.blockSize);
+
     return true;
 }
 
 
-unsigned int HRTFProcessor::calculateNextPowerOfTwo(float x)
+unsigned int HRTFProcessor::calculateNextPowerOfTwo(float x) const
 {
     return static_cast<unsigned int>(log2(x)) + 1;
 }
@@ -423,13 +1500,13 @@ unsigned int HRTFProcessor::calculateNextPowerOfTwo(float x)
  *
  *  The starting point is determined by finding the first point where the impulse has a value >= abs(mean) + std dev
  */
-bool HRTFProcessor::removeImpulseDelay(std::vector<float> &hrir, size_t numDelaySamples)
+bool HRTFProcessor::removeImpulseDelay(std::vector<float> &hrir, size_t numDelaySamples) const
 {
-    if (hrir.size() == 0) return false;
-    
+    if (hrir.size() == 0 || numDelaySamples >= hrir.size()) return false;
+
     std::copy(hrir.begin() + numDelaySamples, hrir.end(), hrir.begin());
     std::fill(hrir.end() - numDelaySamples, hrir.end(), 0.0);
-    
+
     return true;
 }
 
@@ -441,25 +1518,25 @@ bool HRTFProcessor::removeImpulseDelay(std::vector<float> &hrir, size_t numDelay
 std::pair<float, float> HRTFProcessor::getMeanAndStd(const std::vector<float> &x) const
 {
     std::pair<float, float> stats(0, 0);
-    
+
     if (x.size() != 0)
     {
         //  Calculate mean
         float sum = 0;
         for (auto &i : x)
             sum += i;
-        
+
         stats.first = sum / x.size();
-        
+
         //  Calculate std
         float stdSum = 0;
         for (auto &i : x)
             stdSum += (i - stats.first) * (i - stats.first);
-        
+
         stdSum = sqrt(stdSum / x.size());
         stats.second = stdSum;
     }
-    
+
     return stats;
 }
 
@@ -469,69 +1546,447 @@ std::pair<float, float> HRTFProcessor::getMeanAndStd(const std::vector<float> &x
 void HRTFProcessorTest::runTest()
 {
     HRTFProcessor processor;
-    
+
     //  Input an impulse to the HRTFProcessor
-    //  HRTF should be a constant (1)
+    //  The first HRTF partition should be a constant (1) and the second partition should be empty
     size_t fftSize = 512;
     std::vector<double> hrir(fftSize);
     std::fill(hrir.begin(), hrir.end(), 0.0);
     hrir[(fftSize / 2) - 1] = 1.0;
-    
+
     float samplingFreq = 44100.0;
     size_t audioBufferSize = 256;
-    
+
     beginTest("HRTFProcessor Initialization");
-    
-    bool success = processor.init(hrir.data(), hrir.size(), samplingFreq, audioBufferSize);
+
+    bool success = processor.init(hrir.data(), hrir.size(), samplingFreq, audioBufferSize, 0);
     expect(success);
-    
+
     expectEquals<int>(processor.isHRIRLoaded(), 1);
-    expectEquals<size_t>(processor.zeroPaddedBufferSize, 2048);
+    expectEquals<size_t>(processor.segments.size(), 1);
+    expectEquals<size_t>(processor.segments[0]->fftSize, 2 * audioBufferSize);
+    expectEquals<size_t>(processor.segments[0]->numPartitions, 2);
     expectEquals<float>(processor.fs, samplingFreq);
-    expectEquals<size_t>(processor.audioBlockSize, 2 * audioBufferSize + 1);
-    
-    for (auto i = 0; i < processor.zeroPaddedBufferSize; ++i)
-        expectWithinAbsoluteError<float>(std::abs(processor.activeHRTF[i]), 1.0, 0.01);
-    
+    expectEquals<size_t>(processor.hopSize, audioBufferSize);
+
+    //  Only the non-negative frequency bins of each partition are stored, split into padded real and imaginary parts
+    auto numBins = processor.segments[0]->numBins;
+    auto binStride = processor.segments[0]->binStride;
+    expectEquals<size_t>(numBins, audioBufferSize + 1);
+    expectGreaterOrEqual<size_t>(binStride, numBins);
+    expectEquals<size_t>(processor.segments[0]->activeHRTF[0].size(), 2 * 2 * binStride);
+
+    auto &hrtf = processor.segments[0]->activeHRTF[0];
+    for (auto i = 0; i < numBins; ++i)
+    {
+        auto *secondPartition = hrtf.data() + (2 * binStride);
+
+        expectWithinAbsoluteError<float>(std::abs(std::complex<float>(hrtf[i], hrtf[binStride + i])), 1.0, 0.01);
+        expectWithinAbsoluteError<float>(std::abs(std::complex<float>(secondPartition[i], secondPartition[binStride + i])), 0.0, 0.01);
+    }
+
     //===================================================================================================//
-    
-    
+
+
     beginTest("HRTF Application");
-    
+
     std::vector<float> x(audioBufferSize);
     std::fill(x.begin(), x.end(), 1.0);
-    
-    //  In order to meet the min number of samples needed for processing, call addSamples() 3 times
-    processor.addSamples(x.data(), x.size());
-    processor.addSamples(x.data(), x.size());
+
+    //  A full partition of input produces a full partition of output without any added latency
     processor.addSamples(x.data(), x.size());
-    
+
     auto output = processor.getOutput(audioBufferSize);
-    
+
     expectEquals<size_t>(output.size(), audioBufferSize);
-    
-//    std::cout << "HRTFProcessor Output" << std::endl;
-//    std::cout << "------------------" << std::endl;
-//
-//    for (auto i = 0; i < audioBufferSize; ++i)
-//        std::cout << output[i] << std::endl;
-    
+
+    //===================================================================================================//
+
+
+    beginTest("Uniform Partitioned Convolution");
+
+    //  Use an HRIR that is not a multiple of the partition size and feed the input in uneven chunks
+    //  The output should match a direct convolution
+    std::vector<double> longHRIR(1000);
+    for (auto i = 0; i < longHRIR.size(); ++i)
+        longHRIR[i] = sin(0.05 * i) * exp(-0.004 * i);
+
+    std::vector<float> testSignal(4096);
+    createTestSignal(samplingFreq, 1000, testSignal);
+
+    HRTFProcessor uniformProcessor;
+    expect(uniformProcessor.init(longHRIR.data(), longHRIR.size(), samplingFreq, 64, 0));
+    expectEquals<size_t>(uniformProcessor.segments[0]->numPartitions, 16);
+    expectWithinAbsoluteError<float>(processInChunks(uniformProcessor, testSignal, longHRIR, false), 0.0, 0.001);
+
+    //===================================================================================================//
+
+
+    beginTest("Non-Uniform Partitioned Convolution");
+
+    //  The head and segments should cover the HRIR with partitions of 64, 64, 64, 128, 128, 256, 256...
+    //  Every call to addSamples() should produce the same number of output samples
+    std::vector<double> tailHRIR(5000);
+    for (auto i = 0; i < tailHRIR.size(); ++i)
+        tailHRIR[i] = sin(0.03 * i) * exp(-0.001 * i);
+
+    HRTFProcessor nonUniformProcessor;
+    expect(nonUniformProcessor.init(tailHRIR.data(), tailHRIR.size(), samplingFreq, 256, 0, HRTFProcessor::PartitionScheme::nonUniform));
+    expectEquals<size_t>(nonUniformProcessor.headLength, HRTFProcessor::DEFAULT_CONTROL_RATE);
+    expectEquals<size_t>(nonUniformProcessor.segments.size(), 6);
+    expectEquals<size_t>(nonUniformProcessor.segments[0]->firstTap, 64);
+    expectEquals<size_t>(nonUniformProcessor.segments[1]->firstTap, 256);
+    expectEquals<size_t>(nonUniformProcessor.segments.back()->blockSize, 2048);
+    expectGreaterOrEqual<size_t>(nonUniformProcessor.hrirPartitionedSize, tailHRIR.size());
+    expectWithinAbsoluteError<float>(processInChunks(nonUniformProcessor, testSignal, tailHRIR, true), 0.0, 0.001);
+
+    HRTFProcessor backgroundProcessor;
+    expect(backgroundProcessor.init(tailHRIR.data(), tailHRIR.size(), samplingFreq, 256, 0, HRTFProcessor::PartitionScheme::nonUniform, true));
+    expect(backgroundProcessor.segmentWorker.get() != nullptr);
+    expect(!backgroundProcessor.segments[0]->processInBackground);
+    expect(backgroundProcessor.segments.back()->processInBackground);
+    expectWithinAbsoluteError<float>(processInChunks(backgroundProcessor, testSignal, tailHRIR, true), 0.0, 0.001);
+
+    //  The estimate plans the same layout, and a shorter filter costs less
+    auto cost = HRTFProcessor::estimateCost(tailHRIR.size(), 256, HRTFProcessor::PartitionScheme::nonUniform, 1);
+    expectEquals<size_t>(cost.numSegments, nonUniformProcessor.segments.size());
+    expectEquals<size_t>(cost.largestFFTSize, nonUniformProcessor.segments.back()->fftSize);
+    expectLessThan(HRTFProcessor::estimateCost(1000, 256, HRTFProcessor::PartitionScheme::nonUniform, 1).operationsPerSample, cost.operationsPerSample);
+    expectLessThan(cost.operationsPerSample, HRTFProcessor::estimateCost(tailHRIR.size(), 256, HRTFProcessor::PartitionScheme::nonUniform, 2).operationsPerSample);
+
+    //===================================================================================================//
+
+
+    beginTest("Non-Uniform HRTF Change");
+
+    //  Once every segment has crossfaded, the output should match a direct convolution with the new HRIR
+    std::vector<double> newHRIR(tailHRIR.size());
+    for (auto i = 0; i < newHRIR.size(); ++i)
+        newHRIR[i] = cos(0.02 * i) * exp(-0.002 * i);
+
+    std::vector<float> longSignal(16384);
+    createTestSignal(samplingFreq, 700, longSignal);
+    auto newReference = convolve(longSignal, newHRIR);
+
+    backgroundProcessor.flushBuffers();
+
+    std::vector<float> changedOutput;
+    backgroundProcessor.addSamples(longSignal.data(), 1024);
+    readDryOutput(backgroundProcessor, changedOutput);
+
+    expect(backgroundProcessor.swapHRIR(newHRIR.data(), newHRIR.size(), 0));
+
+    for (auto position = 1024; position < longSignal.size(); position += 256)
+    {
+        backgroundProcessor.addSamples(longSignal.data() + position, 256);
+        readDryOutput(backgroundProcessor, changedOutput);
+    }
+
+    expectEquals<size_t>(changedOutput.size(), longSignal.size());
+
+    float maxError = 0;
+    for (auto i = 12288; i < changedOutput.size(); ++i)
+        maxError = juce::jmax(maxError, std::abs(changedOutput[i] - newReference[i]));
+
+    expectWithinAbsoluteError<float>(maxError, 0.0, 0.001);
+
+    //===================================================================================================//
+
+
+    beginTest("Spectral Interpolation Crossfade");
+
+    //  The blocks after a swap should be a weighted mix of the outputs of the old and new HRIRs,
+    //  after which the output should match the new HRIR alone
+    std::vector<double> interpolationHRIR(longHRIR.size());
+    for (auto i = 0; i < interpolationHRIR.size(); ++i)
+        interpolationHRIR[i] = cos(0.08 * i) * exp(-0.005 * i);
+
+    auto oldReference = convolve(testSignal, longHRIR);
+    auto interpolationReference = convolve(testSignal, interpolationHRIR);
+
+    HRTFProcessor interpolatingProcessor;
+    expect(interpolatingProcessor.init(longHRIR.data(), longHRIR.size(), samplingFreq, 64, 0));
+    interpolatingProcessor.setCrossfadeMode(HRTFProcessor::CrossfadeMode::spectralInterpolation);
+
+    std::vector<float> interpolatedOutput;
+    size_t swapBlock = 16;
+    bool interpolationCrossFaded = false;
+
+    for (auto block = 0; block < testSignal.size() / 64; ++block)
+    {
+        if (block == swapBlock)
+            expect(interpolatingProcessor.swapHRIR(interpolationHRIR.data(), interpolationHRIR.size(), 0));
+
+        expect(interpolatingProcessor.addSamples(testSignal.data() + (block * 64), 64));
+        interpolationCrossFaded |= interpolatingProcessor.crossFaded;
+        readDryOutput(interpolatingProcessor, interpolatedOutput);
+    }
+
+    expect(interpolationCrossFaded);
+    expectEquals<size_t>(interpolatedOutput.size(), testSignal.size());
+
+    float maxInterpolationError = 0;
+    for (auto i = 0; i < interpolatedOutput.size(); ++i)
+    {
+        auto block = i / 64;
+        float weight = 0;
+
+        if (block >= swapBlock + HRTFProcessor::SPECTRAL_INTERPOLATION_STEPS)
+            weight = 1;
+        else if (block >= swapBlock)
+            weight = (float)(block - swapBlock + 1) / (float)(HRTFProcessor::SPECTRAL_INTERPOLATION_STEPS + 1);
+
+        auto expected = ((1 - weight) * oldReference[i]) + (weight * interpolationReference[i]);
+        maxInterpolationError = juce::jmax(maxInterpolationError, std::abs(interpolatedOutput[i] - expected));
+    }
+
+    expectWithinAbsoluteError<float>(maxInterpolationError, 0.0, 0.001);
+
     //===================================================================================================//
-    
-    
+
+
+    beginTest("Control Rate");
+
+    //  The head and the first partitions should follow the control rate whatever the buffer size, and the estimate should plan the same layout
+    HRTFProcessor fineProcessor;
+    expect(!fineProcessor.setControlRate(48));
+    expect(!fineProcessor.setControlRate(HRTFProcessor::MIN_CONTROL_RATE / 2));
+    expect(!fineProcessor.setControlRate(HRTFProcessor::MAX_CONTROL_RATE * 2));
+    expect(fineProcessor.setControlRate(32));
+    expect(fineProcessor.init(tailHRIR.data(), tailHRIR.size(), samplingFreq, 1024, 0, HRTFProcessor::PartitionScheme::nonUniform));
+    expect(!fineProcessor.setControlRate(64));
+    expectEquals<size_t>(fineProcessor.hopSize, 32);
+    expectEquals<size_t>(fineProcessor.headLength, 32);
+    expectEquals<size_t>(fineProcessor.segments[0]->blockSize, 32);
+    expectWithinAbsoluteError<float>(processInChunks(fineProcessor, testSignal, tailHRIR, true), 0.0, 0.001);
+
+    auto fineCost = HRTFProcessor::estimateCost(tailHRIR.size(), 1024, HRTFProcessor::PartitionScheme::nonUniform, 1, 32);
+    expectEquals<size_t>(fineCost.numSegments, fineProcessor.segments.size());
+    expectEquals<size_t>(fineCost.largestFFTSize, fineProcessor.segments.back()->fftSize);
+
+    //===================================================================================================//
+
+
+    beginTest("HRTF Ramp");
+
+    //  With a ramp length, the segments should blend over one block per step of the ramp
+    size_t rampLength = 512;
+    size_t rampSteps = rampLength / 64;
+
+    HRTFProcessor rampProcessor;
+    expect(rampProcessor.init(longHRIR.data(), longHRIR.size(), samplingFreq, 64, 0));
+    rampProcessor.setCrossfadeMode(HRTFProcessor::CrossfadeMode::spectralInterpolation);
+    rampProcessor.setHRTFRampLength(rampLength);
+
+    std::vector<float> rampOutput;
+    for (auto block = 0; block < testSignal.size() / 64; ++block)
+    {
+        if (block == swapBlock)
+            expect(rampProcessor.swapHRIR(interpolationHRIR.data(), interpolationHRIR.size(), 0));
+
+        expect(rampProcessor.addSamples(testSignal.data() + (block * 64), 64));
+        readDryOutput(rampProcessor, rampOutput);
+    }
+
+    float maxRampError = 0;
+    for (auto i = 0; i < rampOutput.size(); ++i)
+    {
+        auto block = i / 64;
+        float weight = 0;
+
+        if (block >= swapBlock + rampSteps)
+            weight = 1;
+        else if (block >= swapBlock)
+            weight = (float)(block - swapBlock + 1) / (float)(rampSteps + 1);
+
+        auto expected = ((1 - weight) * oldReference[i]) + (weight * interpolationReference[i]);
+        maxRampError = juce::jmax(maxRampError, std::abs(rampOutput[i] - expected));
+    }
+
+    expectWithinAbsoluteError<float>(maxRampError, 0.0, 0.001);
+
+    //  A head on its own should crossfade to the next step of the ramp every hop, starting with the hop after the swap
+    std::vector<double> shortHRIR(64), newShortHRIR(64);
+    for (auto i = 0; i < shortHRIR.size(); ++i)
+    {
+        shortHRIR[i] = sin(0.2 * i) * exp(-0.05 * i);
+        newShortHRIR[i] = cos(0.3 * i) * exp(-0.04 * i);
+    }
+
+    auto shortReference = convolve(testSignal, shortHRIR);
+    auto newShortReference = convolve(testSignal, newShortHRIR);
+
+    HRTFProcessor headRampProcessor;
+    expect(headRampProcessor.init(shortHRIR.data(), shortHRIR.size(), samplingFreq, 256, 0, HRTFProcessor::PartitionScheme::nonUniform));
+    expect(headRampProcessor.segments.empty());
+    headRampProcessor.setHRTFRampLength(4 * 64);
+
+    std::vector<float> headRampOutput;
+    for (auto block = 0; block < testSignal.size() / 64; ++block)
+    {
+        if (block == swapBlock)
+            expect(headRampProcessor.swapHRIR(newShortHRIR.data(), newShortHRIR.size(), 0));
+
+        expect(headRampProcessor.addSamples(testSignal.data() + (block * 64), 64));
+        readDryOutput(headRampProcessor, headRampOutput);
+    }
+
+    float maxHeadRampError = 0;
+    for (auto i = 0; i < headRampOutput.size(); ++i)
+    {
+        auto hop = (int)(i / 64) - (int)swapBlock;
+        auto blend = [&](int step) { float w = juce::jlimit(0.0f, 1.0f, step / 4.0f); return ((1 - w) * shortReference[i]) + (w * newShortReference[i]); };
+
+        auto expected = blend(hop);
+        if (hop >= 1 && hop <= 4)
+            expected = (headRampProcessor.headFadeOutEnvelope[i % 64] * blend(hop - 1)) + (headRampProcessor.headFadeInEnvelope[i % 64] * blend(hop));
+
+        maxHeadRampError = juce::jmax(maxHeadRampError, std::abs(headRampOutput[i] - expected));
+    }
+
+    expectWithinAbsoluteError<float>(maxHeadRampError, 0.0, 0.001);
+
+    //===================================================================================================//
+
+
+    beginTest("Lock-Free HRTF Swap");
+
+    //  When several HRIRs are swapped in between two blocks, the newest one should take effect at the next block
+    std::vector<double> newestHRIR(longHRIR.size());
+    for (auto i = 0; i < newestHRIR.size(); ++i)
+        newestHRIR[i] = sin(0.11 * i) * exp(-0.006 * i);
+
+    auto newestReference = convolve(testSignal, newestHRIR);
+
+    HRTFProcessor swapProcessor;
+    expect(swapProcessor.init(longHRIR.data(), longHRIR.size(), samplingFreq, 64, 0));
+
+    std::vector<float> swappedOutput;
+    for (auto block = 0; block < testSignal.size() / 64; ++block)
+    {
+        if (block == swapBlock)
+        {
+            expect(swapProcessor.swapHRIR(interpolationHRIR.data(), interpolationHRIR.size(), 0));
+            expect(swapProcessor.swapHRIR(newestHRIR.data(), newestHRIR.size(), 0));
+        }
+
+        expect(swapProcessor.addSamples(testSignal.data() + (block * 64), 64));
+        expect(swapProcessor.crossFaded == (block == swapBlock));
+        readDryOutput(swapProcessor, swappedOutput);
+    }
+
+    float maxSwapError = 0;
+    for (auto i = (swapBlock + 1) * 64; i < swappedOutput.size(); ++i)
+        maxSwapError = juce::jmax(maxSwapError, std::abs(swappedOutput[i] - newestReference[i]));
+
+    expectWithinAbsoluteError<float>(maxSwapError, 0.0, 0.001);
+
+    //  Swapping continuously on another thread should never hold up or break the processing
+    std::atomic<bool> keepSwapping(true);
+    std::thread swapThread([&]()
+    {
+        for (auto i = 0; keepSwapping.load(); ++i)
+        {
+            auto &h = (i % 2 == 0) ? newestHRIR : longHRIR;
+            backgroundProcessor.swapHRIR(h.data(), h.size(), 0);
+        }
+    });
+
+    backgroundProcessor.flushBuffers();
+
+    std::vector<float> concurrentOutput;
+    for (auto position = 0; position + 256 <= longSignal.size(); position += 256)
+    {
+        expect(backgroundProcessor.addSamples(longSignal.data() + position, 256));
+        readDryOutput(backgroundProcessor, concurrentOutput);
+    }
+
+    keepSwapping.store(false);
+    swapThread.join();
+
+    expectEquals<size_t>(concurrentOutput.size(), longSignal.size());
+    for (auto sample : concurrentOutput)
+        expect(std::isfinite(sample));
+
+    //===================================================================================================//
+
+
+    beginTest("Visualization Tap");
+
+    //  Nothing should be copied into the tap until it is enabled, after that it should carry exactly the output
+    HRTFProcessor tapProcessor;
+    expect(tapProcessor.init(longHRIR.data(), longHRIR.size(), samplingFreq, 64, 0));
+
+    std::vector<float> tapOutput;
+    std::vector<float> tapSamples(HRTFProcessor::VISUALIZATION_TAP_SIZE);
+
+    expect(tapProcessor.addSamples(testSignal.data(), 64));
+    readDryOutput(tapProcessor, tapOutput);
+    expectEquals<size_t>(tapProcessor.readVisualizationTap(tapSamples.data(), tapSamples.size()), 0);
+
+    tapOutput.clear();
+    tapProcessor.setVisualizationTapEnabled(true);
+
+    for (auto position = 64; position + 64 <= 1024; position += 64)
+    {
+        expect(tapProcessor.addSamples(testSignal.data() + position, 64));
+        readDryOutput(tapProcessor, tapOutput);
+    }
+
+    auto numTapSamples = tapProcessor.readVisualizationTap(tapSamples.data(), tapSamples.size());
+    expectEquals<size_t>(numTapSamples, tapOutput.size());
+
+    float maxTapError = 0;
+    for (auto i = 0; i < numTapSamples; ++i)
+        maxTapError = juce::jmax(maxTapError, std::abs(tapSamples[i] - tapOutput[i]));
+
+    expectEquals<float>(maxTapError, 0.0);
+
+    //===================================================================================================//
+
+
+    beginTest("In-Place Processing");
+
+    //  Processing a buffer in place should give the same output as the allocating getOutput()
+    HRTFProcessor vectorProcessor;
+    HRTFProcessor inPlaceProcessor;
+    expect(vectorProcessor.init(tailHRIR.data(), tailHRIR.size(), samplingFreq, 256, 0, HRTFProcessor::PartitionScheme::nonUniform));
+    expect(inPlaceProcessor.init(tailHRIR.data(), tailHRIR.size(), samplingFreq, 256, 0, HRTFProcessor::PartitionScheme::nonUniform));
+
+    juce::AudioBuffer<float> inPlaceBuffer(1, 256);
+    float maxInPlaceError = 0;
+
+    for (auto position = 0; position + 256 <= testSignal.size(); position += 256)
+    {
+        expect(vectorProcessor.addSamples(testSignal.data() + position, 256));
+        auto vectorOutput = vectorProcessor.getOutput(256);
+
+        inPlaceBuffer.copyFrom(0, 0, testSignal.data() + position, 256);
+        expect(inPlaceProcessor.process(inPlaceBuffer));
+
+        for (auto i = 0; i < 256; ++i)
+            maxInPlaceError = juce::jmax(maxInPlaceError, std::abs(vectorOutput[i] - inPlaceBuffer.getReadPointer(0)[i]));
+    }
+
+    expectEquals<float>(maxInPlaceError, 0.0);
+    expect(!inPlaceProcessor.process(inPlaceBuffer, 1));
+
+    //===================================================================================================//
+
+
     beginTest("Changing HRTF");
 
     size_t testSignalLength = 2048;
     float testFrequency = 500;
-    
+
     //  Create container to hold the results of processed data when HRIR was changed
     std::vector<float> processedData(testSignalLength);
     std::fill(processedData.begin(), processedData.end(), 0.0);
-    
+
     //  First, reset all the internal HRTFProcessor buffers to start fresh
     processor.flushBuffers();
     output = processor.getOutput(audioBufferSize);
-    
+
     expectEquals<size_t>(output.size(), 0);
 
     std::vector<float> signal(testSignalLength);
@@ -540,26 +1995,23 @@ void HRTFProcessorTest::runTest()
     processor.addSamples(signal.data(), audioBufferSize * 3);
     output = processor.getOutput(audioBufferSize);
     std::copy(output.begin(), output.end(), processedData.begin());
-    
+
     //  Swap HRIR for an impulse response of all ones
     std::fill(hrir.begin(), hrir.end(), 1.0);
-    expect(processor.swapHRIR(hrir.data(), hrir.size()));
-    
+    expect(processor.swapHRIR(hrir.data(), hrir.size(), 0));
+
     //  Feed in rest of test signal and get the processed data
+    bool crossFaded = false;
     for (auto i = 0; i < (testSignalLength / audioBufferSize) - 3; ++i)
     {
         processor.addSamples(signal.data() + ((i + 3) * audioBufferSize), audioBufferSize);
+        crossFaded |= processor.crossFaded;
+
         output = processor.getOutput(audioBufferSize);
         std::copy(output.begin(), output.end(), processedData.begin() + ((i + 1) * audioBufferSize));
     }
-    
 
-    std::cout << "Processed Data from HRTF Change" << std::endl;
-    std::cout << "==================" << std::endl;
-
-    for (auto i = 0; i < testSignalLength; ++i)
-        std::cout << processedData[i] << std::endl;
-    
+    expect(crossFaded);
 }
 
 
@@ -567,11 +2019,74 @@ bool HRTFProcessorTest::createTestSignal(float fs, float f0, std::vector<float>
 {
     if (dest.size() == 0)
         return false;
-    
+
     for (auto i = 0; i < dest.size(); ++i)
         dest.at(i) = sin((i * 2 * juce::MathConstants<float>::pi * f0) / fs);
-    
+
     return true;
 }
 
+
+//  Read every output sample that is available straight from the output buffer
+void HRTFProcessorTest::readDryOutput(HRTFProcessor &processor, std::vector<float> &dest)
+{
+    while (processor.numOutputSamplesAvailable > 0)
+    {
+        dest.push_back(processor.outputBuffer[0][processor.outputSampleStart]);
+        processor.outputSampleStart = (processor.outputSampleStart + 1) % processor.outputBuffer[0].size();
+        processor.numOutputSamplesAvailable--;
+    }
+}
+
+
+//  Direct form convolution used as a reference for the partitioned convolution
+std::vector<float> HRTFProcessorTest::convolve(const std::vector<float> &x, const std::vector<double> &h)
+{
+    std::vector<float> y(x.size());
+    std::fill(y.begin(), y.end(), 0.0);
+
+    for (auto n = 0; n < x.size(); ++n)
+    {
+        for (auto k = 0; k < h.size() && k <= n; ++k)
+            y[n] += h[k] * x[n - k];
+    }
+
+    return y;
+}
+
+
+/*
+ *  Feed x into the processor in uneven chunks and return the largest difference to a direct convolution with h
+ *  If expectNoLatency is set, every chunk has to produce the same number of output samples straight away
+ */
+float HRTFProcessorTest::processInChunks(HRTFProcessor &processor, const std::vector<float> &x, const std::vector<double> &h, bool expectNoLatency)
+{
+    auto reference = convolve(x, h);
+    std::vector<float> y;
+
+    size_t chunkSizes[] = { 64, 13, 51, 64, 128, 100, 7 };
+    size_t position = 0;
+    size_t chunk = 0;
+
+    while (position + 256 <= x.size())
+    {
+        auto numSamples = chunkSizes[chunk++ % 7];
+        expect(processor.addSamples(x.data() + position, numSamples));
+        position += numSamples;
+
+        if (expectNoLatency)
+            expectEquals<size_t>(processor.numOutputSamplesAvailable, numSamples);
+
+        readDryOutput(processor, y);
+    }
+
+    expectGreaterThan<size_t>(y.size(), 0);
+
+    float maxError = 0;
+    for (auto i = 0; i < y.size(); ++i)
+        maxError = juce::jmax(maxError, std::abs(y[i] - reference[i]));
+
+    return maxError;
+}
+
 #endif
@@ -2,83 +2,368 @@
 #include <JuceHeader.h>
 #include <vector>
 #include <complex>
+#include "SpectralKernels.h"
+#include "TripleBuffer.h"
+#include "MinimumPhase.h"
+#include "RenderPool.h"
+#include "Semaphore.h"
 
 
+/*
+ *  Applies an HRIR to a mono signal using partitioned overlap-save convolution
+ *
+ *  The HRIR is split into partitions and each partition is transformed into an HRTF with a real-only FFT of twice the partition size.
+ *  Every time a full partition of input samples is collected, the newest input frame is transformed and pushed into
+ *  a frequency-domain delay line (FDL).  The output is the sum of the FDL spectra multiplied with their matching HRTF partitions,
+ *  so the cost per block scales with the partition size instead of the full HRIR length.
+ *
+ *  Two partitioning schemes are available:
+ *
+ *  uniform:    Every partition is audioBufferSize samples long.  Output is produced in whole blocks of audioBufferSize samples
+ *              so there is no added latency as long as the caller adds and reads audioBufferSize samples at a time.
+ *
+ *  nonUniform: The first taps of the HRIR are applied with a direct form FIR so that every input sample produces an output sample
+ *              straight away.  The rest of the HRIR is split into segments with progressively larger partitions
+ *              which are each delayed just enough to be ready in time.  The larger segments can be processed on a background thread
+ *              so the cost per block stays flat.
+ *
+ *  The engine can apply several HRIRs to the same input (see BinauralHRTFProcessor).  The input frames, forward FFTs and
+ *  frequency-domain delay lines are shared by every ear and only the HRTF spectra, inverse FFTs and output buffers are kept per ear.
+ *
+ *  New HRTFs are handed from the thread calling swapHRIR() to the threads processing the head and each segment through
+ *  triple buffers, so neither side ever waits for the other and the newest HRIR is picked up at the next block of each segment.
+ *
+ *  The engine can also render several sources at once (see setNumSources()).  Every source has its own input frames, forward FFTs,
+ *  frequency-domain delay lines and HRTFs, but the spectra of all sources are summed per ear before the inverse transform,
+ *  so each extra source costs a forward FFT and its multiply-accumulates instead of a whole engine.
+ *
+ *  In the minimum-phase mode (see setMinimumPhase()) every HRIR is split into a truncated minimum-phase filter, which is what the
+ *  segments apply, and a delay per ear, which is applied to each ear's output with a fractional delay line.
+ *
+ *  In the nonUniform scheme the engine works in hops of the control rate (see setControlRate()) whatever the size of the blocks it is fed,
+ *  so a new HRTF can take effect every few dozen samples.  With a ramp length (see setHRTFRampLength()) a new HRTF is blended in
+ *  over many hops, which follows the path between two positions instead of jumping to the second one.
+ */
 class HRTFProcessor
 {
 #ifdef JUCE_UNIT_TESTS
     friend class HRTFProcessorTest;
 #endif
-    
+
 public:
-    
+
+    enum class PartitionScheme
+    {
+        uniform,
+        nonUniform
+    };
+
+    /*
+     *  How a segment moves from one HRTF to the next.  Both modes filter the input spectrum that is already in the
+     *  frequency-domain delay line so neither needs an extra forward FFT
+     *
+     *  timeDomain:             Both HRTFs are applied for one block and the two outputs are crossfaded sample by sample.
+     *                          A swap block costs a second round of multiplications and a second inverse FFT.
+     *
+     *  spectralInterpolation:  The HRTF spectra are blended over SPECTRAL_INTERPOLATION_STEPS blocks and only the blended
+     *                          HRTF is applied, so a swap block costs about the same as a normal block.
+     */
+    enum class CrossfadeMode
+    {
+        timeDomain,
+        spectralInterpolation
+    };
+
+    /*
+     *  The HRTFs of one HRIR per ear, already partitioned and transformed for the segment layout of an engine
+     *  These can be prepared ahead of time (see HRTFCache) so swapping them in does not need any FFTs
+     */
+    struct PreparedHRTF
+    {
+        std::vector<std::vector<float>>                 headTaps;           //  [ear][tap]
+        std::vector<std::vector<std::vector<float>>>    segmentSpectra;     //  [segment][ear][partition spectra]
+        std::vector<float>                              earDelays;          //  [ear], in samples.  Always 0 unless the engine is in the minimum-phase mode
+
+        size_t  getSizeInBytes() const;
+        void    copyTo(float *dest) const;      //  Writes the flat layout used by swapHRTF(const float*, size_t)
+    };
+
+    //  See estimateCost()
+    struct EngineCost
+    {
+        size_t  numSegments;
+        size_t  largestFFTSize;
+        double  operationsPerSample;
+    };
+
     HRTFProcessor();
-    HRTFProcessor(const double *hrir, size_t hrirSize, float samplingFreq, size_t audioBufferSize, size_t numDelaySamples);
-    
-    bool                init(const double *hrir, size_t hrirSize, float samplingFreq, size_t audioBufferSize, size_t numDelaySamples);
-    bool                swapHRIR(const double *hrir, size_t hrirSize, size_t numDelaySamples);
-    bool                addSamples(float *samples, size_t numSamples);
+    HRTFProcessor(const double *hrir, size_t hrirSize, float samplingFreq, size_t audioBufferSize, size_t numDelaySamples, PartitionScheme scheme = PartitionScheme::uniform, bool useBackgroundThread = false);
+    ~HRTFProcessor();
+
+    bool                init(const double *hrir, size_t hrirSize, float samplingFreq, size_t audioBufferSize, size_t numDelaySamples, PartitionScheme scheme = PartitionScheme::uniform, bool useBackgroundThread = false);
+
+    //  Call before init() to split every HRIR into a minimum-phase filter of at most filterLength taps and a delay per ear
+    //  The segments are then sized for filterLength instead of hrirSize.  A filterLength of 0 applies the HRIRs as measured
+    bool                setMinimumPhase(size_t filterLength);
+    bool                isMinimumPhase() const { return minimumPhaseLength > 0; }
+
+    /*
+     *  Call before init() to set the hop of the nonUniform scheme in samples, a power of 2 from MIN_CONTROL_RATE to MAX_CONTROL_RATE
+     *  The head and the first partitions are as long as the hop, so a finer control rate costs more FFTs (see estimateCost())
+     *  The uniform scheme always hops by its audioBufferSize
+     */
+    bool                setControlRate(size_t numSamples);
+    size_t              getControlRate() const { return controlRate; }
+
+    //  Blend new HRTFs in over numSamples in steps of one hop per head and one block per segment.  0 blends over a single step
+    //  Real-time safe and can be called from any thread.  The timeDomain crossfade of the segments always takes one block
+    void                setHRTFRampLength(size_t numSamples) { hrtfRampLength.store(numSamples); }
+
+    //  Call before init() to render numSources inputs, every source starts with the HRIR passed to init()
+    //  The minimum-phase ear delays are applied after the sources are summed, so the two modes cannot be combined
+    bool                setNumSources(size_t numSources);
+    size_t              getNumSources() const { return numSources; }
+    bool                swapHRIR(const double *hrir, size_t hrirSize, size_t numDelaySamples);     //  Only call from one thread at a time
+
+    //  prepareHRTF() is thread safe once init() has returned, swapHRTF() has the same rules as swapHRIR()
+    bool                prepareHRTF(const std::vector<const double*> &hrirs, size_t hrirSize, size_t numDelaySamples, PreparedHRTF &dest) const;
+    //  Prepared HRTFs do not depend on the source, so the same one can be swapped into any of them
+    bool                swapHRTF(const PreparedHRTF &prepared, size_t source = 0);
+
+    //  Flat layout of a PreparedHRTF: the head taps of every ear, the spectra of every ear of every segment and then the delay of every ear
+    //  This is what compiled HRTF files store (see HRTFDatabase)
+    bool                swapHRTF(const float *prepared, size_t numFloats, size_t source = 0);
+    size_t              getPreparedHRTFSize() const;
+
+    //  Swap in the weighted sum of several prepared HRTFs, used to interpolate between measurements
+    //  The transforms are linear so the sum is taken on the prepared spectra, which costs O(bins) per HRTF and needs no FFTs
+    bool                swapHRTF(const PreparedHRTF *const *prepared, const float *weights, size_t numHRTFs, size_t source = 0);
+    bool                swapHRTF(const float *const *prepared, const float *weights, size_t numHRTFs, size_t numFloats, size_t source = 0);
+
+    //  Real-time safe, these only use storage allocated in init()
+    //  The first version is for engines with a single source, the second reads numSamples from each of the numSources inputs
+    bool                addSamples(const float *samples, size_t numSamples);
+    bool                addSamples(const float *const *sources, size_t numSamples);
+    bool                getOutput(float *dest, size_t numSamples);
+    bool                process(juce::AudioBuffer<float> &buffer, int channel = 0);
+
+    //  Allocates the returned vector so it should not be called on the audio thread
     std::vector<float>  getOutput(size_t numSamples);
+
     void                flushBuffers();
-    bool                copyOLABuffer(std::vector<float> &dest, size_t numSamplesToCopy);
     bool                isHRIRLoaded() { return hrirLoaded; }
-    void                setReverbParameters(juce::Reverb::Parameters params);
-    
+    //  Engines with several sources always use spectralInterpolation, a timeDomain crossfade would need an inverse FFT per source
+    void                setCrossfadeMode(CrossfadeMode mode) { crossfadeMode.store(mode); }
+
+    //  Share the segments that are calculated on the audio thread with the workers of pool, nullptr calculates them on the audio thread alone
+    //  Only call while no audio is being processed.  The pool has to outlive its use by this engine
+    void                setRenderPool(RenderPool *pool) { renderPool = pool; }
+    //  Whether the blocks of the engine that was set up have enough work to be shared with a render pool, see MIN_PARALLEL_WORK
+    bool                needsRenderPool() const;
+
+    //  The visualization tap copies the output of the first ear into a lock-free FIFO for a single reader, e.g. the editor
+    //  It is off by default so nothing is copied unless someone is reading it
+    void                setVisualizationTapEnabled(bool shouldBeEnabled) { visualizationTapEnabled.store(shouldBeEnabled); }
+    size_t              readVisualizationTap(float *dest, size_t maxNumSamples);
+
+    //  Rough cost of an engine set up for filterLength taps, used to pick and report filter lengths before setting an engine up
+    static EngineCost   estimateCost(size_t filterLength, size_t audioBufferSize, PartitionScheme scheme, size_t numEars, size_t controlRate = DEFAULT_CONTROL_RATE);
+
     bool                crossFaded;
-    
-    
+
+    //  Range and default of the hop of the nonUniform scheme, which is also the length of its direct form head
+    static constexpr size_t     MIN_CONTROL_RATE = 32;
+    static constexpr size_t     MAX_CONTROL_RATE = 128;
+    static constexpr size_t     DEFAULT_CONTROL_RATE = 64;
+
+    //  Largest partition size used for the tail of the HRIR in the nonUniform scheme
+    static constexpr size_t     MAX_PARTITION_SIZE = 4096;
+
+    //  Number of output samples the visualization tap can hold before new samples are dropped
+    static constexpr size_t     VISUALIZATION_TAP_SIZE = 8192;
+
+    //  Least number of blocks a segment blends over in the spectralInterpolation crossfade mode
+    static constexpr size_t     SPECTRAL_INTERPOLATION_STEPS = 2;
+
+    //  Length of the per-ear delay lines of the minimum-phase mode, must be a power of 2
+    static constexpr size_t     EAR_DELAY_LINE_SIZE = 1024;
+
+    //  The Lagrange interpolation reads one sample either side of the delay, so delays are kept within [1, MAX_EAR_DELAY]
+    static constexpr float      MAX_EAR_DELAY = EAR_DELAY_LINE_SIZE - 4;
+
+    //  Blocks with less work than this, in FFT points and complex multiplies, are calculated on the audio thread alone
+    //  Below it waking the render pool costs more than it saves
+    static constexpr size_t     MIN_PARALLEL_WORK = 32768;
+
+
 protected:
-    
-    bool                        setupHRTF(const double *hrir, size_t hrirSize, size_t numDelaySamples);
-    const float*                calculateOutput(const std::vector<float> &x);
-    bool                        overlapAndAdd();
-    bool                        crossfadeWithNewHRTF(const std::vector<float> &x);
-    unsigned int                calculateNextPowerOfTwo(float x);
-    bool                        removeImpulseDelay(std::vector<float> &hrir, size_t numDelaySamples);
+
+    /*
+     *  A run of equally sized partitions covering the HRIR taps [firstTap, firstTap + numPartitions * blockSize)
+     *  Each segment has its own FFT size and an input frame and frequency-domain delay line per source.
+     *  The output block calculated from input block j is played back as block j + latencyBlocks
+     */
+    struct ConvolutionSegment
+    {
+        size_t                                      blockSize;
+        size_t                                      fftSize;
+        size_t                                      numBins;
+        size_t                                      binStride;
+        size_t                                      firstTap;
+        size_t                                      numPartitions;
+        size_t                                      latencyBlocks;
+        bool                                        processInBackground;
+
+        std::unique_ptr<juce::dsp::FFT>             fftEngine;
+
+        std::vector<std::vector<float>>             inputFrames;
+        std::vector<std::vector<float>>             processingFrames;
+        std::vector<std::vector<float>>             frequencyDelayLines;
+        size_t                                      fdlIndex;
+
+        //  Spectra only hold the numBins non-negative frequency bins of the real-only transforms
+        //  They are stored split-complex (see SpectralKernels), every spectrum takes 2 * binStride floats
+        //  Active HRTFs are indexed by source * numEars + ear, incoming HRTFs by source and then ear
+        //  Spectrum accumulators, inverse transform buffers and output blocks are indexed by ear
+        //  so every source and every ear can be worked on by a thread of its own
+        std::vector<std::vector<float>>             activeHRTF;
+        std::vector<TripleBuffer<std::vector<std::vector<float>>>>  incomingHRTF;
+        std::vector<std::vector<float>>             spectrumAccumulators;
+        std::vector<size_t>                         interpolationStep;
+        std::vector<size_t>                         interpolationSteps;
+        bool                                        timeDomainSwap;
+
+        //  Real-only transforms need 2 * fftSize floats of working space, the forward transforms have one per source
+        std::vector<std::vector<float>>             fftBuffers;
+        std::vector<std::vector<float>>             xBuffer;
+        std::vector<std::vector<float>>             auxBuffer;
+        std::vector<float>                          fadeInEnvelope;
+        std::vector<float>                          fadeOutEnvelope;
+
+        //  Two output blocks are kept so the background thread can write one while the other is being played back
+        std::vector<std::vector<float>>             outputBlocks;
+        size_t                                      nextOutputBlock;
+
+        bool                                        crossFaded;
+
+        //  The audio thread polls jobFinished instead of waiting on an event, the job is normally finished long before it is due
+        std::atomic<bool>                           jobRequested;
+        bool                                        jobPending;
+        std::atomic<bool>                           jobFinished;
+    };
+
+
+    //  Where a segment goes, see planSegments()
+    struct SegmentPlan
+    {
+        size_t                                      blockSize;
+        size_t                                      firstTap;
+        size_t                                      numPartitions;
+        bool                                        canProcessInBackground;
+    };
+
+
+    //  Processes the segments that were flagged for background processing
+    //  It sleeps on a Semaphore, so the audio thread wakes it without taking a lock
+    class SegmentWorker : public juce::Thread
+    {
+    public:
+        SegmentWorker(HRTFProcessor &p) : juce::Thread("HRTF Segment Worker"), processor(p) {}
+
+        void run() override;
+        void wake() { wakeSignal.signal(); }
+
+    private:
+        HRTFProcessor &processor;
+        Semaphore     wakeSignal;
+    };
+
+
+    bool                        initEngine(const std::vector<const double*> &hrirs, size_t hrirSize, float samplingFreq, size_t audioBufferSize, size_t numDelaySamples, PartitionScheme scheme, bool useBackgroundThread);
+    bool                        setupHRTF(const std::vector<const double*> &hrirs, size_t hrirSize, size_t numDelaySamples);
+    bool                        createSegments(size_t hrirSize, size_t audioBufferSize, PartitionScheme scheme, bool useBackgroundThread);
+    static void                 planSegments(size_t hrirSize, size_t audioBufferSize, PartitionScheme scheme, size_t controlRate, size_t &hopSize, size_t &headLength, std::vector<SegmentPlan> &plan);
+    void                        addSegment(size_t blockSize, size_t firstTap, size_t numPartitions, bool processInBackground);
+    void                        processHead(size_t numSamples);
+    void                        blendHeadTaps(size_t source);
+    void                        processBlockBoundary();
+    void                        calculateSegmentOutput(ConvolutionSegment &segment);
+    void                        calculateSegmentOutputs(size_t numSegments);
+    size_t                      getSegmentWork(const ConvolutionSegment &segment) const;
+    void                        transformSegmentInput(ConvolutionSegment &segment, size_t source);
+    void                        beginSegmentOutput(ConvolutionSegment &segment);
+    void                        calculateSegmentEar(ConvolutionSegment &segment, size_t ear);
+    void                        finishSegmentOutput(ConvolutionSegment &segment);
+    void                        applyHRTFPartitions(ConvolutionSegment &segment, size_t source, size_t ear, const std::vector<float> &hrtf, std::vector<float> &dest);
+    void                        accumulateHRTFPartitions(ConvolutionSegment &segment, size_t source, size_t ear, const std::vector<float> &hrtf);
+    void                        accumulateInterpolatedHRTFPartitions(ConvolutionSegment &segment, size_t source, size_t ear, const std::vector<float> &from, const std::vector<float> &to, float weight);
+    void                        writeOutput(size_t ear, const float *samples, size_t numSamples);
+    void                        writeDelayedOutput(size_t ear, const float *samples, size_t numSamples);
+    void                        writeVisualizationTap();
+    bool                        crossfadeWithNewHRTF(ConvolutionSegment &segment, size_t ear);
+    void                        waitForBackgroundJobs();
+    void                        joinBackgroundJob(ConvolutionSegment &segment);
+    unsigned int                calculateNextPowerOfTwo(float x) const;
+    bool                        removeImpulseDelay(std::vector<float> &hrir, size_t numDelaySamples) const;
     std::pair<float, float>     getMeanAndStd(const std::vector<float> &x) const;
-    
-    
+
+
     double                                          fs;
-    
-    std::vector<float>                              inputBuffer;
-    size_t                                          inputBlockStart;
-    size_t                                          inputSampleAddIndex;
-    std::vector<float>                              outputBuffer;
-    size_t                                          outputSamplesStart;
-    size_t                                          outputSamplesEnd;
-    size_t                                          numOutputSamplesAvailable;
-    size_t                                          numSamplesAdded;
-    size_t                                          hopSize;
-    
-    std::vector<float>                              reverbBuffer;
-    size_t                                          reverbBufferStartIndex;
-    size_t                                          reverbBufferAddIndex;
-    
-    std::vector<float>                              window;
-    
-    std::vector<float>                              shadowOLABuffer;
-    std::vector<std::complex<float>>                activeHRTF;
-    std::vector<std::complex<float>>                auxHRTFBuffer;
-    std::vector<std::complex<float>>                xBuffer;
-    std::vector<float>                              olaBuffer;
+    PartitionScheme                                 partitionScheme;
+    size_t                                          numEars;
+    size_t                                          numSources;
+
+    //  One output buffer per ear, they are all filled and read together so they share their indices
+    size_t                                          inputPosition;
+    std::vector<std::vector<float>>                 outputBuffer;
     size_t                                          outputSampleStart;
     size_t                                          outputSampleEnd;
-    std::vector<std::complex<float>>                auxBuffer;
-    size_t                                          audioBlockSize;
-
-    bool                                            hrirChanged;
-    size_t                                          olaWriteIndex;
-    size_t                                          zeroPaddedBufferSize;
-    std::vector<float>                              fadeInEnvelope;
-    std::vector<float>                              fadeOutEnvelope;
-    
-    std::unique_ptr<juce::dsp::FFT>                 fftEngine;
-    
-    juce::Reverb                                    reverb;
-    
-    juce::SpinLock                                  hrirChangingLock;
-    juce::SpinLock                                  shadowOLACopyingLock;
-    
+    size_t                                          numOutputSamplesAvailable;
+    size_t                                          hopSize;
+    size_t                                          controlRate;
+    std::atomic<size_t>                             hrtfRampLength;
+
+    std::atomic<bool>                               visualizationTapEnabled;
+    std::unique_ptr<juce::AbstractFifo>             visualizationTapFifo;
+    std::vector<float>                              visualizationTapBuffer;
+
+    std::vector<std::unique_ptr<ConvolutionSegment>>    segments;
+    size_t                                          hrirPartitionedSize;
+
+    //  Direct form head of the HRIR used by the nonUniform scheme
+    //  Frames, incoming taps and crossfades are kept per source, the active taps are indexed like the active segment HRTFs
+    //  A ramp crossfades from the active taps to the next taps every hop, the next taps step from the taps the ramp started at to the incoming ones
+    size_t                                          headLength;
+    std::vector<std::vector<float>>                 headFrames;
+    std::vector<std::vector<float>>                 headTaps;
+    std::vector<TripleBuffer<std::vector<std::vector<float>>>>  incomingHeadTaps;
+    std::vector<float>                              headScratch;
+    std::vector<float>                              headFadeInEnvelope;
+    std::vector<float>                              headFadeOutEnvelope;
+    std::vector<bool>                               headCrossfading;
+    std::vector<std::vector<float>>                 headRampStartTaps;
+    std::vector<std::vector<float>>                 headNextTaps;
+    std::vector<size_t>                             headRampStep;
+    std::vector<size_t>                             headRampSteps;
+
+    std::atomic<CrossfadeMode>                      crossfadeMode;
+
+    //  Minimum-phase mode.  A new delay is ramped to over hopSize samples
+    size_t                                          minimumPhaseLength;
+    std::vector<float>                              earDelays;
+    std::vector<float>                              earDelayIncrements;
+    std::vector<size_t>                             earDelayRampRemaining;
+    TripleBuffer<std::vector<float>>                incomingEarDelays;
+    std::vector<std::vector<float>>                 earDelayLines;
+    size_t                                          earDelayLineIndex;
+
+    std::unique_ptr<SegmentWorker>                  segmentWorker;
+
+    //  The segments due at a block boundary that are calculated on the audio thread, shared with the render pool if there is one
+    RenderPool                                      *renderPool;
+    std::vector<ConvolutionSegment*>                dueSegments;
+
+
     bool                                            hrirLoaded;
 };
 
@@ -88,11 +373,14 @@ class HRTFProcessorTest : public juce::UnitTest
 {
 public:
     HRTFProcessorTest() : UnitTest("HRTFProcessorUnitTest", "HRTFProcessor") {};
-    
+
     void runTest() override;
-    
+
 private:
     bool createTestSignal(float fs, float f0, std::vector<float> &dest);
+    void readDryOutput(HRTFProcessor &processor, std::vector<float> &dest);
+    std::vector<float> convolve(const std::vector<float> &x, const std::vector<double> &h);
+    float processInChunks(HRTFProcessor &processor, const std::vector<float> &x, const std::vector<double> &h, bool expectNoLatency);
 };
 
 static HRTFProcessorTest hrtfProcessorUnitTest;
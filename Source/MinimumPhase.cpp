@@ -0,0 +1,251 @@
+#include "MinimumPhase.h"
+
+
+MinimumPhase::MinimumPhase(size_t maxHRIRSize)
+{
+    //  Four times the HRIR length keeps the aliasing of the cepstrum well below the truncation thresholds
+    int order = 1;
+    while (((size_t)1 << order) < 4 * maxHRIRSize)
+        ++order;
+
+    fftSize = (size_t)1 << order;
+    fftEngine.reset(new juce::dsp::FFT(order));
+
+    spectrum = std::vector<float>(2 * fftSize);
+    buffer = std::vector<float>(2 * fftSize);
+}
+
+
+/*
+ *  Split an HRIR into its minimum-phase filter and the delay of the HRIR relative to that filter
+ *  Returns false if the HRIR is silent or longer than the HRIRs this instance was made for
+ */
+bool MinimumPhase::split(const double *hrir, size_t hrirSize, std::vector<float> &minimumPhase, float &delay)
+{
+    if (hrir == nullptr || hrirSize == 0 || 4 * hrirSize > fftSize)
+        return false;
+
+    auto numBins = (fftSize / 2) + 1;
+
+    std::fill(spectrum.begin(), spectrum.end(), 0.0);
+    for (auto i = 0; i < hrirSize; ++i)
+        spectrum[i] = (float)hrir[i];
+
+    fftEngine->performRealOnlyForwardTransform(spectrum.data(), true);
+
+    float peak = 0;
+    for (auto k = 0; k < numBins; ++k)
+        peak = juce::jmax(peak, std::hypot(spectrum[2 * k], spectrum[(2 * k) + 1]));
+
+    if (peak <= 0)
+        return false;
+
+    //  Bins far below the peak would send the log towards minus infinity, so they are kept 200 dB down
+    auto magnitudeFloor = peak * 1e-10f;
+
+    std::fill(buffer.begin(), buffer.end(), 0.0);
+    for (auto k = 0; k < numBins; ++k)
+        buffer[2 * k] = std::log(juce::jmax(std::hypot(spectrum[2 * k], spectrum[(2 * k) + 1]), magnitudeFloor));
+
+    //  Real cepstrum, folded so that only the causal part is left
+    fftEngine->performRealOnlyInverseTransform(buffer.data());
+
+    for (auto n = 1; n < fftSize / 2; ++n)
+        buffer[n] *= 2;
+
+    std::fill(buffer.begin() + (fftSize / 2) + 1, buffer.end(), 0.0);
+
+    fftEngine->performRealOnlyForwardTransform(buffer.data(), true);
+
+    for (auto k = 0; k < numBins; ++k)
+    {
+        auto magnitude = std::exp(buffer[2 * k]);
+        auto phase = buffer[(2 * k) + 1];
+
+        buffer[2 * k] = magnitude * std::cos(phase);
+        buffer[(2 * k) + 1] = magnitude * std::sin(phase);
+    }
+
+    //  Cross spectrum of the HRIR and its minimum-phase filter, its peak is at the delay between them
+    for (auto k = 0; k < numBins; ++k)
+    {
+        auto xRe = spectrum[2 * k];
+        auto xIm = spectrum[(2 * k) + 1];
+        auto yRe = buffer[2 * k];
+        auto yIm = buffer[(2 * k) + 1];
+
+        spectrum[2 * k] = (xRe * yRe) + (xIm * yIm);
+        spectrum[(2 * k) + 1] = (xIm * yRe) - (xRe * yIm);
+    }
+
+    fftEngine->performRealOnlyInverseTransform(buffer.data());
+    fftEngine->performRealOnlyInverseTransform(spectrum.data());
+
+    minimumPhase.assign(buffer.begin(), buffer.begin() + hrirSize);
+
+    size_t peakLag = 0;
+    for (auto n = 1; n < hrirSize; ++n)
+    {
+        if (spectrum[n] > spectrum[peakLag])
+            peakLag = n;
+    }
+
+    //  Fit a parabola through the peak and its neighbours for the fraction of a sample
+    auto before = spectrum[(peakLag + fftSize - 1) % fftSize];
+    auto at = spectrum[peakLag];
+    auto after = spectrum[peakLag + 1];
+    auto curvature = before - (2 * at) + after;
+
+    float fraction = 0;
+    if (curvature < 0)
+        fraction = juce::jlimit(-0.5f, 0.5f, 0.5f * (before - after) / curvature);
+
+    delay = juce::jmax(0.0f, peakLag + fraction);
+
+    return true;
+}
+
+
+size_t MinimumPhase::getSignificantLength(const float *filter, size_t filterSize, float thresholdDb)
+{
+    double energy = 0;
+    for (auto i = 0; i < filterSize; ++i)
+        energy += filter[i] * filter[i];
+
+    auto allowedTailEnergy = energy * std::pow(10.0, -thresholdDb / 10.0);
+
+    double tailEnergy = 0;
+    for (auto length = filterSize; length > 0; --length)
+    {
+        tailEnergy += filter[length - 1] * filter[length - 1];
+        if (tailEnergy > allowedTailEnergy)
+            return length;
+    }
+
+    return 0;
+}
+
+
+void MinimumPhase::truncate(std::vector<float> &filter, size_t length)
+{
+    if (length >= filter.size())
+        return;
+
+    auto fadeLength = juce::jmin(TRUNCATION_FADE_LENGTH, length / 4);
+
+    //  Half a Hann window that reaches zero just after the last tap
+    for (auto i = 0; i < fadeLength; ++i)
+        filter[length - fadeLength + i] *= 0.5f * (1.0f + std::cos(juce::MathConstants<float>::pi * (i + 1) / (fadeLength + 1)));
+
+    filter.resize(length);
+}
+
+
+
+#ifdef JUCE_UNIT_TESTS
+void MinimumPhaseTest::runTest()
+{
+    size_t hrirSize = 256;
+
+    //  A decaying resonance is minimum phase, its zero is inside the unit circle
+    std::vector<double> filter(hrirSize, 0.0);
+    for (auto i = 0; i < 128; ++i)
+        filter[i] = std::pow(0.9, i) * std::cos(0.3 * i);
+
+    MinimumPhase minimumPhase(hrirSize);
+    std::vector<float> result;
+    float delay;
+
+
+    beginTest("Split");
+
+    //  A delayed minimum-phase filter splits back into the filter and the delay
+    std::vector<double> delayed(hrirSize, 0.0);
+    std::copy(filter.begin(), filter.begin() + 200, delayed.begin() + 20);
+
+    expect(minimumPhase.split(delayed.data(), hrirSize, result, delay));
+    expectEquals<size_t>(result.size(), hrirSize);
+    expectWithinAbsoluteError<float>(delay, 20.0f, 0.05f);
+
+    float maxError = 0;
+    for (auto i = 0; i < hrirSize; ++i)
+        maxError = juce::jmax(maxError, std::abs(result[i] - (float)filter[i]));
+
+    expectWithinAbsoluteError<float>(maxError, 0.0f, 1e-3f);
+
+    //  A filter with a zero outside the unit circle keeps its magnitude response and moves its energy to the front
+    std::vector<double> mixedPhase(hrirSize, 0.0);
+    for (auto i = 0; i + 1 < hrirSize; ++i)
+        mixedPhase[i + 1] = (0.3 * filter[i + 1]) + filter[i];
+
+    expect(minimumPhase.split(mixedPhase.data(), hrirSize, result, delay));
+
+    auto magnitudes = [](const std::vector<float> &x)
+    {
+        juce::dsp::FFT fft(10);
+        std::vector<float> transform(2048, 0.0);
+        std::copy(x.begin(), x.end(), transform.begin());
+        fft.performRealOnlyForwardTransform(transform.data(), true);
+
+        std::vector<float> result(513);
+        for (auto k = 0; k < result.size(); ++k)
+            result[k] = std::hypot(transform[2 * k], transform[(2 * k) + 1]);
+
+        return result;
+    };
+
+    auto original = magnitudes(std::vector<float>(mixedPhase.begin(), mixedPhase.end()));
+    auto converted = magnitudes(result);
+
+    maxError = 0;
+    for (auto k = 0; k < original.size(); ++k)
+        maxError = juce::jmax(maxError, std::abs(original[k] - converted[k]));
+
+    expectWithinAbsoluteError<float>(maxError, 0.0f, 1e-2f);
+
+    float originalHead = 0, convertedHead = 0;
+    for (auto i = 0; i < 4; ++i)
+    {
+        originalHead += (float)(mixedPhase[i] * mixedPhase[i]);
+        convertedHead += result[i] * result[i];
+    }
+
+    expectGreaterThan(convertedHead, originalHead);
+
+    std::vector<double> silence(hrirSize, 0.0);
+    expect(!minimumPhase.split(silence.data(), hrirSize, result, delay));
+    expect(!minimumPhase.split(delayed.data(), 2 * hrirSize, result, delay));
+
+    //===================================================================================================//
+
+
+    beginTest("Truncation");
+
+    std::vector<float> decaying(64);
+    for (auto i = 0; i < decaying.size(); ++i)
+        decaying[i] = std::pow(0.5f, (float)i);
+
+    auto length = MinimumPhase::getSignificantLength(decaying.data(), decaying.size(), 60);
+
+    double energy = 0, tail = 0, longerTail = 0;
+    for (auto i = 0; i < decaying.size(); ++i)
+    {
+        energy += decaying[i] * decaying[i];
+        tail += (i >= length) ? decaying[i] * decaying[i] : 0;
+        longerTail += (i >= length - 1) ? decaying[i] * decaying[i] : 0;
+    }
+
+    expectLessOrEqual(tail, energy * 1e-6);
+    expectGreaterThan(longerTail, energy * 1e-6);
+
+    std::vector<float> silentFilter(64, 0.0);
+    expectEquals<size_t>(MinimumPhase::getSignificantLength(silentFilter.data(), silentFilter.size(), 60), 0);
+
+    auto truncated = decaying;
+    MinimumPhase::truncate(truncated, length);
+    expectEquals<size_t>(truncated.size(), length);
+    expectEquals(truncated[0], decaying[0]);
+    expectLessThan(truncated[length - 1], decaying[length - 1]);
+}
+
+#endif
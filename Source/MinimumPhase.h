@@ -0,0 +1,65 @@
+#pragma once
+#include <JuceHeader.h>
+#include <vector>
+
+
+/*
+ *  Splits an HRIR into a minimum-phase filter and a delay
+ *
+ *  An HRIR is close to a minimum-phase filter delayed by the time the sound takes to reach the ear.  Keeping the two apart
+ *  means the filters of neighbouring measurements line up, so blending or crossfading them does not comb filter, and the delays
+ *  can be blended separately and applied with a fractional delay line.  A minimum-phase filter also packs its energy into its
+ *  first taps, so it can be truncated to far fewer taps than the measured HRIR.
+ *
+ *  The minimum-phase filter is found with the real cepstrum: the log magnitude spectrum is transformed back, folded onto the positive
+ *  quefrencies and exponentiated.  The delay is the lag at which the HRIR best matches its minimum-phase filter, to a fraction of a sample.
+ *
+ *  Each instance keeps its own FFT engine and buffers, so use one per thread.
+ */
+class MinimumPhase
+{
+#ifdef JUCE_UNIT_TESTS
+    friend class MinimumPhaseTest;
+#endif
+
+public:
+
+    //  The FFT is large enough for HRIRs of up to maxHRIRSize samples
+    MinimumPhase(size_t maxHRIRSize);
+
+    //  Writes the minimum-phase filter into minimumPhase, which gets the same size as the HRIR
+    bool            split(const double *hrir, size_t hrirSize, std::vector<float> &minimumPhase, float &delay);
+
+    //  Number of taps needed to keep all but thresholdDb of the energy of filter
+    static size_t   getSignificantLength(const float *filter, size_t filterSize, float thresholdDb);
+
+    //  Cut filter down to length taps, fading out the last taps so the cut does not add a step
+    static void     truncate(std::vector<float> &filter, size_t length);
+
+    //  Number of taps the truncation fade takes, shorter filters use a quarter of their length
+    static constexpr size_t     TRUNCATION_FADE_LENGTH = 16;
+
+
+private:
+
+    size_t                              fftSize;
+    std::unique_ptr<juce::dsp::FFT>     fftEngine;
+
+    //  Real-only transforms need 2 * fftSize floats of working space
+    std::vector<float>                  spectrum;
+    std::vector<float>                  buffer;
+};
+
+
+#ifdef JUCE_UNIT_TESTS
+class MinimumPhaseTest : public juce::UnitTest
+{
+public:
+    MinimumPhaseTest() : UnitTest("MinimumPhaseUnitTest", "HRTFProcessor") {};
+
+    void runTest() override;
+};
+
+static MinimumPhaseTest minimumPhaseUnitTest;
+
+#endif
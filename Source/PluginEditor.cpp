@@ -19,6 +19,9 @@ OrbiterAudioProcessorEditor::OrbiterAudioProcessorEditor (OrbiterAudioProcessor&
         reverbWetLevelSlider(reverbSliderSize, "Wet"),
         reverbDryLevelSlider(reverbSliderSize, "Dry"),
         reverbWidthSlider(reverbSliderSize, "Width"),
+        selectedSource(0),
+        sofaLoadProgress(0),
+        sofaLoadProgressBar(sofaLoadProgress),
         audioProcessor (p)
 
 {
@@ -55,6 +58,60 @@ OrbiterAudioProcessorEditor::OrbiterAudioProcessorEditor (OrbiterAudioProcessor&
     sofaFileButton.onClick = [this]{ openSofaButtonClicked(); };
     addAndMakeVisible(sofaFileButton);
     
+    //  Only shown while a SOFA file is loading
+    addChildComponent(sofaLoadProgressBar);
+    
+    interpolationButton.setButtonText("Interpolate");
+    addAndMakeVisible(interpolationButton);
+    
+    minimumPhaseButton.setButtonText("Minimum Phase");
+    addAndMakeVisible(minimumPhaseButton);
+    
+    //  The threshold the HRIRs are truncated at, in dB below their energy
+    truncationSlider.setSliderStyle(juce::Slider::SliderStyle::LinearHorizontal);
+    truncationSlider.setTextBoxStyle(juce::Slider::TextEntryBoxPosition::TextBoxRight, false, 50, 20);
+    truncationSlider.setTextValueSuffix(" dB");
+    addAndMakeVisible(truncationSlider);
+    
+    //  How many input channels are rendered, and which of them the position controls move
+    for (auto source = 1; source <= OrbiterAudioProcessor::MAX_SOURCES; ++source)
+    {
+        numSourcesBox.addItem(juce::String(source) + ((source == 1) ? " Source" : " Sources"), source);
+        sourceSelector.addItem("Source " + juce::String(source), source);
+    }
+    
+    addAndMakeVisible(numSourcesBox);
+    
+    sourceSelector.setSelectedId(1, juce::dontSendNotification);
+    sourceSelector.onChange = [this]{ selectSource(sourceSelector.getSelectedId() - 1); };
+    addAndMakeVisible(sourceSelector);
+    
+    //  Direct rendering gives every source its own HRTFs, the Ambisonic orders render any number of sources at the same cost
+    ambisonicOrderBox.addItem("Direct", 1);
+    for (auto order = 1; order <= Ambisonics::MAX_ORDER; ++order)
+        ambisonicOrderBox.addItem("Ambisonics " + juce::String(order), order + 1);
+    
+    addAndMakeVisible(ambisonicOrderBox);
+    
+    //  A measured room response replaces the Freeverb while the toggle is on
+    roomResponseButton.setButtonText("Open Room IR");
+    roomResponseButton.onClick = [this]{ openRoomResponseButtonClicked(); };
+    addAndMakeVisible(roomResponseButton);
+    
+    convolutionReverbButton.setButtonText("Convolution Reverb");
+    addAndMakeVisible(convolutionReverbButton);
+    
+    //  The algorithmic reverb used while no room response is in use
+    reverbTypeBox.addItem("Freeverb", 1);
+    reverbTypeBox.addItem("FDN", 2);
+    addAndMakeVisible(reverbTypeBox);
+    
+    //  How often moving sources get new HRTFs, whatever the block size of the host
+    for (auto choice = 0; choice < 3; ++choice)
+        controlRateBox.addItem("Every " + juce::String((int)HRTFProcessor::MIN_CONTROL_RATE << choice) + " Samples", choice + 1);
+    
+    addAndMakeVisible(controlRateBox);
+    
     hrtfThetaAttachment = std::make_unique<juce::AudioProcessorValueTreeState::SliderAttachment>(audioProcessor.valueTreeState, HRTF_THETA_ID, hrtfThetaSlider);
     
     hrtfPhiAttachment = std::make_unique<juce::AudioProcessorValueTreeState::SliderAttachment>(audioProcessor.valueTreeState, HRTF_PHI_ID, hrtfPhiSlider);
@@ -75,6 +132,15 @@ OrbiterAudioProcessorEditor::OrbiterAudioProcessorEditor (OrbiterAudioProcessor&
     
     reverbWidthAttachment = std::make_unique<juce::AudioProcessorValueTreeState::SliderAttachment>(audioProcessor.valueTreeState, HRTF_REVERB_WIDTH_ID, reverbWidthSlider.slider);
     
+    interpolationAttachment = std::make_unique<juce::AudioProcessorValueTreeState::ButtonAttachment>(audioProcessor.valueTreeState, HRTF_INTERPOLATION_ID, interpolationButton);
+    minimumPhaseAttachment = std::make_unique<juce::AudioProcessorValueTreeState::ButtonAttachment>(audioProcessor.valueTreeState, HRTF_MINIMUM_PHASE_ID, minimumPhaseButton);
+    truncationAttachment = std::make_unique<juce::AudioProcessorValueTreeState::SliderAttachment>(audioProcessor.valueTreeState, HRTF_TRUNCATION_ID, truncationSlider);
+    numSourcesAttachment = std::make_unique<juce::AudioProcessorValueTreeState::ComboBoxAttachment>(audioProcessor.valueTreeState, HRTF_NUM_SOURCES_ID, numSourcesBox);
+    ambisonicOrderAttachment = std::make_unique<juce::AudioProcessorValueTreeState::ComboBoxAttachment>(audioProcessor.valueTreeState, HRTF_AMBISONIC_ORDER_ID, ambisonicOrderBox);
+    convolutionReverbAttachment = std::make_unique<juce::AudioProcessorValueTreeState::ButtonAttachment>(audioProcessor.valueTreeState, HRTF_REVERB_CONVOLUTION_ID, convolutionReverbButton);
+    reverbTypeAttachment = std::make_unique<juce::AudioProcessorValueTreeState::ComboBoxAttachment>(audioProcessor.valueTreeState, HRTF_REVERB_TYPE_ID, reverbTypeBox);
+    controlRateAttachment = std::make_unique<juce::AudioProcessorValueTreeState::ComboBoxAttachment>(audioProcessor.valueTreeState, HRTF_CONTROL_RATE_ID, controlRateBox);
+    
     
     addAndMakeVisible(azimuthComp);
     
@@ -122,7 +188,12 @@ void OrbiterAudioProcessorEditor::paint (juce::Graphics& g)
     
     //  Draw SOFA load status text
     juce::String sofaStatus;
-    if (audioProcessor.sofaFileLoaded)
+    if (sofaLoadProgressBar.isVisible())
+    {
+        g.setColour(juce::Colours::orange);
+        sofaStatus = "Loading SOFA";
+    }
+    else if (audioProcessor.sofaFileLoaded)
     {
         g.setColour(juce::Colours::green);
         sofaStatus = "SOFA Loaded";
@@ -136,6 +207,20 @@ void OrbiterAudioProcessorEditor::paint (juce::Graphics& g)
     g.drawFittedText(sofaStatus, getLocalBounds().withTrimmedTop(sofaStatusYOffset).withTrimmedLeft(sofaStatusXOffset).withSize(sofaStatusWidth, sofaStatusHeight), juce::Justification::Flags::centred, 1);
     
     
+    //  Draw the filter sizes chosen for the SOFA file
+    OrbiterAudioProcessor::HRTFSizing sizing;
+    if (audioProcessor.getHRTFSizing(sizing))
+    {
+        auto sizingText = juce::String(sizing.filterLength) + " of " + juce::String(sizing.measuredLength) + " taps, FFT " + juce::String(sizing.largestFFTSize)
+                        + "\n" + juce::String(juce::roundToInt(100 * sizing.cpuSaving)) + "% less CPU than untruncated"
+                        + "\nUpdates every " + juce::String((int)sizing.controlRate) + " samples, +" + juce::String(juce::roundToInt(100 * sizing.controlRateCost)) + "% CPU";
+        
+        g.setColour(juce::Colours::white);
+        g.setFont(12.0f);
+        g.drawFittedText(sizingText, getLocalBounds().withTrimmedTop(hrtfSizingYOffset).withTrimmedLeft(hrtfSizingXOffset).withSize(hrtfSizingWidth, hrtfSizingHeight), juce::Justification::Flags::centredLeft, 3);
+    }
+    
+    
     
 }
 
@@ -153,12 +238,26 @@ void OrbiterAudioProcessorEditor::resized()
     hrtfPhiSlider.setBounds(getLocalBounds().withTrimmedTop(elevationSliderYOffset).withTrimmedLeft(elevationSliderXOffset).withSize(50, 200));
 
     sofaFileButton.setBounds(getLocalBounds().withTrimmedTop(sofaButtonYOffset).withTrimmedLeft(sofaButtonXOffset).withSize(sofaButtonWidth, sofaButtonHeight));
+    sofaLoadProgressBar.setBounds(getLocalBounds().withTrimmedTop(sofaProgressYOffset).withTrimmedLeft(sofaStatusXOffset).withSize(sofaStatusWidth, sofaProgressHeight));
+    interpolationButton.setBounds(getLocalBounds().withTrimmedTop(interpolationButtonYOffset).withTrimmedLeft(sofaStatusXOffset).withSize(sofaStatusWidth, interpolationButtonHeight));
+    minimumPhaseButton.setBounds(getLocalBounds().withTrimmedTop(minimumPhaseButtonYOffset).withTrimmedLeft(sofaStatusXOffset).withSize(sofaStatusWidth, minimumPhaseButtonHeight));
+    truncationSlider.setBounds(getLocalBounds().withTrimmedTop(truncationSliderYOffset).withTrimmedLeft(sofaStatusXOffset).withSize(sofaStatusWidth + 30, truncationSliderHeight));
+    
+    numSourcesBox.setBounds(getLocalBounds().withTrimmedTop(sourceBoxYOffset).withTrimmedLeft(sourceBoxXOffset).withSize(sourceBoxWidth, sourceBoxHeight));
+    sourceSelector.setBounds(getLocalBounds().withTrimmedTop(sourceBoxYOffset).withTrimmedLeft(sourceBoxXOffset + sourceBoxSeparation).withSize(sourceBoxWidth, sourceBoxHeight));
+    ambisonicOrderBox.setBounds(getLocalBounds().withTrimmedTop(sourceBoxYOffset).withTrimmedLeft(sourceBoxXOffset + (2 * sourceBoxSeparation)).withSize(sourceBoxWidth, sourceBoxHeight));
+    roomResponseButton.setBounds(getLocalBounds().withTrimmedTop(sourceBoxYOffset).withTrimmedLeft(sourceBoxXOffset + (3 * sourceBoxSeparation)).withSize(sourceBoxWidth, sourceBoxHeight));
+    convolutionReverbButton.setBounds(getLocalBounds().withTrimmedTop(sourceBoxYOffset).withTrimmedLeft(sourceBoxXOffset + (4 * sourceBoxSeparation)).withSize(sourceBoxWidth + 30, sourceBoxHeight));
+    controlRateBox.setBounds(getLocalBounds().withTrimmedTop(sourceBoxYOffset).withTrimmedLeft(controlRateBoxXOffset).withSize(sourceBoxWidth + 20, sourceBoxHeight));
     
     reverbRoomSizeSlider.setCentrePosition(reverbSliderXOffset, reverbSliderYOffset);
     reverbDampingSlider.setCentrePosition(reverbSliderXOffset + reverbSliderSeparation, reverbSliderYOffset);
     reverbWetLevelSlider.setCentrePosition(reverbSliderXOffset, reverbSliderYOffset + reverbSliderSeparation);
     reverbDryLevelSlider.setCentrePosition(reverbSliderXOffset + reverbSliderSeparation, reverbSliderYOffset + reverbSliderSeparation);
     reverbWidthSlider.setCentrePosition(reverbSliderXOffset + (reverbSliderSeparation / 2), reverbSliderYOffset + (2 * reverbSliderSeparation));
+    
+    float reverbTypeBoxXOffset = reverbSliderXOffset - (reverbSliderSize / 2) - ((reverbSliderEnclosingBoxWidth - (reverbSliderSeparation + reverbSliderSize)) / 2);
+    reverbTypeBox.setBounds(getLocalBounds().withTrimmedTop(reverbTypeBoxYOffset).withTrimmedLeft(reverbTypeBoxXOffset).withSize(reverbSliderEnclosingBoxWidth, reverbTypeBoxHeight));
 }
 
 
@@ -178,19 +277,41 @@ void OrbiterAudioProcessorEditor::openSofaButtonClicked()
 
 void OrbiterAudioProcessorEditor::notifyNewSOFA(juce::String filePath)
 {
-    audioProcessor.newSofaFilePath.swapWith(filePath);
-    audioProcessor.newSofaFileWaiting = true;
+    audioProcessor.loadSofaFile(filePath);
+}
+
+
+void OrbiterAudioProcessorEditor::openRoomResponseButtonClicked()
+{
+    juce::FileChooser fileChooser("Select Room Impulse Response", {}, "*.wav;*.aif;*.aiff;*.flac");
+    
+    if (fileChooser.browseForFileToOpen())
+        audioProcessor.loadRoomResponse(fileChooser.getResult().getFullPathName());
 }
 
 
 void OrbiterAudioProcessorEditor::timerCallback()
 {
+    auto progress = audioProcessor.getSofaLoadProgress();
+    auto loading = progress >= 0;
+    
+    if (loading)
+        sofaLoadProgress = progress;
+    
+    if (loading != sofaLoadProgressBar.isVisible())
+    {
+        sofaLoadProgressBar.setVisible(loading);
+        repaint();
+    }
+    
     if (audioProcessor.sofaFileLoaded)
         repaint();
     
     auto sourceAngleAndRadius = azimuthComp.getNormalisedAngleAndRadius();
-    auto paramAngle = audioProcessor.valueTreeState.getRawParameterValue(HRTF_THETA_ID);
-    auto paramRadius = audioProcessor.valueTreeState.getRawParameterValue(HRTF_RADIUS_ID);
+    auto thetaID = OrbiterAudioProcessor::getSourceParameterID(HRTF_THETA_ID, selectedSource);
+    auto radiusID = OrbiterAudioProcessor::getSourceParameterID(HRTF_RADIUS_ID, selectedSource);
+    auto paramAngle = audioProcessor.valueTreeState.getRawParameterValue(thetaID);
+    auto paramRadius = audioProcessor.valueTreeState.getRawParameterValue(radiusID);
     
     auto paramAngleValue = floorValue(*paramAngle, 0.00001);
     auto paramRadiusValue = floorValue(*paramRadius, 0.00001);
@@ -208,8 +329,8 @@ void OrbiterAudioProcessorEditor::timerCallback()
     else if (uiAngleValue != prevAzimuthAngle || uiRadiusValue != prevAzimuthRadius)
     {
 
-        audioProcessor.valueTreeState.getParameter(HRTF_THETA_ID)->setValueNotifyingHost(uiAngleValue);
-        audioProcessor.valueTreeState.getParameter(HRTF_RADIUS_ID)->setValueNotifyingHost(uiRadiusValue);
+        audioProcessor.valueTreeState.getParameter(thetaID)->setValueNotifyingHost(uiAngleValue);
+        audioProcessor.valueTreeState.getParameter(radiusID)->setValueNotifyingHost(uiRadiusValue);
 
         prevAzimuthRadius = uiRadiusValue;
         prevAzimuthAngle = uiAngleValue;
@@ -221,6 +342,29 @@ void OrbiterAudioProcessorEditor::timerCallback()
 }
 
 
+void OrbiterAudioProcessorEditor::selectSource(int source)
+{
+    if (source < 0 || source >= OrbiterAudioProcessor::MAX_SOURCES || source == selectedSource)
+        return;
+    
+    selectedSource = source;
+    
+    //  Attachments cannot be moved to another parameter, so they are replaced.  The old ones are let go first
+    //  so they stop writing to the previous source while the new ones set the sliders
+    hrtfThetaAttachment.reset();
+    hrtfPhiAttachment.reset();
+    hrtfRadiusAttachment.reset();
+    
+    hrtfThetaAttachment = std::make_unique<juce::AudioProcessorValueTreeState::SliderAttachment>(audioProcessor.valueTreeState, OrbiterAudioProcessor::getSourceParameterID(HRTF_THETA_ID, source), hrtfThetaSlider);
+    hrtfPhiAttachment = std::make_unique<juce::AudioProcessorValueTreeState::SliderAttachment>(audioProcessor.valueTreeState, OrbiterAudioProcessor::getSourceParameterID(HRTF_PHI_ID, source), hrtfPhiSlider);
+    hrtfRadiusAttachment = std::make_unique<juce::AudioProcessorValueTreeState::SliderAttachment>(audioProcessor.valueTreeState, OrbiterAudioProcessor::getSourceParameterID(HRTF_RADIUS_ID, source), hrtfRadiusSlider);
+    
+    //  Forces the azimuth view to jump to the new source on the next timer callback
+    prevParamAngle = -1;
+    prevParamRadius = -1;
+}
+
+
 float OrbiterAudioProcessorEditor::floorValue(float value, float epsilon)
 {
     int valueTruncated = value / epsilon;
@@ -28,6 +28,7 @@ public:
     
     void openSofaButtonClicked();
     void notifyNewSOFA(juce::String filePath);
+    void openRoomResponseButtonClicked();
     
     
     AzimuthUIComponent azimuthComp;
@@ -75,6 +76,9 @@ private:
     void timerCallback() override;
     float floorValue(float value, float epsilon);
     
+    //  Point the position controls at the parameters of another source
+    void selectSource(int source);
+    
     juce::Slider hrtfThetaSlider;
     juce::Slider hrtfPhiSlider;
     juce::Slider hrtfRadiusSlider;
@@ -87,6 +91,21 @@ private:
     OrbiterSliderComponent reverbWidthSlider;
     
     juce::TextButton sofaFileButton;
+    juce::ToggleButton interpolationButton;
+    juce::ToggleButton minimumPhaseButton;
+    juce::Slider truncationSlider;
+    juce::ComboBox numSourcesBox;
+    juce::ComboBox sourceSelector;
+    juce::ComboBox ambisonicOrderBox;
+    juce::TextButton roomResponseButton;
+    juce::ToggleButton convolutionReverbButton;
+    juce::ComboBox reverbTypeBox;
+    juce::ComboBox controlRateBox;
+    
+    int selectedSource;
+    
+    double sofaLoadProgress;
+    juce::ProgressBar sofaLoadProgressBar;
     
     std::unique_ptr<juce::AudioProcessorValueTreeState::SliderAttachment> hrtfThetaAttachment;
     std::unique_ptr<juce::AudioProcessorValueTreeState::SliderAttachment> hrtfPhiAttachment;
@@ -98,6 +117,14 @@ private:
     std::unique_ptr<juce::AudioProcessorValueTreeState::SliderAttachment> reverbWetLevelAttachment;
     std::unique_ptr<juce::AudioProcessorValueTreeState::SliderAttachment> reverbDryLevelAttachment;
     std::unique_ptr<juce::AudioProcessorValueTreeState::SliderAttachment> reverbWidthAttachment;
+    std::unique_ptr<juce::AudioProcessorValueTreeState::ButtonAttachment> interpolationAttachment;
+    std::unique_ptr<juce::AudioProcessorValueTreeState::ButtonAttachment> minimumPhaseAttachment;
+    std::unique_ptr<juce::AudioProcessorValueTreeState::SliderAttachment> truncationAttachment;
+    std::unique_ptr<juce::AudioProcessorValueTreeState::ComboBoxAttachment> numSourcesAttachment;
+    std::unique_ptr<juce::AudioProcessorValueTreeState::ComboBoxAttachment> ambisonicOrderAttachment;
+    std::unique_ptr<juce::AudioProcessorValueTreeState::ButtonAttachment> convolutionReverbAttachment;
+    std::unique_ptr<juce::AudioProcessorValueTreeState::ComboBoxAttachment> reverbTypeAttachment;
+    std::unique_ptr<juce::AudioProcessorValueTreeState::ComboBoxAttachment> controlRateAttachment;
     
     float prevAzimuthAngle;
     float prevAzimuthRadius;
@@ -136,6 +163,9 @@ private:
     float reverbSliderEnclosingBoxHeight = 240;
     float reverbSliderEnclosingBoxYOffset = 80;
     
+    float reverbTypeBoxYOffset = 325;
+    float reverbTypeBoxHeight = 20;
+    
     //  Sofa Button Characteristics
     float sofaButtonXOffset = 765;
     float sofaButtonYOffset = 80;
@@ -145,6 +175,28 @@ private:
     float sofaStatusYOffset = 150;
     float sofaStatusWidth = 100;
     float sofaStatusHeight = 80;
+    float sofaProgressYOffset = 240;
+    float sofaProgressHeight = 20;
+    float interpolationButtonYOffset = 270;
+    float interpolationButtonHeight = 20;
+    float minimumPhaseButtonYOffset = 295;
+    float minimumPhaseButtonHeight = 20;
+    float truncationSliderYOffset = 320;
+    float truncationSliderHeight = 20;
+    
+    //  Source Selection Characteristics
+    float sourceBoxXOffset = 15;
+    float sourceBoxYOffset = 3;
+    float sourceBoxWidth = 120;
+    float sourceBoxHeight = 20;
+    float sourceBoxSeparation = 130;
+    float controlRateBoxXOffset = 695;
+    
+    //  HRTF Sizing Report Characteristics
+    float hrtfSizingXOffset = 330;
+    float hrtfSizingYOffset = 290;
+    float hrtfSizingWidth = 200;
+    float hrtfSizingHeight = 55;
 
     
     OrbiterAudioProcessor& audioProcessor;
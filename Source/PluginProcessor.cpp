@@ -25,30 +25,71 @@ valueTreeState(*this, nullptr, "PARAMETERS", createParameters())
 #endif
 {
     sofaFileLoaded = false;
-    newSofaFileWaiting = false;
-    newSofaFilePath = "";
     currentSOFA = nullptr;
     
-    prevTheta = -1;
-    prevPhi = -1;
-    prevRadius = -1;
+    currentRoom = nullptr;
+    roomRequested.store(false);
+    roomSampleRate = 0.0;
+    prevRoomWetLevel = 0.0f;
+    
+    for (auto source = 0; source < MAX_SOURCES; ++source)
+    {
+        prevTheta[source] = -1;
+        prevPhi[source] = -1;
+        prevRadius[source] = -1;
+        prevMeasurement[source] = 0;
+    }
+    
+    prevInterpolation = false;
+    prevSofa = nullptr;
+    positionsToRetry = 0;
+    preparationReloadedSofa = nullptr;
     hrtfParamChangeLoop = true;
     
     audioBlockSize = 0;
     
-    valueTreeState.addParameterListener(HRTF_REVERB_ROOM_SIZE_ID, this);
-    valueTreeState.addParameterListener(HRTF_REVERB_DAMPING_ID, this);
-    valueTreeState.addParameterListener(HRTF_REVERB_WET_LEVEL_ID, this);
-    valueTreeState.addParameterListener(HRTF_REVERB_DRY_LEVEL_ID, this);
-    valueTreeState.addParameterListener(HRTF_REVERB_WIDTH_ID, this);
-    reverbParamsChanged.store(false);
+    //  Every parameter the watcher acts on posts an event, so the watcher only wakes up when there is something to do
+    //  The IDs are built once here, parameterChanged() only looks them up
+    for (auto source = 0; source < MAX_SOURCES; ++source)
+    {
+        addControlEventParameter(getSourceParameterID(HRTF_THETA_ID, source), positionChanged << source);
+        addControlEventParameter(getSourceParameterID(HRTF_PHI_ID, source), positionChanged << source);
+        addControlEventParameter(getSourceParameterID(HRTF_RADIUS_ID, source), positionChanged << source);
+    }
+    
+    addControlEventParameter(HRTF_INTERPOLATION_ID, ALL_POSITIONS_CHANGED);
+    addControlEventParameter(HRTF_NUM_SOURCES_ID, preparationChanged);
+    addControlEventParameter(HRTF_AMBISONIC_ORDER_ID, preparationChanged);
+    addControlEventParameter(HRTF_MINIMUM_PHASE_ID, preparationChanged);
+    addControlEventParameter(HRTF_TRUNCATION_ID, preparationChanged);
+    addControlEventParameter(HRTF_CONTROL_RATE_ID, preparationChanged);
+    addControlEventParameter(HRTF_REVERB_ROOM_SIZE_ID, reverbChanged);
+    addControlEventParameter(HRTF_REVERB_DAMPING_ID, reverbChanged);
+    addControlEventParameter(HRTF_REVERB_WET_LEVEL_ID, reverbChanged);
+    addControlEventParameter(HRTF_REVERB_DRY_LEVEL_ID, reverbChanged);
+    addControlEventParameter(HRTF_REVERB_WIDTH_ID, reverbChanged);
+    
+    reverbParamsBuffer.setup(juce::Reverb::Parameters());
+    pendingControlEvents.store(reverbChanged);
+    visualizationTapEnabled.store(false);
+    
+    sofaLoader.reset(new SofaLoader(*this));
+    sofaLoader->startThread();
+    
+    roomLoader.reset(new RoomLoader(*this));
+    roomLoader->startThread();
     
     startThread();
 }
 
 OrbiterAudioProcessor::~OrbiterAudioProcessor()
 {
+    sofaLoader->stopThread(4000);
+    roomLoader->stopThread(4000);
+    
     hrtfParamChangeLoop = false;
+    signalThreadShouldExit();
+    controlEventSignal.signal();
     stopThread(4000);
 }
 
@@ -85,9 +126,44 @@ bool OrbiterAudioProcessor::isMidiEffect() const
 #endif
 }
 
+/*
+ *  The output rings on for the length of the HRIRs after the input stops, plus the room response or the decay time of the reverb
+ *  A Freeverb comb loses 20 * log10(feedback) dB every time round, so it takes 60 dB / that many trips through the longest comb to decay
+ */
 double OrbiterAudioProcessor::getTailLengthSeconds() const
 {
-    return 0.0;
+    auto sampleRate = getSampleRate();
+    double hrirTail = 0.0;
+    
+    //  Minimum-phase filters are shorter, but each ear is delayed after them by up to the length of its delay line
+    ReferenceCountedSOFA::Ptr retainedSofa(currentSOFA);
+    if (retainedSofa != nullptr && sampleRate > 0.0)
+    {
+        if (retainedSofa->minimumPhase)
+            hrirTail = ((double)retainedSofa->minimumPhaseLength + HRTFProcessor::MAX_EAR_DELAY) / sampleRate;
+        else
+            hrirTail = (double)retainedSofa->hrirSize / sampleRate;
+    }
+    
+    ReferenceCountedRoom::Ptr retainedRoom(currentRoom);
+    float roomSize = *valueTreeState.getRawParameterValue(HRTF_REVERB_ROOM_SIZE_ID);
+    double reverbTail;
+    
+    if (retainedRoom != nullptr && *valueTreeState.getRawParameterValue(HRTF_REVERB_CONVOLUTION_ID) >= 0.5f)
+    {
+        reverbTail = retainedRoom->lengthSeconds;
+    }
+    else if (*valueTreeState.getRawParameterValue(HRTF_REVERB_TYPE_ID) >= 0.5f)
+    {
+        reverbTail = FDNReverb::getDecayTime(roomSize);
+    }
+    else
+    {
+        auto feedback = FREEVERB_FEEDBACK_OFFSET + (FREEVERB_FEEDBACK_SCALE * juce::jlimit(0.0f, 1.0f, roomSize));
+        reverbTail = FREEVERB_LONGEST_COMB_SECONDS * 60.0 / (-20.0 * std::log10(feedback));
+    }
+    
+    return hrirTail + reverbTail;
 }
 
 int OrbiterAudioProcessor::getNumPrograms()
@@ -118,11 +194,29 @@ void OrbiterAudioProcessor::changeProgramName (int index, const juce::String& ne
 void OrbiterAudioProcessor::prepareToPlay (double sampleRate, int samplesPerBlock)
 {
     audioBlockSize = samplesPerBlock;
+    
+    //  The engines output every sample as soon as it is added, so feeding them the host blocks in slices adds no latency
+    setLatencySamples(0);
+    
+    //  New HRTFs are blended in over a host block, see loadSofa()
+    ReferenceCountedSOFA::Ptr retainedSofa(currentSOFA);
+    if (retainedSofa != nullptr)
+        retainedSofa->hrtfProcessor.setHRTFRampLength((size_t)samplesPerBlock);
+    
     auto *inputGainParam = valueTreeState.getRawParameterValue(HRTF_INPUT_GAIN_ID);
     auto *outputGainParam = valueTreeState.getRawParameterValue(HRTF_OUTPUT_GAIN_ID);
     
     prevInputGain = *inputGainParam;
     prevOutputGain = *outputGainParam;
+    
+    reverb.setSampleRate(sampleRate);
+    reverb.reset();
+    fdnReverb.setSampleRate(sampleRate);
+    reverbBuffer.setSize(2, ENGINE_BLOCK_SIZE);
+    reverbBuffer.clear();
+    
+    //  The room response is resampled to the sampling rate
+    postControlEvents(roomChanged);
 }
 
 void OrbiterAudioProcessor::releaseResources()
@@ -138,15 +232,13 @@ bool OrbiterAudioProcessor::isBusesLayoutSupported (const BusesLayout& layouts)
     juce::ignoreUnused (layouts);
     return true;
 #else
-    // This is the place where you check if the layout is supported.
-    // In this template code we only support mono or stereo.
-    if (layouts.getMainOutputChannelSet() != juce::AudioChannelSet::mono()
-        && layouts.getMainOutputChannelSet() != juce::AudioChannelSet::stereo())
+    //  The output is always binaural, every input channel can be a source
+    if (layouts.getMainOutputChannelSet() != juce::AudioChannelSet::stereo())
         return false;
     
-    // This checks if the input layout matches the output layout
 #if ! JucePlugin_IsSynth
-    if (layouts.getMainOutputChannelSet() != layouts.getMainInputChannelSet())
+    auto numInputChannels = layouts.getMainInputChannelSet().size();
+    if (numInputChannels < 1 || numInputChannels > MAX_SOURCES)
         return false;
 #endif
     
@@ -164,47 +256,107 @@ void OrbiterAudioProcessor::processBlock (juce::AudioBuffer<float>& buffer, juce
     
     for (auto i = totalNumInputChannels; i < totalNumOutputChannels; ++i)
         buffer.clear (i, 0, buffer.getNumSamples());
-
     
+    //  Hosts can send blocks of any size, and change it from one block to the next, so the engines are fed slices of at most
+    //  ENGINE_BLOCK_SIZE samples.  A slice refers to the host's channels so nothing is copied or allocated
+    for (auto start = 0; start < buffer.getNumSamples(); start += ENGINE_BLOCK_SIZE)
+    {
+        juce::AudioBuffer<float> slice(buffer.getArrayOfWritePointers(), buffer.getNumChannels(), start, juce::jmin(ENGINE_BLOCK_SIZE, buffer.getNumSamples() - start));
+        renderBlock(slice);
+    }
+}
+
+
+//  Renders a slice of the host block in place, see processBlock()
+void OrbiterAudioProcessor::renderBlock(juce::AudioBuffer<float> &buffer)
+{
     if (sofaFileLoaded)
     {
         ReferenceCountedSOFA::Ptr retainedSofa(currentSOFA);
         
-        for (int channel = 0; channel < 1; ++channel)
+        auto *inputGainParam = valueTreeState.getRawParameterValue(HRTF_INPUT_GAIN_ID);
+        float inputGain = *inputGainParam;
+        
+        for (auto source = 0; source < juce::jmin(retainedSofa->numSources, buffer.getNumChannels()); ++source)
+            buffer.applyGainRamp(source, 0, buffer.getNumSamples(), prevInputGain, inputGain);
+        
+        prevInputGain = inputGain;
+        
+        //  The reverb only depends on the dry input, so one stereo reverb is run on the mix of every source before the engine writes over it
+        auto numReverbSamples = buffer.getNumSamples();
+        bool reverbReady = numReverbSamples <= reverbBuffer.getNumSamples();
+        
+        if (reverbReady)
         {
-            auto *channelData = buffer.getWritePointer (channel);
+            checkForHRTFReverbParamChanges();
             
-            auto *inputGainParam = valueTreeState.getRawParameterValue(HRTF_INPUT_GAIN_ID);
-            float inputGain = *inputGainParam;
+            auto numSources = juce::jmin(retainedSofa->numSources, buffer.getNumChannels());
             
-            buffer.applyGainRamp(0, 0, buffer.getNumSamples(), prevInputGain, inputGain);
-            prevInputGain = inputGain;
+            reverbBuffer.copyFrom(0, 0, buffer, 0, 0, numReverbSamples, 0.5f);
+            for (auto source = 1; source < numSources; ++source)
+                reverbBuffer.addFrom(0, 0, buffer, source, 0, numReverbSamples, 0.5f);
             
-            retainedSofa->leftHRTFProcessor.addSamples(channelData, buffer.getNumSamples());
-            retainedSofa->rightHRTFProcessor.addSamples(channelData, buffer.getNumSamples());
+            ReferenceCountedRoom::Ptr retainedRoom(currentRoom);
             
-            auto left = retainedSofa->leftHRTFProcessor.getOutput(buffer.getNumSamples());
-            auto right = retainedSofa->rightHRTFProcessor.getOutput(buffer.getNumSamples());
+            if (retainedRoom != nullptr && *valueTreeState.getRawParameterValue(HRTF_REVERB_CONVOLUTION_ID) >= 0.5f)
+            {
+                renderRoomResponse(*retainedRoom, numReverbSamples);
+            }
+            else
+            {
+                reverbBuffer.copyFrom(1, 0, reverbBuffer, 0, 0, numReverbSamples);
+                
+                if (*valueTreeState.getRawParameterValue(HRTF_REVERB_TYPE_ID) >= 0.5f)
+                    fdnReverb.processStereo(reverbBuffer.getWritePointer(0), reverbBuffer.getWritePointer(1), numReverbSamples);
+                else
+                    reverb.processStereo(reverbBuffer.getWritePointer(0), reverbBuffer.getWritePointer(1), numReverbSamples);
+            }
+        }
+        
+        bool rendered;
+        
+        if (retainedSofa->ambisonicEncoder != nullptr)
+        {
+            //  The bus is sized for the block size the file was loaded with, the processor checks the rest
+            auto numSamples = buffer.getNumSamples();
+            auto &bus = retainedSofa->ambisonicBus;
+            
+            rendered = (numSamples <= bus.getNumSamples()) && (buffer.getNumChannels() >= juce::jmax(2, retainedSofa->numSources));
             
-            if (left.size() != 0 || right.size() != 0)
+            if (rendered)
             {
-                auto *outLeft = buffer.getWritePointer(0);
-                auto *outRight = buffer.getWritePointer(1);
-
-                for (auto i = 0; i < buffer.getNumSamples(); ++i)
-                {
-                    outLeft[i] = left[i];
-                    outRight[i] = right[i];
-                }
+                retainedSofa->ambisonicEncoder->encode(buffer.getArrayOfReadPointers(), (size_t)numSamples, bus.getArrayOfWritePointers());
                 
-                auto *outputGainParam = valueTreeState.getRawParameterValue(HRTF_OUTPUT_GAIN_ID);
-                float outputGain = *outputGainParam;
+                rendered = retainedSofa->hrtfProcessor.addSamples(bus.getArrayOfReadPointers(), (size_t)numSamples)
+                        && retainedSofa->hrtfProcessor.getOutput(buffer.getWritePointer(0), buffer.getWritePointer(1), (size_t)numSamples);
                 
-                buffer.applyGainRamp(0, 0, buffer.getNumSamples(), prevOutputGain, outputGain);
-                buffer.applyGainRamp(1, 0, buffer.getNumSamples(), prevOutputGain, outputGain);
-                prevOutputGain = outputGain;
+                if (!rendered)
+                {
+                    buffer.clear(0, 0, numSamples);
+                    buffer.clear(1, 0, numSamples);
+                }
             }
-
+        }
+        else
+        {
+            //  Each source channel is rendered in place into both output channels without any allocation or extra copy
+            rendered = retainedSofa->hrtfProcessor.process(buffer);
+        }
+        
+        if (rendered)
+        {
+            if (reverbReady)
+            {
+                buffer.addFrom(0, 0, reverbBuffer, 0, 0, numReverbSamples);
+                buffer.addFrom(1, 0, reverbBuffer, 1, 0, numReverbSamples);
+            }
+            
+            auto *outputGainParam = valueTreeState.getRawParameterValue(HRTF_OUTPUT_GAIN_ID);
+            float outputGain = *outputGainParam;
+            
+            buffer.applyGainRamp(0, 0, buffer.getNumSamples(), prevOutputGain, outputGain);
+            buffer.applyGainRamp(1, 0, buffer.getNumSamples(), prevOutputGain, outputGain);
+            prevOutputGain = outputGain;
         }
     }
 }
@@ -240,9 +392,15 @@ juce::AudioProcessorValueTreeState::ParameterLayout OrbiterAudioProcessor::creat
     std::vector<std::unique_ptr<juce::RangedAudioParameter>> parameters;
     juce::NormalisableRange<float> parameterRange(0, 1, 0.0000001);
     
-    parameters.push_back(std::make_unique<juce::AudioParameterFloat>(HRTF_THETA_ID, "Theta", parameterRange, 0));
-    parameters.push_back(std::make_unique<juce::AudioParameterFloat>(HRTF_PHI_ID, "Phi", parameterRange, 0));
-    parameters.push_back(std::make_unique<juce::AudioParameterFloat>(HRTF_RADIUS_ID, "Radius", parameterRange, 0));
+    for (auto source = 0; source < MAX_SOURCES; ++source)
+    {
+        auto suffix = (source == 0) ? juce::String() : " " + juce::String(source + 1);
+        
+        parameters.push_back(std::make_unique<juce::AudioParameterFloat>(getSourceParameterID(HRTF_THETA_ID, source), "Theta" + suffix, parameterRange, 0));
+        parameters.push_back(std::make_unique<juce::AudioParameterFloat>(getSourceParameterID(HRTF_PHI_ID, source), "Phi" + suffix, parameterRange, 0));
+        parameters.push_back(std::make_unique<juce::AudioParameterFloat>(getSourceParameterID(HRTF_RADIUS_ID, source), "Radius" + suffix, parameterRange, 0));
+    }
+    
     parameters.push_back(std::make_unique<juce::AudioParameterFloat>(HRTF_INPUT_GAIN_ID, "Input Gain", parameterRange, 1));
     parameters.push_back(std::make_unique<juce::AudioParameterFloat>(HRTF_OUTPUT_GAIN_ID, "Output Gain", 0, 10, 1));
     parameters.push_back(std::make_unique<juce::AudioParameterFloat>(HRTF_REVERB_ROOM_SIZE_ID, "Room Size", 0, 1, 0.5));
@@ -250,179 +408,1111 @@ juce::AudioProcessorValueTreeState::ParameterLayout OrbiterAudioProcessor::creat
     parameters.push_back(std::make_unique<juce::AudioParameterFloat>(HRTF_REVERB_WET_LEVEL_ID, "Wet Level", 0, 1, 0.5));
     parameters.push_back(std::make_unique<juce::AudioParameterFloat>(HRTF_REVERB_DRY_LEVEL_ID, "Dry Level", 0, 1, 0.5));
     parameters.push_back(std::make_unique<juce::AudioParameterFloat>(HRTF_REVERB_WIDTH_ID, "Reverb Width", 0, 1, 0.5));
+    parameters.push_back(std::make_unique<juce::AudioParameterBool>(HRTF_REVERB_CONVOLUTION_ID, "Convolution Reverb", true));
+    parameters.push_back(std::make_unique<juce::AudioParameterChoice>(HRTF_REVERB_TYPE_ID, "Reverb Type", juce::StringArray("Freeverb", "FDN"), 0));
+    parameters.push_back(std::make_unique<juce::AudioParameterBool>(HRTF_INTERPOLATION_ID, "Interpolate HRTFs", false));
+    parameters.push_back(std::make_unique<juce::AudioParameterBool>(HRTF_MINIMUM_PHASE_ID, "Minimum Phase HRTFs", false));
+    parameters.push_back(std::make_unique<juce::AudioParameterFloat>(HRTF_TRUNCATION_ID, "Truncation Threshold", juce::NormalisableRange<float>(20, 120, 1), 60));
+    parameters.push_back(std::make_unique<juce::AudioParameterInt>(HRTF_NUM_SOURCES_ID, "Sources", 1, MAX_SOURCES, 1));
+    parameters.push_back(std::make_unique<juce::AudioParameterInt>(HRTF_AMBISONIC_ORDER_ID, "Ambisonic Order", 0, Ambisonics::MAX_ORDER, 0));
+    parameters.push_back(std::make_unique<juce::AudioParameterChoice>(HRTF_CONTROL_RATE_ID, "HRTF Control Rate", juce::StringArray("32", "64", "128"), 1));
     
     //parameters.push_back(std::make_unique<juce::AudioParameterBool>("ORBIT", "Enable Orbit", false));
     return {parameters.begin(), parameters.end()};
 }
 
 
+juce::String OrbiterAudioProcessor::getSourceParameterID(const juce::String &parameterID, int source)
+{
+    if (source == 0)
+        return parameterID;
+    
+    return parameterID + "_" + juce::String(source + 1);
+}
+
+
+/*
+ *  Handles the events posted since it last woke up, then sleeps until the next one
+ *  Positions are read from the parameters when they are handled, so a burst of changes to one source only moves it once.
+ *  Files that were replaced are freed once the audio thread lets go of them, so the watcher only wakes up on its own while there are any
+ *  or while a source is waiting for a swap that failed to be tried again
+ */
 void OrbiterAudioProcessor::run()
 {
-    while (hrtfParamChangeLoop)
+    while (hrtfParamChangeLoop && !threadShouldExit())
     {
-        checkForNewSofaToLoad();
-        checkForGUIParameterChanges();
-        checkForHRTFReverbParamChanges();
-        juce::Thread::wait(10);
+        auto events = pendingControlEvents.exchange(0) | positionsToRetry;
+        positionsToRetry = 0;
+        
+        if ((events & reverbChanged) != 0)
+            publishReverbParameters();
+        
+        if ((events & (sofaChanged | ALL_POSITIONS_CHANGED)) != 0)
+            checkForGUIParameterChanges();
+        
+        if ((events & (sofaChanged | preparationChanged)) != 0)
+            checkForPreparationChanges();
+        
+        if ((events & roomChanged) != 0)
+            checkForRoomResponseChanges();
+        
+        checkSofaInstancesToFree();
+        
+        bool instancesToFree = (sofaInstances.size() > 1) || (roomInstances.size() > 1);
+        
+        auto timeout = -1;
+        if (instancesToFree)
+            timeout = INSTANCE_RELEASE_INTERVAL_MS;
+        if (positionsToRetry != 0)
+            timeout = SWAP_RETRY_INTERVAL_MS;
+        
+        if (pendingControlEvents.load() == 0)
+            controlEventSignal.wait(timeout);
     }
 }
 
 
+/*
+ *  Safe to call from any thread, including the audio thread: neither setting the bits nor signalling the watcher takes a lock
+ *  Only the post that finds the mask empty signals, so a burst of events costs one wake-up and the semaphore count stays small
+ */
+void OrbiterAudioProcessor::postControlEvents(uint32_t events)
+{
+    if (pendingControlEvents.fetch_or(events) == 0)
+        controlEventSignal.signal();
+}
+
+
+void OrbiterAudioProcessor::addControlEventParameter(const juce::String &parameterID, uint32_t events)
+{
+    controlEventParameterIDs.add(parameterID);
+    controlEventBits.push_back(events);
+    valueTreeState.addParameterListener(parameterID, this);
+}
+
+
 void OrbiterAudioProcessor::checkForGUIParameterChanges()
 {
     ReferenceCountedSOFA::Ptr retainedSofa(currentSOFA);
     
     if (retainedSofa != nullptr)
     {
-        auto *theta = valueTreeState.getRawParameterValue(HRTF_THETA_ID);
-        auto *phi = valueTreeState.getRawParameterValue(HRTF_PHI_ID);
-        auto *radius = valueTreeState.getRawParameterValue(HRTF_RADIUS_ID);
-        
-        float t = *theta;
-        float p = *phi;
-        float r = *radius;
+        bool interpolate = *valueTreeState.getRawParameterValue(HRTF_INTERPOLATION_ID) >= 0.5f;
         
-        auto thetaMapped = mapAndQuantize(t, 0.f, 1.f, retainedSofa->sofa.getMinTheta(), retainedSofa->sofa.getMaxTheta(), retainedSofa->sofa.getDeltaTheta());
-        auto phiMapped = mapAndQuantize(p, 0.f, 1.f, retainedSofa->sofa.getMinPhi(), retainedSofa->sofa.getMaxPhi(), retainedSofa->sofa.getDeltaPhi());
-        auto radiusMapped = mapAndQuantize(r, 0.f, 1.f, retainedSofa->sofa.getMinRadius(), retainedSofa->sofa.getMaxRadius(), retainedSofa->sofa.getDeltaRadius());
-
+        //  A file that was just loaded starts at its default position so it is always moved to the current one
+        bool fileOrModeChanged = (retainedSofa != prevSofa) || (interpolate != prevInterpolation);
+        bool swapped = false;
+        bool swapFailed = false;
         
-        if ((thetaMapped != prevTheta) || (phiMapped != prevPhi) || (radiusMapped != prevRadius))
+        //  A source whose swap failed keeps its previous values, so the watcher tries it again
+        for (auto source = 0; source < retainedSofa->numSources; ++source)
         {
-            auto *hrirLeft = retainedSofa->sofa.getHRIR(0, (int)thetaMapped, (int)phiMapped, radiusMapped);
-            auto *hrirRight = retainedSofa->sofa.getHRIR(1, (int)thetaMapped, (int)phiMapped, radiusMapped);
+            float t = *valueTreeState.getRawParameterValue(getSourceParameterID(HRTF_THETA_ID, source));
+            float p = *valueTreeState.getRawParameterValue(getSourceParameterID(HRTF_PHI_ID, source));
+            float r = *valueTreeState.getRawParameterValue(getSourceParameterID(HRTF_RADIUS_ID, source));
             
-            if ((hrirLeft != nullptr) && (hrirRight != nullptr))
+            if (retainedSofa->ambisonicEncoder != nullptr)
+            {
+                //  Moving an encoded source is only a change of its gains
+                if (!fileOrModeChanged && (t == prevTheta[source]) && (p == prevPhi[source]) && (r == prevRadius[source]))
+                    continue;
+                
+                auto &measurements = retainedSofa->measurements;
+                retainedSofa->ambisonicEncoder->setDirection(source, juce::jmap(t, measurements.getMinTheta(), measurements.getMaxTheta()), juce::jmap(p, measurements.getMinPhi(), measurements.getMaxPhi()));
+            }
+            else if (interpolate)
             {
-                retainedSofa->leftHRTFProcessor.swapHRIR(hrirLeft, currentSOFA->hrirSize, currentSOFA->sofa.getMinImpulseDelay() * 0.75);
-                retainedSofa->rightHRTFProcessor.swapHRIR(hrirRight, currentSOFA->hrirSize, currentSOFA->sofa.getMinImpulseDelay() * 0.75);
+                //  Every move gets its own blend, the spectral crossfade keeps these cheap
+                if (!fileOrModeChanged && (t == prevTheta[source]) && (p == prevPhi[source]) && (r == prevRadius[source]))
+                    continue;
+                
+                if (!swapToPosition(*retainedSofa, t, p, r, source))
+                {
+                    positionsToRetry |= positionChanged << source;
+                    swapFailed = true;
+                    continue;
+                }
+            }
+            else
+            {
+                //  Only swap once the source has moved to a different measurement
+                auto measurement = findNearestMeasurement(*retainedSofa, t, p, r);
+                
+                if (!fileOrModeChanged && (measurement == prevMeasurement[source]))
+                    continue;
+                
+                if (!swapToMeasurement(*retainedSofa, measurement, source))
+                {
+                    positionsToRetry |= positionChanged << source;
+                    swapFailed = true;
+                    continue;
+                }
+                
+                prevMeasurement[source] = measurement;
             }
-            prevTheta = thetaMapped;
-            prevPhi = phiMapped;
-            prevRadius = radiusMapped;
             
+            prevTheta[source] = t;
+            prevPhi[source] = p;
+            prevRadius[source] = r;
+            swapped = true;
+        }
+        
+        //  The file or mode only counts as handled once every source was moved to it
+        if (swapped && !swapFailed)
+        {
+            prevInterpolation = interpolate;
+            prevSofa = retainedSofa;
+        }
+        
+        if (swapped)
             sofaFileLoaded = true;
+    }
+}
+
+
+/*
+ *  The phase mode, truncation threshold, number of sources, Ambisonic order and control rate decide how the HRTFs are prepared
+ *  and the engine is laid out, so changing any of them reloads the current file
+ *  Each file is only reloaded once, if a setting changes again during the reload the new file is reloaded again
+ */
+void OrbiterAudioProcessor::checkForPreparationChanges()
+{
+    ReferenceCountedSOFA::Ptr retainedSofa(currentSOFA);
+    
+    if (retainedSofa != preparationReloadedSofa)
+        preparationReloadedSofa = nullptr;
+    
+    if (retainedSofa == nullptr || retainedSofa == preparationReloadedSofa)
+        return;
+    
+    auto numSources = getNumSourcesToRender();
+    auto ambisonicOrder = (int)*valueTreeState.getRawParameterValue(HRTF_AMBISONIC_ORDER_ID);
+    bool minimumPhase = (numSources == 1) && (ambisonicOrder == 0) && (*valueTreeState.getRawParameterValue(HRTF_MINIMUM_PHASE_ID) >= 0.5f);
+    float truncationThresholdDb = *valueTreeState.getRawParameterValue(HRTF_TRUNCATION_ID);
+    auto controlRate = getControlRate();
+    
+    if (numSources != retainedSofa->numSources || ambisonicOrder != retainedSofa->ambisonicOrder || minimumPhase != retainedSofa->minimumPhase || truncationThresholdDb != retainedSofa->truncationThresholdDb
+        || controlRate != retainedSofa->controlRate)
+    {
+        preparationReloadedSofa = retainedSofa;
+        loadSofaFile(retainedSofa->filePath);
+    }
+}
+
+
+//  The sources asked for, limited to the input channels there are to read them from
+int OrbiterAudioProcessor::getNumSourcesToRender()
+{
+    auto numSources = (int)*valueTreeState.getRawParameterValue(HRTF_NUM_SOURCES_ID);
+    
+    return juce::jlimit(1, juce::jmax(1, getTotalNumInputChannels()), numSources);
+}
+
+
+//  The choices of HRTF_CONTROL_RATE_ID are the powers of 2 from HRTFProcessor::MIN_CONTROL_RATE up
+size_t OrbiterAudioProcessor::getControlRate()
+{
+    return HRTFProcessor::MIN_CONTROL_RATE << (int)*valueTreeState.getRawParameterValue(HRTF_CONTROL_RATE_ID);
+}
+
+
+/*
+ *  Map normalised parameter values onto the range of the measured positions and find the measurement closest to them
+ *  The measurements do not have to lie on a regular grid so there is always one to snap to
+ */
+size_t OrbiterAudioProcessor::findNearestMeasurement(const ReferenceCountedSOFA &sofa, float theta, float phi, float radius)
+{
+    auto &measurements = sofa.measurements;
+    
+    return measurements.findNearest(juce::jmap(theta, measurements.getMinTheta(), measurements.getMaxTheta()),
+                                    juce::jmap(phi, measurements.getMinPhi(), measurements.getMaxPhi()),
+                                    juce::jmap(radius, measurements.getMinRadius(), measurements.getMaxRadius()));
+}
+
+
+/*
+ *  Both the compiled file and the cache already hold the HRTFs in the processor's layout so the swap is a copy without any FFTs
+ *  Returns false if the measurement could not be prepared
+ */
+bool OrbiterAudioProcessor::swapToMeasurement(ReferenceCountedSOFA &sofa, size_t measurement, int source)
+{
+    if (sofa.hrtfDatabase.isOpen())
+        return sofa.hrtfProcessor.swapHRTF(sofa.hrtfDatabase.getHRTF(measurement), sofa.hrtfDatabase.getHeader().entrySize, (size_t)source);
+    
+    auto preparedHRTF = sofa.hrtfCache->get(measurement);
+    if (preparedHRTF == nullptr)
+        return false;
+    
+    return sofa.hrtfProcessor.swapHRTF(*preparedHRTF, (size_t)source);
+}
+
+
+/*
+ *  Swap in the blend of the measurements around normalised parameter values
+ *  The weights come from the triangulation of the measured directions and are applied to the prepared spectra,
+ *  so moving the source between measurements is a weighted sum of a few HRTFs instead of a jump to the nearest one.
+ *  Measurements that could not be prepared are left out of the blend
+ */
+bool OrbiterAudioProcessor::swapToPosition(ReferenceCountedSOFA &sofa, float theta, float phi, float radius, int source)
+{
+    auto &measurements = sofa.measurements;
+    
+    size_t blend[SphericalIndex::MAX_BLEND];
+    float weights[SphericalIndex::MAX_BLEND];
+    
+    auto numBlend = measurements.findBlend(juce::jmap(theta, measurements.getMinTheta(), measurements.getMaxTheta()),
+                                           juce::jmap(phi, measurements.getMinPhi(), measurements.getMaxPhi()),
+                                           juce::jmap(radius, measurements.getMinRadius(), measurements.getMaxRadius()),
+                                           blend, weights);
+    
+    size_t numUsed = 0;
+    float sum = 0;
+    
+    std::shared_ptr<const HRTFProcessor::PreparedHRTF> cachedHRTFs[SphericalIndex::MAX_BLEND];
+    const HRTFProcessor::PreparedHRTF *preparedHRTFs[SphericalIndex::MAX_BLEND];
+    const float *compiledHRTFs[SphericalIndex::MAX_BLEND];
+    
+    for (auto i = 0; i < numBlend; ++i)
+    {
+        //  Measurements with almost no weight are not worth their share of the blend
+        if (weights[i] < 1e-4f)
+            continue;
+        
+        if (sofa.hrtfDatabase.isOpen())
+        {
+            compiledHRTFs[numUsed] = sofa.hrtfDatabase.getHRTF(blend[i]);
+            if (compiledHRTFs[numUsed] == nullptr)
+                continue;
+        }
+        else
+        {
+            cachedHRTFs[numUsed] = sofa.hrtfCache->get(blend[i]);
+            preparedHRTFs[numUsed] = cachedHRTFs[numUsed].get();
+            if (preparedHRTFs[numUsed] == nullptr)
+                continue;
         }
+        
+        weights[numUsed++] = weights[i];
+        sum += weights[i];
     }
+    
+    if (numUsed == 0)
+        return false;
+    
+    for (auto i = 0; i < numUsed; ++i)
+        weights[i] /= sum;
+    
+    if (sofa.hrtfDatabase.isOpen())
+        return sofa.hrtfProcessor.swapHRTF(compiledHRTFs, weights, numUsed, sofa.hrtfDatabase.getHeader().entrySize, (size_t)source);
+    
+    return sofa.hrtfProcessor.swapHRTF(preparedHRTFs, weights, numUsed, (size_t)source);
 }
 
 
-void OrbiterAudioProcessor::checkForNewSofaToLoad()
+/*
+ *  Runs on the SOFA loader thread.  Loads a SOFA file and makes it the current one unless a newer file is requested first
+ *
+ *  A SOFA file that was loaded before with the same block size is opened from its compiled file, which is close to instant.
+ *  Otherwise the SOFA file is parsed, the HRTFs of every measurement are precomputed and the file is made current,
+ *  then the HRTFs are compiled for next time.
+ *
+ *  Many SOFA files carry long tails that are close to silent, or room reflections, and the HRIR length sets the partitions
+ *  and FFT sizes of the engine.  So before the engine is set up every HRIR of the file is analysed and the filters are
+ *  truncated to the shortest length that keeps all but HRTF_TRUNCATION dB of the energy of each of them.
+ */
+void OrbiterAudioProcessor::loadSofa(const juce::String &filePath)
 {
-    if (newSofaFileWaiting)
+    juce::File sofaFile(filePath);
+    ReferenceCountedSOFA::Ptr newSofa = new ReferenceCountedSOFA();
+    sofaInstances.add(newSofa);
+    
+    //  The preparation settings can change while the file loads, the whole load uses the ones it started with
+    newSofa->filePath = filePath;
+    newSofa->audioBlockSize = ENGINE_BLOCK_SIZE;
+    newSofa->numSources = getNumSourcesToRender();
+    newSofa->ambisonicOrder = (int)*valueTreeState.getRawParameterValue(HRTF_AMBISONIC_ORDER_ID);
+    
+    //  The ear delays of minimum-phase filters are applied after the sources are mixed, so several sources
+    //  and the Ambisonic channels use the measured HRIRs
+    newSofa->minimumPhase = (newSofa->numSources == 1) && (newSofa->ambisonicOrder == 0) && (*valueTreeState.getRawParameterValue(HRTF_MINIMUM_PHASE_ID) >= 0.5f);
+    newSofa->truncationThresholdDb = *valueTreeState.getRawParameterValue(HRTF_TRUNCATION_ID);
+    newSofa->controlRate = getControlRate();
+    newSofa->minimumPhaseLength = 0;
+    
+    setupSofaEngine(*newSofa);
+    
+    if (openCompiledHRTFs(*newSofa, sofaFile))
+    {
+        if (newSofa->ambisonicOrder > 0 && !setupAmbisonicDecoder(*newSofa))
+            return;
+        
+        attachRenderPool(newSofa->hrtfProcessor);
+        currentSOFA = newSofa;
+        postControlEvents(sofaChanged);
+        return;
+    }
+    
+    //  A compiled file that could not be used after all may have set the engine up already, and a set up engine cannot be
+    //  set up again, so the SOFA file is loaded into a fresh one with the same settings
+    if (newSofa->hrtfProcessor.isHRIRLoaded())
     {
-        if (newSofaFilePath.isNotEmpty())
+        ReferenceCountedSOFA::Ptr freshSofa = new ReferenceCountedSOFA();
+        sofaInstances.add(freshSofa);
+        
+        freshSofa->filePath = newSofa->filePath;
+        freshSofa->audioBlockSize = newSofa->audioBlockSize;
+        freshSofa->numSources = newSofa->numSources;
+        freshSofa->ambisonicOrder = newSofa->ambisonicOrder;
+        freshSofa->minimumPhase = newSofa->minimumPhase;
+        freshSofa->truncationThresholdDb = newSofa->truncationThresholdDb;
+        freshSofa->controlRate = newSofa->controlRate;
+        freshSofa->minimumPhaseLength = 0;
+        
+        setupSofaEngine(*freshSofa);
+        newSofa = freshSofa;
+    }
+    
+    if (!newSofa->sofa.readSOFAFile(filePath.toStdString()) || sofaLoader->shouldCancel())
+        return;
+    
+    //  BasicSOFA only finds measurements at whole degrees, so the positions and HRIRs are read from the table of the file
+    auto &table = newSofa->measurementTable;
+    if (!table.read(filePath.toStdString()) || table.getNumReceivers() < 2 || sofaLoader->shouldCancel())
+        return;
+    
+    sofaLoader->setProgress(SOFA_READ_PROGRESS);
+    
+    auto &sofa = newSofa->sofa;
+    
+    newSofa->measuredHRIRSize = juce::jmin(table.getNumSamples(), MAX_HRIR_LENGTH);
+    newSofa->hrirSize = newSofa->measuredHRIRSize;
+    newSofa->measurements.build(table.getPositions());
+    
+    if (newSofa->measurements.getNumPositions() == 0 || sofaLoader->shouldCancel())
+        return;
+    
+    auto significantLength = findSignificantLength(*newSofa);
+    
+    if (significantLength == 0 || sofaLoader->shouldCancel())
+        return;
+    
+    //  Minimum-phase filters are split from the whole HRIR and truncated afterwards
+    if (newSofa->minimumPhase)
+    {
+        newSofa->minimumPhaseLength = significantLength;
+        newSofa->hrtfProcessor.setMinimumPhase(newSofa->minimumPhaseLength);
+    }
+    else
+    {
+        newSofa->hrirSize = significantLength;
+    }
+    
+    auto initialMeasurement = findNearestMeasurement(*newSofa, 0.5, 0.5, 1);
+    
+    //  Use the non-uniform scheme so that output is available for every block the host sends without added latency
+    if (!newSofa->hrtfProcessor.init(table.getHRIR(initialMeasurement, 0), table.getHRIR(initialMeasurement, 1), newSofa->hrirSize, sofa.getFs(), newSofa->audioBlockSize, sofa.getMinImpulseDelay() * 0.75, HRTFProcessor::PartitionScheme::nonUniform, true))
+        return;
+    
+    createHRTFCache(*newSofa);
+    
+    while (newSofa->hrtfCache->isPrecomputing())
+    {
+        if (sofaLoader->shouldCancel())
         {
-            ReferenceCountedSOFA::Ptr newSofa = new ReferenceCountedSOFA();
-            bool success = newSofa->sofa.readSOFAFile(newSofaFilePath.toStdString());
-            
-            if (success){
-                newSofa->hrirSize = juce::jmin((size_t)newSofa->sofa.getN(), MAX_HRIR_LENGTH);
-                
-                bool leftHRTFSuccess = false;
-                bool rightHRTFSuccess = false;
-                
-                auto radiusMapped = mapAndQuantize(1, 0, 1, newSofa->sofa.getMinRadius(), newSofa->sofa.getMaxRadius(), newSofa->sofa.getDeltaRadius());
-                auto thetaMapped = mapAndQuantize(0.5, 0, 1, newSofa->sofa.getMinTheta(), newSofa->sofa.getMaxTheta(), newSofa->sofa.getDeltaTheta());
-                auto phiMapped = mapAndQuantize(0.5, 0, 1, newSofa->sofa.getMinPhi(), newSofa->sofa.getMaxPhi(), newSofa->sofa.getDeltaPhi());
-                
-                leftHRTFSuccess = newSofa->leftHRTFProcessor.init(newSofa->sofa.getHRIR(0, (int)thetaMapped, (int)phiMapped, radiusMapped), newSofa->hrirSize, newSofa->sofa.getFs(), audioBlockSize, newSofa->sofa.getMinImpulseDelay() * 0.75);
-                rightHRTFSuccess = newSofa->rightHRTFProcessor.init(newSofa->sofa.getHRIR(1, (int)thetaMapped, (int)phiMapped, radiusMapped), newSofa->hrirSize, newSofa->sofa.getFs(), audioBlockSize, newSofa->sofa.getMinImpulseDelay() * 0.75);
-                
-                
-                if (leftHRTFSuccess && rightHRTFSuccess)
-                    currentSOFA = newSofa;
-                
-                sofaInstances.add(newSofa);
-            }
+            newSofa->hrtfCache->cancelPrecompute();
+            return;
         }
         
-        newSofaFileWaiting = false;
+        sofaLoader->setProgress(SOFA_READ_PROGRESS + ((SOFA_PRECOMPUTE_PROGRESS - SOFA_READ_PROGRESS) * newSofa->hrtfCache->getPrecomputeProgress()));
+        sofaLoader->wait(10);
     }
+    
+    if (newSofa->ambisonicOrder > 0 && !setupAmbisonicDecoder(*newSofa))
+        return;
+    
+    attachRenderPool(newSofa->hrtfProcessor);
+    
+    //  The cache is thread safe so the file can be used while it is being compiled
+    currentSOFA = newSofa;
+    postControlEvents(sofaChanged);
+    
+    compileHRTFs(*newSofa, sofaFile);
 }
 
 
-void OrbiterAudioProcessor::checkSofaInstancesToFree()
+//  Set up everything about the engine of sofa that comes from its settings, before its HRTFs are loaded
+void OrbiterAudioProcessor::setupSofaEngine(ReferenceCountedSOFA &sofa)
 {
-    for (auto i = sofaInstances.size(); i >= 0; --i)
+    //  The source can move continuously so blend HRTF changes spectrally, this keeps swap blocks as cheap as normal blocks
+    //  Positions only change once per host block, so every new HRTF is blended in over a block in steps of the control rate
+    //  and the sources follow the path between two positions however large the blocks are
+    sofa.hrtfProcessor.setCrossfadeMode(HRTFProcessor::CrossfadeMode::spectralInterpolation);
+    sofa.hrtfProcessor.setControlRate(sofa.controlRate);
+    sofa.hrtfProcessor.setHRTFRampLength((size_t)juce::jmax(0, audioBlockSize.load()));
+    sofa.hrtfProcessor.setVisualizationTapEnabled(visualizationTapEnabled.load());
+    
+    //  In the Ambisonics mode the processor renders the channels of the bus, the sources only set their gains
+    if (sofa.ambisonicOrder > 0)
     {
-        ReferenceCountedSOFA::Ptr sofaInstance(sofaInstances.getUnchecked(i));
-        if (sofaInstance->getReferenceCount() == 2)
-            sofaInstances.remove(i);
+        sofa.ambisonicEncoder.reset(new Ambisonics::Encoder(sofa.ambisonicOrder, (size_t)sofa.numSources));
+        sofa.ambisonicBus.setSize((int)sofa.ambisonicEncoder->getNumChannels(), sofa.audioBlockSize);
+        sofa.hrtfProcessor.setNumSources(sofa.ambisonicEncoder->getNumChannels());
+    }
+    else
+    {
+        sofa.hrtfProcessor.setNumSources((size_t)sofa.numSources);
     }
 }
 
 
-void OrbiterAudioProcessor::checkForHRTFReverbParamChanges()
+//  Compiled files are kept per SOFA file, block size, control rate, phase mode and truncation threshold, since these set the partitioning
+//  and contents of the HRTFs
+juce::File OrbiterAudioProcessor::getCompiledHRTFFile(const juce::File &sofaFile, int blockSize, size_t controlRate, bool minimumPhase, float truncationThresholdDb)
+{
+    auto directory = juce::File::getSpecialLocation(juce::File::userApplicationDataDirectory).getChildFile("Orbiter").getChildFile("CompiledHRTFs");
+    auto name = sofaFile.getFileNameWithoutExtension() + "_" + juce::String::toHexString(sofaFile.hashCode64()) + "_" + juce::String(blockSize) + "_" + juce::String((int)controlRate)
+              + "_" + juce::String(juce::roundToInt(truncationThresholdDb)) + "dB" + (minimumPhase ? "_minphase" : "") + ".orbhrtf";
+    
+    return directory.getChildFile(name);
+}
+
+
+/*
+ *  Map the compiled file of sofaFile and set the processor up from it without parsing the SOFA file
+ *  Returns false if there is no compiled file or it is out of date, in which case sofa is left as it was.
+ *  An up to date file can still turn out unusable once the engine is set up, e.g. if its entries do not fit the engine.
+ *  sofa is then left with its engine set up and loadSofa() loads the SOFA file into a fresh one
+ */
+bool OrbiterAudioProcessor::openCompiledHRTFs(ReferenceCountedSOFA &sofa, const juce::File &sofaFile)
 {
-    auto changeFlag = reverbParamsChanged.load();
-    if (changeFlag)
+    auto &database = sofa.hrtfDatabase;
+    
+    if (!database.open(getCompiledHRTFFile(sofaFile, sofa.audioBlockSize, sofa.controlRate, sofa.minimumPhase, sofa.truncationThresholdDb)))
+        return false;
+    
+    auto &header = database.getHeader();
+    
+    bool upToDate = (header.sourceModificationTime == sofaFile.getLastModificationTime().toMilliseconds())
+                 && (header.sourceSize == sofaFile.getSize())
+                 && (header.audioBufferSize == (uint32_t)sofa.audioBlockSize)
+                 && (header.controlRate == (uint32_t)sofa.controlRate)
+                 && (header.numEars == 2)
+                 && (header.partitionScheme == (uint32_t)HRTFProcessor::PartitionScheme::nonUniform)
+                 && ((header.minimumPhaseLength > 0) == sofa.minimumPhase)
+                 && (header.truncationThresholdDb == sofa.truncationThresholdDb);
+    
+    if (!upToDate)
     {
-        ReferenceCountedSOFA::Ptr retainedSOFA(currentSOFA);
-        if (retainedSOFA != nullptr)
+        database.close();
+        return false;
+    }
+    
+    sofa.measurements.build(std::vector<SphericalIndex::Position>(database.getPositions(), database.getPositions() + header.numMeasurements));
+    auto *initialHRTF = database.getHRTF(findNearestMeasurement(sofa, 0.5, 0.5, 1));
+    
+    //  The engine only needs the HRIR length to lay out its segments, the HRTFs are swapped in from the compiled file
+    std::vector<double> silence(header.hrirSize, 0.0);
+    
+    bool ready = initialHRTF != nullptr
+              && sofa.hrtfProcessor.setMinimumPhase(header.minimumPhaseLength)
+              && sofa.hrtfProcessor.init(silence.data(), silence.data(), header.hrirSize, (float)header.samplingFreq, sofa.audioBlockSize, 0, HRTFProcessor::PartitionScheme::nonUniform, true);
+    
+    for (auto source = 0; ready && source < sofa.hrtfProcessor.getNumSources(); ++source)
+        ready = sofa.hrtfProcessor.swapHRTF(initialHRTF, header.entrySize, (size_t)source);
+    
+    if (ready)
+    {
+        sofa.hrirSize = header.hrirSize;
+        sofa.measuredHRIRSize = header.measuredHRIRSize;
+        sofa.minimumPhaseLength = header.minimumPhaseLength;
+        
+        return true;
+    }
+    
+    database.close();
+    
+    return false;
+}
+
+
+/*
+ *  Write the prepared HRTFs of every measurement into the compiled file of sofaFile, which is opened the next time the file is loaded
+ *  Gives up and leaves any previous compiled file in place if a newer file is requested in the meantime
+ */
+bool OrbiterAudioProcessor::compileHRTFs(ReferenceCountedSOFA &sofa, const juce::File &sofaFile)
+{
+    auto compiledFile = getCompiledHRTFFile(sofaFile, sofa.audioBlockSize, sofa.controlRate, sofa.minimumPhase, sofa.truncationThresholdDb);
+    if (!compiledFile.getParentDirectory().createDirectory())
+        return false;
+    
+    HRTFDatabase::Header header;
+    header.numEars = 2;
+    header.hrirSize = (uint32_t)sofa.hrirSize;
+    header.audioBufferSize = (uint32_t)sofa.audioBlockSize;
+    header.partitionScheme = (uint32_t)HRTFProcessor::PartitionScheme::nonUniform;
+    header.numDelaySamples = (uint32_t)(sofa.sofa.getMinImpulseDelay() * 0.75);
+    header.minimumPhaseLength = (uint32_t)sofa.minimumPhaseLength;
+    header.measuredHRIRSize = (uint32_t)sofa.measuredHRIRSize;
+    header.truncationThresholdDb = sofa.truncationThresholdDb;
+    header.controlRate = (uint32_t)sofa.controlRate;
+    header.samplingFreq = sofa.sofa.getFs();
+    header.numMeasurements = sofa.measurements.getNumPositions();
+    header.entrySize = sofa.hrtfProcessor.getPreparedHRTFSize();
+    header.sourceModificationTime = sofaFile.getLastModificationTime().toMilliseconds();
+    header.sourceSize = sofaFile.getSize();
+    
+    auto &cache = *sofa.hrtfCache;
+    auto &loader = *sofaLoader;
+    
+    std::vector<SphericalIndex::Position> positions;
+    for (auto measurement = 0; measurement < sofa.measurements.getNumPositions(); ++measurement)
+        positions.push_back(sofa.measurements.getPosition(measurement));
+    
+    return HRTFDatabase::write(compiledFile, header, positions, [&cache](size_t measurement) { return cache.get(measurement); }, [&loader](float progress)
+    {
+        loader.setProgress(SOFA_PRECOMPUTE_PROGRESS + ((1.0f - SOFA_PRECOMPUTE_PROGRESS) * progress));
+        return !loader.shouldCancel();
+    });
+}
+
+
+/*
+ *  Build the spherical-harmonic HRTFs of the Ambisonics decoder from the prepared HRTFs of the measurements and swap them in
+ *  Only the measurements at the largest radius are used, Ambisonics only knows directions.  Each measurement is fetched once
+ *  and added into the flat HRTFs of every channel, so measurements that did not fit in the cache are only prepared once.
+ *  Returns false if the file has too few directions for the order or a newer file was requested in the meantime
+ */
+bool OrbiterAudioProcessor::setupAmbisonicDecoder(ReferenceCountedSOFA &sofa)
+{
+    auto &measurements = sofa.measurements;
+    
+    std::vector<size_t> decoderMeasurements;
+    std::vector<SphericalIndex::Position> directions;
+    
+    for (auto measurement = 0; measurement < measurements.getNumPositions(); ++measurement)
+    {
+        auto &position = measurements.getPosition(measurement);
+        
+        if (std::abs(position.radius - measurements.getMaxRadius()) < 1e-3f)
         {
-            retainedSOFA->leftHRTFProcessor.setReverbParameters(reverbParams);
-            retainedSOFA->rightHRTFProcessor.setReverbParameters(reverbParams);
-            reverbParamsChanged.store(false);
+            decoderMeasurements.push_back(measurement);
+            directions.push_back(position);
         }
     }
+    
+    std::vector<float> weights;
+    if (!Ambisonics::findDecoderWeights(sofa.ambisonicOrder, directions, weights))
+        return false;
+    
+    auto numChannels = sofa.hrtfProcessor.getNumSources();
+    auto entrySize = sofa.hrtfProcessor.getPreparedHRTFSize();
+    
+    std::vector<std::vector<float>> channelHRTFs(numChannels, std::vector<float>(entrySize, 0.0));
+    std::vector<float> flatHRTF(entrySize);
+    
+    for (auto d = 0; d < decoderMeasurements.size(); ++d)
+    {
+        if (sofaLoader->shouldCancel())
+            return false;
+        
+        const float *hrtf = nullptr;
+        
+        if (sofa.hrtfDatabase.isOpen())
+        {
+            hrtf = sofa.hrtfDatabase.getHRTF(decoderMeasurements[d]);
+        }
+        else if (auto prepared = sofa.hrtfCache->get(decoderMeasurements[d]))
+        {
+            prepared->copyTo(flatHRTF.data());
+            hrtf = flatHRTF.data();
+        }
+        
+        if (hrtf == nullptr)
+            continue;
+        
+        for (auto channel = 0; channel < numChannels; ++channel)
+            juce::FloatVectorOperations::addWithMultiply(channelHRTFs[channel].data(), hrtf, weights[(channel * directions.size()) + d], (int)entrySize);
+    }
+    
+    for (auto channel = 0; channel < numChannels; ++channel)
+    {
+        if (!sofa.hrtfProcessor.swapHRTF(channelHRTFs[channel].data(), entrySize, channel))
+            return false;
+    }
+    
+    return true;
 }
 
 
 /*
- *  Map a value from one set to another
- *  This works similar to jmap except that the output is quantized in steps of outputDelta
+ *  Find the number of taps every filter of a SOFA file can be truncated to, the filters being the minimum-phase filters
+ *  in the minimum-phase mode and the HRIRs otherwise.  This is the longest significant length of any filter,
+ *  so every measurement keeps at least the same share of its energy.  Returns 0 if a newer file was requested in the meantime
  */
-float OrbiterAudioProcessor::mapAndQuantize(float value, float inputMin, float inputMax, float outputMin, float outputMax, float outputDelta)
+size_t OrbiterAudioProcessor::findSignificantLength(ReferenceCountedSOFA &sofa)
 {
-    if ((outputMax - outputMin) == 0)
-        return 0;
+    MinimumPhase minimumPhase(sofa.measuredHRIRSize);
+    std::vector<float> filter(sofa.measuredHRIRSize);
+    float delay;
+    size_t length = 1;
+    
+    for (auto measurement = 0; measurement < sofa.measurements.getNumPositions(); ++measurement)
+    {
+        if (sofaLoader->shouldCancel())
+            return 0;
+        
+        for (auto ear = 0; ear < 2; ++ear)
+        {
+            auto *hrir = sofa.measurementTable.getHRIR(measurement, ear);
+            
+            if (hrir == nullptr)
+                continue;
+            
+            if (sofa.minimumPhase)
+            {
+                if (!minimumPhase.split(hrir, sofa.measuredHRIRSize, filter, delay))
+                    continue;
+            }
+            else
+            {
+                std::copy(hrir, hrir + sofa.measuredHRIRSize, filter.begin());
+            }
+            
+            length = juce::jmax(length, MinimumPhase::getSignificantLength(filter.data(), filter.size(), sofa.truncationThresholdDb));
+        }
+    }
+    
+    return length;
+}
+
+
+/*
+ *  Start precomputing the HRTFs of every measurement of a SOFA file that was just parsed
+ *  This runs on all but one of the CPUs so the audio thread keeps a core to itself
+ */
+void OrbiterAudioProcessor::createHRTFCache(ReferenceCountedSOFA &newSofa)
+{
+    auto *sofaPtr = &newSofa;
+    HRTFCache::HRIRProvider provider = [sofaPtr](size_t measurement)
+    {
+        auto *hrirLeft = sofaPtr->measurementTable.getHRIR(measurement, 0);
+        auto *hrirRight = sofaPtr->measurementTable.getHRIR(measurement, 1);
+        
+        if ((hrirLeft == nullptr) || (hrirRight == nullptr))
+            return std::vector<const double*>();
+        
+        return std::vector<const double*>({ hrirLeft, hrirRight });
+    };
+    
+    newSofa.hrtfCache.reset(new HRTFCache(newSofa.hrtfProcessor, newSofa.measurements.getNumPositions(), provider, newSofa.hrirSize, newSofa.sofa.getMinImpulseDelay() * 0.75, HRTF_CACHE_MEMORY_LIMIT));
+    newSofa.hrtfCache->precomputeAll(juce::SystemStats::getNumCpus() - 1);
+}
+
+
+//  Safe to call from any thread.  A load that is still in progress is cancelled
+void OrbiterAudioProcessor::loadSofaFile(const juce::String &filePath)
+{
+    if (filePath.isNotEmpty())
+        sofaLoader->requestLoad(filePath);
+}
+
+
+//  Progress of the SOFA file being loaded between 0 and 1, or -1 if nothing is being loaded
+float OrbiterAudioProcessor::getSofaLoadProgress() const
+{
+    return sofaLoader->getProgress();
+}
+
+
+//  The saving compares the engine for the truncated filters with one for the HRIRs as measured
+bool OrbiterAudioProcessor::getHRTFSizing(HRTFSizing &dest)
+{
+    ReferenceCountedSOFA::Ptr retainedSofa(currentSOFA);
+    
+    if (retainedSofa == nullptr)
+        return false;
+    
+    dest.measuredLength = retainedSofa->measuredHRIRSize;
+    dest.filterLength = retainedSofa->minimumPhase ? retainedSofa->minimumPhaseLength : retainedSofa->hrirSize;
+    
+    auto cost = HRTFProcessor::estimateCost(dest.filterLength, retainedSofa->audioBlockSize, HRTFProcessor::PartitionScheme::nonUniform, 2, retainedSofa->controlRate);
+    auto measuredCost = HRTFProcessor::estimateCost(dest.measuredLength, retainedSofa->audioBlockSize, HRTFProcessor::PartitionScheme::nonUniform, 2, retainedSofa->controlRate);
     
-    if ((outputMax < outputMin) || (inputMax < inputMin) || (outputDelta < 0))
+    dest.largestFFTSize = cost.largestFFTSize;
+    dest.cpuSaving = (float)(1.0 - (cost.operationsPerSample / measuredCost.operationsPerSample));
+    
+    //  A finer control rate means smaller FFTs at the start of the filter, a coarser one a longer direct form head
+    //  so the cheapest rate depends on the filter length
+    auto cheapestCost = cost.operationsPerSample;
+    for (auto controlRate = HRTFProcessor::MIN_CONTROL_RATE; controlRate <= HRTFProcessor::MAX_CONTROL_RATE; controlRate *= 2)
+        cheapestCost = juce::jmin(cheapestCost, HRTFProcessor::estimateCost(dest.filterLength, retainedSofa->audioBlockSize, HRTFProcessor::PartitionScheme::nonUniform, 2, controlRate).operationsPerSample);
+    
+    dest.controlRate = retainedSofa->controlRate;
+    dest.controlRateCost = (float)((cost.operationsPerSample / cheapestCost) - 1.0);
+    
+    return true;
+}
+
+
+/*
+ *  Requests are queued in order but only the newest one is worth loading, so taking a request drops the ones before it
+ *  and a load in progress is cancelled as soon as a newer request comes in
+ */
+void OrbiterAudioProcessor::SofaLoader::requestLoad(const juce::String &filePath)
+{
+    const juce::ScopedLock scopedLock(requestLock);
+    
+    requests.add(filePath);
+    numRequests.store(requests.size());
+    
+    notify();
+}
+
+
+bool OrbiterAudioProcessor::SofaLoader::shouldCancel() const
+{
+    return threadShouldExit() || (numRequests.load() > 0);
+}
+
+
+void OrbiterAudioProcessor::SofaLoader::run()
+{
+    while (!threadShouldExit())
+    {
+        juce::String filePath;
+        
+        {
+            const juce::ScopedLock scopedLock(requestLock);
+            
+            if (!requests.isEmpty())
+            {
+                filePath = requests[requests.size() - 1];
+                requests.clear();
+                numRequests.store(0);
+            }
+        }
+        
+        if (filePath.isEmpty())
+        {
+            wait(-1);
+            continue;
+        }
+        
+        progress.store(0.0f);
+        processor.loadSofa(filePath);
+        progress.store(-1.0f);
+    }
+}
+
+
+void OrbiterAudioProcessor::setVisualizationTapEnabled(bool shouldBeEnabled)
+{
+    visualizationTapEnabled.store(shouldBeEnabled);
+    
+    ReferenceCountedSOFA::Ptr retainedSofa(currentSOFA);
+    if (retainedSofa != nullptr)
+        retainedSofa->hrtfProcessor.setVisualizationTapEnabled(shouldBeEnabled);
+}
+
+
+//  Read the newest output of the left ear, returns the number of samples written to dest
+size_t OrbiterAudioProcessor::readVisualizationTap(float *dest, size_t maxNumSamples)
+{
+    ReferenceCountedSOFA::Ptr retainedSofa(currentSOFA);
+    if (retainedSofa == nullptr)
         return 0;
     
-    unsigned int totalNumSteps = (outputMax - outputMin) / outputDelta;
-    float inputChunkSize = (inputMax - inputMin) / totalNumSteps;
+    return retainedSofa->hrtfProcessor.readVisualizationTap(dest, maxNumSamples);
+}
+
+
+void OrbiterAudioProcessor::checkSofaInstancesToFree()
+{
+    for (auto i = sofaInstances.size() - 1; i >= 0; --i)
+    {
+        ReferenceCountedSOFA::Ptr sofaInstance(sofaInstances.getUnchecked(i));
+        if (sofaInstance->getReferenceCount() == 2)
+            sofaInstances.remove(i);
+    }
+    
+    for (auto i = roomInstances.size() - 1; i >= 0; --i)
+    {
+        ReferenceCountedRoom::Ptr roomInstance(roomInstances.getUnchecked(i));
+        if (roomInstance->getReferenceCount() == 2)
+            roomInstances.remove(i);
+    }
+}
+
+
+void OrbiterAudioProcessor::loadRoomResponse(const juce::String &filePath)
+{
+    const juce::ScopedLock scopedLock(roomRequestLock);
     
-    unsigned int deltaMultiplier = value / inputChunkSize;
+    roomRequest = filePath;
+    roomRequested.store(true);
     
-    return (deltaMultiplier * outputDelta) + outputMin;
+    postControlEvents(roomChanged);
 }
 
 
-void OrbiterAudioProcessor::parameterChanged(const juce::String &parameterID, float newValue)
-{  
-    if (parameterID == HRTF_REVERB_ROOM_SIZE_ID)
+void OrbiterAudioProcessor::checkForRoomResponseChanges()
+{
+    if (roomRequested.exchange(false))
     {
-        reverbParams.roomSize = newValue;
-        reverbParamsChanged.store(true);
+        const juce::ScopedLock scopedLock(roomRequestLock);
+        roomFilePath = roomRequest;
     }
+    else if (roomSampleRate == getSampleRate())
+    {
+        return;
+    }
+    
+    roomSampleRate = getSampleRate();
+    roomLoader->requestLoad(roomFilePath, roomSampleRate);
+}
+
+
+//  Only the newest request is loaded, a load in progress is cancelled as soon as a newer request comes in
+void OrbiterAudioProcessor::RoomLoader::requestLoad(const juce::String &filePath, double sampleRate)
+{
+    const juce::ScopedLock scopedLock(requestLock);
+    
+    requestFilePath = filePath;
+    requestSampleRate = sampleRate;
+    requested.store(true);
     
-    else if (parameterID == HRTF_REVERB_DAMPING_ID)
+    notify();
+}
+
+
+bool OrbiterAudioProcessor::RoomLoader::shouldCancel() const
+{
+    return threadShouldExit() || requested.load();
+}
+
+
+//  The audio thread keeps the previous room response until the new one is ready.  An empty or unusable file removes the room response
+void OrbiterAudioProcessor::RoomLoader::run()
+{
+    while (!threadShouldExit())
     {
-        reverbParams.damping = newValue;
-        reverbParamsChanged.store(true);
+        if (!requested.exchange(false))
+        {
+            wait(-1);
+            continue;
+        }
+        
+        juce::String filePath;
+        double sampleRate;
+        
+        {
+            const juce::ScopedLock scopedLock(requestLock);
+            
+            filePath = requestFilePath;
+            sampleRate = requestSampleRate;
+        }
+        
+        auto room = processor.loadRoom(filePath, ENGINE_BLOCK_SIZE, sampleRate);
+        
+        if (shouldCancel())
+            continue;
+        
+        processor.currentRoom = room;
+        processor.postControlEvents(roomLoaded);
     }
+}
+
+
+/*
+ *  Low-pass buffer at ANTI_ALIASING_CUTOFF of the sampling rate it is about to be divided down to by ratio
+ *  The filter is a windowed sinc with an odd number of taps, its delay of half its length is taken off again so the response does not move
+ */
+void OrbiterAudioProcessor::lowPassForResampling(juce::AudioBuffer<float> &buffer, double ratio)
+{
+    auto halfLength = (int)std::ceil(ANTI_ALIASING_TAPS_PER_RATIO * ratio);
     
-    else if (parameterID == HRTF_REVERB_WET_LEVEL_ID)
+    //  Frequencies are given relative to the sampling rate of buffer
+    auto filter = juce::dsp::FilterDesign<float>::designFIRLowpassWindowMethod((float)(ANTI_ALIASING_CUTOFF / ratio), 1.0, (size_t)(2 * halfLength), juce::dsp::WindowingFunction<float>::blackmanHarris);
+    
+    auto *taps = filter->getRawCoefficients();
+    auto numTaps = 2 * halfLength + 1;
+    
+    //  Keep the level of the response
+    float gain = 0.0f;
+    for (auto k = 0; k < numTaps; ++k)
+        gain += taps[k];
+    
+    juce::FloatVectorOperations::multiply(taps, 1.0f / gain, numTaps);
+    
+    auto numSamples = buffer.getNumSamples();
+    std::vector<float> filtered((size_t)numSamples);
+    
+    for (auto channel = 0; channel < buffer.getNumChannels(); ++channel)
     {
-        reverbParams.wetLevel = newValue;
-        reverbParamsChanged.store(true);
+        auto *samples = buffer.getWritePointer(channel);
+        
+        for (auto n = 0; n < numSamples; ++n)
+        {
+            auto firstTap = juce::jmax(0, halfLength - n);
+            auto lastTap = juce::jmin(numTaps, numSamples + halfLength - n);
+            
+            float sum = 0.0f;
+            for (auto k = firstTap; k < lastTap; ++k)
+                sum += taps[k] * samples[n + k - halfLength];
+            
+            filtered[(size_t)n] = sum;
+        }
+        
+        std::copy(filtered.begin(), filtered.end(), samples);
     }
+}
+
+
+/*
+ *  Engines with little work per block render on the audio thread alone, so the pool is only created once an engine needs it.
+ *  The workers are shared by every instance of the plugin.  Called on the loading threads before the engine is handed to the audio thread
+ */
+void OrbiterAudioProcessor::attachRenderPool(HRTFProcessor &engine)
+{
+    if (!engine.needsRenderPool())
+        return;
+    
+    const juce::ScopedLock scopedLock(renderPoolLock);
+    
+    if (renderPool == nullptr)
+        renderPool.reset(new juce::SharedResourcePointer<RenderPool>());
     
-    else if (parameterID == HRTF_REVERB_DRY_LEVEL_ID)
+    engine.setRenderPool(renderPool->get());
+}
+
+
+/*
+ *  Read up to MAX_ROOM_RESPONSE_SECONDS of a room response, resample it to the sampling rate of the host and set up its convolver
+ *  The convolver uses the non-uniform scheme like the HRTFs, so only the head and the first segments are calculated on the audio thread
+ *  and the cost there does not grow with the length of the response.  Returns nullptr if the file could not be used
+ */
+OrbiterAudioProcessor::ReferenceCountedRoom::Ptr OrbiterAudioProcessor::loadRoom(const juce::String &filePath, int blockSize, double sampleRate)
+{
+    if (filePath.isEmpty() || blockSize <= 0 || sampleRate <= 0.0)
+        return nullptr;
+    
+    juce::AudioFormatManager formatManager;
+    formatManager.registerBasicFormats();
+    
+    std::unique_ptr<juce::AudioFormatReader> reader(formatManager.createReaderFor(juce::File(filePath)));
+    if (reader == nullptr || reader->numChannels == 0 || reader->lengthInSamples <= 0 || reader->sampleRate <= 0.0)
+        return nullptr;
+    
+    auto numFileSamples = (int)juce::jmin(reader->lengthInSamples, (juce::int64)(MAX_ROOM_RESPONSE_SECONDS * reader->sampleRate));
+    auto numChannels = juce::jmin(2, (int)reader->numChannels);
+    
+    juce::AudioBuffer<float> fileResponse(numChannels, numFileSamples);
+    if (!reader->read(&fileResponse, 0, numFileSamples, 0, true, numChannels > 1) || roomLoader->shouldCancel())
+        return nullptr;
+    
+    //  The Lagrange interpolator does not filter, so a response that is downsampled is band-limited first
+    auto ratio = reader->sampleRate / sampleRate;
+    if (ratio > 1.0)
+        lowPassForResampling(fileResponse, ratio);
+    
+    if (roomLoader->shouldCancel())
+        return nullptr;
+    
+    //  Leave a few samples at the end for the interpolator to read past the last output sample
+    auto numSamples = (size_t)juce::jmax(0.0, (numFileSamples - 4) / ratio);
+    if (numSamples == 0)
+        return nullptr;
+    
+    std::vector<float> resampled(numSamples);
+    std::vector<std::vector<double>> response;
+    
+    for (auto channel = 0; channel < numChannels; ++channel)
     {
-        reverbParams.dryLevel = newValue;
-        reverbParamsChanged.store(true);
+        juce::LagrangeInterpolator interpolator;
+        interpolator.process(ratio, fileResponse.getReadPointer(channel), resampled.data(), (int)numSamples);
+        
+        response.push_back(std::vector<double>(resampled.begin(), resampled.end()));
     }
     
-    else if (parameterID == HRTF_REVERB_WIDTH_ID)
+    auto &left = response.front();
+    auto &right = response.back();
+    
+    ReferenceCountedRoom::Ptr room = new ReferenceCountedRoom();
+    room->filePath = filePath;
+    room->lengthSeconds = (double)numSamples / sampleRate;
+    
+    if (!room->convolver.init(left.data(), right.data(), numSamples, (float)sampleRate, (size_t)blockSize, 0, HRTFProcessor::PartitionScheme::nonUniform, true))
+        return nullptr;
+    
+    attachRenderPool(room->convolver);
+    
+    roomInstances.add(room);
+    
+    return room;
+}
+
+
+//  Called on the audio thread.  The response is convolved with the dry mix in the first channel of reverbBuffer
+//  Only the wet level applies, the direct sound is already in the binaural output
+void OrbiterAudioProcessor::renderRoomResponse(ReferenceCountedRoom &room, int numSamples)
+{
+    juce::AudioBuffer<float> wet(reverbBuffer.getArrayOfWritePointers(), 2, numSamples);
+    
+    if (!room.convolver.process(wet))
+        wet.clear();
+    
+    float wetLevel = *valueTreeState.getRawParameterValue(HRTF_REVERB_WET_LEVEL_ID);
+    wet.applyGainRamp(0, numSamples, prevRoomWetLevel, wetLevel);
+    prevRoomWetLevel = wetLevel;
+}
+
+
+//  Called on the watcher thread, which is the only writer of reverbParamsBuffer
+void OrbiterAudioProcessor::publishReverbParameters()
+{
+    auto &params = reverbParamsBuffer.getWriteBuffer();
+    
+    params.roomSize = *valueTreeState.getRawParameterValue(HRTF_REVERB_ROOM_SIZE_ID);
+    params.damping = *valueTreeState.getRawParameterValue(HRTF_REVERB_DAMPING_ID);
+    params.wetLevel = *valueTreeState.getRawParameterValue(HRTF_REVERB_WET_LEVEL_ID);
+    params.dryLevel = *valueTreeState.getRawParameterValue(HRTF_REVERB_DRY_LEVEL_ID);
+    params.width = *valueTreeState.getRawParameterValue(HRTF_REVERB_WIDTH_ID);
+    
+    reverbParamsBuffer.publish();
+}
+
+
+//  Called on the audio thread, the reverb is only used there
+void OrbiterAudioProcessor::checkForHRTFReverbParamChanges()
+{
+    if (reverbParamsBuffer.acquire())
     {
-        reverbParams.width = newValue;
-        reverbParamsChanged.store(true);
+        reverb.setParameters(reverbParamsBuffer.getReadBuffer());
+        fdnReverb.setParameters(reverbParamsBuffer.getReadBuffer());
     }
+}
+
+
+/*
+ *  Called on whichever thread changed the parameter, which can be the audio thread
+ *  Only posts an event for the watcher, the new value is read from the parameter when the event is handled.
+ *  The IDs were built in the constructor, so this compares strings but never allocates
+ */
+void OrbiterAudioProcessor::parameterChanged(const juce::String &parameterID, float newValue)
+{
+    juce::ignoreUnused(newValue);
     
-    else{}
+    auto index = controlEventParameterIDs.indexOf(parameterID);
+    
+    if (index >= 0)
+        postControlEvents(controlEventBits[(size_t)index]);
+}
+
+
+//  The number of input channels limits how many sources are rendered
+void OrbiterAudioProcessor::numChannelsChanged()
+{
+    postControlEvents(preparationChanged);
 }
 
 
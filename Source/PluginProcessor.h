@@ -10,7 +10,15 @@
 
 #include <JuceHeader.h>
 #include <BasicSOFA.hpp>
-#include "HRTFProcessor.h"
+#include "BinauralHRTFProcessor.h"
+#include "HRTFCache.h"
+#include "HRTFDatabase.h"
+#include "SphericalIndex.h"
+#include "SOFAMeasurementTable.h"
+#include "Ambisonics.h"
+#include "FDNReverb.h"
+#include "TripleBuffer.h"
+#include "Semaphore.h"
 
 #define HRTF_THETA_ID               "HRTF_THETA"
 #define HRTF_PHI_ID                 "HRTF_PHI"
@@ -22,6 +30,14 @@
 #define HRTF_REVERB_WET_LEVEL_ID    "HRTF_REVERB_WET_LEVEL"
 #define HRTF_REVERB_DRY_LEVEL_ID    "HRTF_REVERB_DRY_LEVEL"
 #define HRTF_REVERB_WIDTH_ID        "HRTF_REVERB_WIDTH"
+#define HRTF_INTERPOLATION_ID       "HRTF_INTERPOLATION"
+#define HRTF_MINIMUM_PHASE_ID       "HRTF_MINIMUM_PHASE"
+#define HRTF_TRUNCATION_ID          "HRTF_TRUNCATION"
+#define HRTF_NUM_SOURCES_ID         "HRTF_NUM_SOURCES"
+#define HRTF_AMBISONIC_ORDER_ID     "HRTF_AMBISONIC_ORDER"
+#define HRTF_REVERB_CONVOLUTION_ID  "HRTF_REVERB_CONVOLUTION"
+#define HRTF_REVERB_TYPE_ID         "HRTF_REVERB_TYPE"
+#define HRTF_CONTROL_RATE_ID        "HRTF_CONTROL_RATE"
 
 
 
@@ -70,14 +86,46 @@ public:
     
     //==============================================================================
     void                            run() override;
+    void                            numChannelsChanged() override;
+    
+    //  For views that display the rendered output, the tap is only filled while it is enabled
+    void                            setVisualizationTapEnabled(bool shouldBeEnabled);
+    size_t                          readVisualizationTap(float *dest, size_t maxNumSamples);
     
     juce::AudioProcessorValueTreeState::ParameterLayout     createParameters();
     
     
-    bool                            newSofaFileWaiting;
-    bool                            sofaFileLoaded;
+    //  Loading happens on a thread of its own so position changes keep being applied while a file loads
+    void                            loadSofaFile(const juce::String &filePath);
+    float                           getSofaLoadProgress() const;
+    
+    //  A room impulse response or BRIR to use as the reverb instead of the Freeverb, a mono file is used for both ears
+    //  The file is loaded on the room loader thread and replaces the current one once it is ready, an empty path unloads it
+    void                            loadRoomResponse(const juce::String &filePath);
+    
+    //  How the HRIRs of the current file were truncated and what that saves, see loadSofa()
+    struct HRTFSizing
+    {
+        size_t  measuredLength;
+        size_t  filterLength;
+        size_t  largestFFTSize;
+        float   cpuSaving;
+        
+        //  How often the HRTFs are updated in samples, and how much more CPU that takes than the cheapest control rate
+        size_t  controlRate;
+        float   controlRateCost;
+    };
+    
+    //  Returns false if no file is loaded
+    bool                            getHRTFSizing(HRTFSizing &dest);
+    
+    //  Every input channel up to MAX_SOURCES is rendered as a source with its own position
+    //  The first source uses HRTF_THETA_ID, HRTF_PHI_ID and HRTF_RADIUS_ID, the others add their number, e.g. HRTF_THETA_2
+    static juce::String             getSourceParameterID(const juce::String &parameterID, int source);
+    
+    static constexpr int            MAX_SOURCES = 8;
     
-    juce::String                    newSofaFilePath;
+    std::atomic<bool>               sofaFileLoaded;
     
     juce::AudioProcessorValueTreeState  valueTreeState;
     
@@ -94,10 +142,36 @@ private:
         BasicSOFA::BasicSOFA    *getSOFA() { return &sofa; }
         
         BasicSOFA::BasicSOFA    sofa;
-        HRTFProcessor           leftHRTFProcessor;
-        HRTFProcessor           rightHRTFProcessor;
+        BinauralHRTFProcessor   hrtfProcessor;
         
+        juce::String            filePath;
         size_t                  hrirSize;
+        int                     audioBlockSize;     //  The block size the engine is set up for, see ENGINE_BLOCK_SIZE
+        
+        //  The phase mode, truncation, number of sources and control rate are fixed when the file is loaded
+        //  Measured HRIRs are truncated to hrirSize, minimum-phase filters to minimumPhaseLength
+        int                     numSources;
+        bool                    minimumPhase;
+        float                   truncationThresholdDb;
+        size_t                  controlRate;
+        size_t                  measuredHRIRSize;
+        size_t                  minimumPhaseLength;
+        
+        //  Positions of the measurements the file has, measurements are numbered in the order of the index
+        //  and of the table, which holds their HRIRs
+        SphericalIndex          measurements;
+        SOFAMeasurementTable    measurementTable;
+        
+        //  With an Ambisonic order the sources are encoded into ambisonicBus and the processor renders its channels
+        //  through the spherical-harmonic HRTFs, otherwise every source is rendered with HRTFs of its own
+        int                     ambisonicOrder;
+        std::unique_ptr<Ambisonics::Encoder>    ambisonicEncoder;
+        juce::AudioBuffer<float>                ambisonicBus;
+        
+        //  The HRTFs come from the compiled file when it is open, otherwise from the cache
+        //  Both are declared after the processor so they are destroyed first, their entries are only valid for this processor
+        HRTFDatabase            hrtfDatabase;
+        std::unique_ptr<HRTFCache>  hrtfCache;
         
     private:
         
@@ -107,32 +181,205 @@ private:
     
     //==============================================================================
     
+    //  A room response rendered as a convolution reverb, the tail segments are calculated on the background thread of the convolver
+    class ReferenceCountedRoom : public juce::ReferenceCountedObject
+    {
+    public:
+        typedef juce::ReferenceCountedObjectPtr<ReferenceCountedRoom> Ptr;
+        
+        ReferenceCountedRoom(){}
+        
+        BinauralHRTFProcessor   convolver;
+        juce::String            filePath;
+        double                  lengthSeconds;
+        
+    private:
+        
+        JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(ReferenceCountedRoom)
+    };
+    
+    
+    //==============================================================================
+    
+    //  Loads the newest requested SOFA file, see loadSofa()
+    class SofaLoader : public juce::Thread
+    {
+    public:
+        SofaLoader(OrbiterAudioProcessor &p) : juce::Thread("SOFA Loader"), processor(p) { numRequests.store(0); progress.store(-1.0f); }
+        
+        void                    requestLoad(const juce::String &filePath);
+        
+        //  Only for the loader thread, true once a newer file was requested or the thread is stopping
+        bool                    shouldCancel() const;
+        
+        void                    setProgress(float newProgress) { progress.store(newProgress); }
+        float                   getProgress() const { return progress.load(); }
+        
+        void                    run() override;
+        
+    private:
+        OrbiterAudioProcessor   &processor;
+        
+        juce::CriticalSection   requestLock;
+        juce::StringArray       requests;
+        std::atomic<int>        numRequests;
+        std::atomic<float>      progress;
+    };
+    
+    
+    //  Reads, resamples and sets up room responses off the watcher thread, so positions keep moving while a long response loads
+    class RoomLoader : public juce::Thread
+    {
+    public:
+        RoomLoader(OrbiterAudioProcessor &p) : juce::Thread("Room Loader"), processor(p) { requested.store(false); requestSampleRate = 0.0; }
+        
+        void                    requestLoad(const juce::String &filePath, double sampleRate);
+        
+        //  Only for the loader thread, true once a newer response was requested or the thread is stopping
+        bool                    shouldCancel() const;
+        
+        void                    run() override;
+        
+    private:
+        OrbiterAudioProcessor   &processor;
+        
+        juce::CriticalSection   requestLock;
+        juce::String            requestFilePath;
+        double                  requestSampleRate;
+        std::atomic<bool>       requested;
+    };
+    
+    
+    //==============================================================================
+    
+    void                        renderBlock(juce::AudioBuffer<float> &buffer);
     void                        checkSofaInstancesToFree();
-    void                        checkForNewSofaToLoad();
+    void                        loadSofa(const juce::String &filePath);
+    void                        setupSofaEngine(ReferenceCountedSOFA &sofa);
     void                        checkForGUIParameterChanges();
     void                        checkForHRTFReverbParamChanges();
+    void                        publishReverbParameters();
+    void                        checkForPreparationChanges();
+    void                        checkForRoomResponseChanges();
+    int                         getNumSourcesToRender();
+    size_t                      getControlRate();
     
-    float                       mapAndQuantize(float value, float inputMin, float inputMax, float outputMin, float outputMax, float                                 outputDelta);
+    ReferenceCountedRoom::Ptr   loadRoom(const juce::String &filePath, int blockSize, double sampleRate);
+    static void                 lowPassForResampling(juce::AudioBuffer<float> &buffer, double ratio);
+    void                        attachRenderPool(HRTFProcessor &engine);
+    void                        renderRoomResponse(ReferenceCountedRoom &room, int numSamples);
+    
+    size_t                      findSignificantLength(ReferenceCountedSOFA &sofa);
+    size_t                      findNearestMeasurement(const ReferenceCountedSOFA &sofa, float theta, float phi, float radius);
+    bool                        swapToMeasurement(ReferenceCountedSOFA &sofa, size_t measurement, int source);
+    bool                        swapToPosition(ReferenceCountedSOFA &sofa, float theta, float phi, float radius, int source);
+    void                        createHRTFCache(ReferenceCountedSOFA &sofa);
+    juce::File                  getCompiledHRTFFile(const juce::File &sofaFile, int blockSize, size_t controlRate, bool minimumPhase, float truncationThresholdDb);
+    bool                        openCompiledHRTFs(ReferenceCountedSOFA &sofa, const juce::File &sofaFile);
+    bool                        compileHRTFs(ReferenceCountedSOFA &sofa, const juce::File &sofaFile);
+    bool                        setupAmbisonicDecoder(ReferenceCountedSOFA &sofa);
     
     void                        parameterChanged(const juce::String &parameterID, float newValue) override;
+    void                        postControlEvents(uint32_t events);
+    void                        addControlEventParameter(const juce::String &parameterID, uint32_t events);
+    
+    //  What the watcher thread has to look at, posted as bits of pendingControlEvents.  Every source has its own position bit
+    //  roomLoaded only wakes the watcher to free the room response that was replaced
+    enum ControlEvent : uint32_t
+    {
+        reverbChanged = 1 << 0,
+        preparationChanged = 1 << 1,
+        roomChanged = 1 << 2,
+        sofaChanged = 1 << 3,
+        roomLoaded = 1 << 4,
+        positionChanged = 1 << 5
+    };
+    
+    static constexpr uint32_t   ALL_POSITIONS_CHANGED = ((1u << MAX_SOURCES) - 1) * positionChanged;
+    
+    //  How often the watcher wakes up on its own while replaced files are waiting to be freed
+    static constexpr int        INSTANCE_RELEASE_INTERVAL_MS = 50;
+    
+    //  How often the watcher tries again to swap in the HRTFs of sources whose swap failed, e.g. because they were not prepared yet
+    static constexpr int        SWAP_RETRY_INTERVAL_MS = 50;
     
-    float                       prevTheta;
-    float                       prevPhi;
-    float                       prevRadius;
+    std::atomic<uint32_t>       pendingControlEvents;
+    Semaphore                   controlEventSignal;         //  Wakes the watcher without a lock, juce::Thread::notify() locks a mutex
+    
+    //  The event each listened-to parameter posts, see parameterChanged()
+    juce::StringArray           controlEventParameterIDs;
+    std::vector<uint32_t>       controlEventBits;
+    
+    float                       prevTheta[MAX_SOURCES];
+    float                       prevPhi[MAX_SOURCES];
+    float                       prevRadius[MAX_SOURCES];
+    size_t                      prevMeasurement[MAX_SOURCES];
+    uint32_t                    positionsToRetry;           //  Position events of the sources whose swap failed, only used by the watcher
+    bool                        prevInterpolation;
+    ReferenceCountedSOFA::Ptr   prevSofa;
+    ReferenceCountedSOFA::Ptr   preparationReloadedSofa;
     bool                        hrtfParamChangeLoop;
     
-    int                         audioBlockSize;
+    std::atomic<int>            audioBlockSize;
     
     float                       prevInputGain;
     float                       prevOutputGain;
+    float                       prevRoomWetLevel;
     
     static constexpr size_t     MAX_HRIR_LENGTH = 15000;
     
-    juce::Reverb::Parameters    reverbParams;
-    std::atomic<bool>           reverbParamsChanged;
+    //  The engines are set up for blocks of this many samples whatever the host sends, see processBlock()
+    //  This keeps their layout and the compiled HRTF files the same when the host changes its block size
+    static constexpr int        ENGINE_BLOCK_SIZE = 512;
+    
+    //  juce::Reverb is a Freeverb, its combs feed back by FREEVERB_FEEDBACK_OFFSET + FREEVERB_FEEDBACK_SCALE * roomSize
+    //  and the longest of them is FREEVERB_LONGEST_COMB_SECONDS long
+    static constexpr double     FREEVERB_FEEDBACK_OFFSET = 0.7;
+    static constexpr double     FREEVERB_FEEDBACK_SCALE = 0.28;
+    static constexpr double     FREEVERB_LONGEST_COMB_SECONDS = 1617.0 / 44100.0;
+    
+    //  Room responses are cut off after this many seconds
+    static constexpr double     MAX_ROOM_RESPONSE_SECONDS = 10.0;
+    
+    //  A room response that is downsampled is low-passed at this share of the new sampling rate first, so nothing above it folds back
+    //  The filter has ANTI_ALIASING_TAPS_PER_RATIO taps on either side of its centre for every step of the resampling ratio
+    static constexpr double     ANTI_ALIASING_CUTOFF = 0.45;
+    static constexpr int        ANTI_ALIASING_TAPS_PER_RATIO = 64;
+    
+    //  Memory each loaded SOFA file may use for its precomputed HRTFs, measurements that do not fit are prepared when they are used
+    static constexpr size_t     HRTF_CACHE_MEMORY_LIMIT = 256 * 1024 * 1024;
+    
+    //  Share of the load progress reached after reading the SOFA file and after precomputing its HRTFs, compiling takes the rest
+    static constexpr float      SOFA_READ_PROGRESS = 0.1f;
+    static constexpr float      SOFA_PRECOMPUTE_PROGRESS = 0.7f;
+    
+    //  One stereo reverb for the dry mix of every source, shared by every loaded file
+    //  HRTF_REVERB_TYPE_ID picks the Freeverb or the feedback delay network, both take the same parameters
+    juce::Reverb                reverb;
+    FDNReverb                   fdnReverb;
+    juce::AudioBuffer<float>    reverbBuffer;
+    TripleBuffer<juce::Reverb::Parameters>  reverbParamsBuffer;
+    
+    std::atomic<bool>           visualizationTapEnabled;
+
+    //  Shared by the engines of every loaded file and every instance, created by attachRenderPool().  Declared before the engines so it outlives them
+    std::unique_ptr<juce::SharedResourcePointer<RenderPool>>    renderPool;
+    juce::CriticalSection       renderPoolLock;
 
     ReferenceCountedSOFA::Ptr   currentSOFA;
-    juce::ReferenceCountedArray<ReferenceCountedSOFA>   sofaInstances;
+    juce::ReferenceCountedArray<ReferenceCountedSOFA, juce::CriticalSection>    sofaInstances;
+    
+    //  The requested room response is loaded again when the sample rate it was loaded for changes
+    ReferenceCountedRoom::Ptr   currentRoom;
+    juce::ReferenceCountedArray<ReferenceCountedRoom, juce::CriticalSection>    roomInstances;
+    juce::CriticalSection       roomRequestLock;
+    juce::String                roomRequest;
+    std::atomic<bool>           roomRequested;
+    juce::String                roomFilePath;
+    double                      roomSampleRate;
+    
+    std::unique_ptr<SofaLoader> sofaLoader;
+    std::unique_ptr<RoomLoader> roomLoader;
     
     
     JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (OrbiterAudioProcessor)
@@ -0,0 +1,255 @@
+#include "RenderPool.h"
+
+
+RenderPool::RenderPool() : RenderPool(juce::jmin(MAX_SHARED_WORKERS, juce::SystemStats::getNumCpus() - 2))
+{
+}
+
+
+RenderPool::RenderPool(int numWorkers)
+{
+    numWorkers = juce::jmax(0, numWorkers);
+    numParticipants = (size_t)numWorkers + 1;
+
+    inUse.store(false);
+    state.store(0);
+    remainingTasks.store(0);
+    taskFunction = nullptr;
+    taskContext = nullptr;
+
+    slices.reset(new Slice[numParticipants]);
+    for (auto p = 0; p < numParticipants; ++p)
+    {
+        slices[p].next.store(0);
+        slices[p].end = 0;
+    }
+
+    auto numCpus = juce::SystemStats::getNumCpus();
+
+    for (auto w = 0; w < numWorkers; ++w)
+    {
+        workers.push_back(std::make_unique<Worker>(*this, (size_t)w + 1));
+
+        //  Core 0 is left to the audio thread and everything else on the machine
+        auto core = (w % juce::jmax(1, numCpus - 1)) + 1;
+        if (core < numCpus && core < 32)
+            workers.back()->setAffinityMask((uint32_t)1 << core);
+
+        workers.back()->startThread(9);
+    }
+}
+
+
+RenderPool::~RenderPool()
+{
+    for (auto &worker : workers)
+    {
+        worker->signalThreadShouldExit();
+        worker->wake();
+    }
+
+    for (auto &worker : workers)
+        worker->stopThread(1000);
+}
+
+
+/*
+ *  Only one thread at a time gets the workers, a caller that finds them busy with the block of another thread runs its tasks itself.
+ *  The tasks are dealt out in equal slices, then the calling thread works through its own slice and steals from the others
+ *  like the workers do.  Once every task has finished the block is closed and the workers that are still looking for tasks are waited for,
+ *  so none of them can pick up a task of the next block with the function of this one
+ */
+void RenderPool::runTasks(size_t numTasks, TaskFunction function, void *context)
+{
+    if (numTasks == 0)
+        return;
+
+    if (workers.empty() || numTasks == 1 || inUse.exchange(true, std::memory_order_acquire))
+    {
+        for (auto i = 0; i < numTasks; ++i)
+            function(context, i);
+
+        return;
+    }
+
+    taskFunction = function;
+    taskContext = context;
+
+    for (auto p = 0; p < numParticipants; ++p)
+    {
+        slices[p].end = (numTasks * (p + 1)) / numParticipants;
+        slices[p].next.store((numTasks * p) / numParticipants, std::memory_order_relaxed);
+    }
+
+    remainingTasks.store(numTasks, std::memory_order_relaxed);
+    state.store(JOB_OPEN, std::memory_order_release);
+
+    //  Wake no more workers than there are tasks to share
+    auto numToWake = juce::jmin(workers.size(), numTasks - 1);
+    for (auto w = 0; w < numToWake; ++w)
+        workers[w]->wake();
+
+    participate(0);
+
+    while (remainingTasks.load(std::memory_order_acquire) > 0)
+        juce::Thread::yield();
+
+    state.fetch_and(~JOB_OPEN, std::memory_order_acq_rel);
+
+    while ((state.load(std::memory_order_acquire) & ACTIVE_MASK) != 0)
+        juce::Thread::yield();
+
+    inUse.store(false, std::memory_order_release);
+}
+
+
+//  Work through the slice of participant, then through the slices of the others
+void RenderPool::participate(size_t participant)
+{
+    for (auto offset = 0; offset < numParticipants; ++offset)
+    {
+        auto &slice = slices[(participant + offset) % numParticipants];
+
+        for (;;)
+        {
+            auto index = slice.next.fetch_add(1, std::memory_order_relaxed);
+            if (index >= slice.end)
+                break;
+
+            taskFunction(taskContext, index);
+            remainingTasks.fetch_sub(1, std::memory_order_acq_rel);
+        }
+    }
+}
+
+
+void RenderPool::Worker::run()
+{
+    while (!threadShouldExit())
+    {
+        wakeSignal.wait();
+
+        if (threadShouldExit())
+            break;
+
+        //  Only join a block that is still open, counting this worker in so the caller waits for it to leave
+        auto current = pool.state.load(std::memory_order_acquire);
+        bool joined = false;
+
+        while ((current & JOB_OPEN) != 0 && !joined)
+            joined = pool.state.compare_exchange_weak(current, current + 1, std::memory_order_acq_rel);
+
+        if (!joined)
+            continue;
+
+        pool.participate(participant);
+        pool.state.fetch_sub(1, std::memory_order_release);
+    }
+}
+
+
+
+#ifdef JUCE_UNIT_TESTS
+void RenderPoolTest::runTest()
+{
+    beginTest("Every Task Once");
+
+    RenderPool pool(3);
+    expectEquals(pool.getNumWorkers(), 3);
+
+    std::vector<std::atomic<int>> counts(1000);
+
+    auto countTask = [&counts](size_t index) { counts[index].fetch_add(1); };
+
+    //  Many small blocks in a row, so workers that wake late meet blocks that are already closed
+    for (auto block = 0; block < 200; ++block)
+    {
+        auto numTasks = (size_t)(block * 5) % counts.size();
+        for (auto &count : counts)
+            count.store(0);
+
+        pool.run(numTasks, countTask);
+
+        int wrong = 0;
+        for (auto i = 0; i < counts.size(); ++i)
+            wrong += (counts[i].load() != ((i < numTasks) ? 1 : 0)) ? 1 : 0;
+
+        expectEquals(wrong, 0);
+    }
+
+    //===================================================================================================//
+
+
+    beginTest("Results Ready On Return");
+
+    //  Uneven tasks leave some slices with far more work, which the other threads steal
+    std::vector<double> results(64, 0.0);
+    auto unevenTask = [&results](size_t index)
+    {
+        double sum = 0;
+        auto length = (index % 8 == 0) ? 200000 : 1000;
+        for (auto i = 0; i < length; ++i)
+            sum += std::sin(0.001 * i) * (index + 1);
+
+        results[index] = sum;
+    };
+
+    pool.run(results.size(), unevenTask);
+
+    std::vector<double> expected(results.size(), 0.0);
+    for (auto index = 0; index < expected.size(); ++index)
+    {
+        auto length = (index % 8 == 0) ? 200000 : 1000;
+        for (auto i = 0; i < length; ++i)
+            expected[index] += std::sin(0.001 * i) * (index + 1);
+    }
+
+    for (auto index = 0; index < results.size(); ++index)
+        expectEquals(results[index], expected[index]);
+
+    //  Without workers the calling thread runs every task itself
+    RenderPool serialPool(0);
+    std::fill(results.begin(), results.end(), 0.0);
+    serialPool.run(results.size(), unevenTask);
+
+    for (auto index = 0; index < results.size(); ++index)
+        expectEquals(results[index], expected[index]);
+
+    //===================================================================================================//
+
+
+    beginTest("Shared Between Threads");
+
+    //  Two threads render through the same pool at once, whichever finds the workers busy runs its tasks itself
+    std::vector<std::atomic<int>> otherCounts(counts.size());
+    auto otherTask = [&otherCounts](size_t index) { otherCounts[index].fetch_add(1); };
+
+    for (auto &count : counts)
+        count.store(0);
+
+    for (auto &count : otherCounts)
+        count.store(0);
+
+    std::thread other([&pool, &otherTask]
+    {
+        for (auto block = 0; block < 100; ++block)
+            pool.run(64, otherTask);
+    });
+
+    for (auto block = 0; block < 100; ++block)
+        pool.run(64, countTask);
+
+    other.join();
+
+    int wrong = 0;
+    for (auto i = 0; i < counts.size(); ++i)
+    {
+        auto expectedCount = (i < 64) ? 100 : 0;
+        wrong += (counts[i].load() != expectedCount || otherCounts[i].load() != expectedCount) ? 1 : 0;
+    }
+
+    expectEquals(wrong, 0);
+    expect(!pool.inUse.load());
+}
+
+#endif
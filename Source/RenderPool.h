@@ -0,0 +1,108 @@
+#pragma once
+#include <JuceHeader.h>
+#include <atomic>
+#include <memory>
+#include "Semaphore.h"
+
+
+/*
+ *  Worker threads that help the audio thread through the work of one block
+ *
+ *  run() splits a number of independent tasks between the calling thread and the workers and only returns once every task has finished,
+ *  so whatever the tasks write is ready for the caller and the results do not depend on which thread ran which task.  Each thread starts on
+ *  a slice of the tasks of its own and, once that is done, steals what is left of the other slices, so a thread that was woken late or got
+ *  slow tasks is caught up by the others.  Tasks are claimed with a single atomic increment, there are no locks and nothing is allocated.
+ *
+ *  The workers are started with a high priority and each is pinned to a core of its own, leaving the first core free.  Workers that wake up
+ *  after a block was finished do not join in, so the caller never waits for a thread that is still being scheduled.  Each worker sleeps on
+ *  a Semaphore, so waking it from the audio thread takes no lock.
+ *
+ *  A pool can be shared, e.g. by every plugin instance through a juce::SharedResourcePointer.  Only one thread uses the workers at a time,
+ *  a thread that calls run() while they are busy runs its tasks itself instead of waiting for them.
+ */
+class RenderPool
+{
+#ifdef JUCE_UNIT_TESTS
+    friend class RenderPoolTest;
+#endif
+
+public:
+
+    //  The default pool has a worker per core that is left, up to MAX_SHARED_WORKERS
+    RenderPool();
+    RenderPool(int numWorkers);
+    ~RenderPool();
+
+    int     getNumWorkers() const { return (int)workers.size(); }
+
+    //  Calls task(index) for every index below numTasks, task must be callable as void(size_t)
+    template <typename Task>
+    void    run(size_t numTasks, Task &task)
+    {
+        runTasks(numTasks, [](void *context, size_t index) { (*static_cast<Task*>(context))(index); }, &task);
+    }
+
+
+private:
+
+    typedef void (*TaskFunction)(void *context, size_t index);
+
+    class Worker : public juce::Thread
+    {
+    public:
+        Worker(RenderPool &p, size_t index) : juce::Thread("HRTF Render Worker"), pool(p), participant(index) {}
+
+        void run() override;
+        void wake() { wakeSignal.signal(); }
+
+    private:
+        RenderPool  &pool;
+        size_t      participant;
+        Semaphore   wakeSignal;
+    };
+
+    //  The tasks a thread starts on, other threads take from the same counter once they run out of their own
+    struct alignas(64) Slice
+    {
+        std::atomic<size_t>     next;
+        size_t                  end;
+    };
+
+    void    runTasks(size_t numTasks, TaskFunction function, void *context);
+    void    participate(size_t participant);
+
+    //  Workers in a default pool.  The pool is meant to be shared by every instance, so more would only compete with the host for cores
+    static constexpr int        MAX_SHARED_WORKERS = 4;
+
+    //  state holds the number of workers taking part in the current block and whether workers may still join it
+    static constexpr uint64_t   JOB_OPEN = (uint64_t)1 << 32;
+    static constexpr uint64_t   ACTIVE_MASK = JOB_OPEN - 1;
+
+    std::atomic<bool>                   inUse;
+    std::atomic<uint64_t>               state;
+    std::atomic<size_t>                 remainingTasks;
+    TaskFunction                        taskFunction;
+    void                                *taskContext;
+
+    //  One slice per worker and one for the calling thread, which is participant 0
+    std::unique_ptr<Slice[]>            slices;
+    size_t                              numParticipants;
+
+    std::vector<std::unique_ptr<Worker>>    workers;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(RenderPool)
+};
+
+
+#ifdef JUCE_UNIT_TESTS
+class RenderPoolTest : public juce::UnitTest
+{
+public:
+    RenderPoolTest() : UnitTest("RenderPoolUnitTest", "HRTFProcessor") {};
+
+    void runTest() override;
+};
+
+static RenderPoolTest renderPoolUnitTest;
+
+#endif
@@ -0,0 +1,113 @@
+#include "SOFAMeasurementTable.h"
+#include <H5Cpp.h>
+
+
+SOFAMeasurementTable::SOFAMeasurementTable()
+{
+    numReceivers = 0;
+    numSamples = 0;
+}
+
+
+/*
+ *  SourcePosition is [I or M][3] and Data.IR is [M][R][N], both are read as doubles whatever they are stored as
+ *  The HDF5 C++ API reports errors with exceptions, they are turned into a false return here
+ */
+bool SOFAMeasurementTable::read(const std::string &filePath)
+{
+    positions.clear();
+    irs.clear();
+    numReceivers = 0;
+    numSamples = 0;
+
+    std::vector<double> sourcePositions;
+    bool cartesian = false;
+    hsize_t positionDims[2];
+    hsize_t irDims[3];
+
+    try
+    {
+        H5::Exception::dontPrint();
+        H5::H5File file(filePath, H5F_ACC_RDONLY);
+
+        auto positionSet = file.openDataSet("SourcePosition");
+        auto positionSpace = positionSet.getSpace();
+        if (positionSpace.getSimpleExtentNdims() != 2)
+            return false;
+
+        positionSpace.getSimpleExtentDims(positionDims);
+        if (positionDims[0] == 0 || positionDims[1] != 3)
+            return false;
+
+        if (positionSet.attrExists("Type"))
+        {
+            auto typeAttribute = positionSet.openAttribute("Type");
+            H5std_string type;
+            typeAttribute.read(typeAttribute.getStrType(), type);
+            cartesian = (type.find("cartesian") != std::string::npos);
+        }
+
+        sourcePositions.resize((size_t)(positionDims[0] * positionDims[1]));
+        positionSet.read(sourcePositions.data(), H5::PredType::NATIVE_DOUBLE);
+
+        auto irSet = file.openDataSet("Data.IR");
+        auto irSpace = irSet.getSpace();
+        if (irSpace.getSimpleExtentNdims() != 3)
+            return false;
+
+        irSpace.getSimpleExtentDims(irDims);
+        if (irDims[0] == 0 || irDims[1] == 0 || irDims[2] == 0)
+            return false;
+
+        irs.resize((size_t)(irDims[0] * irDims[1] * irDims[2]));
+        irSet.read(irs.data(), H5::PredType::NATIVE_DOUBLE);
+    }
+    catch (const H5::Exception &)
+    {
+        irs.clear();
+        return false;
+    }
+
+    auto numMeasurements = (size_t)irDims[0];
+    if (positionDims[0] != 1 && positionDims[0] != numMeasurements)
+    {
+        irs.clear();
+        return false;
+    }
+
+    numReceivers = (size_t)irDims[1];
+    numSamples = (size_t)irDims[2];
+    positions.reserve(numMeasurements);
+
+    for (auto m = 0; m < numMeasurements; ++m)
+    {
+        auto *position = sourcePositions.data() + ((positionDims[0] == 1) ? 0 : (3 * m));
+
+        if (cartesian)
+        {
+            auto x = position[0];
+            auto y = position[1];
+            auto z = position[2];
+            auto theta = juce::radiansToDegrees(std::atan2(y, x));
+
+            positions.push_back({ (float)((theta < 0.0) ? theta + 360.0 : theta),
+                                  (float)juce::radiansToDegrees(std::atan2(z, std::sqrt((x * x) + (y * y)))),
+                                  (float)std::sqrt((x * x) + (y * y) + (z * z)) });
+        }
+        else
+        {
+            positions.push_back({ (float)position[0], (float)position[1], (float)position[2] });
+        }
+    }
+
+    return true;
+}
+
+
+const double *SOFAMeasurementTable::getHRIR(size_t measurement, size_t receiver) const
+{
+    if (measurement >= positions.size() || receiver >= numReceivers)
+        return nullptr;
+
+    return irs.data() + (((measurement * numReceivers) + receiver) * numSamples);
+}
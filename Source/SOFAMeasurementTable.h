@@ -0,0 +1,45 @@
+#pragma once
+#include <JuceHeader.h>
+#include <string>
+#include <vector>
+#include "SphericalIndex.h"
+
+
+/*
+ *  The measurement positions and HRIRs of a SOFA file, numbered like the rows of the file
+ *
+ *  BasicSOFA only looks HRIRs up by position in whole degrees, so measurements at fractional angles, which irregular and Lebedev
+ *  grids are full of, cannot be reached through it.  This reads the SourcePosition and Data.IR variables of the file straight from HDF5
+ *  instead, so every measurement the file has is found, wherever it is, in one pass over the file.
+ *
+ *  Cartesian source positions are converted to the spherical coordinates used by SOFA (theta is the azimuth and phi the elevation,
+ *  both in degrees).  A file with a single source position gives it to every measurement.
+ */
+class SOFAMeasurementTable
+{
+public:
+
+    SOFAMeasurementTable();
+
+    //  Not real-time safe.  Returns false if the file cannot be read or its variables do not fit together
+    bool                read(const std::string &filePath);
+
+    size_t              getNumMeasurements() const { return positions.size(); }
+    size_t              getNumReceivers() const { return numReceivers; }
+    size_t              getNumSamples() const { return numSamples; }
+
+    const std::vector<SphericalIndex::Position> &getPositions() const { return positions; }
+
+    //  Returns nullptr if there is no such measurement or receiver
+    const double        *getHRIR(size_t measurement, size_t receiver) const;
+
+
+private:
+
+    std::vector<SphericalIndex::Position>   positions;
+    std::vector<double>                     irs;
+    size_t                                  numReceivers;
+    size_t                                  numSamples;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(SOFAMeasurementTable)
+};
@@ -0,0 +1,161 @@
+#include "Semaphore.h"
+
+#if JUCE_WINDOWS
+ #ifndef NOMINMAX
+  #define NOMINMAX
+ #endif
+ #include <windows.h>
+#elif JUCE_MAC || JUCE_IOS
+ #include <dispatch/dispatch.h>
+#else
+ #include <semaphore.h>
+ #include <cerrno>
+ #include <ctime>
+#endif
+
+
+#if JUCE_WINDOWS
+
+struct Semaphore::Pimpl
+{
+    Pimpl() { handle = CreateSemaphoreW(nullptr, 0, LONG_MAX, nullptr); }
+    ~Pimpl() { CloseHandle(handle); }
+
+    void signal() { ReleaseSemaphore(handle, 1, nullptr); }
+    bool wait(int timeoutMs) { return WaitForSingleObject(handle, (timeoutMs < 0) ? INFINITE : (DWORD)timeoutMs) == WAIT_OBJECT_0; }
+
+    HANDLE  handle;
+};
+
+#elif JUCE_MAC || JUCE_IOS
+
+struct Semaphore::Pimpl
+{
+    Pimpl() { handle = dispatch_semaphore_create(0); }
+    ~Pimpl() { dispatch_release(handle); }
+
+    void signal() { dispatch_semaphore_signal(handle); }
+
+    bool wait(int timeoutMs)
+    {
+        auto timeout = (timeoutMs < 0) ? DISPATCH_TIME_FOREVER : dispatch_time(DISPATCH_TIME_NOW, (int64_t)timeoutMs * NSEC_PER_MSEC);
+        return dispatch_semaphore_wait(handle, timeout) == 0;
+    }
+
+    dispatch_semaphore_t    handle;
+};
+
+#else
+
+struct Semaphore::Pimpl
+{
+    Pimpl() { sem_init(&handle, 0, 0); }
+    ~Pimpl() { sem_destroy(&handle); }
+
+    void signal() { sem_post(&handle); }
+
+    //  Waits are restarted when a signal handler interrupts them
+    bool wait(int timeoutMs)
+    {
+        if (timeoutMs < 0)
+        {
+            while (sem_wait(&handle) != 0)
+            {
+                if (errno != EINTR)
+                    return false;
+            }
+
+            return true;
+        }
+
+        timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += timeoutMs / 1000;
+        deadline.tv_nsec += (long)(timeoutMs % 1000) * 1000000;
+
+        if (deadline.tv_nsec >= 1000000000)
+        {
+            deadline.tv_sec += 1;
+            deadline.tv_nsec -= 1000000000;
+        }
+
+        while (sem_timedwait(&handle, &deadline) != 0)
+        {
+            if (errno != EINTR)
+                return false;
+        }
+
+        return true;
+    }
+
+    sem_t   handle;
+};
+
+#endif
+
+
+Semaphore::Semaphore() : pimpl(new Pimpl())
+{
+}
+
+
+Semaphore::~Semaphore()
+{
+}
+
+
+void Semaphore::signal()
+{
+    pimpl->signal();
+}
+
+
+bool Semaphore::wait(int timeoutMs)
+{
+    return pimpl->wait(timeoutMs);
+}
+
+
+
+#ifdef JUCE_UNIT_TESTS
+void SemaphoreTest::runTest()
+{
+    beginTest("Signal Before Wait");
+
+    //  Every signal lets exactly one wait through
+    Semaphore semaphore;
+    semaphore.signal();
+    semaphore.signal();
+
+    expect(semaphore.wait(0));
+    expect(semaphore.wait(0));
+    expect(!semaphore.wait(0));
+
+    //===================================================================================================//
+
+
+    beginTest("Timeout");
+
+    auto start = juce::Time::getMillisecondCounterHiRes();
+    expect(!semaphore.wait(20));
+    expectGreaterOrEqual(juce::Time::getMillisecondCounterHiRes() - start, 15.0);
+
+    //===================================================================================================//
+
+
+    beginTest("Wakes Waiting Thread");
+
+    std::atomic<bool> woken(false);
+    std::thread waiter([&semaphore, &woken]
+    {
+        woken.store(semaphore.wait(5000));
+    });
+
+    juce::Thread::sleep(10);
+    semaphore.signal();
+    waiter.join();
+
+    expect(woken.load());
+}
+
+#endif
@@ -0,0 +1,53 @@
+#pragma once
+#include <JuceHeader.h>
+#include <memory>
+
+
+/*
+ *  A counting semaphore whose signal() never takes a lock, so a real-time thread can wake another thread
+ *
+ *  juce::Thread::notify() signals a juce::WaitableEvent, which locks a mutex that the waiting thread may be holding.
+ *  signal() only increments the count in the kernel and wakes a waiter if there is one: a futex on Linux,
+ *  a dispatch semaphore on macOS and a semaphore object on Windows.  The signalling thread never waits for the woken one.
+ *
+ *  Every signal() lets one wait() through, callers that signal for every event should coalesce them first.
+ */
+class Semaphore
+{
+#ifdef JUCE_UNIT_TESTS
+    friend class SemaphoreTest;
+#endif
+
+public:
+
+    Semaphore();
+    ~Semaphore();
+
+    //  Real-time safe, can be called from any thread
+    void    signal();
+
+    //  Returns true once the semaphore was signalled, or false after timeoutMs.  A negative timeout waits forever
+    bool    wait(int timeoutMs = -1);
+
+
+private:
+
+    struct Pimpl;
+    std::unique_ptr<Pimpl>  pimpl;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(Semaphore)
+};
+
+
+#ifdef JUCE_UNIT_TESTS
+class SemaphoreTest : public juce::UnitTest
+{
+public:
+    SemaphoreTest() : UnitTest("SemaphoreUnitTest", "HRTFProcessor") {};
+
+    void runTest() override;
+};
+
+static SemaphoreTest semaphoreUnitTest;
+
+#endif
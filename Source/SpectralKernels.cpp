@@ -0,0 +1,460 @@
+#include "SpectralKernels.h"
+#include <complex>
+
+#if JUCE_INTEL
+ #include <immintrin.h>
+
+ //  Lets single functions use instructions the rest of the build is not compiled for
+ //  MSVC does not need this to use the intrinsics
+ #if JUCE_GCC || JUCE_CLANG
+  #define SPECTRAL_KERNELS_TARGET(isa) __attribute__((target(isa)))
+ #else
+  #define SPECTRAL_KERNELS_TARGET(isa)
+ #endif
+#endif
+
+
+//==============================================================================
+//  Scalar kernels, also used for the bins that do not fill a whole vector
+
+static void multiplyAccumulateScalar(float *yRe, float *yIm, const float *xRe, const float *xIm, const float *hRe, const float *hIm, size_t numBins)
+{
+    for (auto i = 0; i < numBins; ++i)
+    {
+        yRe[i] += (xRe[i] * hRe[i]) - (xIm[i] * hIm[i]);
+        yIm[i] += (xRe[i] * hIm[i]) + (xIm[i] * hRe[i]);
+    }
+}
+
+static void multiplyAccumulateInterpolatedScalar(float *yRe, float *yIm, const float *xRe, const float *xIm, const float *h0Re, const float *h0Im, const float *h1Re, const float *h1Im, float weight, size_t numBins)
+{
+    for (auto i = 0; i < numBins; ++i)
+    {
+        auto hRe = h0Re[i] + (weight * (h1Re[i] - h0Re[i]));
+        auto hIm = h0Im[i] + (weight * (h1Im[i] - h0Im[i]));
+
+        yRe[i] += (xRe[i] * hRe) - (xIm[i] * hIm);
+        yIm[i] += (xRe[i] * hIm) + (xIm[i] * hRe);
+    }
+}
+
+static void crossfadeScalar(float *dest, const float *a, const float *fadeOut, const float *b, const float *fadeIn, size_t numSamples)
+{
+    for (auto i = 0; i < numSamples; ++i)
+        dest[i] = (a[i] * fadeOut[i]) + (b[i] * fadeIn[i]);
+}
+
+
+#if JUCE_INTEL
+//==============================================================================
+//  SSE2 kernels, 4 floats at a time
+
+SPECTRAL_KERNELS_TARGET("sse2")
+static void multiplyAccumulateSSE2(float *yRe, float *yIm, const float *xRe, const float *xIm, const float *hRe, const float *hIm, size_t numBins)
+{
+    size_t i = 0;
+    for (; i + 4 <= numBins; i += 4)
+    {
+        auto xr = _mm_loadu_ps(xRe + i);
+        auto xi = _mm_loadu_ps(xIm + i);
+        auto hr = _mm_loadu_ps(hRe + i);
+        auto hi = _mm_loadu_ps(hIm + i);
+
+        auto re = _mm_sub_ps(_mm_mul_ps(xr, hr), _mm_mul_ps(xi, hi));
+        auto im = _mm_add_ps(_mm_mul_ps(xr, hi), _mm_mul_ps(xi, hr));
+
+        _mm_storeu_ps(yRe + i, _mm_add_ps(_mm_loadu_ps(yRe + i), re));
+        _mm_storeu_ps(yIm + i, _mm_add_ps(_mm_loadu_ps(yIm + i), im));
+    }
+
+    multiplyAccumulateScalar(yRe + i, yIm + i, xRe + i, xIm + i, hRe + i, hIm + i, numBins - i);
+}
+
+SPECTRAL_KERNELS_TARGET("sse2")
+static void multiplyAccumulateInterpolatedSSE2(float *yRe, float *yIm, const float *xRe, const float *xIm, const float *h0Re, const float *h0Im, const float *h1Re, const float *h1Im, float weight, size_t numBins)
+{
+    auto w = _mm_set1_ps(weight);
+
+    size_t i = 0;
+    for (; i + 4 <= numBins; i += 4)
+    {
+        auto xr = _mm_loadu_ps(xRe + i);
+        auto xi = _mm_loadu_ps(xIm + i);
+        auto h0r = _mm_loadu_ps(h0Re + i);
+        auto h0i = _mm_loadu_ps(h0Im + i);
+
+        auto hr = _mm_add_ps(h0r, _mm_mul_ps(w, _mm_sub_ps(_mm_loadu_ps(h1Re + i), h0r)));
+        auto hi = _mm_add_ps(h0i, _mm_mul_ps(w, _mm_sub_ps(_mm_loadu_ps(h1Im + i), h0i)));
+
+        auto re = _mm_sub_ps(_mm_mul_ps(xr, hr), _mm_mul_ps(xi, hi));
+        auto im = _mm_add_ps(_mm_mul_ps(xr, hi), _mm_mul_ps(xi, hr));
+
+        _mm_storeu_ps(yRe + i, _mm_add_ps(_mm_loadu_ps(yRe + i), re));
+        _mm_storeu_ps(yIm + i, _mm_add_ps(_mm_loadu_ps(yIm + i), im));
+    }
+
+    multiplyAccumulateInterpolatedScalar(yRe + i, yIm + i, xRe + i, xIm + i, h0Re + i, h0Im + i, h1Re + i, h1Im + i, weight, numBins - i);
+}
+
+SPECTRAL_KERNELS_TARGET("sse2")
+static void crossfadeSSE2(float *dest, const float *a, const float *fadeOut, const float *b, const float *fadeIn, size_t numSamples)
+{
+    size_t i = 0;
+    for (; i + 4 <= numSamples; i += 4)
+    {
+        auto faded = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(fadeOut + i)), _mm_mul_ps(_mm_loadu_ps(b + i), _mm_loadu_ps(fadeIn + i)));
+        _mm_storeu_ps(dest + i, faded);
+    }
+
+    crossfadeScalar(dest + i, a + i, fadeOut + i, b + i, fadeIn + i, numSamples - i);
+}
+
+
+//==============================================================================
+//  AVX2 kernels, 8 floats at a time using fused multiply-adds
+
+SPECTRAL_KERNELS_TARGET("avx2,fma")
+static void multiplyAccumulateAVX2(float *yRe, float *yIm, const float *xRe, const float *xIm, const float *hRe, const float *hIm, size_t numBins)
+{
+    size_t i = 0;
+    for (; i + 8 <= numBins; i += 8)
+    {
+        auto xr = _mm256_loadu_ps(xRe + i);
+        auto xi = _mm256_loadu_ps(xIm + i);
+        auto hr = _mm256_loadu_ps(hRe + i);
+        auto hi = _mm256_loadu_ps(hIm + i);
+
+        auto re = _mm256_fnmadd_ps(xi, hi, _mm256_fmadd_ps(xr, hr, _mm256_loadu_ps(yRe + i)));
+        auto im = _mm256_fmadd_ps(xi, hr, _mm256_fmadd_ps(xr, hi, _mm256_loadu_ps(yIm + i)));
+
+        _mm256_storeu_ps(yRe + i, re);
+        _mm256_storeu_ps(yIm + i, im);
+    }
+
+    multiplyAccumulateScalar(yRe + i, yIm + i, xRe + i, xIm + i, hRe + i, hIm + i, numBins - i);
+}
+
+SPECTRAL_KERNELS_TARGET("avx2,fma")
+static void multiplyAccumulateInterpolatedAVX2(float *yRe, float *yIm, const float *xRe, const float *xIm, const float *h0Re, const float *h0Im, const float *h1Re, const float *h1Im, float weight, size_t numBins)
+{
+    auto w = _mm256_set1_ps(weight);
+
+    size_t i = 0;
+    for (; i + 8 <= numBins; i += 8)
+    {
+        auto xr = _mm256_loadu_ps(xRe + i);
+        auto xi = _mm256_loadu_ps(xIm + i);
+        auto h0r = _mm256_loadu_ps(h0Re + i);
+        auto h0i = _mm256_loadu_ps(h0Im + i);
+
+        auto hr = _mm256_fmadd_ps(w, _mm256_sub_ps(_mm256_loadu_ps(h1Re + i), h0r), h0r);
+        auto hi = _mm256_fmadd_ps(w, _mm256_sub_ps(_mm256_loadu_ps(h1Im + i), h0i), h0i);
+
+        auto re = _mm256_fnmadd_ps(xi, hi, _mm256_fmadd_ps(xr, hr, _mm256_loadu_ps(yRe + i)));
+        auto im = _mm256_fmadd_ps(xi, hr, _mm256_fmadd_ps(xr, hi, _mm256_loadu_ps(yIm + i)));
+
+        _mm256_storeu_ps(yRe + i, re);
+        _mm256_storeu_ps(yIm + i, im);
+    }
+
+    multiplyAccumulateInterpolatedScalar(yRe + i, yIm + i, xRe + i, xIm + i, h0Re + i, h0Im + i, h1Re + i, h1Im + i, weight, numBins - i);
+}
+
+SPECTRAL_KERNELS_TARGET("avx2,fma")
+static void crossfadeAVX2(float *dest, const float *a, const float *fadeOut, const float *b, const float *fadeIn, size_t numSamples)
+{
+    size_t i = 0;
+    for (; i + 8 <= numSamples; i += 8)
+    {
+        auto faded = _mm256_fmadd_ps(_mm256_loadu_ps(b + i), _mm256_loadu_ps(fadeIn + i), _mm256_mul_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(fadeOut + i)));
+        _mm256_storeu_ps(dest + i, faded);
+    }
+
+    crossfadeScalar(dest + i, a + i, fadeOut + i, b + i, fadeIn + i, numSamples - i);
+}
+
+
+//==============================================================================
+//  AVX-512 kernels, 16 floats at a time using fused multiply-adds
+
+SPECTRAL_KERNELS_TARGET("avx512f")
+static void multiplyAccumulateAVX512(float *yRe, float *yIm, const float *xRe, const float *xIm, const float *hRe, const float *hIm, size_t numBins)
+{
+    size_t i = 0;
+    for (; i + 16 <= numBins; i += 16)
+    {
+        auto xr = _mm512_loadu_ps(xRe + i);
+        auto xi = _mm512_loadu_ps(xIm + i);
+        auto hr = _mm512_loadu_ps(hRe + i);
+        auto hi = _mm512_loadu_ps(hIm + i);
+
+        auto re = _mm512_fnmadd_ps(xi, hi, _mm512_fmadd_ps(xr, hr, _mm512_loadu_ps(yRe + i)));
+        auto im = _mm512_fmadd_ps(xi, hr, _mm512_fmadd_ps(xr, hi, _mm512_loadu_ps(yIm + i)));
+
+        _mm512_storeu_ps(yRe + i, re);
+        _mm512_storeu_ps(yIm + i, im);
+    }
+
+    multiplyAccumulateScalar(yRe + i, yIm + i, xRe + i, xIm + i, hRe + i, hIm + i, numBins - i);
+}
+
+SPECTRAL_KERNELS_TARGET("avx512f")
+static void multiplyAccumulateInterpolatedAVX512(float *yRe, float *yIm, const float *xRe, const float *xIm, const float *h0Re, const float *h0Im, const float *h1Re, const float *h1Im, float weight, size_t numBins)
+{
+    auto w = _mm512_set1_ps(weight);
+
+    size_t i = 0;
+    for (; i + 16 <= numBins; i += 16)
+    {
+        auto xr = _mm512_loadu_ps(xRe + i);
+        auto xi = _mm512_loadu_ps(xIm + i);
+        auto h0r = _mm512_loadu_ps(h0Re + i);
+        auto h0i = _mm512_loadu_ps(h0Im + i);
+
+        auto hr = _mm512_fmadd_ps(w, _mm512_sub_ps(_mm512_loadu_ps(h1Re + i), h0r), h0r);
+        auto hi = _mm512_fmadd_ps(w, _mm512_sub_ps(_mm512_loadu_ps(h1Im + i), h0i), h0i);
+
+        auto re = _mm512_fnmadd_ps(xi, hi, _mm512_fmadd_ps(xr, hr, _mm512_loadu_ps(yRe + i)));
+        auto im = _mm512_fmadd_ps(xi, hr, _mm512_fmadd_ps(xr, hi, _mm512_loadu_ps(yIm + i)));
+
+        _mm512_storeu_ps(yRe + i, re);
+        _mm512_storeu_ps(yIm + i, im);
+    }
+
+    multiplyAccumulateInterpolatedScalar(yRe + i, yIm + i, xRe + i, xIm + i, h0Re + i, h0Im + i, h1Re + i, h1Im + i, weight, numBins - i);
+}
+
+SPECTRAL_KERNELS_TARGET("avx512f")
+static void crossfadeAVX512(float *dest, const float *a, const float *fadeOut, const float *b, const float *fadeIn, size_t numSamples)
+{
+    size_t i = 0;
+    for (; i + 16 <= numSamples; i += 16)
+    {
+        auto faded = _mm512_fmadd_ps(_mm512_loadu_ps(b + i), _mm512_loadu_ps(fadeIn + i), _mm512_mul_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(fadeOut + i)));
+        _mm512_storeu_ps(dest + i, faded);
+    }
+
+    crossfadeScalar(dest + i, a + i, fadeOut + i, b + i, fadeIn + i, numSamples - i);
+}
+#endif
+
+
+
+void SpectralKernels::multiplyAccumulate(float *yRe, float *yIm, const float *xRe, const float *xIm, const float *hRe, const float *hIm, size_t numBins)
+{
+    getKernelTable().multiplyAccumulate(yRe, yIm, xRe, xIm, hRe, hIm, numBins);
+}
+
+
+void SpectralKernels::multiplyAccumulateInterpolated(float *yRe, float *yIm, const float *xRe, const float *xIm, const float *h0Re, const float *h0Im, const float *h1Re, const float *h1Im, float weight, size_t numBins)
+{
+    getKernelTable().multiplyAccumulateInterpolated(yRe, yIm, xRe, xIm, h0Re, h0Im, h1Re, h1Im, weight, numBins);
+}
+
+
+void SpectralKernels::crossfade(float *dest, const float *a, const float *fadeOut, const float *b, const float *fadeIn, size_t numSamples)
+{
+    getKernelTable().crossfade(dest, a, fadeOut, b, fadeIn, numSamples);
+}
+
+
+void SpectralKernels::deinterleave(const float *interleaved, float *re, float *im, size_t numBins)
+{
+    for (auto i = 0; i < numBins; ++i)
+    {
+        re[i] = interleaved[2 * i];
+        im[i] = interleaved[(2 * i) + 1];
+    }
+}
+
+
+void SpectralKernels::interleave(const float *re, const float *im, float *interleaved, size_t numBins)
+{
+    for (auto i = 0; i < numBins; ++i)
+    {
+        interleaved[2 * i] = re[i];
+        interleaved[(2 * i) + 1] = im[i];
+    }
+}
+
+
+//  Round numBins up to a whole number of the widest vectors
+size_t SpectralKernels::getPaddedNumBins(size_t numBins)
+{
+    return ((numBins + VECTOR_SIZE - 1) / VECTOR_SIZE) * VECTOR_SIZE;
+}
+
+
+SpectralKernels::InstructionSet SpectralKernels::getInstructionSet()
+{
+    return getKernelTable().instructionSet;
+}
+
+
+bool SpectralKernels::isSupported(InstructionSet instructionSet)
+{
+    switch (instructionSet)
+    {
+        case InstructionSet::scalar:
+            return true;
+
+#if JUCE_INTEL
+        case InstructionSet::sse2:
+            return juce::SystemStats::hasSSE2();
+
+        case InstructionSet::avx2:
+            return juce::SystemStats::hasAVX2() && juce::SystemStats::hasFMA3();
+
+        case InstructionSet::avx512:
+            return juce::SystemStats::hasAVX512F();
+#endif
+
+        default:
+            return false;
+    }
+}
+
+
+bool SpectralKernels::setInstructionSet(InstructionSet instructionSet)
+{
+    if (!isSupported(instructionSet))
+        return false;
+
+    getKernelTable() = createKernelTable(instructionSet);
+
+    return true;
+}
+
+
+//  The table is created on first use with the widest instruction set the CPU supports
+SpectralKernels::KernelTable &SpectralKernels::getKernelTable()
+{
+    static KernelTable table = createKernelTable(isSupported(InstructionSet::avx512) ? InstructionSet::avx512
+                                                 : isSupported(InstructionSet::avx2) ? InstructionSet::avx2
+                                                 : isSupported(InstructionSet::sse2) ? InstructionSet::sse2
+                                                 : InstructionSet::scalar);
+
+    return table;
+}
+
+
+SpectralKernels::KernelTable SpectralKernels::createKernelTable(InstructionSet instructionSet)
+{
+    KernelTable table { InstructionSet::scalar, multiplyAccumulateScalar, multiplyAccumulateInterpolatedScalar, crossfadeScalar };
+
+#if JUCE_INTEL
+    switch (instructionSet)
+    {
+        case InstructionSet::sse2:
+            table = { instructionSet, multiplyAccumulateSSE2, multiplyAccumulateInterpolatedSSE2, crossfadeSSE2 };
+            break;
+
+        case InstructionSet::avx2:
+            table = { instructionSet, multiplyAccumulateAVX2, multiplyAccumulateInterpolatedAVX2, crossfadeAVX2 };
+            break;
+
+        case InstructionSet::avx512:
+            table = { instructionSet, multiplyAccumulateAVX512, multiplyAccumulateInterpolatedAVX512, crossfadeAVX512 };
+            break;
+
+        default:
+            break;
+    }
+#endif
+
+    return table;
+}
+
+
+
+#ifdef JUCE_UNIT_TESTS
+void SpectralKernelsTest::runTest()
+{
+    //  An odd number of bins so every kernel also has to handle a partial vector
+    size_t numBins = 257;
+    juce::Random random(1234);
+
+    auto createRandom = [&random](size_t size)
+    {
+        std::vector<float> x(size);
+        for (auto &sample : x)
+            sample = (random.nextFloat() * 2.0f) - 1.0f;
+
+        return x;
+    };
+
+    auto xRe = createRandom(numBins), xIm = createRandom(numBins);
+    auto h0Re = createRandom(numBins), h0Im = createRandom(numBins);
+    auto h1Re = createRandom(numBins), h1Im = createRandom(numBins);
+    auto yRe = createRandom(numBins), yIm = createRandom(numBins);
+    auto fadeOut = createRandom(numBins), fadeIn = createRandom(numBins);
+
+
+    beginTest("Split Complex Layout");
+
+    std::vector<float> interleaved(2 * numBins);
+    SpectralKernels::interleave(xRe.data(), xIm.data(), interleaved.data(), numBins);
+
+    auto *bins = reinterpret_cast<std::complex<float>*>(interleaved.data());
+    expectEquals<float>(bins[10].real(), xRe[10]);
+    expectEquals<float>(bins[10].imag(), xIm[10]);
+
+    std::vector<float> re(numBins), im(numBins);
+    SpectralKernels::deinterleave(interleaved.data(), re.data(), im.data(), numBins);
+    expect(re == xRe);
+    expect(im == xIm);
+
+    expectEquals<size_t>(SpectralKernels::getPaddedNumBins(numBins), 272);
+    expectEquals<size_t>(SpectralKernels::getPaddedNumBins(256), 256);
+
+    //===================================================================================================//
+
+
+    beginTest("Instruction Set Kernels");
+
+    auto defaultInstructionSet = SpectralKernels::getInstructionSet();
+    expect(SpectralKernels::isSupported(defaultInstructionSet));
+
+    SpectralKernels::InstructionSet instructionSets[] = { SpectralKernels::InstructionSet::scalar,
+                                                          SpectralKernels::InstructionSet::sse2,
+                                                          SpectralKernels::InstructionSet::avx2,
+                                                          SpectralKernels::InstructionSet::avx512 };
+
+    //  Every kernel should match a plain std::complex calculation
+    for (auto instructionSet : instructionSets)
+    {
+        if (!SpectralKernels::setInstructionSet(instructionSet))
+            continue;
+
+        logMessage("Testing instruction set " + juce::String((int)instructionSet));
+
+        auto macRe = yRe, macIm = yIm;
+        SpectralKernels::multiplyAccumulate(macRe.data(), macIm.data(), xRe.data(), xIm.data(), h0Re.data(), h0Im.data(), numBins);
+
+        auto interpolatedRe = yRe, interpolatedIm = yIm;
+        SpectralKernels::multiplyAccumulateInterpolated(interpolatedRe.data(), interpolatedIm.data(), xRe.data(), xIm.data(), h0Re.data(), h0Im.data(), h1Re.data(), h1Im.data(), 0.25f, numBins);
+
+        std::vector<float> faded(numBins);
+        SpectralKernels::crossfade(faded.data(), xRe.data(), fadeOut.data(), xIm.data(), fadeIn.data(), numBins);
+
+        float maxError = 0;
+        for (auto i = 0; i < numBins; ++i)
+        {
+            std::complex<float> x(xRe[i], xIm[i]), h0(h0Re[i], h0Im[i]), h1(h1Re[i], h1Im[i]), y(yRe[i], yIm[i]);
+
+            auto mac = y + (x * h0);
+            auto interpolated = y + (x * (h0 + (0.25f * (h1 - h0))));
+            auto fade = (xRe[i] * fadeOut[i]) + (xIm[i] * fadeIn[i]);
+
+            maxError = juce::jmax(maxError, std::abs(mac - std::complex<float>(macRe[i], macIm[i])));
+            maxError = juce::jmax(maxError, std::abs(interpolated - std::complex<float>(interpolatedRe[i], interpolatedIm[i])));
+            maxError = juce::jmax(maxError, std::abs(fade - faded[i]));
+        }
+
+        expectWithinAbsoluteError<float>(maxError, 0.0, 1e-5);
+    }
+
+    expect(SpectralKernels::setInstructionSet(defaultInstructionSet));
+}
+
+#endif
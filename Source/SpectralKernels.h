@@ -0,0 +1,79 @@
+#pragma once
+#include <JuceHeader.h>
+
+
+/*
+ *  Vectorized kernels for the spectra used by HRTFProcessor
+ *
+ *  Spectra are kept in a split-complex (SoA) layout: a spectrum of numBins bins is stored as a block of
+ *  getPaddedNumBins(numBins) real parts followed by a block of the same number of imaginary parts.  Keeping the real and imaginary
+ *  parts apart lets the complex multiply-accumulate run on whole vector registers without any shuffling.
+ *  The padding bins are kept at zero so the kernels can always run on whole vectors.
+ *
+ *  The instruction set is picked once at runtime from what the CPU supports: AVX-512, AVX2 with FMA, SSE2 or a scalar fallback.
+ */
+class SpectralKernels
+{
+public:
+
+    enum class InstructionSet
+    {
+        scalar,
+        sse2,
+        avx2,
+        avx512
+    };
+
+    //  y += x * h
+    static void             multiplyAccumulate(float *yRe, float *yIm, const float *xRe, const float *xIm, const float *hRe, const float *hIm, size_t numBins);
+
+    //  y += x * (h0 + weight * (h1 - h0))
+    static void             multiplyAccumulateInterpolated(float *yRe, float *yIm, const float *xRe, const float *xIm, const float *h0Re, const float *h0Im, const float *h1Re, const float *h1Im, float weight, size_t numBins);
+
+    //  dest = (a * fadeOut) + (b * fadeIn), dest may be the same as a or b
+    static void             crossfade(float *dest, const float *a, const float *fadeOut, const float *b, const float *fadeIn, size_t numSamples);
+
+    //  Convert between the interleaved layout of juce::dsp::FFT and the split layout
+    static void             deinterleave(const float *interleaved, float *re, float *im, size_t numBins);
+    static void             interleave(const float *re, const float *im, float *interleaved, size_t numBins);
+
+    static size_t           getPaddedNumBins(size_t numBins);
+
+    static InstructionSet   getInstructionSet();
+    static bool             isSupported(InstructionSet instructionSet);
+
+    //  Only meant for testing the different code paths, do not call while audio is being processed
+    static bool             setInstructionSet(InstructionSet instructionSet);
+
+    //  Number of floats in the widest vector register (AVX-512)
+    static constexpr size_t VECTOR_SIZE = 16;
+
+
+private:
+
+    struct KernelTable
+    {
+        InstructionSet  instructionSet;
+
+        void (*multiplyAccumulate)(float*, float*, const float*, const float*, const float*, const float*, size_t);
+        void (*multiplyAccumulateInterpolated)(float*, float*, const float*, const float*, const float*, const float*, const float*, const float*, float, size_t);
+        void (*crossfade)(float*, const float*, const float*, const float*, const float*, size_t);
+    };
+
+    static KernelTable      &getKernelTable();
+    static KernelTable      createKernelTable(InstructionSet instructionSet);
+};
+
+
+#ifdef JUCE_UNIT_TESTS
+class SpectralKernelsTest : public juce::UnitTest
+{
+public:
+    SpectralKernelsTest() : UnitTest("SpectralKernelsUnitTest", "HRTFProcessor") {};
+
+    void runTest() override;
+};
+
+static SpectralKernelsTest spectralKernelsUnitTest;
+
+#endif
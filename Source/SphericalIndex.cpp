@@ -0,0 +1,817 @@
+#include "SphericalIndex.h"
+#include <array>
+#include <map>
+#include <set>
+
+
+SphericalIndex::SphericalIndex()
+{
+    minTheta = maxTheta = 0;
+    minPhi = maxPhi = 0;
+    minRadius = maxRadius = 0;
+}
+
+
+void SphericalIndex::build(const std::vector<Position> &newPositions)
+{
+    positions = newPositions;
+
+    points = std::vector<float>(3 * positions.size());
+    order = std::vector<size_t>(positions.size());
+    splitAxis = std::vector<uint8_t>(positions.size(), 0);
+
+    for (auto i = 0; i < positions.size(); ++i)
+    {
+        toCartesian(positions[i].theta, positions[i].phi, positions[i].radius, points.data() + (3 * i));
+        order[i] = i;
+    }
+
+    if (!positions.empty())
+    {
+        minTheta = maxTheta = positions[0].theta;
+        minPhi = maxPhi = positions[0].phi;
+        minRadius = maxRadius = positions[0].radius;
+
+        for (auto &position : positions)
+        {
+            minTheta = juce::jmin(minTheta, position.theta);
+            maxTheta = juce::jmax(maxTheta, position.theta);
+            minPhi = juce::jmin(minPhi, position.phi);
+            maxPhi = juce::jmax(maxPhi, position.phi);
+            minRadius = juce::jmin(minRadius, position.radius);
+            maxRadius = juce::jmax(maxRadius, position.radius);
+        }
+    }
+
+    buildNode(0, positions.size());
+    buildShells();
+}
+
+
+//  Split the range at the median of the axis with the widest spread
+void SphericalIndex::buildNode(size_t begin, size_t end)
+{
+    if (end - begin <= 1)
+        return;
+
+    float low[3] = { std::numeric_limits<float>::max(), std::numeric_limits<float>::max(), std::numeric_limits<float>::max() };
+    float high[3] = { std::numeric_limits<float>::lowest(), std::numeric_limits<float>::lowest(), std::numeric_limits<float>::lowest() };
+
+    for (auto i = begin; i < end; ++i)
+    {
+        for (auto axis = 0; axis < 3; ++axis)
+        {
+            low[axis] = juce::jmin(low[axis], points[(3 * order[i]) + axis]);
+            high[axis] = juce::jmax(high[axis], points[(3 * order[i]) + axis]);
+        }
+    }
+
+    uint8_t axis = 0;
+    for (uint8_t a = 1; a < 3; ++a)
+    {
+        if (high[a] - low[a] > high[axis] - low[axis])
+            axis = a;
+    }
+
+    auto mid = (begin + end) / 2;
+    std::nth_element(order.begin() + begin, order.begin() + mid, order.begin() + end, [this, axis](size_t a, size_t b)
+    {
+        return points[(3 * a) + axis] < points[(3 * b) + axis];
+    });
+
+    splitAxis[mid] = axis;
+
+    buildNode(begin, mid);
+    buildNode(mid + 1, end);
+}
+
+
+size_t SphericalIndex::findNearest(float theta, float phi, float radius) const
+{
+    size_t nearest;
+
+    if (findKNearest(theta, phi, radius, 1, &nearest) == 0)
+        return positions.size();
+
+    return nearest;
+}
+
+
+size_t SphericalIndex::findKNearest(float theta, float phi, float radius, size_t k, size_t *dest) const
+{
+    Neighbours neighbours;
+    neighbours.count = 0;
+    neighbours.k = juce::jlimit<size_t>(0, MAX_K, k);
+
+    if (neighbours.k == 0 || positions.empty())
+        return 0;
+
+    float query[3];
+    toCartesian(theta, phi, radius, query);
+
+    searchNode(0, positions.size(), query, neighbours);
+
+    std::copy(neighbours.indices, neighbours.indices + neighbours.count, dest);
+
+    return neighbours.count;
+}
+
+
+void SphericalIndex::searchNode(size_t begin, size_t end, const float *query, Neighbours &neighbours) const
+{
+    if (begin >= end)
+        return;
+
+    auto mid = (begin + end) / 2;
+    auto *point = points.data() + (3 * order[mid]);
+
+    auto dx = query[0] - point[0];
+    auto dy = query[1] - point[1];
+    auto dz = query[2] - point[2];
+    neighbours.insert(order[mid], (dx * dx) + (dy * dy) + (dz * dz));
+
+    if (end - begin == 1)
+        return;
+
+    auto axis = splitAxis[mid];
+    auto planeDistance = query[axis] - point[axis];
+
+    //  Search the side the query is on first, the other side only needs to be searched if the split plane is closer than the worst neighbour
+    if (planeDistance < 0)
+    {
+        searchNode(begin, mid, query, neighbours);
+        if (planeDistance * planeDistance < neighbours.getWorstDistance())
+            searchNode(mid + 1, end, query, neighbours);
+    }
+    else
+    {
+        searchNode(mid + 1, end, query, neighbours);
+        if (planeDistance * planeDistance < neighbours.getWorstDistance())
+            searchNode(begin, mid, query, neighbours);
+    }
+}
+
+
+//  Squared distance of the kth neighbour, or infinity until k neighbours have been found
+float SphericalIndex::Neighbours::getWorstDistance() const
+{
+    if (count < k)
+        return std::numeric_limits<float>::max();
+
+    return distances[count - 1];
+}
+
+
+//  Keep the neighbours sorted by distance, k is small so an insertion sort is fastest
+void SphericalIndex::Neighbours::insert(size_t index, float distance)
+{
+    if (count == k && distance >= distances[count - 1])
+        return;
+
+    auto i = (count < k) ? count++ : count - 1;
+
+    while (i > 0 && distances[i - 1] > distance)
+    {
+        distances[i] = distances[i - 1];
+        indices[i] = indices[i - 1];
+        --i;
+    }
+
+    distances[i] = distance;
+    indices[i] = index;
+}
+
+
+void SphericalIndex::toCartesian(float theta, float phi, float radius, float *dest)
+{
+    auto thetaRadians = juce::degreesToRadians(theta);
+    auto phiRadians = juce::degreesToRadians(phi);
+
+    dest[0] = radius * std::cos(phiRadians) * std::cos(thetaRadians);
+    dest[1] = radius * std::cos(phiRadians) * std::sin(thetaRadians);
+    dest[2] = radius * std::sin(phiRadians);
+}
+
+
+
+/*
+ *  Group the positions by radius and triangulate the directions of each group
+ *  Positions that point the same way, such as every theta at a pole, share one vertex
+ */
+void SphericalIndex::buildShells()
+{
+    shells.clear();
+    triangles.clear();
+    representative = std::vector<size_t>(positions.size());
+    vertexTriangles = std::vector<std::vector<size_t>>(positions.size());
+
+    std::map<float, std::vector<size_t>> positionsByRadius;
+    for (auto i = 0; i < positions.size(); ++i)
+        positionsByRadius[positions[i].radius].push_back(i);
+
+    for (auto &radius : positionsByRadius)
+    {
+        Shell shell;
+        shell.radius = radius.first;
+
+        std::map<std::array<int64_t, 3>, size_t> directions;
+
+        for (auto i : radius.second)
+        {
+            float direction[3];
+            toCartesian(positions[i].theta, positions[i].phi, 1, direction);
+
+            std::array<int64_t, 3> key = { std::llround(direction[0] * 1e5), std::llround(direction[1] * 1e5), std::llround(direction[2] * 1e5) };
+            auto inserted = directions.insert({ key, i });
+
+            if (inserted.second)
+                shell.vertices.push_back(i);
+
+            representative[i] = inserted.first->second;
+        }
+
+        triangulate(shell);
+        shells.push_back(shell);
+    }
+}
+
+
+/*
+ *  Incremental convex hull of the directions of a shell
+ *  Each direction removes the faces it can see and closes the hole with faces to the edges of the hole.  This is O(n^2) in the worst case,
+ *  which is fine for the few thousand directions of a SOFA file since it only runs when a file is loaded.
+ *  Leaves the shell without triangles if its directions lie in one plane
+ */
+void SphericalIndex::triangulate(Shell &shell)
+{
+    typedef std::array<double, 3> Vector;
+
+    shell.firstTriangle = triangles.size();
+    shell.numTriangles = 0;
+
+    auto numVertices = shell.vertices.size();
+    if (numVertices < 4)
+        return;
+
+    std::vector<Vector> points(numVertices);
+    for (auto v = 0; v < numVertices; ++v)
+    {
+        auto &position = positions[shell.vertices[v]];
+        auto theta = juce::degreesToRadians((double)position.theta);
+        auto phi = juce::degreesToRadians((double)position.phi);
+        points[v] = { std::cos(phi) * std::cos(theta), std::cos(phi) * std::sin(theta), std::sin(phi) };
+    }
+
+    auto subtract = [](const Vector &a, const Vector &b) { return Vector({ a[0] - b[0], a[1] - b[1], a[2] - b[2] }); };
+    auto dot = [](const Vector &a, const Vector &b) { return (a[0] * b[0]) + (a[1] * b[1]) + (a[2] * b[2]); };
+    auto cross = [](const Vector &a, const Vector &b)
+    {
+        return Vector({ (a[1] * b[2]) - (a[2] * b[1]), (a[2] * b[0]) - (a[0] * b[2]), (a[0] * b[1]) - (a[1] * b[0]) });
+    };
+
+    //  Positive if q is on the side of the plane through a, b and c that (b - a) x (c - a) points to
+    auto orient = [&](size_t a, size_t b, size_t c, const Vector &q)
+    {
+        return dot(cross(subtract(points[b], points[a]), subtract(points[c], points[a])), subtract(q, points[a]));
+    };
+
+    //  Start with a large tetrahedron: the point furthest from the first, then furthest from their line, then from their plane
+    size_t start[4] = { 0, 0, 0, 0 };
+    double best = 0;
+
+    for (auto v = 1; v < numVertices; ++v)
+    {
+        auto distance = dot(subtract(points[v], points[0]), subtract(points[v], points[0]));
+        if (distance > best)
+        {
+            best = distance;
+            start[1] = v;
+        }
+    }
+
+    best = 0;
+    for (auto v = 1; v < numVertices; ++v)
+    {
+        auto normal = cross(subtract(points[start[1]], points[0]), subtract(points[v], points[0]));
+        if (dot(normal, normal) > best)
+        {
+            best = dot(normal, normal);
+            start[2] = v;
+        }
+    }
+
+    best = 0;
+    for (auto v = 1; v < numVertices; ++v)
+    {
+        auto volume = std::abs(orient(start[0], start[1], start[2], points[v]));
+        if (volume > best)
+        {
+            best = volume;
+            start[3] = v;
+        }
+    }
+
+    if (best < 1e-9)
+        return;
+
+    Vector interior = { 0, 0, 0 };
+    for (auto v : start)
+    {
+        for (auto axis = 0; axis < 3; ++axis)
+            interior[axis] += points[v][axis] / 4;
+    }
+
+    //  Faces are wound so that their normal points away from the interior, which stays inside as the hull grows
+    //  The plane of each face is kept so that testing whether a direction can see it is a single dot product
+    struct Face
+    {
+        size_t  vertices[3];
+        Vector  normal;
+        double  offset;
+    };
+
+    std::vector<Face> faces;
+    auto addFace = [&](size_t a, size_t b, size_t c)
+    {
+        if (orient(a, b, c, interior) > 0)
+            std::swap(b, c);
+
+        auto normal = cross(subtract(points[b], points[a]), subtract(points[c], points[a]));
+        faces.push_back({ { a, b, c }, normal, dot(normal, points[a]) });
+    };
+
+    addFace(start[0], start[1], start[2]);
+    addFace(start[0], start[1], start[3]);
+    addFace(start[0], start[2], start[3]);
+    addFace(start[1], start[2], start[3]);
+
+    const double epsilon = 1e-12;
+    std::vector<Face> visibleFaces;
+    std::set<std::pair<size_t, size_t>> visibleEdges;
+
+    for (auto v = 0; v < numVertices; ++v)
+    {
+        if (std::find(start, start + 4, v) != start + 4)
+            continue;
+
+        visibleFaces.clear();
+        visibleEdges.clear();
+
+        auto firstHidden = std::partition(faces.begin(), faces.end(), [&](const Face &face)
+        {
+            return dot(face.normal, points[v]) - face.offset <= epsilon;
+        });
+
+        //  Directions inside the hull, or too close to it to matter, do not become vertices
+        if (firstHidden == faces.end())
+            continue;
+
+        visibleFaces.assign(firstHidden, faces.end());
+        faces.erase(firstHidden, faces.end());
+
+        for (auto &face : visibleFaces)
+        {
+            for (auto e = 0; e < 3; ++e)
+                visibleEdges.insert({ face.vertices[e], face.vertices[(e + 1) % 3] });
+        }
+
+        //  An edge whose other face is not visible is on the edge of the hole
+        for (auto &face : visibleFaces)
+        {
+            for (auto e = 0; e < 3; ++e)
+            {
+                auto *edge = face.vertices;
+                if (visibleEdges.count({ edge[(e + 1) % 3], edge[e] }) == 0)
+                    addFace(edge[e], edge[(e + 1) % 3], v);
+            }
+        }
+    }
+
+    for (auto &face : faces)
+    {
+        auto &a = points[face.vertices[0]];
+        auto &b = points[face.vertices[1]];
+        auto &c = points[face.vertices[2]];
+
+        //  A face through the centre of the sphere, which only happens if the directions cover no more than a hemisphere, has no weights
+        auto determinant = dot(a, cross(b, c));
+        if (std::abs(determinant) < 1e-9)
+            continue;
+
+        Triangle triangle;
+        Vector rows[3] = { cross(b, c), cross(c, a), cross(a, b) };
+
+        for (auto row = 0; row < 3; ++row)
+        {
+            triangle.vertices[row] = shell.vertices[face.vertices[row]];
+
+            for (auto axis = 0; axis < 3; ++axis)
+                triangle.inverse[(3 * row) + axis] = (float)(rows[row][axis] / determinant);
+        }
+
+        for (auto vertex : triangle.vertices)
+            vertexTriangles[vertex].push_back(triangles.size());
+
+        triangles.push_back(triangle);
+    }
+
+    shell.numTriangles = triangles.size() - shell.firstTriangle;
+}
+
+
+/*
+ *  The measurements around a position and their weights
+ *  Between two radii the triangles of both are used, weighted by how close the radius is to each
+ */
+size_t SphericalIndex::findBlend(float theta, float phi, float radius, size_t *dest, float *weights) const
+{
+    if (shells.empty())
+        return 0;
+
+    auto upper = std::find_if(shells.begin(), shells.end(), [radius](const Shell &shell) { return shell.radius >= radius; });
+
+    if (upper == shells.begin())
+        return findShellBlend(shells.front(), theta, phi, dest, weights);
+
+    if (upper == shells.end())
+        return findShellBlend(shells.back(), theta, phi, dest, weights);
+
+    auto &lower = *(upper - 1);
+    auto upperWeight = (radius - lower.radius) / (upper->radius - lower.radius);
+
+    auto numLower = findShellBlend(lower, theta, phi, dest, weights);
+    auto numUpper = findShellBlend(*upper, theta, phi, dest + numLower, weights + numLower);
+
+    for (auto i = 0; i < numLower; ++i)
+        weights[i] *= 1.0f - upperWeight;
+
+    for (auto i = numLower; i < numLower + numUpper; ++i)
+        weights[i] *= upperWeight;
+
+    return numLower + numUpper;
+}
+
+
+size_t SphericalIndex::findShellBlend(const Shell &shell, float theta, float phi, size_t *dest, float *weights) const
+{
+    float direction[3];
+    toCartesian(theta, phi, 1, direction);
+
+    if (shell.numTriangles == 0)
+        return findAngularBlend(shell, direction, dest, weights);
+
+    //  The triangle around a direction almost always uses one of the closest measurements, only search all of them if it does not
+    size_t nearest[3];
+    auto numNearest = findKNearest(theta, phi, shell.radius, 3, nearest);
+
+    const Triangle *found = nullptr;
+    float triangleWeights[3];
+
+    for (auto n = 0; n < numNearest && found == nullptr; ++n)
+    {
+        for (auto t : vertexTriangles[representative[nearest[n]]])
+        {
+            if (t >= shell.firstTriangle && t < shell.firstTriangle + shell.numTriangles && getTriangleWeights(triangles[t], direction, triangleWeights))
+            {
+                found = &triangles[t];
+                break;
+            }
+        }
+    }
+
+    //  Directions outside the hull, possible when the measurements cover less than a hemisphere, use the closest triangle
+    if (found == nullptr)
+    {
+        float bestMinimum = std::numeric_limits<float>::lowest();
+
+        for (auto t = shell.firstTriangle; t < shell.firstTriangle + shell.numTriangles; ++t)
+        {
+            float candidateWeights[3];
+            getTriangleWeights(triangles[t], direction, candidateWeights);
+
+            auto minimum = juce::jmin(candidateWeights[0], candidateWeights[1], candidateWeights[2]);
+            if (minimum > bestMinimum)
+            {
+                bestMinimum = minimum;
+                found = &triangles[t];
+                std::copy(candidateWeights, candidateWeights + 3, triangleWeights);
+            }
+        }
+    }
+
+    float sum = 0;
+    for (auto &weight : triangleWeights)
+    {
+        weight = juce::jmax(weight, 0.0f);
+        sum += weight;
+    }
+
+    if (sum <= 0)
+        return findAngularBlend(shell, direction, dest, weights);
+
+    for (auto i = 0; i < 3; ++i)
+    {
+        dest[i] = found->vertices[i];
+        weights[i] = triangleWeights[i] / sum;
+    }
+
+    return 3;
+}
+
+
+//  Blend the two directions closest to direction by their angle to it, used when a shell could not be triangulated
+size_t SphericalIndex::findAngularBlend(const Shell &shell, const float *direction, size_t *dest, float *weights) const
+{
+    float angles[2] = { std::numeric_limits<float>::max(), std::numeric_limits<float>::max() };
+    size_t closest[2] = { shell.vertices[0], shell.vertices[0] };
+
+    for (auto vertex : shell.vertices)
+    {
+        float vertexDirection[3];
+        toCartesian(positions[vertex].theta, positions[vertex].phi, 1, vertexDirection);
+
+        auto cosine = (direction[0] * vertexDirection[0]) + (direction[1] * vertexDirection[1]) + (direction[2] * vertexDirection[2]);
+        auto angle = std::acos(juce::jlimit(-1.0f, 1.0f, cosine));
+
+        if (angle < angles[0])
+        {
+            angles[1] = angles[0];
+            closest[1] = closest[0];
+            angles[0] = angle;
+            closest[0] = vertex;
+        }
+        else if (angle < angles[1])
+        {
+            angles[1] = angle;
+            closest[1] = vertex;
+        }
+    }
+
+    if (shell.vertices.size() == 1 || angles[0] < 1e-6f)
+    {
+        dest[0] = closest[0];
+        weights[0] = 1.0;
+        return 1;
+    }
+
+    dest[0] = closest[0];
+    dest[1] = closest[1];
+    weights[0] = angles[1] / (angles[0] + angles[1]);
+    weights[1] = angles[0] / (angles[0] + angles[1]);
+
+    return 2;
+}
+
+
+//  Returns true if direction is inside the triangle, allowing for rounding on its edges
+bool SphericalIndex::getTriangleWeights(const Triangle &triangle, const float *direction, float *weights) const
+{
+    for (auto row = 0; row < 3; ++row)
+    {
+        auto *inverse = triangle.inverse + (3 * row);
+        weights[row] = (inverse[0] * direction[0]) + (inverse[1] * direction[1]) + (inverse[2] * direction[2]);
+    }
+
+    return juce::jmin(weights[0], weights[1], weights[2]) >= -1e-5f;
+}
+
+
+
+#ifdef JUCE_UNIT_TESTS
+void SphericalIndexTest::runTest()
+{
+    juce::Random random(1234);
+
+    //  Irregular sampling: random directions at two radii
+    std::vector<SphericalIndex::Position> positions;
+    for (auto i = 0; i < 2000; ++i)
+    {
+        auto theta = random.nextFloat() * 360.0f;
+        auto phi = juce::radiansToDegrees(std::asin((2.0f * random.nextFloat()) - 1.0f));
+        positions.push_back({ theta, phi, (i % 2 == 0) ? 1.0f : 1.5f });
+    }
+
+    SphericalIndex index;
+    index.build(positions);
+
+    auto bruteForceDistance = [&index](size_t i, const float *query)
+    {
+        float point[3];
+        SphericalIndex::toCartesian(index.getPosition(i).theta, index.getPosition(i).phi, index.getPosition(i).radius, point);
+        return juce::square(point[0] - query[0]) + juce::square(point[1] - query[1]) + juce::square(point[2] - query[2]);
+    };
+
+
+    beginTest("Nearest");
+
+    expectEquals<size_t>(index.getNumPositions(), positions.size());
+
+    bool allMatch = true;
+    for (auto q = 0; q < 500; ++q)
+    {
+        float theta = random.nextFloat() * 360.0f;
+        float phi = (random.nextFloat() * 180.0f) - 90.0f;
+        float radius = 0.8f + random.nextFloat();
+
+        float query[3];
+        SphericalIndex::toCartesian(theta, phi, radius, query);
+
+        size_t expected = 0;
+        for (auto i = 1; i < positions.size(); ++i)
+        {
+            if (bruteForceDistance(i, query) < bruteForceDistance(expected, query))
+                expected = i;
+        }
+
+        auto nearest = index.findNearest(theta, phi, radius);
+        allMatch &= (bruteForceDistance(nearest, query) == bruteForceDistance(expected, query));
+    }
+
+    expect(allMatch);
+
+    //  Every position is its own nearest neighbour
+    for (auto i = 0; i < 50; ++i)
+        expectEquals<size_t>(index.findNearest(positions[i].theta, positions[i].phi, positions[i].radius), i);
+
+    //===================================================================================================//
+
+
+    beginTest("K Nearest");
+
+    allMatch = true;
+    for (auto q = 0; q < 200; ++q)
+    {
+        float theta = random.nextFloat() * 360.0f;
+        float phi = (random.nextFloat() * 180.0f) - 90.0f;
+
+        float query[3];
+        SphericalIndex::toCartesian(theta, phi, 1.0f, query);
+
+        std::vector<float> distances;
+        for (auto i = 0; i < positions.size(); ++i)
+            distances.push_back(bruteForceDistance(i, query));
+        std::sort(distances.begin(), distances.end());
+
+        size_t nearest[8];
+        allMatch &= (index.findKNearest(theta, phi, 1.0f, 8, nearest) == 8);
+
+        for (auto n = 0; n < 8; ++n)
+            allMatch &= (bruteForceDistance(nearest[n], query) == distances[n]);
+    }
+
+    expect(allMatch);
+
+    size_t nearest[SphericalIndex::MAX_K];
+    expectEquals<size_t>(index.findKNearest(0, 0, 1, 100, nearest), SphericalIndex::MAX_K);
+    expectEquals<size_t>(index.findKNearest(0, 0, 1, 0, nearest), 0);
+
+    //===================================================================================================//
+
+
+    beginTest("Sphere Wraparound");
+
+    //  A regular 10 degree grid, 355 degrees is closer to 0 than 20 is
+    std::vector<SphericalIndex::Position> grid;
+    for (auto theta = 0; theta < 360; theta += 10)
+    {
+        for (auto phi = -80; phi <= 80; phi += 10)
+            grid.push_back({ (float)theta, (float)phi, 1.2f });
+    }
+
+    SphericalIndex gridIndex;
+    gridIndex.build(grid);
+
+    auto wrapped = gridIndex.getPosition(gridIndex.findNearest(358, 0, 1.2f));
+    expectEquals<float>(wrapped.theta, 0);
+    expectEquals<float>(wrapped.phi, 0);
+
+    //  Near the pole every azimuth is close, the elevation decides
+    auto polar = gridIndex.getPosition(gridIndex.findNearest(123, 89, 1.2f));
+    expectEquals<float>(polar.phi, 80);
+
+    expectEquals<float>(gridIndex.getMinTheta(), 0);
+    expectEquals<float>(gridIndex.getMaxTheta(), 350);
+    expectEquals<float>(gridIndex.getMinPhi(), -80);
+    expectEquals<float>(gridIndex.getMaxRadius(), 1.2f);
+
+    SphericalIndex emptyIndex;
+    emptyIndex.build({});
+    expectEquals<size_t>(emptyIndex.findNearest(0, 0, 1), 0);
+    expectEquals<size_t>(emptyIndex.findKNearest(0, 0, 1, 3, nearest), 0);
+
+    size_t blend[SphericalIndex::MAX_BLEND];
+    float weights[SphericalIndex::MAX_BLEND];
+    expectEquals<size_t>(emptyIndex.findBlend(0, 0, 1, blend, weights), 0);
+
+    //===================================================================================================//
+
+
+    beginTest("Interpolation Weights");
+
+    //  For every direction, the weights are positive, add up to 1 and mix the measured directions back into the direction asked for
+    auto checkBlends = [&](const SphericalIndex &indexToCheck, float radius)
+    {
+        bool allValid = true;
+
+        for (auto q = 0; q < 500; ++q)
+        {
+            float theta = random.nextFloat() * 360.0f;
+            float phi = (random.nextFloat() * 180.0f) - 90.0f;
+
+            auto numBlend = indexToCheck.findBlend(theta, phi, radius, blend, weights);
+            allValid &= (numBlend == 3);
+
+            float sum = 0;
+            float mixed[3] = { 0, 0, 0 };
+
+            for (auto i = 0; i < numBlend; ++i)
+            {
+                allValid &= (weights[i] >= 0);
+                sum += weights[i];
+
+                float direction[3];
+                auto &position = indexToCheck.getPosition(blend[i]);
+                SphericalIndex::toCartesian(position.theta, position.phi, 1, direction);
+
+                for (auto axis = 0; axis < 3; ++axis)
+                    mixed[axis] += weights[i] * direction[axis];
+            }
+
+            float query[3];
+            SphericalIndex::toCartesian(theta, phi, 1, query);
+
+            float crossX = (mixed[1] * query[2]) - (mixed[2] * query[1]);
+            float crossY = (mixed[2] * query[0]) - (mixed[0] * query[2]);
+            float crossZ = (mixed[0] * query[1]) - (mixed[1] * query[0]);
+
+            allValid &= (std::abs(sum - 1.0f) < 1e-5f);
+            allValid &= (std::sqrt((crossX * crossX) + (crossY * crossY) + (crossZ * crossZ)) < 1e-4f);
+        }
+
+        return allValid;
+    };
+
+    expect(checkBlends(gridIndex, 1.2f));
+
+    std::vector<SphericalIndex::Position> irregular(positions.begin(), positions.begin() + 1000);
+    for (auto &position : irregular)
+        position.radius = 1.0f;
+
+    SphericalIndex irregularIndex;
+    irregularIndex.build(irregular);
+    expect(checkBlends(irregularIndex, 1.0f));
+
+    //  A measured position gets all of the weight
+    auto numBlend = gridIndex.findBlend(40, 30, 1.2f, blend, weights);
+    float maxWeight = 0;
+    size_t heaviest = 0;
+    for (auto i = 0; i < numBlend; ++i)
+    {
+        if (weights[i] > maxWeight)
+        {
+            maxWeight = weights[i];
+            heaviest = blend[i];
+        }
+    }
+
+    expectWithinAbsoluteError<float>(maxWeight, 1.0f, 1e-5f);
+    expectEquals<float>(gridIndex.getPosition(heaviest).theta, 40);
+    expectEquals<float>(gridIndex.getPosition(heaviest).phi, 30);
+
+    //  Between two radii both triangles are used
+    std::vector<SphericalIndex::Position> shells(grid);
+    for (auto &position : grid)
+        shells.push_back({ position.theta, position.phi, 2.2f });
+
+    SphericalIndex shellIndex;
+    shellIndex.build(shells);
+
+    numBlend = shellIndex.findBlend(123, 45, 1.45f, blend, weights);
+    expectEquals<size_t>(numBlend, 6);
+
+    float innerWeight = 0;
+    for (auto i = 0; i < numBlend; ++i)
+        innerWeight += (shellIndex.getPosition(blend[i]).radius == 1.2f) ? weights[i] : 0;
+
+    expectWithinAbsoluteError<float>(innerWeight, 0.75f, 1e-5f);
+    expectEquals<size_t>(shellIndex.findBlend(123, 45, 3.0f, blend, weights), 3);
+
+    //  Horizontal plane only, the directions cannot be triangulated so the closest two are blended
+    std::vector<SphericalIndex::Position> ring;
+    for (auto theta = 0; theta < 360; theta += 10)
+        ring.push_back({ (float)theta, 0, 1.2f });
+
+    SphericalIndex ringIndex;
+    ringIndex.build(ring);
+
+    numBlend = ringIndex.findBlend(355, 0, 1.2f, blend, weights);
+    expectEquals<size_t>(numBlend, 2);
+    expectWithinAbsoluteError<float>(weights[0], 0.5f, 1e-4f);
+    expectWithinAbsoluteError<float>(weights[1], 0.5f, 1e-4f);
+    expect((ringIndex.getPosition(blend[0]).theta + ringIndex.getPosition(blend[1]).theta) == 350);
+
+    expectEquals<size_t>(ringIndex.findBlend(30, 0, 1.2f, blend, weights), 1);
+    expectEquals<float>(ringIndex.getPosition(blend[0]).theta, 30);
+}
+
+#endif
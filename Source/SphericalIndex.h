@@ -0,0 +1,146 @@
+#pragma once
+#include <JuceHeader.h>
+#include <vector>
+
+
+/*
+ *  Nearest neighbour lookup of the measurement positions of a SOFA file
+ *
+ *  Positions are given in the spherical coordinates used by SOFA (theta is the azimuth and phi the elevation, both in degrees)
+ *  and converted to cartesian coordinates, so positions on either side of theta = 0 or close to the poles are found as neighbours
+ *  no matter how the file is sampled.  The positions are kept in a k-d tree that is built once when a file is loaded.
+ *
+ *  For interpolating between measurements, the directions of each radius are also triangulated.  The triangulation is the convex hull
+ *  of the directions, which for points on a sphere is their spherical Delaunay triangulation.  findBlend() returns the measurements of the
+ *  triangle around a direction with their barycentric weights, blended linearly with the triangle of the next radius.
+ *  A radius whose directions all lie in one plane (a horizontal-plane-only file, for example) cannot be triangulated,
+ *  for those the two closest directions are blended by their angle instead.
+ *
+ *  The queries are const, do not allocate and can be called from any number of threads once build() has returned.
+ */
+class SphericalIndex
+{
+#ifdef JUCE_UNIT_TESTS
+    friend class SphericalIndexTest;
+#endif
+
+public:
+
+    struct Position
+    {
+        float   theta;
+        float   phi;
+        float   radius;
+    };
+
+    SphericalIndex();
+
+    //  Not real-time safe
+    void                build(const std::vector<Position> &newPositions);
+
+    size_t              getNumPositions() const { return positions.size(); }
+    const Position      &getPosition(size_t index) const { return positions[index]; }
+
+    //  Returns getNumPositions() if the index is empty
+    size_t              findNearest(float theta, float phi, float radius) const;
+
+    //  Writes the indices of the k nearest positions into dest, closest first.  Returns the number of indices written
+    size_t              findKNearest(float theta, float phi, float radius, size_t k, size_t *dest) const;
+
+    //  Writes up to MAX_BLEND measurements and their weights, which add up to 1, into dest and weights.  Returns the number written
+    size_t              findBlend(float theta, float phi, float radius, size_t *dest, float *weights) const;
+
+    //  Range of the positions, used to map parameters onto the measured part of the sphere
+    float               getMinTheta() const { return minTheta; }
+    float               getMaxTheta() const { return maxTheta; }
+    float               getMinPhi() const { return minPhi; }
+    float               getMaxPhi() const { return maxPhi; }
+    float               getMinRadius() const { return minRadius; }
+    float               getMaxRadius() const { return maxRadius; }
+
+    //  Largest k findKNearest() answers
+    static constexpr size_t     MAX_K = 16;
+
+    //  Largest number of measurements findBlend() returns, a triangle at each of two radii
+    static constexpr size_t     MAX_BLEND = 6;
+
+
+private:
+
+    struct Neighbours
+    {
+        size_t  indices[MAX_K];
+        float   distances[MAX_K];
+        size_t  count;
+        size_t  k;
+
+        float   getWorstDistance() const;
+        void    insert(size_t index, float distance);
+    };
+
+    struct Triangle
+    {
+        size_t  vertices[3];
+
+        //  Rows of the inverse of the matrix with the vertex directions as columns, multiplying a direction by it gives the barycentric weights
+        float   inverse[9];
+    };
+
+    //  The measurements at one radius
+    struct Shell
+    {
+        float               radius;
+        std::vector<size_t> vertices;       //  One measurement per distinct direction
+        size_t              firstTriangle;
+        size_t              numTriangles;
+    };
+
+    void                buildNode(size_t begin, size_t end);
+    void                searchNode(size_t begin, size_t end, const float *query, Neighbours &neighbours) const;
+    static void         toCartesian(float theta, float phi, float radius, float *dest);
+
+    void                buildShells();
+    void                triangulate(Shell &shell);
+    size_t              findShellBlend(const Shell &shell, float theta, float phi, size_t *dest, float *weights) const;
+    size_t              findAngularBlend(const Shell &shell, const float *direction, size_t *dest, float *weights) const;
+    bool                getTriangleWeights(const Triangle &triangle, const float *direction, float *weights) const;
+
+
+    std::vector<Position>       positions;
+
+    //  Cartesian coordinates of every position, three floats per position
+    std::vector<float>          points;
+
+    //  The tree is stored implicitly: the node of the range [begin, end) of order is the median at (begin + end) / 2,
+    //  the positions before it are on the low side of its split plane and the ones after it on the high side
+    std::vector<size_t>         order;
+    std::vector<uint8_t>        splitAxis;
+
+    //  Shells are sorted by radius.  Each position points to the measurement used for its direction in its shell,
+    //  and the triangles that use a measurement are listed in vertexTriangles
+    std::vector<Shell>          shells;
+    std::vector<Triangle>       triangles;
+    std::vector<size_t>         representative;
+    std::vector<std::vector<size_t>>    vertexTriangles;
+
+    float                       minTheta;
+    float                       maxTheta;
+    float                       minPhi;
+    float                       maxPhi;
+    float                       minRadius;
+    float                       maxRadius;
+};
+
+
+#ifdef JUCE_UNIT_TESTS
+class SphericalIndexTest : public juce::UnitTest
+{
+public:
+    SphericalIndexTest() : UnitTest("SphericalIndexUnitTest", "HRTFProcessor") {};
+
+    void runTest() override;
+};
+
+static SphericalIndexTest sphericalIndexUnitTest;
+
+#endif
@@ -0,0 +1,66 @@
+#pragma once
+#include <atomic>
+
+
+/*
+ *  Wait-free handoff of a value from one writer thread to one reader thread
+ *
+ *  There are three slots: one owned by the writer, one owned by the reader and one in between.
+ *  The writer fills its slot and publishes it by swapping it with the one in between.  The reader picks up
+ *  the newest published slot by swapping its own slot with the one in between.  Neither side ever waits for the other,
+ *  a value that was published but never read is simply replaced by the next one.
+ *
+ *  The slots are set up once so that, as long as the writer keeps the sizes of T the same, no memory is allocated after setup().
+ */
+template <typename T>
+class TripleBuffer
+{
+public:
+
+    TripleBuffer() : writeIndex(0), readIndex(1), middleIndex(2) {}
+
+    //  NOT thread safe, call before handing the buffer to the writer and reader threads
+    void setup(const T &initialValue)
+    {
+        for (auto &slot : slots)
+            slot = initialValue;
+
+        writeIndex = 0;
+        readIndex = 1;
+        middleIndex.store(2);
+    }
+
+    //  Writer only
+    T &getWriteBuffer() { return slots[writeIndex]; }
+
+    //  Writer only, hand the write buffer over to the reader
+    void publish()
+    {
+        writeIndex = middleIndex.exchange(writeIndex | NEW_DATA_FLAG, std::memory_order_acq_rel) & INDEX_MASK;
+    }
+
+    //  Reader only, returns true if a new value was picked up
+    bool acquire()
+    {
+        if ((middleIndex.load(std::memory_order_relaxed) & NEW_DATA_FLAG) == 0)
+            return false;
+
+        readIndex = middleIndex.exchange(readIndex, std::memory_order_acq_rel) & INDEX_MASK;
+
+        return true;
+    }
+
+    //  Reader only, the value stays valid until the next successful acquire()
+    T &getReadBuffer() { return slots[readIndex]; }
+
+
+private:
+
+    static constexpr size_t     INDEX_MASK = 3;
+    static constexpr size_t     NEW_DATA_FLAG = 4;
+
+    T                           slots[3];
+    size_t                      writeIndex;
+    size_t                      readIndex;
+    std::atomic<size_t>         middleIndex;
+};